@@ -0,0 +1,261 @@
+# End-to-end benchmarks of the Scrypty API.
+#
+# Every scenario runs a fixed number of operations per worker, for each
+# payload size and each level of concurrency, and reports latency
+# percentiles, throughput, peak RSS (VmHWM, reset before each scenario
+# where /proc/self/clear_refs allows, so it starts from the RSS left by
+# the ones before) and GC allocations.  The environment controls the
+# matrix:
+#
+#   BENCH_SCENARIOS    comma-separated subset of the scenarios below
+#   BENCH_SIZES        comma-separated payload sizes in bytes
+#                      (default 64 B up to BENCH_MAX_SIZE)
+#   BENCH_MAX_SIZE     largest default payload size (default 16 MiB; the
+#                      full range goes up to 4 GiB)
+#   BENCH_CONCURRENCY  comma-separated worker counts (default 1,4,16,64)
+#   BENCH_MODE         "thread" or "process" (default thread)
+#   BENCH_ITERATIONS   operations per worker (default 5)
+#   BENCH_N, BENCH_R, BENCH_P
+#                      scrypt parameters (default 2^14, 8, 1)
+#   BENCH_JSON         also write the results as JSON to this file
+
+require 'json'
+require 'securerandom'
+require 'tmpdir'
+require 'scrypty'
+
+module ScryptyBench
+  SIZES = [64, 1024, 64 * 1024, 1024 ** 2, 16 * 1024 ** 2, 256 * 1024 ** 2, 4 * 1024 ** 3]
+
+  module_function
+
+  def env_list(name, default)
+    ENV[name] ? ENV[name].split(",").map { |v| Integer(v) } : default
+  end
+
+  def profile
+    @profile ||= Scrypty::Profile.from_params(
+      Integer(ENV["BENCH_N"] || 2 ** 14),
+      Integer(ENV["BENCH_R"] || 8),
+      Integer(ENV["BENCH_P"] || 1))
+  end
+
+  # Each scenario returns a lambda which performs one operation on a payload
+  # prepared ahead of time, so that only the operation itself is timed.
+  def scenarios(dir)
+    password = "benchmark password"
+    dk = Scrypty.dk(password, SecureRandom.random_bytes(32), profile.n, profile.r, profile.p, 64)
+
+    {
+      "encrypt" => lambda do |data, _|
+        lambda { Scrypty.encrypt(data, password, profile) }
+      end,
+      "decrypt" => lambda do |data, _|
+        encrypted = Scrypty.encrypt(data, password, profile)
+        lambda { Scrypty.decrypt(encrypted, password, profile) }
+      end,
+      "encrypt_file" => lambda do |data, worker|
+        infn = File.join(dir, "plain-#{worker}")
+        outfn = File.join(dir, "enc-#{worker}")
+        File.binwrite(infn, data)
+        lambda { Scrypty.encrypt_file(infn, outfn, password, profile) }
+      end,
+      "decrypt_file" => lambda do |data, worker|
+        infn = File.join(dir, "plain-#{worker}")
+        encfn = File.join(dir, "enc-#{worker}")
+        outfn = File.join(dir, "dec-#{worker}")
+        File.binwrite(infn, data)
+        Scrypty.encrypt_file(infn, encfn, password, profile)
+        lambda { Scrypty.decrypt_file(encfn, outfn, password, profile) }
+      end,
+      "dk" => lambda do |_, _|
+        salt = SecureRandom.random_bytes(32)
+        lambda { Scrypty.dk(password, salt, profile.n, profile.r, profile.p, 64) }
+      end,
+      "encrypt_raw" => lambda do |data, _|
+        lambda { Scrypty.encrypt_raw(data, dk) }
+      end,
+      "decrypt_raw" => lambda do |data, _|
+        encrypted = Scrypty.encrypt_raw(data, dk)
+        lambda { Scrypty.decrypt_raw(encrypted, dk) }
+      end,
+    }
+  end
+
+  def peak_rss
+    status = File.read("/proc/self/status") rescue nil
+    status && status[/^VmHWM:\s+(\d+) kB/, 1].to_i * 1024
+  end
+
+  # Start VmHWM again from the current RSS, so that each scenario reports
+  # its own peak rather than the largest of every scenario run before it.
+  def reset_peak_rss
+    File.write("/proc/self/clear_refs", "5")
+  rescue SystemCallError
+    nil
+  end
+
+  def clock
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # Run one worker's operations and return their latencies.
+  def work(op, iterations)
+    Array.new(iterations) do
+      started = clock
+      op.call
+      clock - started
+    end
+  end
+
+  def allocated_objects
+    GC.stat(:total_allocated_objects)
+  end
+
+  # Both runners have every worker build its operation first and then
+  # release them all at once, so that neither the scenario's setup nor
+  # starting the workers is timed.  They return [latencies, peak RSS,
+  # objects allocated, seconds from the release until the last worker is
+  # done].
+  def run_threads(scenario, data, concurrency, iterations)
+    ready = Queue.new
+    go = Queue.new
+    threads = Array.new(concurrency) do |worker|
+      Thread.new do
+        begin
+          op = scenario.call(data, worker)
+        ensure
+          ready << worker
+        end
+        go.pop
+        work(op, iterations)
+      end
+    end
+    concurrency.times { ready.pop }
+    reset_peak_rss
+    allocated = allocated_objects
+    started = clock
+    go.close
+    latencies = threads.flat_map(&:value)
+    [latencies, peak_rss, allocated_objects - allocated, clock - started]
+  end
+
+  # The workers say they're ready with a byte each on one pipe, and are
+  # released by the other reaching EOF; CLOCK_MONOTONIC is shared between
+  # processes, so each reports when it finished.
+  def run_processes(scenario, data, concurrency, iterations)
+    ready_reader, ready_writer = IO.pipe
+    go_reader, go_writer = IO.pipe
+    pipes = Array.new(concurrency) do |worker|
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        ready_reader.close
+        go_writer.close
+        op = scenario.call(data, worker)
+        reset_peak_rss
+        allocated = allocated_objects
+        ready_writer.write(".")
+        ready_writer.close
+        go_reader.read
+        latencies = work(op, iterations)
+        finished = clock
+        writer.write(Marshal.dump([latencies, peak_rss, allocated_objects - allocated, finished]))
+        writer.close
+        exit!(0)
+      end
+      writer.close
+      [pid, reader]
+    end
+    ready_writer.close
+    go_reader.close
+    ready_reader.read(concurrency)
+    ready_reader.close
+    started = clock
+    go_writer.close
+    results = pipes.map do |pid, reader|
+      result = Marshal.load(reader.read)
+      reader.close
+      Process.wait(pid)
+      result
+    end
+    [results.flat_map(&:first), results.map { |r| r[1] }.compact.max,
+     results.map { |r| r[2] }.sum, results.map(&:last).max - started]
+  end
+
+  def percentile(sorted, pct)
+    sorted[((sorted.length - 1) * pct / 100.0).round]
+  end
+
+  def measure(name, scenario, size, concurrency, mode, iterations)
+    data = SecureRandom.random_bytes(size)
+    GC.start
+    gc_count = GC.count
+    latencies, rss, allocated, elapsed =
+      if mode == "process"
+        run_processes(scenario, data, concurrency, iterations)
+      else
+        run_threads(scenario, data, concurrency, iterations)
+      end
+    sorted = latencies.sort
+    ops = latencies.length
+
+    {
+      "scenario" => name,
+      "mode" => mode,
+      "size" => size,
+      "concurrency" => concurrency,
+      "operations" => ops,
+      "p50_ms" => percentile(sorted, 50) * 1000,
+      "p95_ms" => percentile(sorted, 95) * 1000,
+      "p99_ms" => percentile(sorted, 99) * 1000,
+      "ops_per_s" => ops / elapsed,
+      "bytes_per_s" => ops * size / elapsed,
+      "peak_rss" => rss,
+      "allocated_objects" => allocated,
+      "gc_count" => GC.count - gc_count,
+    }
+  end
+
+  def run
+    max_size = Integer(ENV["BENCH_MAX_SIZE"] || 16 * 1024 ** 2)
+    sizes = env_list("BENCH_SIZES", SIZES.select { |s| s <= max_size })
+    concurrencies = env_list("BENCH_CONCURRENCY", [1, 4, 16, 64])
+    iterations = Integer(ENV["BENCH_ITERATIONS"] || 5)
+    mode = ENV["BENCH_MODE"] || "thread"
+    results = []
+
+    Dir.mktmpdir do |dir|
+      all = scenarios(dir)
+      names = ENV["BENCH_SCENARIOS"] ? ENV["BENCH_SCENARIOS"].split(",") : all.keys
+
+      puts "N=#{profile.n} r=#{profile.r} p=#{profile.p} mode=#{mode} iterations=#{iterations}"
+      puts "%-13s %12s %5s %10s %10s %10s %12s %10s %12s" %
+        %w{scenario size conc p50_ms p95_ms p99_ms MiB/s rss_MiB allocs/op}
+      names.each do |name|
+        scenario = all.fetch(name)
+        sizes.each do |size|
+          concurrencies.each do |concurrency|
+            result = measure(name, scenario, size, concurrency, mode, iterations)
+            results << result
+            puts "%-13s %12d %5d %10.2f %10.2f %10.2f %12.2f %10.1f %12.1f" % [
+              name, size, concurrency, result["p50_ms"], result["p95_ms"],
+              result["p99_ms"], result["bytes_per_s"] / 1024.0 ** 2,
+              (result["peak_rss"] || 0) / 1024.0 ** 2,
+              result["allocated_objects"].to_f / result["operations"]]
+          end
+        end
+      end
+    end
+
+    if ENV["BENCH_JSON"]
+      File.write(ENV["BENCH_JSON"], JSON.pretty_generate(
+        "ruby" => RUBY_DESCRIPTION,
+        "scrypty" => Scrypty::VERSION,
+        "params" => profile.params,
+        "results" => results))
+    end
+  end
+end
+
+ScryptyBench.run if $0 == __FILE__
@@ -0,0 +1,466 @@
+/*
+ * Microbenchmarks for the kernels underneath scrypty: salsa20/8, BlockMix,
+ * SMix, PBKDF2-SHA256, HMAC-SHA256, SHA256 and AES-CTR.  This file includes
+ * crypto_scrypt-ref.c directly so that it can reach the static scrypt
+ * kernels; the rest of the extension's C sources are linked in as usual.
+ *
+ * Usage: kernels [--quick] [--perf] [--time seconds] [--maxmem bytes]
+ *     [--only kernel] [--label text]
+ *
+ * Results are written to stdout as one JSON document so that runs can be
+ * compared across machines and commits.
+ */
+#include "crypto_scrypt-ref.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/aes.h>
+
+#include "crypto_aesctr.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define HAVE_PERF_EVENTS 1
+#endif
+
+/* Command-line options. */
+static int quick = 0;
+static int useperf = 0;
+static double mintime = 0.2;
+static size_t maxmem = 256 * 1024 * 1024;
+static const char * only = NULL;
+static const char * label = "";
+
+/* Whether a result has already been printed (for JSON commas). */
+static int printed = 0;
+
+struct counters {
+	int fd[2];
+};
+
+struct result {
+	double ns;
+	double cycles;
+	double misses[2];
+	uint64_t iters;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static uint64_t
+cycles(void)
+{
+
+#ifdef HAVE_TSC
+	return (__rdtsc());
+#else
+	return (0);
+#endif
+}
+
+#ifdef HAVE_PERF_EVENTS
+static int
+perf_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return ((int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif
+
+/**
+ * counters_open(c):
+ * Open the cache-miss and dTLB-miss counters, if --perf was given and the
+ * kernel lets us; counters which can't be opened have fd -1.
+ */
+static void
+counters_open(struct counters * c)
+{
+
+	c->fd[0] = c->fd[1] = -1;
+#ifdef HAVE_PERF_EVENTS
+	if (!useperf)
+		return;
+	c->fd[0] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	c->fd[1] = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+}
+
+static void
+counters_toggle(struct counters * c, int on)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (c->fd[i] == -1)
+			continue;
+#ifdef HAVE_PERF_EVENTS
+		if (on) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		} else {
+			ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		}
+#endif
+	}
+}
+
+static void
+counters_close(struct counters * c, double misses[2])
+{
+	uint64_t val;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		misses[i] = -1;
+		if (c->fd[i] == -1)
+			continue;
+		if (read(c->fd[i], &val, sizeof(val)) == sizeof(val))
+			misses[i] = (double)val;
+		close(c->fd[i]);
+	}
+}
+
+/**
+ * measure(fn, cookie, res):
+ * Call fn(cookie) repeatedly for at least mintime seconds (and at least
+ * once) and record the time, cycles and counter values per call.
+ */
+static void
+measure(void (* fn)(void *), void * cookie, struct result * res)
+{
+	struct counters c;
+	double st, en;
+	uint64_t cst, cen;
+	uint64_t i = 0;
+	int k;
+
+	/* Warm up caches and page in any memory. */
+	fn(cookie);
+
+	counters_open(&c);
+	counters_toggle(&c, 1);
+	st = now();
+	cst = cycles();
+	do {
+		fn(cookie);
+		i++;
+		en = now();
+	} while (en - st < mintime * 1e9);
+	cen = cycles();
+	counters_toggle(&c, 0);
+	counters_close(&c, res->misses);
+
+	res->iters = i;
+	res->ns = (en - st) / i;
+	res->cycles = (double)(cen - cst) / i;
+	for (k = 0; k < 2; k++) {
+		if (res->misses[k] >= 0)
+			res->misses[k] /= i;
+	}
+}
+
+static void
+print_result(const char * kernel, const char * params, size_t bytes,
+    size_t traffic, struct result * res)
+{
+
+	printf("%s\n    {\"kernel\": \"%s\", %s\"bytes\": %zu, "
+	    "\"iterations\": %ju, \"ns_per_op\": %.1f, ",
+	    printed ? "," : "", kernel, params, bytes,
+	    (uintmax_t)res->iters, res->ns);
+#ifdef HAVE_TSC
+	printf("\"cycles_per_op\": %.1f, \"cycles_per_byte\": %.3f, ",
+	    res->cycles, res->cycles / bytes);
+#else
+	printf("\"cycles_per_op\": null, \"cycles_per_byte\": null, ");
+#endif
+	printf("\"ns_per_byte\": %.4f, \"bandwidth_gb_per_s\": %.3f",
+	    res->ns / bytes, traffic / res->ns);
+	if (res->misses[0] >= 0)
+		printf(", \"cache_misses_per_op\": %.1f", res->misses[0]);
+	else
+		printf(", \"cache_misses_per_op\": null");
+	if (res->misses[1] >= 0)
+		printf(", \"dtlb_misses_per_op\": %.1f", res->misses[1]);
+	else
+		printf(", \"dtlb_misses_per_op\": null");
+	printf("}");
+	fflush(stdout);
+	printed = 1;
+}
+
+static int
+selected(const char * kernel)
+{
+
+	return ((only == NULL) || (strcmp(only, kernel) == 0));
+}
+
+/* Kernel wrappers. */
+struct scryptargs {
+	uint8_t * B;
+	uint8_t * Y;
+	uint8_t * V;
+	uint8_t * XY;
+	size_t r;
+	uint64_t N;
+};
+
+static void
+run_salsa20_8(void * cookie)
+{
+	struct scryptargs * a = cookie;
+
+	salsa20_8(a->B);
+}
+
+static void
+run_blockmix(void * cookie)
+{
+	struct scryptargs * a = cookie;
+
+	blockmix_salsa8(a->B, a->Y, a->XY, a->r);
+}
+
+static void
+run_smix(void * cookie)
+{
+	struct scryptargs * a = cookie;
+
+	smix_pick(a->r)(a->B, a->r, a->N, a->V, a->XY);
+}
+
+struct bufargs {
+	uint8_t * in;
+	uint8_t * out;
+	size_t len;
+	AES_KEY key;
+};
+
+static void
+run_pbkdf2(void * cookie)
+{
+	struct bufargs * a = cookie;
+
+	scrypty_PBKDF2_SHA256(a->in, 32, a->in, 32, 1, a->out, a->len);
+}
+
+static void
+run_hmac(void * cookie)
+{
+	struct bufargs * a = cookie;
+	scrypty_HMAC_SHA256_CTX ctx;
+
+	scrypty_HMAC_SHA256_Init(&ctx, a->in, 32);
+	scrypty_HMAC_SHA256_Update(&ctx, a->in, a->len);
+	scrypty_HMAC_SHA256_Final(a->out, &ctx);
+}
+
+static void
+run_sha256(void * cookie)
+{
+	struct bufargs * a = cookie;
+	scrypty_SHA256_CTX ctx;
+
+	scrypty_SHA256_Init(&ctx);
+	scrypty_SHA256_Update(&ctx, a->in, a->len);
+	scrypty_SHA256_Final(a->out, &ctx);
+}
+
+static void
+run_aesctr(void * cookie)
+{
+	struct bufargs * a = cookie;
+	struct crypto_aesctr * stream;
+
+	if ((stream = scrypty_crypto_aesctr_init(&a->key, 0)) == NULL)
+		abort();
+	scrypty_crypto_aesctr_stream(stream, a->in, a->out, a->len);
+	scrypty_crypto_aesctr_free(stream);
+}
+
+static void
+bench_scrypt(void)
+{
+	static const size_t rs[] = {1, 2, 4, 8, 16, 32};
+	struct scryptargs a;
+	struct result res;
+	char params[64];
+	size_t i, nr;
+	int logN, maxlogN;
+
+	nr = sizeof(rs) / sizeof(rs[0]);
+	maxlogN = quick ? 14 : 22;
+
+	if ((a.B = calloc(1, 128 * 32)) == NULL ||
+	    (a.Y = calloc(1, 128 * 32)) == NULL ||
+	    (a.XY = calloc(1, 256 * 32 + 64)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	if (selected("salsa20_8")) {
+		measure(run_salsa20_8, &a, &res);
+		print_result("salsa20_8", "", 64, 64, &res);
+	}
+
+	for (i = 0; i < nr; i++) {
+		a.r = rs[i];
+		if (quick && (a.r != 1) && (a.r != 8))
+			continue;
+		if (selected("blockmix_salsa8")) {
+			snprintf(params, sizeof(params), "\"r\": %zu, ", a.r);
+			measure(run_blockmix, &a, &res);
+			print_result("blockmix_salsa8", params, 128 * a.r,
+			    128 * a.r, &res);
+		}
+		if (!selected("smix"))
+			continue;
+		for (logN = 10; logN <= maxlogN; logN++) {
+			a.N = (uint64_t)(1) << logN;
+			if (128 * a.r * a.N > maxmem)
+				break;
+			if ((a.V = malloc(128 * a.r * a.N)) == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			snprintf(params, sizeof(params),
+			    "\"r\": %zu, \"N\": %ju, ", a.r, (uintmax_t)a.N);
+			measure(run_smix, &a, &res);
+
+			/* Each SMix writes all of V once and reads it once. */
+			print_result("smix", params, 128 * a.r * a.N,
+			    2 * 128 * a.r * a.N, &res);
+			free(a.V);
+		}
+	}
+
+	free(a.XY);
+	free(a.Y);
+	free(a.B);
+}
+
+static void
+bench_buffers(void)
+{
+	static const size_t lens[] = {64, 1024, 16384, 65536, 1048576};
+	static const uint8_t key[32] = {0};
+	struct bufargs a;
+	struct result res;
+	size_t i;
+
+	if ((a.in = calloc(1, 1048576)) == NULL ||
+	    (a.out = calloc(1, 1048576)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	if (AES_set_encrypt_key(key, 256, &a.key)) {
+		fprintf(stderr, "AES_set_encrypt_key failed\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		a.len = lens[i];
+		if (quick && (a.len > 65536))
+			continue;
+		if (selected("pbkdf2_sha256") && (a.len <= 65536)) {
+			measure(run_pbkdf2, &a, &res);
+			print_result("pbkdf2_sha256", "", a.len, a.len, &res);
+		}
+		if (selected("hmac_sha256")) {
+			measure(run_hmac, &a, &res);
+			print_result("hmac_sha256", "", a.len, a.len, &res);
+		}
+		if (selected("sha256")) {
+			measure(run_sha256, &a, &res);
+			print_result("sha256", "", a.len, a.len, &res);
+		}
+		if (selected("aesctr")) {
+			measure(run_aesctr, &a, &res);
+			print_result("aesctr", "", a.len, 2 * a.len, &res);
+		}
+	}
+
+	free(a.out);
+	free(a.in);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: kernels [--quick] [--perf] [--time seconds] "
+	    "[--maxmem bytes] [--only kernel] [--label text]\n");
+	exit(1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0)
+			quick = 1;
+		else if (strcmp(argv[i], "--perf") == 0)
+			useperf = 1;
+		else if ((strcmp(argv[i], "--time") == 0) && (i + 1 < argc))
+			mintime = strtod(argv[++i], NULL);
+		else if ((strcmp(argv[i], "--maxmem") == 0) && (i + 1 < argc))
+			maxmem = (size_t)strtoull(argv[++i], NULL, 0);
+		else if ((strcmp(argv[i], "--only") == 0) && (i + 1 < argc))
+			only = argv[++i];
+		else if ((strcmp(argv[i], "--label") == 0) && (i + 1 < argc))
+			label = argv[++i];
+		else
+			usage();
+	}
+
+	printf("{\n  \"label\": \"%s\",\n", label);
+	printf("  \"host\": {\"cpus\": %ld, \"compiler\": \"%s\", "
+	    "\"tsc\": %s, \"perf\": %s},\n", sysconf(_SC_NPROCESSORS_ONLN),
+	    __VERSION__,
+#ifdef HAVE_TSC
+	    "true",
+#else
+	    "false",
+#endif
+	    useperf ? "true" : "false");
+	printf("  \"results\": [");
+
+	bench_scrypt();
+	bench_buffers();
+
+	printf("\n  ]\n}\n");
+
+	return (0);
+}
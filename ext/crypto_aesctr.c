@@ -38,7 +38,7 @@
 #include "crypto_aesctr.h"
 
 struct crypto_aesctr {
-	AES_KEY * key;
+	const AES_KEY * key;
 	uint64_t nonce;
 	uint64_t bytectr;
 	uint8_t buf[16];
@@ -51,7 +51,7 @@ struct crypto_aesctr {
  * lifetime of the stream.
  */
 struct crypto_aesctr *
-scrypty_crypto_aesctr_init(AES_KEY * key, uint64_t nonce)
+scrypty_crypto_aesctr_init(const AES_KEY * key, uint64_t nonce)
 {
 	struct crypto_aesctr * stream;
 
@@ -105,6 +105,50 @@ scrypty_crypto_aesctr_stream(struct crypto_aesctr * stream, const uint8_t * inbu
 	}
 }
 
+/**
+ * scrypty_crypto_aesctr_buf(key, nonce, inbuf, outbuf, buflen):
+ * Encrypt or decrypt ${buflen} bytes from ${inbuf} into ${outbuf} with AES in
+ * CTR mode under the expanded key and nonce provided, without allocating a
+ * stream object.
+ */
+void
+scrypty_crypto_aesctr_buf(const AES_KEY * key, uint64_t nonce,
+    const uint8_t * inbuf, uint8_t * outbuf, size_t buflen)
+{
+
+	scrypty_crypto_aesctr_buf_at(key, nonce, 0, inbuf, outbuf, buflen);
+}
+
+/**
+ * scrypty_crypto_aesctr_buf_at(key, nonce, offset, inbuf, outbuf, buflen):
+ * As scrypty_crypto_aesctr_buf, but starting ${offset} bytes into the
+ * stream.
+ */
+void
+scrypty_crypto_aesctr_buf_at(const AES_KEY * key, uint64_t nonce,
+    uint64_t offset, const uint8_t * inbuf, uint8_t * outbuf, size_t buflen)
+{
+	struct crypto_aesctr stream;
+	uint8_t pblk[16];
+	int i;
+
+	stream.key = key;
+	stream.nonce = nonce;
+	stream.bytectr = offset;
+
+	/* Starting mid-block, we need the rest of that block's cipherstream. */
+	if (offset % 16 != 0) {
+		be64enc(pblk, nonce);
+		be64enc(pblk + 8, offset / 16);
+		AES_encrypt(pblk, stream.buf, key);
+	}
+	scrypty_crypto_aesctr_stream(&stream, inbuf, outbuf, buflen);
+
+	/* Zero potentially sensitive information. */
+	for (i = 0; i < 16; i++)
+		stream.buf[i] = 0;
+}
+
 /**
  * scrypty_crypto_aesctr_free(stream):
  * Free the provided stream object.
@@ -39,7 +39,7 @@
  * expanded key and nonce.  The key provided must remain valid for the
  * lifetime of the stream.
  */
-struct crypto_aesctr * scrypty_crypto_aesctr_init(AES_KEY *, uint64_t);
+struct crypto_aesctr * scrypty_crypto_aesctr_init(const AES_KEY *, uint64_t);
 
 /**
  * scrypty_crypto_aesctr_stream(stream, inbuf, outbuf, buflen):
@@ -50,6 +50,25 @@ struct crypto_aesctr * scrypty_crypto_aesctr_init(AES_KEY *, uint64_t);
 void scrypty_crypto_aesctr_stream(struct crypto_aesctr *, const uint8_t *,
     uint8_t *, size_t);
 
+/**
+ * scrypty_crypto_aesctr_buf(key, nonce, inbuf, outbuf, buflen):
+ * Encrypt or decrypt ${buflen} bytes from ${inbuf} into ${outbuf} with AES in
+ * CTR mode under the expanded key and nonce provided, starting at the
+ * beginning of the stream.  As scrypty_crypto_aesctr_init, _stream and _free
+ * in turn, but without allocating a stream object.
+ */
+void scrypty_crypto_aesctr_buf(const AES_KEY *, uint64_t, const uint8_t *,
+    uint8_t *, size_t);
+
+/**
+ * scrypty_crypto_aesctr_buf_at(key, nonce, offset, inbuf, outbuf, buflen):
+ * As scrypty_crypto_aesctr_buf, but starting ${offset} bytes into the
+ * stream; CTR mode lets separate ranges of one stream be processed
+ * independently (and in parallel).
+ */
+void scrypty_crypto_aesctr_buf_at(const AES_KEY *, uint64_t, uint64_t,
+    const uint8_t *, uint8_t *, size_t);
+
 /**
  * scrypty_crypto_aesctr_free(stream):
  * Free the provided stream object.
@@ -29,24 +29,47 @@
 #include "scrypt_platform.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "scryptenc_budget.h"
+#include "scryptenc_mem.h"
+#include "scryptenc_numa.h"
+#include "scrypty_probes.h"
 #include "sha256.h"
 #include "sysendian.h"
 
 #include "crypto_scrypt.h"
 
-static void blkcpy(uint8_t *, uint8_t *, size_t);
-static void blkxor(uint8_t *, uint8_t *, size_t);
+static void blkcpy(uint8_t *, const uint8_t *, size_t);
+static void blkxor(uint8_t *, const uint8_t *, size_t);
+static void blkxor2(uint8_t *, const uint8_t *, const uint8_t *, size_t);
 static void salsa20_8(uint8_t[64]);
-static void blockmix_salsa8(uint8_t *, uint8_t *, size_t);
-static uint64_t integerify(uint8_t *, size_t);
+static void blockmix_salsa8(const uint8_t *, uint8_t *, uint8_t *, size_t);
+static void blockmix_salsa8_xor(const uint8_t *, const uint8_t *, uint8_t *,
+    uint8_t *, size_t);
+static uint64_t integerify(const uint8_t *, size_t);
 static void smix(uint8_t *, size_t, uint64_t, uint8_t *, uint8_t *);
 
+/*
+ * The kernels below are forced inline into smix_r, which in turn is
+ * forced inline into one copy of SMix per common value of r; with r a
+ * constant the compiler resolves every stride and loop bound and unrolls
+ * BlockMix.  smix itself remains the generic version for other values.
+ */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+typedef void smix_func(uint8_t *, size_t, uint64_t, uint8_t *, uint8_t *);
+static smix_func * smix_pick(size_t);
+
 static void
-blkcpy(uint8_t * dest, uint8_t * src, size_t len)
+blkcpy(uint8_t * dest, const uint8_t * src, size_t len)
 {
 	size_t i;
 
@@ -55,7 +78,7 @@ blkcpy(uint8_t * dest, uint8_t * src, size_t len)
 }
 
 static void
-blkxor(uint8_t * dest, uint8_t * src, size_t len)
+blkxor(uint8_t * dest, const uint8_t * src, size_t len)
 {
 	size_t i;
 
@@ -63,11 +86,21 @@ blkxor(uint8_t * dest, uint8_t * src, size_t len)
 		dest[i] ^= src[i];
 }
 
+static void
+blkxor2(uint8_t * dest, const uint8_t * src1, const uint8_t * src2,
+    size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dest[i] ^= src1[i] ^ src2[i];
+}
+
 /**
  * salsa20_8(B):
  * Apply the salsa20/8 core to the provided block.
  */
-static void
+static ALWAYS_INLINE void
 salsa20_8(uint8_t B[64])
 {
 	uint32_t B32[16];
@@ -121,121 +154,259 @@ salsa20_8(uint8_t B[64])
 }
 
 /**
- * blockmix_salsa8(B, Y, r):
- * Compute B = BlockMix_{salsa20/8, r}(B).  The input B must be 128r bytes in
- * length; the temporary space Y must also be the same size.
+ * blockmix_salsa8(Bin, Bout, X, r):
+ * Compute Bout = BlockMix_{salsa20/8, r}(Bin).  The input Bin and the output
+ * Bout must be 128r bytes in length and must not overlap; the temporary
+ * space X must be 64 bytes.  Each Y_i is written straight to its place in
+ * the shuffled output, so nothing is copied back afterwards.
  */
-static void
-blockmix_salsa8(uint8_t * B, uint8_t * Y, size_t r)
+static ALWAYS_INLINE void
+blockmix_salsa8(const uint8_t * Bin, uint8_t * Bout, uint8_t * X, size_t r)
 {
-	uint8_t X[64];
 	size_t i;
 
 	/* 1: X <-- B_{2r - 1} */
-	blkcpy(X, &B[(2 * r - 1) * 64], 64);
+	blkcpy(X, &Bin[(2 * r - 1) * 64], 64);
 
 	/* 2: for i = 0 to 2r - 1 do */
-	for (i = 0; i < 2 * r; i++) {
+	for (i = 0; i < 2 * r; i += 2) {
 		/* 3: X <-- H(X \xor B_i) */
-		blkxor(X, &B[i * 64], 64);
+		blkxor(X, &Bin[i * 64], 64);
 		salsa20_8(X);
 
 		/* 4: Y_i <-- X */
-		blkcpy(&Y[i * 64], X, 64);
+		/* 6: B'_{i/2} <-- Y_i */
+		blkcpy(&Bout[i * 32], X, 64);
+
+		/* 3: X <-- H(X \xor B_{i+1}) */
+		blkxor(X, &Bin[(i + 1) * 64], 64);
+		salsa20_8(X);
+
+		/* 4: Y_{i+1} <-- X */
+		/* 6: B'_{r + i/2} <-- Y_{i+1} */
+		blkcpy(&Bout[(r + i / 2) * 64], X, 64);
 	}
+}
 
-	/* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
-	for (i = 0; i < r; i++)
-		blkcpy(&B[i * 64], &Y[(i * 2) * 64], 64);
-	for (i = 0; i < r; i++)
-		blkcpy(&B[(i + r) * 64], &Y[(i * 2 + 1) * 64], 64);
+/**
+ * blockmix_salsa8_xor(Bin1, Bin2, Bout, X, r):
+ * Compute Bout = BlockMix_{salsa20/8, r}(Bin1 \xor Bin2), folding the XOR
+ * into the reads of each block rather than making a pass of its own.  The
+ * same requirements as for blockmix_salsa8 apply, and Bin2 must not
+ * overlap Bout either.
+ */
+static ALWAYS_INLINE void
+blockmix_salsa8_xor(const uint8_t * Bin1, const uint8_t * Bin2,
+    uint8_t * Bout, uint8_t * X, size_t r)
+{
+	size_t i;
+
+	/* 1: X <-- B_{2r - 1} */
+	blkcpy(X, &Bin1[(2 * r - 1) * 64], 64);
+	blkxor(X, &Bin2[(2 * r - 1) * 64], 64);
+
+	/* 2: for i = 0 to 2r - 1 do */
+	for (i = 0; i < 2 * r; i += 2) {
+		/* 3: X <-- H(X \xor B_i) */
+		blkxor2(X, &Bin1[i * 64], &Bin2[i * 64], 64);
+		salsa20_8(X);
+
+		/* 4: Y_i <-- X */
+		/* 6: B'_{i/2} <-- Y_i */
+		blkcpy(&Bout[i * 32], X, 64);
+
+		/* 3: X <-- H(X \xor B_{i+1}) */
+		blkxor2(X, &Bin1[(i + 1) * 64], &Bin2[(i + 1) * 64], 64);
+		salsa20_8(X);
+
+		/* 4: Y_{i+1} <-- X */
+		/* 6: B'_{r + i/2} <-- Y_{i+1} */
+		blkcpy(&Bout[(r + i / 2) * 64], X, 64);
+	}
 }
 
 /**
  * integerify(B, r):
  * Return the result of parsing B_{2r-1} as a little-endian integer.
  */
-static uint64_t
-integerify(uint8_t * B, size_t r)
+static ALWAYS_INLINE uint64_t
+integerify(const uint8_t * B, size_t r)
 {
-	uint8_t * X = &B[(2 * r - 1) * 64];
+	const uint8_t * X = &B[(2 * r - 1) * 64];
 
 	return (le64dec(X));
 }
 
 /**
- * smix(B, r, N, V, XY):
+ * smix_r(B, r, N, V, XY):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length; the
  * temporary storage V must be 128rN bytes in length; the temporary storage
- * XY must be 256r bytes in length.  The value N must be a power of 2.
+ * XY must be 256r + 64 bytes in length.  The value N must be a power of 2.
  */
-static void
-smix(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
+static ALWAYS_INLINE void
+smix_r(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
 {
 	uint8_t * X = XY;
 	uint8_t * Y = &XY[128 * r];
+	uint8_t * Z = &XY[256 * r];
+	uint8_t * T;
 	uint64_t i;
 	uint64_t j;
 
-	/* 1: X <-- B */
-	blkcpy(X, B, 128 * r);
-
-	/* 2: for i = 0 to N - 1 do */
-	for (i = 0; i < N; i++) {
-		/* 3: V_i <-- X */
-		blkcpy(&V[i * (128 * r)], X, 128 * r);
+	SCRYPTY_PROBE2(smix__fill, N, r);
 
-		/* 4: X <-- H(X) */
-		blockmix_salsa8(X, Y, r);
+	/* 1: X <-- B */
+	/* 3: V_0 <-- X */
+	blkcpy(V, B, 128 * r);
+
+	/*
+	 * 2: for i = 0 to N - 1 do
+	 *	3: V_i <-- X
+	 *	4: X <-- H(X)
+	 * BlockMix reads V_i and writes V_{i+1} in place of X, except the
+	 * last time, when X goes to the working buffer.
+	 */
+	for (i = 0; i < N - 1; i++) {
+		blockmix_salsa8(&V[i * (128 * r)], &V[(i + 1) * (128 * r)],
+		    Z, r);
 	}
+	blockmix_salsa8(&V[(N - 1) * (128 * r)], X, Z, r);
+
+	SCRYPTY_PROBE2(smix__mix, N, r);
 
 	/* 6: for i = 0 to N - 1 do */
 	for (i = 0; i < N; i++) {
 		/* 7: j <-- Integerify(X) mod N */
 		j = integerify(X, r) & (N - 1);
 
-		/* 8: X <-- H(X \xor V_j) */
-		blkxor(X, &V[j * (128 * r)], 128 * r);
-		blockmix_salsa8(X, Y, r);
+		/* 8: X <-- H(X \xor V_j), with X and Y trading places */
+		blockmix_salsa8_xor(X, &V[j * (128 * r)], Y, Z, r);
+		T = X;
+		X = Y;
+		Y = T;
 	}
 
 	/* 10: B' <-- X */
 	blkcpy(B, X, 128 * r);
+
+	SCRYPTY_PROBE2(smix__done, N, r);
 }
 
 /**
- * scrypty_crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
- * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
- * p, buflen) and write the result into buf.  The parameters r, p, and buflen
- * must satisfy r * p < 2^30 and buflen <= (2^32 - 1) * 32.  The parameter N
- * must be a power of 2.
- *
- * Return 0 on success; or -1 on error.
+ * smix(B, r, N, V, XY):
+ * As smix_r, for any r.
  */
-int
-scrypty_crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
-    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
-    uint8_t * buf, size_t buflen)
+static void
+smix(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
+{
+
+	smix_r(B, r, N, V, XY);
+}
+
+/**
+ * smix_1(B, r, N, V, XY), smix_8, smix_16, smix_32:
+ * As smix_r, for the given value of r (which must be passed anyway).
+ * r = 1 is what CPU calibration runs; r = 8 is what pickparams chooses.
+ */
+static void
+smix_1(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
+{
+
+	(void)r;
+	smix_r(B, 1, N, V, XY);
+}
+
+static void
+smix_8(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
+{
+
+	(void)r;
+	smix_r(B, 8, N, V, XY);
+}
+
+static void
+smix_16(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
+{
+
+	(void)r;
+	smix_r(B, 16, N, V, XY);
+}
+
+static void
+smix_32(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
 {
+
+	(void)r;
+	smix_r(B, 32, N, V, XY);
+}
+
+/**
+ * smix_pick(r):
+ * Return the version of SMix to use for r.
+ */
+static smix_func *
+smix_pick(size_t r)
+{
+
+	switch (r) {
+	case 1:
+		return (smix_1);
+	case 8:
+		return (smix_8);
+	case 16:
+		return (smix_16);
+	case 32:
+		return (smix_32);
+	default:
+		return (smix);
+	}
+}
+
+/*
+ * Workspaces kept by scrypty_crypto_scrypt_keep: the B, XY and V arrays of
+ * the calling thread's last derivation, grown as needed and freed when the
+ * thread exits.  Vkept is what the workspace counts towards kept, the V
+ * bytes held by all workspaces, which may not exceed CRYPTO_SCRYPT_KEPTMAX.
+ */
+struct workspace {
 	uint8_t * B;
-	uint8_t * V;
+	size_t Blen;
 	uint8_t * XY;
-	uint32_t i;
+	size_t XYlen;
+	uint8_t * V;
+	size_t Vlen;
+	size_t Vkept;
+};
+
+static pthread_once_t wsonce = PTHREAD_ONCE_INIT;
+static pthread_key_t wskey;
+static int wskeyok = 0;
+static size_t kept = 0;
+
+/**
+ * checkparams(N, r, p, buflen):
+ * Check that the parameters are ones scrypty_crypto_scrypt can compute
+ * with, and set errno if not.
+ */
+static int
+checkparams(uint64_t N, uint32_t r, uint32_t p, size_t buflen)
+{
 
-	/* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
 	if (buflen > (((uint64_t)(1) << 32) - 1) * 32) {
 		errno = EFBIG;
-		goto err0;
+		return (-1);
 	}
+#else
+	(void)buflen;
 #endif
 	if ((uint64_t)(r) * (uint64_t)(p) >= (1 << 30)) {
 		errno = EFBIG;
-		goto err0;
+		return (-1);
 	}
 	if (((N & (N - 1)) != 0) || (N == 0)) {
 		errno = EINVAL;
-		goto err0;
+		return (-1);
 	}
 	if ((r > SIZE_MAX / 128 / p) ||
 #if SIZE_MAX / 256 <= UINT32_MAX
@@ -243,42 +414,266 @@ scrypty_crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #endif
 	    (N > SIZE_MAX / 128 / r)) {
 		errno = ENOMEM;
-		goto err0;
+		return (-1);
 	}
 
-	/* Allocate memory. */
-	if ((B = malloc(128 * r * p)) == NULL)
-		goto err0;
-	if ((XY = malloc(256 * r)) == NULL)
-		goto err1;
-	if ((V = malloc(128 * r * N)) == NULL)
-		goto err2;
+	return (0);
+}
+
+/**
+ * derive(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen, B, V, XY):
+ * Compute scrypt into buf using the arrays B (128 * r * p bytes), V
+ * (128 * r * N bytes) and XY (256 * r + 64 bytes).
+ */
+static void
+derive(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
+    size_t saltlen, uint64_t N, uint32_t r, uint32_t p, uint8_t * buf,
+    size_t buflen, uint8_t * B, uint8_t * V, uint8_t * XY)
+{
+	smix_func * smixr;
+	uint32_t i;
 
 	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
 	scrypty_PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, B, p * 128 * r);
 
 	/* 2: for i = 0 to p - 1 do */
+	smixr = smix_pick(r);
 	for (i = 0; i < p; i++) {
 		/* 3: B_i <-- MF(B_i, N) */
-		smix(&B[i * 128 * r], r, N, V, XY);
+		smixr(&B[i * 128 * r], r, N, V, XY);
 	}
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
 	scrypty_PBKDF2_SHA256(passwd, passwdlen, B, p * 128 * r, 1, buf, buflen);
+}
+
+/**
+ * scrypty_crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
+ * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
+ * p, buflen) and write the result into buf.  The parameters r, p, and buflen
+ * must satisfy r * p < 2^30 and buflen <= (2^32 - 1) * 32.  The parameter N
+ * must be a power of 2.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+scrypty_crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
+    uint8_t * buf, size_t buflen)
+{
+	uint8_t * B;
+	uint8_t * V;
+	uint8_t * XY;
+	void * pin;
+	int saved_errno;
+
+	SCRYPTY_PROBE4(scrypt__start, N, r, p, (uint64_t)(128) * r * N);
+
+	/* Sanity-check parameters. */
+	if (checkparams(N, r, p, buflen))
+		goto err0;
+
+	/*
+	 * Allocate memory.  On a multi-node system we stay on one node until
+	 * we're done, so that V (and XY, first touched here) is local to the
+	 * CPU running smix.
+	 */
+	if ((B = malloc(128 * r * p)) == NULL)
+		goto err0;
+	pin = scrypty_numa_pin(128 * r * N);
+	if ((XY = malloc(256 * r + 64)) == NULL)
+		goto err1;
+	if (scrypty_budget_acquire(128 * r * N))
+		goto err2;
+	if ((V = scrypty_mem_alloc(128 * r * N)) == NULL)
+		goto err3;
+
+	derive(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen, B, V, XY);
 
 	/* Free memory. */
-	free(V);
+	scrypty_mem_free(V, 128 * r * N);
+	scrypty_budget_release(128 * r * N);
 	free(XY);
 	free(B);
+	scrypty_numa_unpin(pin);
+
+	SCRYPTY_PROBE4(scrypt__done, N, r, p, 0);
 
 	/* Success! */
 	return (0);
 
+err3:
+	scrypty_budget_release(128 * r * N);
 err2:
 	free(XY);
 err1:
+	saved_errno = errno;
+	scrypty_numa_unpin(pin);
+	errno = saved_errno;
 	free(B);
 err0:
+	SCRYPTY_PROBE4(scrypt__done, N, r, p, errno);
+
+	/* Failure! */
+	return (-1);
+}
+
+static void
+wsfree(void * cookie)
+{
+	struct workspace * ws = cookie;
+
+	free(ws->B);
+	free(ws->XY);
+	if (ws->V != NULL)
+		scrypty_mem_free(ws->V, ws->Vlen);
+	__atomic_sub_fetch(&kept, ws->Vkept, __ATOMIC_RELAXED);
+	free(ws);
+}
+
+static void
+wsinit(void)
+{
+
+	wskeyok = (pthread_key_create(&wskey, wsfree) == 0);
+}
+
+/**
+ * getws():
+ * Return the calling thread's workspace, or NULL if it can't have one.
+ */
+static struct workspace *
+getws(void)
+{
+	struct workspace * ws;
+
+	pthread_once(&wsonce, wsinit);
+	if (!wskeyok)
+		return (NULL);
+	if ((ws = pthread_getspecific(wskey)) != NULL)
+		return (ws);
+	if ((ws = calloc(1, sizeof(struct workspace))) == NULL)
+		return (NULL);
+	if (pthread_setspecific(wskey, ws)) {
+		free(ws);
+		return (NULL);
+	}
+	return (ws);
+}
+
+/**
+ * grow(buf, buflen, len):
+ * Make the malloced buffer *buf of *buflen bytes at least len bytes long.
+ * Its contents are not kept.
+ */
+static int
+grow(uint8_t ** buf, size_t * buflen, size_t len)
+{
+
+	if (*buflen >= len)
+		return (0);
+	free(*buf);
+	*buflen = 0;
+	if ((*buf = malloc(len)) == NULL)
+		return (-1);
+	*buflen = len;
+	return (0);
+}
+
+/**
+ * reserve(ws, Vlen):
+ * Count a V of Vlen bytes in ws towards kept, unless that would take kept
+ * over CRYPTO_SCRYPT_KEPTMAX.  Return non-zero if it would.
+ */
+static int
+reserve(struct workspace * ws, size_t Vlen)
+{
+	size_t more;
+
+	if (ws->Vkept >= Vlen)
+		return (0);
+	more = Vlen - ws->Vkept;
+	if (__atomic_add_fetch(&kept, more, __ATOMIC_RELAXED) >
+	    CRYPTO_SCRYPT_KEPTMAX) {
+		__atomic_sub_fetch(&kept, more, __ATOMIC_RELAXED);
+		return (-1);
+	}
+	ws->Vkept = Vlen;
+	return (0);
+}
+
+/**
+ * scrypty_crypto_scrypt_keep(passwd, passwdlen, salt, saltlen, N, r, p,
+ *     buf, buflen):
+ * As scrypty_crypto_scrypt, reusing the calling thread's workspace.
+ */
+int
+scrypty_crypto_scrypt_keep(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
+    uint8_t * buf, size_t buflen)
+{
+	struct workspace * ws;
+	void * pin;
+	size_t Vlen;
+	int saved_errno;
+
+	/*
+	 * Anything too large to keep, or which would take the workspaces of
+	 * all threads over CRYPTO_SCRYPT_KEPTMAX, takes the usual path.
+	 */
+	if ((r == 0) || (p == 0) || (N > CRYPTO_SCRYPT_KEEPMAX / 128 / r) ||
+	    (p > CRYPTO_SCRYPT_KEEPMAX / 128 / r) || ((ws = getws()) == NULL) ||
+	    reserve(ws, 128 * r * N))
+		return (scrypty_crypto_scrypt(passwd, passwdlen, salt, saltlen,
+		    N, r, p, buf, buflen));
+	Vlen = 128 * r * N;
+
+	SCRYPTY_PROBE4(scrypt__start, N, r, p, (uint64_t)(Vlen));
+
+	/* Sanity-check parameters. */
+	if (checkparams(N, r, p, buflen))
+		goto err0;
+
+	/* Grow the workspace if need be; V is still covered by the budget. */
+	pin = scrypty_numa_pin(Vlen);
+	if (grow(&ws->B, &ws->Blen, 128 * r * p) ||
+	    grow(&ws->XY, &ws->XYlen, 256 * r + 64))
+		goto err1;
+	if (scrypty_budget_acquire(Vlen))
+		goto err1;
+	if (ws->Vlen < Vlen) {
+		if (ws->V != NULL)
+			scrypty_mem_free(ws->V, ws->Vlen);
+		ws->Vlen = 0;
+		if ((ws->V = scrypty_mem_alloc(Vlen)) == NULL)
+			goto err2;
+		ws->Vlen = Vlen;
+	}
+
+	derive(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen, ws->B,
+	    ws->V, ws->XY);
+
+	/* Nothing derived from the password stays in the workspace. */
+	memset(ws->B, 0, 128 * r * p);
+	memset(ws->XY, 0, 256 * r + 64);
+	memset(ws->V, 0, Vlen);
+	scrypty_budget_release(Vlen);
+	scrypty_numa_unpin(pin);
+
+	SCRYPTY_PROBE4(scrypt__done, N, r, p, 0);
+
+	/* Success! */
+	return (0);
+
+err2:
+	scrypty_budget_release(Vlen);
+err1:
+	saved_errno = errno;
+	scrypty_numa_unpin(pin);
+	errno = saved_errno;
+err0:
+	SCRYPTY_PROBE4(scrypt__done, N, r, p, errno);
+
 	/* Failure! */
 	return (-1);
 }
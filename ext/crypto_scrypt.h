@@ -43,4 +43,25 @@
 int scrypty_crypto_scrypt(const uint8_t *, size_t, const uint8_t *, size_t, uint64_t,
     uint32_t, uint32_t, uint8_t *, size_t);
 
+/* Workspaces larger than this are not kept between derivations. */
+#define CRYPTO_SCRYPT_KEEPMAX	(64 * 1024 * 1024)
+
+/* The V arrays kept by all threads together are at most this large. */
+#define CRYPTO_SCRYPT_KEPTMAX	(256 * 1024 * 1024)
+
+/**
+ * scrypty_crypto_scrypt_keep(passwd, passwdlen, salt, saltlen, N, r, p,
+ *     buf, buflen):
+ * As scrypty_crypto_scrypt, but keep the memory it uses (if V and B are
+ * each at most CRYPTO_SCRYPT_KEEPMAX bytes) for the calling thread's next
+ * call, instead of allocating and freeing it every time.  This is for many
+ * derivations with the same parameters, as in password checking.  The
+ * memory budget still counts V only while a derivation runs, so a call which
+ * would take the V arrays kept by all threads over CRYPTO_SCRYPT_KEPTMAX
+ * bytes allocates its own instead.  The arrays are zeroed after every
+ * derivation and freed when the thread exits.
+ */
+int scrypty_crypto_scrypt_keep(const uint8_t *, size_t, const uint8_t *,
+    size_t, uint64_t, uint32_t, uint32_t, uint8_t *, size_t);
+
 #endif /* !_CRYPTO_SCRYPT_H_ */
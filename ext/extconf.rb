@@ -33,10 +33,30 @@ end
 have_func('malloc')
 have_func('mmap')
 have_func('strtod')
-%w{clock_gettime gettimeofday memmove memset munmap posix_memalign strcspn strdup strerror strtoumax sysinfo}.each do |func|
+%w{clock_gettime gettimeofday memmove memset munmap posix_fadvise posix_memalign strcspn strdup strerror strtoumax sysinfo}.each do |func|
   have_func(func)
 end
 have_const('be64enc')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+have_header('sys/random.h') && have_func('getrandom', 'sys/random.h')
+
+# NUMA-local V arrays and worker placement (see scryptenc_numa.h).
+have_header('numa.h') && have_library('numa', 'numa_available')
+
+# Compression before encryption (see scryptenc_compress.h): zlib is expected
+# everywhere, zstd and lz4 are used when present.
+have_header('zlib.h') && have_library('z', 'deflateInit_')
+have_header('zstd.h') && have_library('zstd', 'ZSTD_compressStream2')
+have_header('lz4frame.h') && have_library('lz4', 'LZ4F_compressBegin')
+
+# Static tracepoints for bpftrace/perf (see scrypty_probes.h).
+if enable_config('probes', false)
+  unless have_header('sys/sdt.h')
+    abort "--enable-probes requires sys/sdt.h (systemtap-sdt-dev or systemtap-sdt-devel)"
+  end
+  $defs.push("-DENABLE_PROBES=1")
+end
 
 system("sysctl hw.usermem >/dev/null 2>/dev/null")
 if $?.exitstatus == 0
@@ -1,9 +1,28 @@
 #include <ruby.h>
+#include <ruby/encoding.h>
 #include <ruby/io.h>
+#include <ruby/thread.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <openssl/crypto.h>
 #include "scryptenc.h"
+#include "scryptenc_batch.h"
+#include "scryptenc_budget.h"
+#include "scryptenc_compress.h"
 #include "scryptenc_cpuperf.h"
+#include "scryptenc_entropy.h"
+#include "scryptenc_key.h"
+#include "scryptenc_log.h"
+#include "scryptenc_mcf.h"
+#include "scryptenc_mem.h"
+#include "scryptenc_pipe.h"
+#include "scryptenc_sched.h"
+#include "scryptenc_stats.h"
+#include "scryptenc_tree.h"
+#include "scryptenc_tune.h"
 #include "memlimit.h"
 #include "crypto_scrypt.h"
 #include "crypto_aesctr.h"
@@ -25,6 +44,39 @@ VALUE eTooMuchTimeError;
 VALUE eIncorrectPasswordError;
 VALUE eWriteError;
 VALUE eReadError;
+VALUE eMemoryBudgetTimeoutError;
+VALUE eCompressionError;
+VALUE eCancelledError;
+VALUE eLockedError;
+
+VALUE cProfile;
+VALUE cKey;
+VALUE cLogWriter;
+VALUE cLogReader;
+VALUE mPassword;
+
+/* Profiles are frozen once initialized, so Ractors may share them. */
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+static size_t
+scrypty_profile_memsize(ptr)
+  const void *ptr;
+{
+  return sizeof(struct scryptenc_profile);
+}
+
+static const rb_data_type_t scrypty_profile_type = {
+  "Scrypty::Profile",
+  { NULL, RUBY_TYPED_DEFAULT_FREE, scrypty_profile_memsize, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+/* Keyword argument names, interned once in Init_scrypty_ext. */
+static ID scrypty_job_kwargs[5];
+static ID scrypty_tune_kwargs[3];
+static ID scrypty_log_kwargs[2];
 
 /**
  * Return codes from scrypt(enc|dec)_(buf|file):
@@ -32,7 +84,7 @@ VALUE eReadError;
  * 1	getrlimit or sysctl(hw.usermem) failed
  * 2	clock_getres or clock_gettime failed
  * 3	error computing derived key
- * 4	could not read salt from /dev/urandom
+ * 4	could not get random bytes for the salt
  * 5	error in OpenSSL
  * 6	malloc failed
  * 7	data is not a valid scrypt-encrypted block
@@ -42,616 +94,3213 @@ VALUE eReadError;
  * 11	password is incorrect
  * 12	error writing output file
  * 13	error reading input file
+ * 14	timed out waiting for the memory budget
+ * 15	error compressing or decompressing data
+ * 16	cancelled by Thread#raise, Thread#kill or a signal
+ * 17	the log is open for writing elsewhere
  */
-static void
-raise_scrypty_error(errorcode)
+static VALUE
+scrypty_error_new(errorcode)
    int errorcode;
 {
+  scrypty_stats_error(errorcode);
+
   switch (errorcode) {
     case 1:
-      rb_raise(eMemoryLimitError, "couldn't get memory limit");
-      break;
+      return rb_exc_new_cstr(eMemoryLimitError, "couldn't get memory limit");
     case 2:
-      rb_raise(eClockTimeError, "couldn't determine CPU speed");
-      break;
+      return rb_exc_new_cstr(eClockTimeError, "couldn't determine CPU speed");
     case 3:
-      rb_raise(eDerivedKeyError, "couldn't compute derived key");
-      break;
+      return rb_exc_new_cstr(eDerivedKeyError, "couldn't compute derived key");
     case 4:
-      rb_raise(eSaltError, "couldn't read salt from /dev/urandom");
-      break;
+      return rb_exc_new_cstr(eSaltError, "couldn't get random bytes for the salt");
     case 5:
-      rb_raise(eOpenSSLError, "OpenSSL error");
-      break;
+      return rb_exc_new_cstr(eOpenSSLError, "OpenSSL error");
     case 6:
-      rb_raise(rb_eNoMemError, "couldn't allocate memory");
-      break;
+      return rb_exc_new_cstr(rb_eNoMemError, "couldn't allocate memory");
     case 7:
-      rb_raise(eInvalidBlockError, "data is not a valid scrypt-encrypted block");
-      break;
+      return rb_exc_new_cstr(eInvalidBlockError, "data is not a valid scrypt-encrypted block");
     case 8:
-      rb_raise(eUnrecognizedFormatError, "unrecognized scrypt format");
-      break;
+      return rb_exc_new_cstr(eUnrecognizedFormatError, "unrecognized scrypt format");
     case 9:
-      rb_raise(eNotEnoughMemoryError, "decrypting would take too much memory");
-      break;
+      return rb_exc_new_cstr(eNotEnoughMemoryError, "decrypting would take too much memory");
     case 10:
-      rb_raise(eTooMuchTimeError, "decrypting would take too long");
-      break;
+      return rb_exc_new_cstr(eTooMuchTimeError, "decrypting would take too long");
     case 11:
-      rb_raise(eIncorrectPasswordError, "password is incorrect");
-      break;
+      return rb_exc_new_cstr(eIncorrectPasswordError, "password is incorrect");
     case 12:
-      rb_raise(eWriteError, "error writing output file");
-      break;
+      return rb_exc_new_cstr(eWriteError, "error writing output file");
     case 13:
-      rb_raise(eReadError, "error reading input file");
-      break;
+      return rb_exc_new_cstr(eReadError, "error reading input file");
+    case 14:
+      return rb_exc_new_cstr(eMemoryBudgetTimeoutError, "timed out waiting for the memory budget");
+    case 15:
+      return rb_exc_new_cstr(eCompressionError, "error compressing or decompressing data");
+    case 16:
+      return rb_exc_new_cstr(eCancelledError, "cancelled");
+    case 17:
+      return rb_exc_new_cstr(eLockedError, "log is open for writing elsewhere");
   }
+
+  return Qnil;
 }
 
-static VALUE
-scrypty_buffer(rb_obj, rb_data, rb_password, rb_maxmem, rb_maxmemfrac, rb_maxtime, encrypt)
-  VALUE rb_obj;
-  VALUE rb_data;
-  VALUE rb_password;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
-  VALUE rb_maxtime;
-  int encrypt;
+static void
+raise_scrypty_error(errorcode)
+   int errorcode;
 {
-  VALUE rb_out;
-  char *data, *password, *out;
-  size_t data_len, password_len, out_len, maxmem;
-  double maxmemfrac, maxtime;
-  int errorcode;
+  VALUE rb_exc;
 
-  if (TYPE(rb_data) == T_STRING) {
-    data = RSTRING_PTR(rb_data);
-    data_len = (size_t) RSTRING_LEN(rb_data);
-  }
-  else {
-    rb_raise(rb_eTypeError, "first argument (data) must be a String");
+  rb_exc = scrypty_error_new(errorcode);
+  if (!NIL_P(rb_exc)) {
+    rb_exc_raise(rb_exc);
   }
+}
 
-  if (TYPE(rb_password) == T_STRING) {
-    password = RSTRING_PTR(rb_password);
-    password_len = (size_t) RSTRING_LEN(rb_password);
+static const char *scrypty_ordinals[] = {
+  "first", "second", "third", "fourth", "fifth", "sixth", "seventh",
+  "eighth", "ninth", "tenth"
+};
+
+/* Fill in a profile from the trailing arguments of a call, which are
+ * either a single Scrypty::Profile or (maxmem, maxmemfrac, maxtime).  The
+ * first of these trailing arguments is argument number pos, counting from
+ * zero, which is only used for error messages. */
+static void
+scrypty_get_profile(argc, argv, pos, profile)
+  int argc;
+  VALUE *argv;
+  int pos;
+  struct scryptenc_profile *profile;
+{
+  VALUE rb_maxmem, rb_maxmemfrac, rb_maxtime;
+  size_t maxmem;
+  double maxmemfrac, maxtime;
+  int errorcode;
+
+  if (argc == 1) {
+    if (rb_typeddata_is_kind_of(argv[0], &scrypty_profile_type)) {
+      *profile = *(struct scryptenc_profile *) RTYPEDDATA_DATA(argv[0]);
+      return;
+    }
+    rb_raise(rb_eTypeError, "%s argument (profile) must be a Scrypty::Profile",
+        scrypty_ordinals[pos]);
   }
-  else {
-    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  else if (argc != 3) {
+    rb_raise(rb_eArgError, "expected a Scrypty::Profile or maxmem, maxmemfrac and maxtime");
   }
+  rb_maxmem = argv[0];
+  rb_maxmemfrac = argv[1];
+  rb_maxtime = argv[2];
 
   if (TYPE(rb_maxmem) == T_FIXNUM) {
     maxmem = FIX2INT(rb_maxmem);
   }
   else {
-    rb_raise(rb_eTypeError, "third argument (maxmem) must be a Fixnum");
+    rb_raise(rb_eTypeError, "%s argument (maxmem) must be a Fixnum",
+        scrypty_ordinals[pos]);
   }
 
   if (FIXNUM_P(rb_maxmemfrac) || TYPE(rb_maxmemfrac) == T_FLOAT) {
     maxmemfrac = NUM2DBL(rb_maxmemfrac);
   }
   else {
-    rb_raise(rb_eTypeError, "fourth argument (maxmemfrac) must be a Fixnum or Float");
+    rb_raise(rb_eTypeError, "%s argument (maxmemfrac) must be a Fixnum or Float",
+        scrypty_ordinals[pos + 1]);
   }
 
   if (FIXNUM_P(rb_maxtime) || TYPE(rb_maxtime) == T_FLOAT) {
     maxtime = NUM2DBL(rb_maxtime);
   }
   else {
-    rb_raise(rb_eTypeError, "fifth argument (maxtime) must be a Fixnum or Float");
-  }
-
-  if (encrypt) {
-    out_len = data_len + 128;
-    rb_out = rb_str_new(NULL, out_len);
-    out = RSTRING_PTR(rb_out);
-
-    errorcode = scrypty_scryptenc_buf((const uint8_t *) data, data_len,
-        (uint8_t *) out, (const uint8_t *) password, password_len,
-        maxmem, maxmemfrac, maxtime);
-  }
-  else {
-    rb_out = rb_str_new(NULL, data_len);
-    out = RSTRING_PTR(rb_out);
-
-    errorcode = scrypty_scryptdec_buf((const uint8_t *) data, data_len,
-        (uint8_t *) out, &out_len, (const uint8_t *) password, password_len,
-        maxmem, maxmemfrac, maxtime);
+    rb_raise(rb_eTypeError, "%s argument (maxtime) must be a Fixnum or Float",
+        scrypty_ordinals[pos + 2]);
   }
 
+  errorcode = scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime, profile);
   if (errorcode) {
     raise_scrypty_error(errorcode);
   }
-  rb_str_set_len(rb_out, out_len);
-
-  return rb_out;
 }
 
-VALUE
-scrypty_encrypt_buffer(rb_obj, rb_data, rb_password, rb_maxmem, rb_maxmemfrac, rb_maxtime)
-  VALUE rb_obj;
-  VALUE rb_data;
-  VALUE rb_password;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
-  VALUE rb_maxtime;
-{
-  return scrypty_buffer(rb_obj, rb_data, rb_password, rb_maxmem, rb_maxmemfrac,
-      rb_maxtime, 1);
-}
+/* How a call waits for the memory budget (see scryptenc_budget.h) and the
+ * scheduler (see scryptenc_sched.h), how encryption compresses, and where
+ * the output goes.  vbytes is not an option: callers which can tell how
+ * large a V array the call will allocate set it, for scrypty_without_gvl
+ * to report to the GC. */
+struct scrypty_job {
+  int priority;
+  double timeout;
+  int sched_class;
+  uint64_t deadline;
+  int compress;
+  VALUE out;
+  size_t vbytes;
+};
 
-VALUE
-scrypty_decrypt_buffer(rb_obj, rb_data, rb_password, rb_maxmem, rb_maxmemfrac, rb_maxtime)
-  VALUE rb_obj;
-  VALUE rb_data;
-  VALUE rb_password;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
-  VALUE rb_maxtime;
+/* Fill in the scheduling class and memory budget priority of job from a
+ * priority: option.  The Symbols name a class, and set the budget priority
+ * to match; an Integer is a budget priority only, and leaves the class
+ * :normal. */
+static void
+scrypty_get_priority(rb_priority, job)
+  VALUE rb_priority;
+  struct scrypty_job *job;
 {
-  return scrypty_buffer(rb_obj, rb_data, rb_password, rb_maxmem, rb_maxmemfrac,
-      rb_maxtime, 0);
-}
+  ID id;
 
-VALUE
-scrypty_file(rb_obj, rb_infn, rb_outfn, rb_password, rb_maxmem, rb_maxmemfrac, rb_maxtime, encrypt)
-  VALUE rb_obj;
-  VALUE rb_infn;
-  VALUE rb_outfn;
-  VALUE rb_password;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
-  VALUE rb_maxtime;
-  int encrypt;
-{
-  VALUE rb_infile, rb_outfile;
-  FILE *in, *out;
-  rb_io_t *in_p, *out_p;
-  char *password;
-  size_t password_len;
-  int errorcode, maxmem;
-  double maxmemfrac, maxtime;
+  if (SYMBOL_P(rb_priority)) {
+    id = SYM2ID(rb_priority);
+    if (id == rb_intern("interactive")) {
+      job->sched_class = SCRYPTY_SCHED_INTERACTIVE;
+      job->priority = 1;
+    }
+    else if (id == rb_intern("normal")) {
+      job->sched_class = SCRYPTY_SCHED_NORMAL;
+      job->priority = 0;
+    }
+    else if (id == rb_intern("batch")) {
+      job->sched_class = SCRYPTY_SCHED_BATCH;
+      job->priority = -1;
+    }
+    else {
+      rb_raise(rb_eArgError,
+          "priority must be :interactive, :normal, :batch or an Integer");
+    }
+    return;
+  }
 
-  rb_infile = rb_file_open_str(rb_infn, "rb");
-  rb_outfile = rb_file_open_str(rb_outfn, "wb");
+  job->priority = NUM2INT(rb_priority);
+}
 
-  if (TYPE(rb_password) == T_STRING) {
-    password = RSTRING_PTR(rb_password);
-    password_len = (size_t) RSTRING_LEN(rb_password);
+/* Convert a deadline: option, seconds from now or a Time, to a
+ * scrypty_stats_now timestamp. */
+static uint64_t
+scrypty_get_deadline(rb_deadline)
+  VALUE rb_deadline;
+{
+  struct timespec then, now;
+  double seconds;
+
+  if (rb_obj_is_kind_of(rb_deadline, rb_cTime)) {
+    then = rb_time_timespec(rb_deadline);
+    clock_gettime(CLOCK_REALTIME, &now);
+    seconds = (double) (then.tv_sec - now.tv_sec) +
+        (double) (then.tv_nsec - now.tv_nsec) / 1e9;
   }
   else {
-    rb_raise(rb_eTypeError, "third argument (password) must be a String");
+    seconds = NUM2DBL(rb_deadline);
   }
 
-  if (TYPE(rb_maxmem) == T_FIXNUM) {
-    maxmem = FIX2INT(rb_maxmem);
-  }
-  else {
-    rb_raise(rb_eTypeError, "fourth argument (maxmem) must be a Fixnum");
+  /* A deadline already past is as urgent as it gets, but 0 means none. */
+  if (!(seconds > 0)) {
+    return 1;
   }
+  return scrypty_stats_now() + (uint64_t) (seconds * 1e9);
+}
 
-  if (FIXNUM_P(rb_maxmemfrac) || TYPE(rb_maxmemfrac) == T_FLOAT) {
-    maxmemfrac = NUM2DBL(rb_maxmemfrac);
+/* Convert a compress: option to one of the SCRYPTENC_COMPRESS_* values. */
+static int
+scrypty_get_compress(rb_compress)
+  VALUE rb_compress;
+{
+  ID id;
+  int compress;
+
+  if (!RTEST(rb_compress)) {
+    return SCRYPTENC_COMPRESS_NONE;
   }
-  else {
-    rb_raise(rb_eTypeError, "fifth argument (maxmemfrac) must be a Fixnum or Float");
+  if (rb_compress == Qtrue) {
+    return SCRYPTENC_COMPRESS_ZLIB;
+  }
+  if (!SYMBOL_P(rb_compress)) {
+    rb_raise(rb_eTypeError, "compress must be a Symbol");
   }
 
-  if (FIXNUM_P(rb_maxtime) || TYPE(rb_maxtime) == T_FLOAT) {
-    maxtime = NUM2DBL(rb_maxtime);
+  id = SYM2ID(rb_compress);
+  if (id == rb_intern("none")) {
+    return SCRYPTENC_COMPRESS_NONE;
   }
-  else {
-    rb_raise(rb_eTypeError, "sixth argument (maxtime) must be a Fixnum or Float");
+  else if (id == rb_intern("zlib")) {
+    compress = SCRYPTENC_COMPRESS_ZLIB;
   }
-
-  GetOpenFile(rb_infile, in_p);
-  in = rb_io_stdio_file(in_p);
-  GetOpenFile(rb_outfile, out_p);
-  out = rb_io_stdio_file(out_p);
-
-  if (encrypt) {
-    errorcode = scrypty_scryptenc_file(in, out, (const uint8_t *) password,
-        password_len, maxmem, maxmemfrac, maxtime);
+  else if (id == rb_intern("zstd")) {
+    compress = SCRYPTENC_COMPRESS_ZSTD;
+  }
+  else if (id == rb_intern("lz4")) {
+    compress = SCRYPTENC_COMPRESS_LZ4;
   }
   else {
-    errorcode = scrypty_scryptdec_file(in, out, (const uint8_t *) password,
-        password_len, maxmem, maxmemfrac, maxtime);
+    rb_raise(rb_eArgError, "compress must be :zlib, :zstd, :lz4 or :none");
   }
-  rb_io_close(rb_infile);
-  rb_io_close(rb_outfile);
-
-  if (errorcode) {
-    raise_scrypty_error(errorcode);
+  if (!scrypty_compress_supported(compress)) {
+    rb_raise(rb_eArgError, "%s compression was not built in",
+        rb_id2name(id));
   }
 
-  return Qnil;
-}
-
-VALUE
-scrypty_encrypt_file(rb_obj, rb_infn, rb_outfn, rb_password, rb_maxmem, rb_maxmemfrac, rb_maxtime)
-  VALUE rb_obj;
-  VALUE rb_infn;
-  VALUE rb_outfn;
-  VALUE rb_password;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
-  VALUE rb_maxtime;
-{
-  return scrypty_file(rb_obj, rb_infn, rb_outfn, rb_password, rb_maxmem,
-      rb_maxmemfrac, rb_maxtime, 1);
+  return compress;
 }
 
-VALUE
-scrypty_decrypt_file(rb_obj, rb_infn, rb_outfn, rb_password, rb_maxmem, rb_maxmemfrac, rb_maxtime)
-  VALUE rb_obj;
-  VALUE rb_infn;
-  VALUE rb_outfn;
-  VALUE rb_password;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
-  VALUE rb_maxtime;
+/* Fill in job with the defaults of every option. */
+static void
+scrypty_job_init(job)
+  struct scrypty_job *job;
 {
-  return scrypty_file(rb_obj, rb_infn, rb_outfn, rb_password, rb_maxmem,
-      rb_maxmemfrac, rb_maxtime, 0);
+  job->priority = 0;
+  job->timeout = 0;
+  job->sched_class = SCRYPTY_SCHED_NORMAL;
+  job->deadline = 0;
+  job->compress = SCRYPTENC_COMPRESS_NONE;
+  job->out = Qnil;
+  job->vbytes = 0;
 }
 
-VALUE
-scrypty_memlimit(rb_obj, rb_maxmem, rb_maxmemfrac)
-  VALUE rb_obj;
-  VALUE rb_maxmem;
-  VALUE rb_maxmemfrac;
+/* Take a trailing Hash of options off the arguments of a call, and fill in
+ * job from it:
+ *   priority: Symbol     :interactive, :normal or :batch; the scheduler
+ *                        runs queued derivations of the first class first,
+ *                        and the budget gives them priority 1, 0 and -1
+ *             Integer    higher values get memory first when the budget
+ *                        policy is :priority; the scheduler class stays
+ *                        :normal (default 0)
+ *   deadline: Numeric    seconds from now, or a Time, by which the
+ *             or Time    derivation should finish; the scheduler runs the
+ *                        earliest deadline in a class first (default: none)
+ *   timeout:  Numeric    seconds to wait for memory before raising
+ *                        Scrypty::MemoryBudgetTimeoutError (default: wait)
+ *   compress: Symbol     :zlib, :zstd or :lz4 to compress data before
+ *                        encrypting it (true means :zlib); decryption
+ *                        inflates on its own (default: none)
+ *   out:      String     for encrypt, decrypt and reencrypt, a String to
+ *                        write the output into and return, reusing its
+ *                        capacity, instead of a new one (default: nil) */
+static void
+scrypty_get_job(argc, argv, job)
+  int *argc;
+  VALUE *argv;
+  struct scrypty_job *job;
 {
-  long l_maxmem;
-  size_t maxmem, memlimit, max_size;
-  double maxmemfrac;
-
-  max_size = (size_t) -1;
+  VALUE rb_values[5];
 
-  if (TYPE(rb_maxmem) == T_FIXNUM) {
-    l_maxmem = FIX2LONG(rb_maxmem);
+  scrypty_job_init(job);
+  if (*argc == 0 || TYPE(argv[*argc - 1]) != T_HASH) {
+    return;
+  }
 
-    if (l_maxmem < 0) {
-      rb_raise(rb_eArgError, "maxmem (%ld) must not be less than 0", l_maxmem);
-    }
-    else if ((unsigned long) l_maxmem > (unsigned long) max_size) {
-      rb_raise(rb_eArgError, "maxmem (%ld) cannot exceed %zu", l_maxmem, max_size);
-    }
-    else {
-      maxmem = (size_t) l_maxmem;
+  rb_get_kwargs(argv[--*argc], scrypty_job_kwargs, 0, 5, rb_values);
+  if (rb_values[0] != Qundef && !NIL_P(rb_values[0])) {
+    scrypty_get_priority(rb_values[0], job);
+  }
+  if (rb_values[1] != Qundef && !NIL_P(rb_values[1])) {
+    job->timeout = NUM2DBL(rb_values[1]);
+    if (!(job->timeout > 0)) {
+      rb_raise(rb_eArgError, "timeout must be positive");
     }
   }
-  else {
-    rb_raise(rb_eTypeError, "first argument (maxmem) must be a Fixnum");
+  if (rb_values[2] != Qundef && !NIL_P(rb_values[2])) {
+    job->deadline = scrypty_get_deadline(rb_values[2]);
+  }
+  if (rb_values[3] != Qundef) {
+    job->compress = scrypty_get_compress(rb_values[3]);
+  }
+  if (rb_values[4] != Qundef && !NIL_P(rb_values[4])) {
+    if (TYPE(rb_values[4]) != T_STRING) {
+      rb_raise(rb_eTypeError, "out must be a String");
+    }
+    job->out = rb_values[4];
   }
+}
 
-  if (FIXNUM_P(rb_maxmemfrac) || TYPE(rb_maxmemfrac) == T_FLOAT) {
-    maxmemfrac = NUM2DBL(rb_maxmemfrac);
+/* Return a String with room for len bytes of output: job's out: String,
+ * emptied and grown only if its capacity is too small, or a new one.  out
+ * can't be the data or password, which are read while it is written. */
+static VALUE
+scrypty_get_out(job, len, rb_data, rb_password)
+  const struct scrypty_job *job;
+  long len;
+  VALUE rb_data;
+  VALUE rb_password;
+{
+  VALUE rb_out;
+
+  rb_out = job->out;
+  if (NIL_P(rb_out)) {
+    return rb_str_buf_new(len);
   }
-  else {
-    rb_raise(rb_eTypeError, "second argument (maxmemfrac) must be a Fixnum or Float");
+  if (rb_out == rb_data || rb_out == rb_password) {
+    rb_raise(rb_eArgError, "out must not be the data or password");
   }
 
-  if (scrypty_memtouse(maxmem, maxmemfrac, &memlimit) != 0) {
-    rb_raise(rb_eRuntimeError, "could not determine memory limit");
+  /* Raises if out is frozen, and gives it a buffer of its own if shared. */
+  rb_str_modify(rb_out);
+  rb_str_set_len(rb_out, 0);
+  if (rb_str_capacity(rb_out) < (size_t) len) {
+    rb_str_modify_expand(rb_out, len);
   }
+  rb_enc_associate(rb_out, rb_ascii8bit_encoding());
 
-  return SIZET2NUM(memlimit);
+  return rb_out;
 }
 
-VALUE
-scrypty_opslimit(rb_obj, rb_maxtime)
-  VALUE rb_obj;
-  VALUE rb_maxtime;
+/* The size of the V array for N = 2^logN and r, or 0 if that is out of
+ * range (and the derivation will fail before allocating anything). */
+static size_t
+scrypty_vbytes(logN, r)
+  int logN;
+  uint32_t r;
 {
-  double opps, maxtime, opslimit;
-
-  if (FIXNUM_P(rb_maxtime) || TYPE(rb_maxtime) == T_FLOAT) {
-    maxtime = NUM2DBL(rb_maxtime);
-  }
-  else {
-    rb_raise(rb_eTypeError, "first argument (maxtime) must be a Fixnum or Float");
+  if (logN < 1 || logN > 63 || r == 0 ||
+      ((uint64_t) 1 << logN) > SIZE_MAX / 128 / r) {
+    return 0;
   }
+  return (size_t) 128 * r << logN;
+}
 
-  /* Figure out how fast the CPU is. */
-  if (scrypty_scryptenc_cpuperf(&opps) != 0) {
-    rb_raise(rb_eRuntimeError, "could not determine CPU performance");
+/* The size of the V array needed to decrypt rb_data (a String) within the
+ * limits of profile, going by its header: 0 if it has none, or if the
+ * limits would reject it. */
+static size_t
+scrypty_data_vbytes(rb_data, profile)
+  VALUE rb_data;
+  const struct scryptenc_profile *profile;
+{
+  struct scryptenc_header header;
+  size_t vbytes;
+
+  if (scrypty_scryptdec_header((const uint8_t *) RSTRING_PTR(rb_data),
+        (size_t) RSTRING_LEN(rb_data), &header)) {
+    return 0;
   }
-  opslimit = opps * maxtime;
+  vbytes = scrypty_vbytes(header.logN, header.r);
+  return vbytes <= profile->memlimit ? vbytes : 0;
+}
 
-  /* Allow a minimum of 2^15 salsa20/8 cores. */
-  if (opslimit < 32768)
-    opslimit = 32768;
+/* Tell the GC that nbytes (which may be negative) more bytes of native
+ * memory are in use, so that its malloc-driven heuristics see V arrays
+ * and workspaces. */
+static void
+scrypty_gc_adjust(nbytes)
+  int64_t nbytes;
+{
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  if (nbytes != 0) {
+    rb_gc_adjust_memory_usage((ssize_t) nbytes);
+  }
+#endif
+}
 
-  return DBL2NUM(opslimit);
+/* Report the memory allocated and freed through scryptenc_mem since the
+ * last report, less reserved bytes already reported for the call which
+ * just returned. */
+static void
+scrypty_gc_settle(reserved)
+  size_t reserved;
+{
+  scrypty_gc_adjust(scrypty_mem_unreported() - (int64_t) reserved);
 }
 
-/* Calculate parameters used for creating a derived key with the
- * scrypt algorithm. */
-VALUE
-scrypty_params(rb_obj, rb_memlimit, rb_opslimit)
-  VALUE rb_obj;
-  VALUE rb_memlimit;
-  VALUE rb_opslimit;
+struct scrypty_nogvl {
+  void *(*func)(void *);
+  void *arg;
+  struct scrypty_job job;
+  int cancel;
+  int ran;
+};
+
+static void *
+scrypty_nogvl_call(ptr)
+  void *ptr;
 {
-  VALUE rb_result;
-  long l_memlimit;
-  size_t memlimit, max_size;
-  double opslimit;
-  double maxN, maxrp;
-  int logN;
-  uint64_t N = 0;
-  uint32_t r = 0, p = 0;
+  struct scrypty_nogvl *call = ptr;
+
+  call->ran = 1;
+  scrypty_budget_setattr(call->job.priority, call->job.timeout);
+  scrypty_budget_setcancel(&call->cancel);
+  scrypty_sched_setattr(call->job.sched_class, call->job.deadline);
+  call->func(call->arg);
+  scrypty_sched_setattr(SCRYPTY_SCHED_NORMAL, 0);
+  scrypty_budget_setcancel(NULL);
+  scrypty_budget_setattr(0, 0);
+
+  return NULL;
+}
 
-  max_size = (size_t) -1;
+/* Called by Ruby, from another thread, when Thread#raise, Thread#kill or a
+ * signal interrupts a call without the GVL: make its wait for memory or
+ * for a scheduler worker give up, so the interrupt is seen in good time.
+ * A derivation already running is not stopped. */
+static void
+scrypty_nogvl_cancel(ptr)
+  void *ptr;
+{
+  struct scrypty_nogvl *call = ptr;
 
-  if (TYPE(rb_memlimit) == T_FIXNUM) {
-    l_memlimit = FIX2LONG(rb_memlimit);
+  __atomic_or_fetch(&call->cancel, BUDGET_CANCEL, __ATOMIC_RELEASE);
+  scrypty_budget_wake();
+  scrypty_sched_wake();
+}
 
-    if (l_memlimit < 0) {
-      rb_raise(rb_eArgError, "memlimit (%ld) must not be less than 0", l_memlimit);
-    }
-    else if ((unsigned long) l_memlimit > (unsigned long) max_size) {
-      rb_raise(rb_eArgError, "memlimit (%ld) cannot exceed %zu", l_memlimit, max_size);
+/* Run func(arg) without the GVL, so other threads can run while it derives
+ * keys or waits for memory, with the budget and scheduler attributes from
+ * job.  func must not touch Ruby objects; callers pass it pointers into
+ * frozen Strings.  job's vbytes are reported to the GC beforehand, so that
+ * a collection they set off runs before V is allocated rather than just
+ * after it is freed, and taken back (with whatever else the C code
+ * allocated or freed meanwhile) afterwards. */
+static void
+scrypty_without_gvl(func, arg, job)
+  void *(*func)(void *);
+  void *arg;
+  const struct scrypty_job *job;
+{
+  struct scrypty_nogvl call;
+
+  call.func = func;
+  call.arg = arg;
+  call.job = *job;
+  call.cancel = 0;
+  call.ran = 0;
+  scrypty_gc_adjust((int64_t) job->vbytes);
+
+  /* An interrupt already pending keeps func from being called at all, and
+   * is raised (after the GC is settled) here; one which made func give up
+   * a wait is raised instead of the error func returned.  Any other is
+   * left to Ruby's next check, after the caller has taken its result. */
+  while (!call.ran) {
+    rb_thread_call_without_gvl2(scrypty_nogvl_call, &call,
+        scrypty_nogvl_cancel, &call);
+    if (!call.ran) {
+      scrypty_gc_settle(job->vbytes);
+      rb_thread_check_ints();
+      scrypty_gc_adjust((int64_t) job->vbytes);
+    }
+  }
+  scrypty_gc_settle(job->vbytes);
+  if (call.cancel & BUDGET_CANCELLED) {
+    rb_thread_check_ints();
+  }
+}
+
+/* What a call without the GVL does with its data. */
+#define SCRYPTY_DECRYPT 0
+#define SCRYPTY_ENCRYPT 1
+#define SCRYPTY_VERIFY 2
+#define SCRYPTY_PASSWORD 3
+#define SCRYPTY_REENCRYPT 4
+
+struct scrypty_buffer_args {
+  const uint8_t *data;
+  size_t data_len;
+  uint8_t *out;
+  size_t out_len;
+  uint8_t *alloc;
+  int compress;
+  const uint8_t *password;
+  size_t password_len;
+  const uint8_t *new_password;
+  size_t new_password_len;
+  struct scryptenc_profile profile;
+  int mode;
+  int errorcode;
+};
+
+static void *
+scrypty_buffer_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_buffer_args *args = ptr;
+
+  switch (args->mode) {
+    case SCRYPTY_ENCRYPT:
+      args->errorcode = scrypty_scryptenc_buf_compress(args->data,
+          args->data_len, args->out, &args->out_len, args->password,
+          args->password_len, &args->profile, args->compress);
+      break;
+    case SCRYPTY_DECRYPT:
+      /* Compressed data may not fit in out, so it gets a buffer of its own. */
+      if (args->out == NULL || (args->data_len > 6 && args->data[6] == 1)) {
+        args->errorcode = scrypty_scryptdec_buf_alloc(args->data,
+            args->data_len, &args->alloc, &args->out_len, args->password,
+            args->password_len, &args->profile);
+        break;
+      }
+      args->errorcode = scrypty_scryptdec_buf_profile(args->data,
+          args->data_len, args->out, &args->out_len, args->password,
+          args->password_len, &args->profile);
+      break;
+    case SCRYPTY_VERIFY:
+      args->errorcode = scrypty_scryptdec_verify_buf(args->data,
+          args->data_len, args->password, args->password_len, &args->profile);
+      break;
+    case SCRYPTY_PASSWORD:
+      args->errorcode = scrypty_scryptdec_password(args->data,
+          args->data_len, args->password, args->password_len, &args->profile);
+      break;
+    case SCRYPTY_REENCRYPT:
+      args->errorcode = scrypty_scryptenc_rekey_buf(args->data,
+          args->data_len, args->out, args->password, args->password_len,
+          args->new_password, args->new_password_len, &args->profile);
+      break;
+  }
+
+  return NULL;
+}
+
+/* Run a buffer call on data (which, like password, must be a String)
+ * without the GVL, and return its error code. */
+static int
+scrypty_buffer_call(args, rb_data, rb_password, job)
+  struct scrypty_buffer_args *args;
+  VALUE rb_data;
+  VALUE rb_password;
+  const struct scrypty_job *job;
+{
+  struct scrypty_job sized;
+
+  /* Frozen copies share the bytes but can't change under us. */
+  rb_data = rb_str_new_frozen(rb_data);
+  rb_password = rb_str_new_frozen(rb_password);
+  args->data = (const uint8_t *) RSTRING_PTR(rb_data);
+  args->data_len = (size_t) RSTRING_LEN(rb_data);
+  args->password = (const uint8_t *) RSTRING_PTR(rb_password);
+  args->password_len = (size_t) RSTRING_LEN(rb_password);
+
+  /* Encryption uses the profile's parameters, the rest the data's; a
+   * re-encryption may hold both V arrays at once. */
+  sized = *job;
+  sized.vbytes = 0;
+  if (args->mode != SCRYPTY_ENCRYPT) {
+    sized.vbytes += scrypty_data_vbytes(rb_data, &args->profile);
+  }
+  if (args->mode == SCRYPTY_ENCRYPT || args->mode == SCRYPTY_REENCRYPT) {
+    sized.vbytes += scrypty_vbytes(args->profile.logN, args->profile.r);
+  }
+
+  scrypty_without_gvl(scrypty_buffer_nogvl, args, &sized);
+  RB_GC_GUARD(rb_data);
+  RB_GC_GUARD(rb_password);
+
+  return args->errorcode;
+}
+
+/* Inflated plaintext, to be copied into the output String. */
+struct scrypty_alloc_copy {
+  const struct scrypty_job *job;
+  struct scrypty_buffer_args *args;
+  VALUE rb_data;
+  VALUE rb_password;
+};
+
+static VALUE
+scrypty_alloc_copy(ptr)
+  VALUE ptr;
+{
+  struct scrypty_alloc_copy *copy = (struct scrypty_alloc_copy *) ptr;
+  VALUE rb_out;
+
+  rb_out = scrypty_get_out(copy->job, (long) copy->args->out_len,
+      copy->rb_data, copy->rb_password);
+  memcpy(RSTRING_PTR(rb_out), copy->args->alloc, copy->args->out_len);
+  rb_str_set_len(rb_out, (long) copy->args->out_len);
+
+  return rb_out;
+}
+
+/* Zero and free the plaintext, however the copy went. */
+static VALUE
+scrypty_alloc_free(ptr)
+  VALUE ptr;
+{
+  struct scrypty_alloc_copy *copy = (struct scrypty_alloc_copy *) ptr;
+
+  OPENSSL_cleanse(copy->args->alloc, copy->args->out_len);
+  free(copy->args->alloc);
+  copy->args->alloc = NULL;
+
+  return Qnil;
+}
+
+static VALUE
+scrypty_buffer(argc, argv, encrypt)
+  int argc;
+  VALUE *argv;
+  int encrypt;
+{
+  VALUE rb_data, rb_password, rb_out;
+  struct scrypty_buffer_args args;
+  struct scrypty_alloc_copy copy;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 3, 5);
+  rb_data = argv[0];
+  rb_password = argv[1];
+
+  if (TYPE(rb_data) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (data) must be a String");
+  }
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 2, argv + 2, 2, &args.profile);
+
+  /* Compressed (version 1) data is decrypted into a buffer of its own,
+   * but out: is still checked before any work is done. */
+  rb_out = Qnil;
+  args.out = NULL;
+  if (encrypt || RSTRING_LEN(rb_data) <= 6 || RSTRING_PTR(rb_data)[6] != 1) {
+    rb_out = scrypty_get_out(&job, RSTRING_LEN(rb_data) + (encrypt ? 128 : 0),
+        rb_data, rb_password);
+    args.out = (uint8_t *) RSTRING_PTR(rb_out);
+  }
+  else if (!NIL_P(job.out)) {
+    scrypty_get_out(&job, 0, rb_data, rb_password);
+  }
+  args.out_len = 0;
+  args.alloc = NULL;
+  args.compress = job.compress;
+  args.mode = encrypt ? SCRYPTY_ENCRYPT : SCRYPTY_DECRYPT;
+
+  if (scrypty_buffer_call(&args, rb_data, rb_password, &job)) {
+    raise_scrypty_error(args.errorcode);
+  }
+  if (args.alloc != NULL) {
+    copy.job = &job;
+    copy.args = &args;
+    copy.rb_data = rb_data;
+    copy.rb_password = rb_password;
+    return rb_ensure(scrypty_alloc_copy, (VALUE) &copy,
+        scrypty_alloc_free, (VALUE) &copy);
+  }
+  rb_str_set_len(rb_out, args.out_len);
+
+  return rb_out;
+}
+
+/* Scrypty.encrypt(data, password, profile, compress: nil, out: nil)
+ * Scrypty.encrypt(data, password, maxmem, maxmemfrac, maxtime, compress: nil,
+ *                 out: nil) */
+VALUE
+scrypty_encrypt_buffer(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_buffer(argc, argv, 1);
+}
+
+/* Scrypty.decrypt(data, password, profile, out: nil)
+ * Scrypty.decrypt(data, password, maxmem, maxmemfrac, maxtime, out: nil) */
+VALUE
+scrypty_decrypt_buffer(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_buffer(argc, argv, 0);
+}
+
+struct scrypty_file_args {
+  FILE *in;
+  FILE *out;
+  const uint8_t *password;
+  size_t password_len;
+  const uint8_t *new_password;
+  size_t new_password_len;
+  struct scryptenc_profile profile;
+  int compress;
+  int mode;
+  int errorcode;
+};
+
+static void *
+scrypty_file_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_file_args *args = ptr;
+
+  switch (args->mode) {
+    case SCRYPTY_ENCRYPT:
+      args->errorcode = scrypty_scryptenc_file_compress(args->in, args->out,
+          args->password, args->password_len, &args->profile, args->compress);
+      break;
+    case SCRYPTY_DECRYPT:
+      args->errorcode = scrypty_scryptdec_file_profile(args->in, args->out,
+          args->password, args->password_len, &args->profile);
+      break;
+    case SCRYPTY_VERIFY:
+      args->errorcode = scrypty_scryptdec_verify_file(args->in,
+          args->password, args->password_len, &args->profile);
+      break;
+    case SCRYPTY_REENCRYPT:
+      args->errorcode = scrypty_scryptenc_rekey_file(args->in, args->out,
+          args->password, args->password_len, args->new_password,
+          args->new_password_len, &args->profile);
+      /* The output replaces the old file, so it must be on disk first. */
+      if (args->errorcode == 0 &&
+          (fflush(args->out) || fsync(fileno(args->out)))) {
+        args->errorcode = 12;
+      }
+      break;
+  }
+
+  return NULL;
+}
+
+VALUE
+scrypty_file(argc, argv, encrypt)
+  int argc;
+  VALUE *argv;
+  int encrypt;
+{
+  VALUE rb_infn, rb_outfn, rb_password, rb_infile, rb_outfile;
+  rb_io_t *in_p, *out_p;
+  struct scrypty_file_args args;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 4, 6);
+  rb_infn = argv[0];
+  rb_outfn = argv[1];
+  rb_password = argv[2];
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "third argument (password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 3, argv + 3, 3, &args.profile);
+
+  rb_password = rb_str_new_frozen(rb_password);
+  args.password = (const uint8_t *) RSTRING_PTR(rb_password);
+  args.password_len = (size_t) RSTRING_LEN(rb_password);
+  args.compress = job.compress;
+  args.mode = encrypt ? SCRYPTY_ENCRYPT : SCRYPTY_DECRYPT;
+  if (encrypt) {
+    job.vbytes = scrypty_vbytes(args.profile.logN, args.profile.r);
+  }
+
+  rb_infile = rb_file_open_str(rb_infn, "rb");
+  rb_outfile = rb_file_open_str(rb_outfn, "wb");
+
+  GetOpenFile(rb_infile, in_p);
+  args.in = rb_io_stdio_file(in_p);
+  GetOpenFile(rb_outfile, out_p);
+  args.out = rb_io_stdio_file(out_p);
+
+  scrypty_without_gvl(scrypty_file_nogvl, &args, &job);
+  RB_GC_GUARD(rb_password);
+  rb_io_close(rb_infile);
+  rb_io_close(rb_outfile);
+
+  if (args.errorcode) {
+    raise_scrypty_error(args.errorcode);
+  }
+
+  return Qnil;
+}
+
+/* Scrypty.encrypt_file(infn, outfn, password, profile, compress: nil)
+ * Scrypty.encrypt_file(infn, outfn, password, maxmem, maxmemfrac, maxtime,
+ *                      compress: nil) */
+VALUE
+scrypty_encrypt_file(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_file(argc, argv, 1);
+}
+
+/* Scrypty.decrypt_file(infn, outfn, password, profile)
+ * Scrypty.decrypt_file(infn, outfn, password, maxmem, maxmemfrac, maxtime) */
+VALUE
+scrypty_decrypt_file(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_file(argc, argv, 0);
+}
+
+/* Scrypty.verify(data, password, profile)
+ * Scrypty.verify(data, password, maxmem, maxmemfrac, maxtime)
+ *
+ * Check that data was encrypted with password and is intact, without
+ * decrypting it.  Returns true, or raises as decrypt would. */
+VALUE
+scrypty_verify(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_data, rb_password;
+  struct scrypty_buffer_args args;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 3, 5);
+  rb_data = argv[0];
+  rb_password = argv[1];
+
+  if (TYPE(rb_data) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (data) must be a String");
+  }
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 2, argv + 2, 2, &args.profile);
+
+  args.mode = SCRYPTY_VERIFY;
+  if (scrypty_buffer_call(&args, rb_data, rb_password, &job)) {
+    raise_scrypty_error(args.errorcode);
+  }
+
+  return Qtrue;
+}
+
+/* Scrypty.verify_file(infn, password, profile)
+ * Scrypty.verify_file(infn, password, maxmem, maxmemfrac, maxtime)
+ *
+ * As Scrypty.verify, but reading the encrypted data from the file infn. */
+VALUE
+scrypty_verify_file(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_infn, rb_password, rb_infile;
+  rb_io_t *in_p;
+  struct scrypty_file_args args;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 3, 5);
+  rb_infn = argv[0];
+  rb_password = argv[1];
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 2, argv + 2, 2, &args.profile);
+
+  rb_password = rb_str_new_frozen(rb_password);
+  args.password = (const uint8_t *) RSTRING_PTR(rb_password);
+  args.password_len = (size_t) RSTRING_LEN(rb_password);
+  args.mode = SCRYPTY_VERIFY;
+
+  rb_infile = rb_file_open_str(rb_infn, "rb");
+  GetOpenFile(rb_infile, in_p);
+  args.in = rb_io_stdio_file(in_p);
+  args.out = NULL;
+
+  scrypty_without_gvl(scrypty_file_nogvl, &args, &job);
+  RB_GC_GUARD(rb_password);
+  rb_io_close(rb_infile);
+
+  if (args.errorcode) {
+    raise_scrypty_error(args.errorcode);
+  }
+
+  return Qtrue;
+}
+
+/* Scrypty.reencrypt(data, old_password, new_password, profile, out: nil)
+ * Scrypty.reencrypt(data, old_password, new_password, maxmem, maxmemfrac,
+ *                   maxtime, out: nil)
+ *
+ * Re-encrypt data from old_password to new_password with the parameters
+ * from the profile, whose limits also apply to the old ones.  The data is
+ * decrypted and encrypted again in a single pass, and raises as decrypt
+ * would if it was not intact. */
+VALUE
+scrypty_reencrypt(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_data, rb_old, rb_new, rb_out;
+  struct scrypty_buffer_args args;
+  struct scrypty_job job;
+  long len;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 4, 6);
+  rb_data = argv[0];
+  rb_old = argv[1];
+  rb_new = argv[2];
+
+  if (TYPE(rb_data) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (data) must be a String");
+  }
+
+  if (TYPE(rb_old) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (old_password) must be a String");
+  }
+
+  if (TYPE(rb_new) != T_STRING) {
+    rb_raise(rb_eTypeError, "third argument (new_password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 3, argv + 3, 3, &args.profile);
+
+  rb_new = rb_str_new_frozen(rb_new);
+  args.new_password = (const uint8_t *) RSTRING_PTR(rb_new);
+  args.new_password_len = (size_t) RSTRING_LEN(rb_new);
+  if (job.out == argv[2]) {
+    rb_raise(rb_eArgError, "out must not be the data or password");
+  }
+  len = RSTRING_LEN(rb_data);
+  rb_out = scrypty_get_out(&job, len, rb_data, rb_old);
+  args.out = (uint8_t *) RSTRING_PTR(rb_out);
+  args.mode = SCRYPTY_REENCRYPT;
+
+  if (scrypty_buffer_call(&args, rb_data, rb_old, &job)) {
+    raise_scrypty_error(args.errorcode);
+  }
+  RB_GC_GUARD(rb_new);
+  rb_str_set_len(rb_out, len);
+
+  return rb_out;
+}
+
+/* The temporary file of a reencrypt_file call, which is unlinked unless it
+ * was renamed into place, however the call ends. */
+struct scrypty_reencrypt_tmp {
+  struct scrypty_file_args *args;
+  struct scrypty_job *job;
+  VALUE rb_infile;
+  VALUE rb_outfn;
+  VALUE rb_tmpfn;
+  int created;
+  int renamed;
+};
+
+/* Give the temporary file the mode, and where permitted the owner, of the
+ * file it will replace, or of the input if there is none yet. */
+static void
+scrypty_reencrypt_perms(fd, tmp)
+  int fd;
+  struct scrypty_reencrypt_tmp *tmp;
+{
+  struct stat sb;
+
+  if (stat(StringValueCStr(tmp->rb_outfn), &sb) != 0 &&
+      fstat(fileno(tmp->args->in), &sb) != 0) {
+    return;
+  }
+  if (fchown(fd, sb.st_uid, sb.st_gid) != 0 && errno != EPERM) {
+    rb_sys_fail_str(tmp->rb_tmpfn);
+  }
+  if (fchmod(fd, sb.st_mode & 07777) != 0) {
+    rb_sys_fail_str(tmp->rb_tmpfn);
+  }
+}
+
+static VALUE
+scrypty_reencrypt_run(ptr)
+  VALUE ptr;
+{
+  struct scrypty_reencrypt_tmp *tmp = (struct scrypty_reencrypt_tmp *) ptr;
+  int fd;
+
+  /* mkstemp opens with O_EXCL under a random name, so concurrent calls
+   * for the same outfn never share a temporary file. */
+  if ((fd = mkstemp(RSTRING_PTR(tmp->rb_tmpfn))) == -1) {
+    rb_sys_fail_str(tmp->rb_tmpfn);
+  }
+  tmp->created = 1;
+  if ((tmp->args->out = fdopen(fd, "wb")) == NULL) {
+    close(fd);
+    rb_sys_fail_str(tmp->rb_tmpfn);
+  }
+  scrypty_reencrypt_perms(fd, tmp);
+
+  scrypty_without_gvl(scrypty_file_nogvl, tmp->args, tmp->job);
+  if (fclose(tmp->args->out) != 0 && tmp->args->errorcode == 0) {
+    tmp->args->errorcode = 12;
+  }
+  tmp->args->out = NULL;
+  if (tmp->args->errorcode) {
+    raise_scrypty_error(tmp->args->errorcode);
+  }
+  rb_funcall(rb_cFile, rb_intern("rename"), 2, tmp->rb_tmpfn, tmp->rb_outfn);
+  tmp->renamed = 1;
+
+  return Qnil;
+}
+
+static VALUE
+scrypty_reencrypt_cleanup(ptr)
+  VALUE ptr;
+{
+  struct scrypty_reencrypt_tmp *tmp = (struct scrypty_reencrypt_tmp *) ptr;
+
+  if (tmp->args->out != NULL) {
+    fclose(tmp->args->out);
+  }
+  rb_io_close(tmp->rb_infile);
+  if (tmp->created && !tmp->renamed) {
+    unlink(RSTRING_PTR(tmp->rb_tmpfn));
+  }
+  return Qnil;
+}
+
+/* Scrypty.reencrypt_file(infn, outfn, old_password, new_password, profile)
+ * Scrypty.reencrypt_file(infn, outfn, old_password, new_password, maxmem,
+ *                        maxmemfrac, maxtime)
+ *
+ * As Scrypty.reencrypt, streaming from the file infn.  The output goes to
+ * a temporary file next to outfn, created under a random name and given
+ * the mode and owner of the file it replaces, which is renamed to outfn
+ * only once the whole of infn has been checked, so outfn may be infn
+ * itself; on failure outfn is left as it was and the temporary file is
+ * removed. */
+VALUE
+scrypty_reencrypt_file(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_infn, rb_old, rb_new, rb_result;
+  rb_io_t *in_p;
+  struct scrypty_file_args args;
+  struct scrypty_reencrypt_tmp tmp;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 5, 7);
+  rb_infn = argv[0];
+  rb_old = argv[2];
+  rb_new = argv[3];
+
+  if (TYPE(rb_old) != T_STRING) {
+    rb_raise(rb_eTypeError, "third argument (old_password) must be a String");
+  }
+
+  if (TYPE(rb_new) != T_STRING) {
+    rb_raise(rb_eTypeError, "fourth argument (new_password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 4, argv + 4, 4, &args.profile);
+
+  rb_old = rb_str_new_frozen(rb_old);
+  rb_new = rb_str_new_frozen(rb_new);
+  args.password = (const uint8_t *) RSTRING_PTR(rb_old);
+  args.password_len = (size_t) RSTRING_LEN(rb_old);
+  args.new_password = (const uint8_t *) RSTRING_PTR(rb_new);
+  args.new_password_len = (size_t) RSTRING_LEN(rb_new);
+  args.mode = SCRYPTY_REENCRYPT;
+  args.out = NULL;
+
+  tmp.args = &args;
+  tmp.job = &job;
+  tmp.rb_outfn = rb_get_path(argv[1]);
+  tmp.rb_tmpfn = rb_sprintf("%"PRIsVALUE".XXXXXX", tmp.rb_outfn);
+  tmp.created = 0;
+  tmp.renamed = 0;
+  tmp.rb_infile = rb_file_open_str(rb_infn, "rb");
+  GetOpenFile(tmp.rb_infile, in_p);
+  args.in = rb_io_stdio_file(in_p);
+
+  rb_result = rb_ensure(scrypty_reencrypt_run, (VALUE) &tmp,
+      scrypty_reencrypt_cleanup, (VALUE) &tmp);
+  RB_GC_GUARD(rb_old);
+  RB_GC_GUARD(rb_new);
+  RB_GC_GUARD(tmp.rb_outfn);
+  RB_GC_GUARD(tmp.rb_tmpfn);
+
+  return rb_result;
+}
+
+/* Return the first 96 bytes of encrypted data.  A String is taken as the
+ * data itself if it holds a whole header (at least 96 bytes, starting with
+ * the scrypt magic and a known version) or a NUL, which no path can; any
+ * other String, such as "scrypt-backup.enc", or Pathname is the name of a
+ * file holding it. */
+static VALUE
+scrypty_header_bytes(rb_data_or_path)
+  VALUE rb_data_or_path;
+{
+  const char *ptr;
+  long len;
+
+  if (TYPE(rb_data_or_path) == T_STRING) {
+    ptr = RSTRING_PTR(rb_data_or_path);
+    len = RSTRING_LEN(rb_data_or_path);
+    if ((len >= 96 && memcmp(ptr, "scrypt", 6) == 0 &&
+          (uint8_t) ptr[6] <= SCRYPTENC_VERSION_LOG) ||
+        memchr(ptr, '\0', (size_t) len) != NULL) {
+      return rb_str_substr(rb_data_or_path, 0, 96);
+    }
+  }
+
+  return rb_funcall(rb_cFile, rb_intern("binread"), 2,
+      rb_get_path(rb_data_or_path), INT2FIX(96));
+}
+
+/* Scrypty.header(data_or_path)
+ *
+ * Parse and checksum the header of encrypted data, given as a String or as
+ * the name of a file, without deriving any keys.  Returns a Hash with the
+ * scrypt parameters (:n, :r, :p and :salt), the memory the derivation needs
+ * (:memory) and the time it is predicted to take on this host (:time). */
+VALUE
+scrypty_header(rb_obj, rb_data_or_path)
+  VALUE rb_obj;
+  VALUE rb_data_or_path;
+{
+  VALUE rb_bytes, rb_header;
+  struct scryptenc_header header;
+  uint64_t N;
+  double ops, opps;
+  int errorcode;
+
+  rb_bytes = scrypty_header_bytes(rb_data_or_path);
+  errorcode = scrypty_scryptdec_header((const uint8_t *) RSTRING_PTR(rb_bytes),
+      (size_t) RSTRING_LEN(rb_bytes), &header);
+  if (errorcode == 0 && (header.logN < 1 || header.logN > 63)) {
+    errorcode = 7;
+  }
+  if (errorcode) {
+    raise_scrypty_error(errorcode);
+  }
+
+  errorcode = scrypty_scryptenc_cpuperf_cached(&opps);
+  if (errorcode) {
+    raise_scrypty_error(errorcode);
+  }
+
+  N = (uint64_t)(1) << header.logN;
+  ops = 4.0 * N * header.r * header.p;
+
+  rb_header = rb_hash_new();
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("version")), INT2NUM(header.version));
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("n")), ULL2NUM(N));
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("r")), UINT2NUM(header.r));
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("p")), UINT2NUM(header.p));
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("salt")),
+      rb_str_new((const char *) header.salt, 32));
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("memory")),
+      rb_funcall(ULL2NUM(N), '*', 1, ULL2NUM((uint64_t)(128) * header.r)));
+  rb_hash_aset(rb_header, ID2SYM(rb_intern("time")),
+      DBL2NUM(ops / opps));
+
+  return rb_header;
+}
+
+/* Scrypty.password_ok?(data_or_path, password, profile)
+ * Scrypty.password_ok?(data_or_path, password, maxmem, maxmemfrac, maxtime)
+ *
+ * Check password against encrypted data, given as for Scrypty.header, by
+ * deriving the keys and checking the header HMAC only; none of the data
+ * after the header is read.  Returns true or false, or raises if the header
+ * is invalid or the derivation exceeds the limits. */
+VALUE
+scrypty_password_ok(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_password;
+  struct scrypty_buffer_args args;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 3, 5);
+  rb_password = argv[1];
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  }
+
+  scrypty_get_profile(argc - 2, argv + 2, 2, &args.profile);
+
+  args.mode = SCRYPTY_PASSWORD;
+  switch (scrypty_buffer_call(&args, scrypty_header_bytes(argv[0]),
+        rb_password, &job)) {
+    case 0:
+      return Qtrue;
+    case 11:
+      return Qfalse;
+    default:
+      raise_scrypty_error(args.errorcode);
+  }
+
+  return Qnil;
+}
+
+struct scrypty_batch_args {
+  struct scryptenc_batch_item *items;
+  size_t nitems;
+  uint8_t *buf;
+  const uint8_t *password;
+  size_t password_len;
+  struct scryptenc_profile profile;
+  int mode;
+  size_t nthreads;
+  size_t maxmemtotal;
+  int errorcode;
+};
+
+static void *
+scrypty_batch_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_batch_args *args = ptr;
+
+  args->errorcode = scrypty_scryptenc_batch(args->items, args->nitems,
+      args->password, args->password_len, &args->profile, args->mode,
+      args->nthreads, args->maxmemtotal);
+
+  return NULL;
+}
+
+static VALUE
+scrypty_batch_run(ptr)
+  VALUE ptr;
+{
+  struct scrypty_batch_args *args = (struct scrypty_batch_args *) ptr;
+  struct scryptenc_batch_item *item;
+  struct scrypty_job job;
+  VALUE rb_result;
+  size_t i;
+
+  /* The workers stop taking items once the call is interrupted. */
+  scrypty_job_init(&job);
+  scrypty_without_gvl(scrypty_batch_nogvl, args, &job);
+  if (args->errorcode) {
+    raise_scrypty_error(args->errorcode);
+  }
+
+  rb_result = rb_ary_new_capa((long) args->nitems);
+  for (i = 0; i < args->nitems; i++) {
+    item = &args->items[i];
+    if (item->rc) {
+      rb_ary_push(rb_result, scrypty_error_new(item->rc));
+    }
+    else if (args->mode == SCRYPTENC_BATCH_VERIFY) {
+      rb_ary_push(rb_result, Qtrue);
+    }
+    else {
+      rb_ary_push(rb_result, rb_str_new((const char *) item->outbuf,
+            (long) item->outlen));
+    }
+  }
+
+  return rb_result;
+}
+
+static VALUE
+scrypty_batch_cleanup(ptr)
+  VALUE ptr;
+{
+  struct scrypty_batch_args *args = (struct scrypty_batch_args *) ptr;
+  size_t i;
+
+  for (i = 0; i < args->nitems; i++) {
+    free(args->items[i].outalloc);
+  }
+  xfree(args->items);
+  xfree(args->buf);
+
+  return Qnil;
+}
+
+/* Read the profile (a Scrypty::Profile, or maxmem, maxmemfrac and maxtime)
+ * and the optional thread count and memory total that follow the nfixed
+ * leading arguments of a batch call. */
+static void
+scrypty_batch_options(argc, argv, nfixed, args)
+  int argc;
+  VALUE *argv;
+  int nfixed;
+  struct scrypty_batch_args *args;
+{
+  int nprofile, nrest;
+  long ncpus;
+
+  nprofile = rb_typeddata_is_kind_of(argv[nfixed], &scrypty_profile_type) ? 1 : 3;
+  if (argc < nfixed + nprofile || argc > nfixed + 2 + nprofile) {
+    rb_raise(rb_eArgError, "wrong number of arguments (given %d)", argc);
+  }
+  scrypty_get_profile(nprofile, argv + nfixed, nfixed, &args->profile);
+  nrest = argc - nfixed - nprofile;
+
+  args->nthreads = 0;
+  if (nrest > 0 && !NIL_P(argv[nfixed + nprofile])) {
+    args->nthreads = NUM2SIZET(argv[nfixed + nprofile]);
+  }
+  if (args->nthreads == 0) {
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    args->nthreads = ncpus > 0 ? (size_t) ncpus : 1;
+  }
+
+  args->maxmemtotal = 0;
+  if (nrest > 1 && !NIL_P(argv[nfixed + 1 + nprofile])) {
+    args->maxmemtotal = NUM2SIZET(argv[nfixed + 1 + nprofile]);
+  }
+}
+
+/* Process every String in items on a pool of native threads.  The results
+ * come back in the same order, with a Scrypty::Exception in place of each
+ * item that failed.  When verifying, the items are file names. */
+static VALUE
+scrypty_batch(argc, argv, mode)
+  int argc;
+  VALUE *argv;
+  int mode;
+{
+  VALUE rb_items, rb_password, rb_item;
+  struct scrypty_batch_args args;
+  size_t i, total, len;
+  uint8_t *ptr;
+
+  rb_check_arity(argc, 3, 7);
+  rb_items = argv[0];
+  rb_password = argv[1];
+
+  if (TYPE(rb_items) != T_ARRAY) {
+    rb_raise(rb_eTypeError, "first argument (items) must be an Array");
+  }
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  }
+
+  scrypty_batch_options(argc, argv, 2, &args);
+
+  /* Work out how much room the copies of the inputs and outputs need;
+   * the workers run without the GVL, so they can't touch Ruby strings. */
+  args.nitems = (size_t) RARRAY_LEN(rb_items);
+  total = RSTRING_LEN(rb_password);
+  for (i = 0; i < args.nitems; i++) {
+    rb_item = RARRAY_AREF(rb_items, i);
+    if (mode == SCRYPTENC_BATCH_VERIFY) {
+      rb_item = rb_get_path(rb_item);
+      rb_ary_store(rb_items, i, rb_item);
+      StringValueCStr(rb_item);
+    }
+    else if (TYPE(rb_item) != T_STRING) {
+      rb_raise(rb_eTypeError, "items must be Strings");
+    }
+    len = (size_t) RSTRING_LEN(rb_item);
+    if (len > (SIZE_MAX - total - 128) / 2) {
+      rb_raise(rb_eNoMemError, "couldn't allocate memory");
+    }
+    if (mode == SCRYPTENC_BATCH_VERIFY) {
+      total += len + 1;
+    }
+    else {
+      total += 2 * len + (mode == SCRYPTENC_BATCH_ENCRYPT ? 128 : 0);
+    }
+  }
+
+  args.mode = mode;
+  args.items = NULL;
+  args.buf = NULL;
+  args.items = ALLOC_N(struct scryptenc_batch_item, args.nitems);
+  args.buf = ALLOC_N(uint8_t, total > 0 ? total : 1);
+
+  ptr = args.buf;
+  memcpy(ptr, RSTRING_PTR(rb_password), RSTRING_LEN(rb_password));
+  args.password = ptr;
+  args.password_len = (size_t) RSTRING_LEN(rb_password);
+  ptr += args.password_len;
+  for (i = 0; i < args.nitems; i++) {
+    rb_item = RARRAY_AREF(rb_items, i);
+    len = (size_t) RSTRING_LEN(rb_item);
+    memcpy(ptr, RSTRING_PTR(rb_item), len);
+    args.items[i].outpath = NULL;
+    args.items[i].outlen = 0;
+    args.items[i].outalloc = NULL;
+    args.items[i].rc = 0;
+    if (mode == SCRYPTENC_BATCH_VERIFY) {
+      ptr[len] = '\0';
+      args.items[i].path = (const char *) ptr;
+      args.items[i].inbuf = NULL;
+      args.items[i].inbuflen = 0;
+      args.items[i].outbuf = NULL;
+      ptr += len + 1;
+      continue;
+    }
+    args.items[i].path = NULL;
+    args.items[i].inbuf = ptr;
+    args.items[i].inbuflen = len;
+    ptr += len;
+    args.items[i].outbuf = ptr;
+    ptr += len + (mode == SCRYPTENC_BATCH_ENCRYPT ? 128 : 0);
+  }
+
+  return rb_ensure(scrypty_batch_run, (VALUE) &args,
+      scrypty_batch_cleanup, (VALUE) &args);
+}
+
+/* Scrypty.encrypt_batch(items, password, profile, threads = nil, memory = nil)
+ * Scrypty.encrypt_batch(items, password, maxmem, maxmemfrac, maxtime,
+ *     threads = nil, memory = nil) */
+VALUE
+scrypty_encrypt_batch(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_batch(argc, argv, SCRYPTENC_BATCH_ENCRYPT);
+}
+
+/* Scrypty.decrypt_batch(items, password, profile, threads = nil, memory = nil)
+ * Scrypty.decrypt_batch(items, password, maxmem, maxmemfrac, maxtime,
+ *     threads = nil, memory = nil) */
+VALUE
+scrypty_decrypt_batch(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_batch(argc, argv, SCRYPTENC_BATCH_DECRYPT);
+}
+
+/* Scrypty.verify_files(paths, password, profile, threads = nil, memory = nil)
+ * Scrypty.verify_files(paths, password, maxmem, maxmemfrac, maxtime,
+ *     threads = nil, memory = nil)
+ *
+ * Verify many files on a pool of native threads.  paths is an Array of file
+ * names or the name of a directory, whose regular files are all verified.
+ * Returns a Hash from each file name to true, or to the Scrypty::Exception
+ * its verification raised. */
+VALUE
+scrypty_verify_files(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_paths, rb_path, rb_results, rb_hash;
+  VALUE *args;
+  long i;
+
+  rb_check_arity(argc, 3, 7);
+  rb_paths = argv[0];
+  if (TYPE(rb_paths) != T_ARRAY) {
+    rb_path = rb_get_path(rb_paths);
+    if (!RTEST(rb_funcall(rb_cFile, rb_intern("directory?"), 1, rb_path))) {
+      rb_raise(rb_eTypeError, "first argument (paths) must be an Array or a directory");
+    }
+    rb_paths = rb_ary_new();
+    rb_results = rb_funcall(rb_funcall(rb_cDir, rb_intern("children"), 1, rb_path),
+        rb_intern("sort"), 0);
+    for (i = 0; i < RARRAY_LEN(rb_results); i++) {
+      rb_path = rb_funcall(rb_cFile, rb_intern("join"), 2, argv[0],
+          RARRAY_AREF(rb_results, i));
+      if (RTEST(rb_funcall(rb_cFile, rb_intern("file?"), 1, rb_path))) {
+        rb_ary_push(rb_paths, rb_path);
+      }
+    }
+  }
+  else {
+    rb_paths = rb_ary_dup(rb_paths);
+  }
+
+  args = ALLOCA_N(VALUE, argc);
+  MEMCPY(args, argv, VALUE, argc);
+  args[0] = rb_paths;
+  rb_results = scrypty_batch(argc, args, SCRYPTENC_BATCH_VERIFY);
+
+  rb_hash = rb_hash_new();
+  for (i = 0; i < RARRAY_LEN(rb_paths); i++) {
+    rb_hash_aset(rb_hash, RARRAY_AREF(rb_paths, i), RARRAY_AREF(rb_results, i));
+  }
+  return rb_hash;
+}
+
+struct scrypty_tree_args {
+  struct scrypty_batch_args batch;
+  const char *srcdir;
+  const char *dstdir;
+};
+
+static void *
+scrypty_tree_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_tree_args *args = ptr;
+
+  args->batch.errorcode = scrypty_scryptenc_tree(args->srcdir, args->dstdir,
+      args->batch.password, args->batch.password_len, &args->batch.profile,
+      args->batch.mode == SCRYPTENC_BATCH_DECRYPT_FILE, args->batch.nthreads,
+      args->batch.maxmemtotal, &args->batch.items, &args->batch.nitems);
+
+  return NULL;
+}
+
+static VALUE
+scrypty_tree_run(ptr)
+  VALUE ptr;
+{
+  struct scrypty_tree_args *args = (struct scrypty_tree_args *) ptr;
+  struct scryptenc_batch_item *item;
+  struct scrypty_job job;
+  VALUE rb_hash;
+  size_t i, skip;
+
+  /* Like a batch, the walk and the workers stop once interrupted. */
+  scrypty_job_init(&job);
+  scrypty_without_gvl(scrypty_tree_nogvl, args, &job);
+  if (args->batch.errorcode) {
+    raise_scrypty_error(args->batch.errorcode);
+  }
+
+  /* Each path is the source directory, a '/' and the relative name. */
+  skip = strlen(args->srcdir) + 1;
+  rb_hash = rb_hash_new();
+  for (i = 0; i < args->batch.nitems; i++) {
+    item = &args->batch.items[i];
+    rb_hash_aset(rb_hash, rb_filesystem_str_new_cstr(item->path + skip),
+        item->rc ? scrypty_error_new(item->rc) : SIZET2NUM(item->outlen));
+  }
+
+  return rb_hash;
+}
+
+static VALUE
+scrypty_tree_cleanup(ptr)
+  VALUE ptr;
+{
+  struct scrypty_tree_args *args = (struct scrypty_tree_args *) ptr;
+
+  scrypty_scryptenc_tree_free(args->batch.items, args->batch.nitems);
+  xfree(args->batch.buf);
+
+  return Qnil;
+}
+
+/* Encrypt or decrypt every regular file below one directory into the same
+ * place below another, as a single batch on a pool of native threads. */
+static VALUE
+scrypty_tree(argc, argv, mode)
+  int argc;
+  VALUE *argv;
+  int mode;
+{
+  VALUE rb_src, rb_dst, rb_password;
+  struct scrypty_tree_args args;
+  long srclen, dstlen, passwordlen;
+  char *ptr;
+
+  rb_check_arity(argc, 4, 8);
+  rb_src = rb_get_path(argv[0]);
+  rb_dst = rb_get_path(argv[1]);
+  rb_password = argv[2];
+  StringValueCStr(rb_src);
+  StringValueCStr(rb_dst);
+
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "third argument (password) must be a String");
+  }
+
+  scrypty_batch_options(argc, argv, 3, &args.batch);
+
+  /* The walk and the workers run without the GVL, so copy the strings. */
+  srclen = RSTRING_LEN(rb_src);
+  dstlen = RSTRING_LEN(rb_dst);
+  passwordlen = RSTRING_LEN(rb_password);
+  args.batch.mode = mode;
+  args.batch.items = NULL;
+  args.batch.nitems = 0;
+  args.batch.buf = ALLOC_N(uint8_t, srclen + dstlen + passwordlen + 2);
+
+  ptr = (char *) args.batch.buf;
+  memcpy(ptr, RSTRING_PTR(rb_src), srclen + 1);
+  args.srcdir = ptr;
+  ptr += srclen + 1;
+  memcpy(ptr, RSTRING_PTR(rb_dst), dstlen + 1);
+  args.dstdir = ptr;
+  ptr += dstlen + 1;
+  memcpy(ptr, RSTRING_PTR(rb_password), passwordlen);
+  args.batch.password = (const uint8_t *) ptr;
+  args.batch.password_len = (size_t) passwordlen;
+
+  return rb_ensure(scrypty_tree_run, (VALUE) &args,
+      scrypty_tree_cleanup, (VALUE) &args);
+}
+
+/* Scrypty.encrypt_tree(src_dir, dst_dir, password, profile, threads = nil,
+ *     memory = nil)
+ * Scrypty.encrypt_tree(src_dir, dst_dir, password, maxmem, maxmemfrac,
+ *     maxtime, threads = nil, memory = nil)
+ *
+ * Encrypt every regular file below src_dir to the same name below dst_dir,
+ * which is created (as are the directories below it) if need be.  Symbolic
+ * links and other special files are skipped.  Returns a Hash from each
+ * file's name relative to src_dir to the number of bytes written, or to
+ * the Scrypty::Exception that file raised; the output of a file that
+ * failed is removed. */
+VALUE
+scrypty_encrypt_tree(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_tree(argc, argv, SCRYPTENC_BATCH_ENCRYPT_FILE);
+}
+
+/* Scrypty.decrypt_tree(src_dir, dst_dir, password, profile, threads = nil,
+ *     memory = nil)
+ * Scrypty.decrypt_tree(src_dir, dst_dir, password, maxmem, maxmemfrac,
+ *     maxtime, threads = nil, memory = nil)
+ *
+ * The reverse of Scrypty.encrypt_tree. */
+VALUE
+scrypty_decrypt_tree(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  return scrypty_tree(argc, argv, SCRYPTENC_BATCH_DECRYPT_FILE);
+}
+
+VALUE
+scrypty_memlimit(rb_obj, rb_maxmem, rb_maxmemfrac)
+  VALUE rb_obj;
+  VALUE rb_maxmem;
+  VALUE rb_maxmemfrac;
+{
+  long l_maxmem;
+  size_t maxmem, memlimit, max_size;
+  double maxmemfrac;
+
+  max_size = (size_t) -1;
+
+  if (TYPE(rb_maxmem) == T_FIXNUM) {
+    l_maxmem = FIX2LONG(rb_maxmem);
+
+    if (l_maxmem < 0) {
+      rb_raise(rb_eArgError, "maxmem (%ld) must not be less than 0", l_maxmem);
+    }
+    else if ((unsigned long) l_maxmem > (unsigned long) max_size) {
+      rb_raise(rb_eArgError, "maxmem (%ld) cannot exceed %zu", l_maxmem, max_size);
+    }
+    else {
+      maxmem = (size_t) l_maxmem;
+    }
+  }
+  else {
+    rb_raise(rb_eTypeError, "first argument (maxmem) must be a Fixnum");
+  }
+
+  if (FIXNUM_P(rb_maxmemfrac) || TYPE(rb_maxmemfrac) == T_FLOAT) {
+    maxmemfrac = NUM2DBL(rb_maxmemfrac);
+  }
+  else {
+    rb_raise(rb_eTypeError, "second argument (maxmemfrac) must be a Fixnum or Float");
+  }
+
+  if (scrypty_memtouse(maxmem, maxmemfrac, &memlimit) != 0) {
+    rb_raise(rb_eRuntimeError, "could not determine memory limit");
+  }
+
+  return SIZET2NUM(memlimit);
+}
+
+VALUE
+scrypty_opslimit(rb_obj, rb_maxtime)
+  VALUE rb_obj;
+  VALUE rb_maxtime;
+{
+  double opps, maxtime, opslimit;
+  uint64_t start;
+
+  if (FIXNUM_P(rb_maxtime) || TYPE(rb_maxtime) == T_FLOAT) {
+    maxtime = NUM2DBL(rb_maxtime);
+  }
+  else {
+    rb_raise(rb_eTypeError, "first argument (maxtime) must be a Fixnum or Float");
+  }
+
+  /* Figure out how fast the CPU is. */
+  start = scrypty_stats_now();
+  if (scrypty_scryptenc_cpuperf(&opps) != 0) {
+    rb_raise(rb_eRuntimeError, "could not determine CPU performance");
+  }
+  scrypty_stats_phase(STATS_CALIBRATE, start);
+  scrypty_stats_calibration(opps);
+  opslimit = opps * maxtime;
+
+  /* Allow a minimum of 2^15 salsa20/8 cores. */
+  if (opslimit < 32768)
+    opslimit = 32768;
+
+  return DBL2NUM(opslimit);
+}
+
+/* Calculate parameters used for creating a derived key with the
+ * scrypt algorithm. */
+VALUE
+scrypty_params(rb_obj, rb_memlimit, rb_opslimit)
+  VALUE rb_obj;
+  VALUE rb_memlimit;
+  VALUE rb_opslimit;
+{
+  VALUE rb_result;
+  long l_memlimit;
+  size_t memlimit, max_size;
+  double opslimit;
+  int logN;
+  uint64_t N = 0;
+  uint32_t r = 0, p = 0;
+
+  max_size = (size_t) -1;
+
+  if (TYPE(rb_memlimit) == T_FIXNUM) {
+    l_memlimit = FIX2LONG(rb_memlimit);
+
+    if (l_memlimit < 0) {
+      rb_raise(rb_eArgError, "memlimit (%ld) must not be less than 0", l_memlimit);
+    }
+    else if ((unsigned long) l_memlimit > (unsigned long) max_size) {
+      rb_raise(rb_eArgError, "memlimit (%ld) cannot exceed %zu", l_memlimit, max_size);
     }
     else {
       memlimit = (size_t) l_memlimit;
     }
   }
-  else {
-    rb_raise(rb_eTypeError, "first argument (memlimit) must be a Fixnum");
+  else {
+    rb_raise(rb_eTypeError, "first argument (memlimit) must be a Fixnum");
+  }
+
+  if (FIXNUM_P(rb_opslimit) || TYPE(rb_opslimit) == T_FLOAT) {
+    opslimit = NUM2DBL(rb_opslimit);
+  }
+  else {
+    rb_raise(rb_eTypeError, "second argument (opslimit) must be a Fixnum or Float");
+  }
+
+  scrypty_scryptenc_pickparams(memlimit, opslimit, &logN, &r, &p);
+  N = (uint64_t)(1) << logN;
+
+  rb_result = rb_ary_new3(3, ULL2NUM(N), UINT2NUM(r), UINT2NUM(p));
+  return rb_result;
+};
+
+static VALUE
+scrypty_profile_alloc(klass)
+  VALUE klass;
+{
+  struct scryptenc_profile *profile;
+
+  return TypedData_Make_Struct(klass, struct scryptenc_profile,
+      &scrypty_profile_type, profile);
+}
+
+/* Scrypty::Profile.new(maxmem, maxmemfrac, maxtime)
+ *
+ * Examine the system once and remember the resulting memory and CPU limits
+ * along with the N, r and p that encryption would pick under them. */
+static VALUE
+scrypty_profile_initialize(rb_self, rb_maxmem, rb_maxmemfrac, rb_maxtime)
+  VALUE rb_self;
+  VALUE rb_maxmem;
+  VALUE rb_maxmemfrac;
+  VALUE rb_maxtime;
+{
+  struct scryptenc_profile *profile;
+  VALUE argv[3];
+
+  rb_check_frozen(rb_self);
+  TypedData_Get_Struct(rb_self, struct scryptenc_profile,
+      &scrypty_profile_type, profile);
+
+  argv[0] = rb_maxmem;
+  argv[1] = rb_maxmemfrac;
+  argv[2] = rb_maxtime;
+  scrypty_get_profile(3, argv, 0, profile);
+
+  return rb_obj_freeze(rb_self);
+}
+
+/* Scrypty::Profile.from_params(n, r, p, memlimit = nil, opslimit = nil)
+ *
+ * Build a profile from explicit scrypt parameters.  Unless given, the
+ * memory and CPU limits are exactly what those parameters require, so
+ * decryption with this profile accepts anything at most as costly. */
+static VALUE
+scrypty_profile_from_params(argc, argv, klass)
+  int argc;
+  VALUE *argv;
+  VALUE klass;
+{
+  VALUE rb_n, rb_r, rb_p, rb_memlimit, rb_opslimit, rb_profile;
+  struct scryptenc_profile *profile;
+  uint64_t N;
+  int logN;
+
+  rb_scan_args(argc, argv, "32", &rb_n, &rb_r, &rb_p, &rb_memlimit,
+      &rb_opslimit);
+
+  N = (uint64_t) NUM2ULL(rb_n);
+  if (((N & (N - 1)) != 0) || (N < 2)) {
+    rb_raise(rb_eArgError, "n must be a power of 2 greater than 1");
+  }
+  for (logN = 1; ((uint64_t)(1) << logN) < N; logN++);
+
+  rb_profile = scrypty_profile_alloc(klass);
+  TypedData_Get_Struct(rb_profile, struct scryptenc_profile,
+      &scrypty_profile_type, profile);
+
+  if (scrypty_scryptenc_profile_params(logN, NUM2UINT(rb_r), NUM2UINT(rb_p),
+        profile) != 0) {
+    rb_raise(rb_eArgError, "parameters were invalid");
+  }
+  if (!NIL_P(rb_memlimit)) {
+    profile->memlimit = NUM2SIZET(rb_memlimit);
+  }
+  if (!NIL_P(rb_opslimit)) {
+    profile->opslimit = NUM2DBL(rb_opslimit);
+  }
+
+  return rb_obj_freeze(rb_profile);
+}
+
+static struct scryptenc_profile *
+scrypty_profile_get(rb_self)
+  VALUE rb_self;
+{
+  struct scryptenc_profile *profile;
+
+  TypedData_Get_Struct(rb_self, struct scryptenc_profile,
+      &scrypty_profile_type, profile);
+  return profile;
+}
+
+static VALUE
+scrypty_profile_memlimit(rb_self)
+  VALUE rb_self;
+{
+  return SIZET2NUM(scrypty_profile_get(rb_self)->memlimit);
+}
+
+static VALUE
+scrypty_profile_opslimit(rb_self)
+  VALUE rb_self;
+{
+  return DBL2NUM(scrypty_profile_get(rb_self)->opslimit);
+}
+
+static VALUE
+scrypty_profile_n(rb_self)
+  VALUE rb_self;
+{
+  return ULL2NUM((uint64_t)(1) << scrypty_profile_get(rb_self)->logN);
+}
+
+static VALUE
+scrypty_profile_r(rb_self)
+  VALUE rb_self;
+{
+  return UINT2NUM(scrypty_profile_get(rb_self)->r);
+}
+
+static VALUE
+scrypty_profile_p(rb_self)
+  VALUE rb_self;
+{
+  return UINT2NUM(scrypty_profile_get(rb_self)->p);
+}
+
+static VALUE
+scrypty_profile_params(rb_self)
+  VALUE rb_self;
+{
+  return rb_ary_new3(3, scrypty_profile_n(rb_self),
+      scrypty_profile_r(rb_self), scrypty_profile_p(rb_self));
+}
+
+struct scrypty_dk_args {
+  const uint8_t *password;
+  size_t password_len;
+  const uint8_t *salt;
+  size_t salt_len;
+  uint64_t N;
+  uint32_t r;
+  uint32_t p;
+  uint8_t *dk;
+  size_t keylen;
+  int rc;
+  int err;
+};
+
+static void *
+scrypty_dk_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_dk_args *args = ptr;
+
+  scrypty_stats_count(STATS_DK, 1, args->password_len);
+  scrypty_stats_vbytes((uint64_t) 128 * args->r * args->N);
+  args->rc = scrypty_sched_scrypt(args->password, args->password_len,
+      args->salt, args->salt_len, args->N, args->r, args->p, args->dk,
+      args->keylen);
+  args->err = errno;
+
+  return NULL;
+}
+
+/* Scrypty.dk(password, salt, n, r, p, keylen, priority: 0, deadline: nil,
+ *            timeout: nil) */
+VALUE
+scrypty_dk(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_password, rb_salt, rb_n, rb_r, rb_p, rb_keylen, rb_dk;
+  struct scrypty_dk_args args;
+  struct scrypty_job job;
+  const uint8_t *password, *salt;
+  uint8_t *dk;
+  uint64_t N;
+  uint32_t r, p;
+  size_t password_len, salt_len, keylen;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 6, 6);
+  rb_password = argv[0];
+  rb_salt = argv[1];
+  rb_n = argv[2];
+  rb_r = argv[3];
+  rb_p = argv[4];
+  rb_keylen = argv[5];
+
+  if (TYPE(rb_password) == T_STRING) {
+    rb_password = rb_str_new_frozen(rb_password);
+    password = (const uint8_t *) RSTRING_PTR(rb_password);
+    password_len = (size_t) RSTRING_LEN(rb_password);
+  }
+  else {
+    rb_raise(rb_eTypeError, "first argument (password) must be a String");
+  }
+
+  if (TYPE(rb_salt) == T_STRING) {
+    rb_salt = rb_str_new_frozen(rb_salt);
+    salt = (const uint8_t *) RSTRING_PTR(rb_salt);
+    salt_len = (size_t) RSTRING_LEN(rb_salt);
+  }
+  else {
+    rb_raise(rb_eTypeError, "second argument (salt) must be a String");
+  }
+
+  if (FIXNUM_P(rb_n)) {
+    N = (uint64_t) NUM2ULL(rb_n);
+  }
+  else {
+    rb_raise(rb_eTypeError, "third argument (n) must be a Fixnum");
+  }
+
+  if (FIXNUM_P(rb_r)) {
+    r = (uint32_t) NUM2ULONG(rb_r);
+  }
+  else {
+    rb_raise(rb_eTypeError, "fourth argument (r) must be a Fixnum");
+  }
+
+  if (FIXNUM_P(rb_p)) {
+    p = (uint32_t) NUM2ULONG(rb_p);
+  }
+  else {
+    rb_raise(rb_eTypeError, "fifth argument (p) must be a Fixnum");
+  }
+
+  if (FIXNUM_P(rb_keylen)) {
+    keylen = NUM2SIZET(rb_keylen);
+  }
+  else {
+    rb_raise(rb_eTypeError, "sixth argument (keylen) must be a Fixnum");
+  }
+
+  rb_dk = rb_str_buf_new(keylen);
+  dk = (uint8_t *) RSTRING_PTR(rb_dk);
+
+  args.password = password;
+  args.password_len = password_len;
+  args.salt = salt;
+  args.salt_len = salt_len;
+  args.N = N;
+  args.r = r;
+  args.p = p;
+  args.dk = dk;
+  args.keylen = keylen;
+  if (r > 0 && N <= SIZE_MAX / 128 / r) {
+    job.vbytes = (size_t) 128 * r * N;
+  }
+  scrypty_without_gvl(scrypty_dk_nogvl, &args, &job);
+  RB_GC_GUARD(rb_password);
+  RB_GC_GUARD(rb_salt);
+
+  if (args.rc != 0) {
+
+    switch (args.err) {
+      case EFBIG:
+        rb_raise(rb_eRuntimeError, "parameters were too big");
+        break;
+
+      case EINVAL:
+        rb_raise(rb_eRuntimeError, "parameters were invalid");
+        break;
+
+      case ENOMEM:
+        rb_raise(rb_eNoMemError, "not enough memory to create derived key");
+        break;
+
+      case ETIMEDOUT:
+        raise_scrypty_error(14);
+        break;
+
+      case ECANCELED:
+        raise_scrypty_error(16);
+        break;
+
+      default:
+        rb_raise(rb_eRuntimeError, "%s", strerror(args.err));
+    }
+  }
+
+  rb_str_set_len(rb_dk, keylen);
+  return rb_dk;
+}
+
+/* Check that rb_dk is a String holding a derived key of at least 64 bytes,
+ * and expand it into key.  dk is argument number pos, counting from zero,
+ * which is only used for error messages. */
+static void
+scrypty_get_key(rb_dk, pos, key)
+  VALUE rb_dk;
+  int pos;
+  struct scryptenc_key *key;
+{
+  if (TYPE(rb_dk) != T_STRING) {
+    rb_raise(rb_eTypeError, "%s argument (dk) must be a String",
+        scrypty_ordinals[pos]);
+  }
+  if (RSTRING_LEN(rb_dk) < 64) {
+    rb_raise(rb_eArgError, "dk must be at least 64 bytes");
+  }
+  if (scrypty_key_init(key, (const uint8_t *) RSTRING_PTR(rb_dk))) {
+    scrypty_key_wipe(key);
+    raise_scrypty_error(5);
+  }
+}
+
+static void
+scrypty_check_data(rb_data)
+  VALUE rb_data;
+{
+  if (TYPE(rb_data) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (data) must be a String");
+  }
+}
+
+/* Encrypt rb_data under key in the raw format: AES-CTR followed by an
+ * HMAC-SHA256 of the ciphertext. */
+static VALUE
+scrypty_key_encrypt_str(key, rb_data)
+  const struct scryptenc_key *key;
+  VALUE rb_data;
+{
+  VALUE rb_out;
+  size_t data_len;
+
+  data_len = (size_t) RSTRING_LEN(rb_data);
+  rb_out = rb_str_buf_new(data_len + 32);
+  scrypty_stats_count(STATS_ENC_RAW, 1, data_len);
+  scrypty_key_encrypt(key, (const uint8_t *) RSTRING_PTR(rb_data), data_len,
+      (uint8_t *) RSTRING_PTR(rb_out));
+  rb_str_set_len(rb_out, data_len + 32);
+
+  return rb_out;
+}
+
+/* Check and decrypt rb_data, in the raw format, under key.  Return nil if
+ * it is not a valid block under key. */
+static VALUE
+scrypty_key_decrypt_str(key, rb_data)
+  const struct scryptenc_key *key;
+  VALUE rb_data;
+{
+  VALUE rb_out;
+  size_t data_len;
+
+  data_len = (size_t) RSTRING_LEN(rb_data);
+  if (data_len < 32) {
+    return Qnil;
+  }
+
+  rb_out = rb_str_buf_new(data_len - 32);
+  scrypty_stats_count(STATS_DEC_RAW, 1, data_len - 32);
+  if (scrypty_key_decrypt(key, (const uint8_t *) RSTRING_PTR(rb_data),
+      data_len, (uint8_t *) RSTRING_PTR(rb_out))) {
+    return Qnil;
+  }
+  rb_str_set_len(rb_out, data_len - 32);
+
+  return rb_out;
+}
+
+VALUE
+scrypty_encrypt_raw(rb_obj, rb_data, rb_dk)
+  VALUE rb_obj;
+  VALUE rb_data;
+  VALUE rb_dk;
+{
+  struct scryptenc_key key;
+  VALUE rb_out;
+
+  scrypty_check_data(rb_data);
+  scrypty_get_key(rb_dk, 1, &key);
+  rb_out = scrypty_key_encrypt_str(&key, rb_data);
+  scrypty_key_wipe(&key);
+
+  return rb_out;
+}
+
+VALUE
+scrypty_decrypt_raw(rb_obj, rb_data, rb_dk)
+  VALUE rb_obj;
+  VALUE rb_data;
+  VALUE rb_dk;
+{
+  struct scryptenc_key key;
+  VALUE rb_out;
+
+  scrypty_check_data(rb_data);
+  scrypty_get_key(rb_dk, 1, &key);
+  rb_out = scrypty_key_decrypt_str(&key, rb_data);
+  scrypty_key_wipe(&key);
+  if (NIL_P(rb_out)) {
+    raise_scrypty_error(7);
+  }
+
+  return rb_out;
+}
+
+/* A Scrypty::Key: the expanded key, and whether it holds one (it doesn't
+ * before initialize or after wipe). */
+struct scrypty_key {
+  struct scryptenc_key key;
+  int ready;
+};
+
+static void
+scrypty_key_free(ptr)
+  void *ptr;
+{
+  scrypty_key_wipe(&((struct scrypty_key *) ptr)->key);
+  xfree(ptr);
+}
+
+static size_t
+scrypty_key_memsize(ptr)
+  const void *ptr;
+{
+  return sizeof(struct scrypty_key);
+}
+
+static const rb_data_type_t scrypty_key_type = {
+  "Scrypty::Key",
+  { NULL, scrypty_key_free, scrypty_key_memsize, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+scrypty_key_alloc(klass)
+  VALUE klass;
+{
+  struct scrypty_key *key;
+
+  return TypedData_Make_Struct(klass, struct scrypty_key,
+      &scrypty_key_type, key);
+}
+
+/* Return the expanded key of a Scrypty::Key, raising if it was wiped. */
+static const struct scryptenc_key *
+scrypty_key_get(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_key *key;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_key, &scrypty_key_type, key);
+  if (!key->ready) {
+    rb_raise(rb_eRuntimeError, "key has been wiped");
+  }
+
+  return &key->key;
+}
+
+/* Scrypty::Key.new(dk)
+ *
+ * Expand a 64-byte derived key (from Scrypty.dk) once, keeping the AES key
+ * schedule and the HMAC pad states, so that encrypt_raw and decrypt_raw
+ * only run the cipher and hash the message. */
+static VALUE
+scrypty_key_initialize(rb_self, rb_dk)
+  VALUE rb_self;
+  VALUE rb_dk;
+{
+  struct scrypty_key *key;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_key, &scrypty_key_type, key);
+  key->ready = 0;
+  scrypty_get_key(rb_dk, 0, &key->key);
+  key->ready = 1;
+
+  return rb_self;
+}
+
+/* Scrypty::Key#encrypt_raw(data)
+ *
+ * As Scrypty.encrypt_raw(data, dk). */
+static VALUE
+scrypty_key_encrypt_raw(rb_self, rb_data)
+  VALUE rb_self;
+  VALUE rb_data;
+{
+  scrypty_check_data(rb_data);
+  return scrypty_key_encrypt_str(scrypty_key_get(rb_self), rb_data);
+}
+
+/* Scrypty::Key#decrypt_raw(data)
+ *
+ * As Scrypty.decrypt_raw(data, dk). */
+static VALUE
+scrypty_key_decrypt_raw(rb_self, rb_data)
+  VALUE rb_self;
+  VALUE rb_data;
+{
+  VALUE rb_out;
+
+  scrypty_check_data(rb_data);
+  rb_out = scrypty_key_decrypt_str(scrypty_key_get(rb_self), rb_data);
+  if (NIL_P(rb_out)) {
+    raise_scrypty_error(7);
+  }
+
+  return rb_out;
+}
+
+/* Scrypty::Key#wipe
+ *
+ * Zero the expanded key now rather than when the object is collected.
+ * The key can't be used afterwards. */
+static VALUE
+scrypty_key_wipe_m(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_key *key;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_key, &scrypty_key_type, key);
+  scrypty_key_wipe(&key->key);
+  key->ready = 0;
+
+  return Qnil;
+}
+
+/* Scrypty::Key#wiped? */
+static VALUE
+scrypty_key_wiped_p(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_key *key;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_key, &scrypty_key_type, key);
+  return key->ready ? Qfalse : Qtrue;
+}
+
+/* A Scrypty::LogWriter or Scrypty::LogReader, and whether its log is open
+ * (it isn't before initialize or after close). */
+struct scrypty_log {
+  struct scryptenc_log log;
+  int open;
+  int writable;
+};
+
+static void
+scrypty_log_free(ptr)
+  void *ptr;
+{
+  struct scrypty_log *log = ptr;
+
+  /* Records written since the last checkpoint would be lost otherwise. */
+  if (log->open) {
+    if (log->writable) {
+      scrypty_log_checkpoint(&log->log);
+    }
+    scrypty_log_close(&log->log);
+  }
+  xfree(ptr);
+}
+
+static size_t
+scrypty_log_memsize(ptr)
+  const void *ptr;
+{
+  return sizeof(struct scrypty_log);
+}
+
+static const rb_data_type_t scrypty_log_type = {
+  "Scrypty::Log",
+  { NULL, scrypty_log_free, scrypty_log_memsize, },
+  NULL, NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+scrypty_log_alloc(klass)
+  VALUE klass;
+{
+  struct scrypty_log *log;
+
+  return TypedData_Make_Struct(klass, struct scrypty_log,
+      &scrypty_log_type, log);
+}
+
+/* Return the open log of a LogWriter or LogReader, raising if it's closed. */
+static struct scrypty_log *
+scrypty_log_get(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_log *log;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_log, &scrypty_log_type, log);
+  if (!log->open) {
+    rb_raise(rb_eIOError, "log is closed");
+  }
+
+  return log;
+}
+
+struct scrypty_log_args {
+  struct scryptenc_log *log;
+  const char *path;
+  const uint8_t *password;
+  size_t password_len;
+  struct scryptenc_profile profile;
+  int writable;
+  int errorcode;
+};
+
+static void *
+scrypty_log_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_log_args *args = ptr;
+
+  args->errorcode = scrypty_log_open(args->log, args->path, args->password,
+      args->password_len, &args->profile, args->writable);
+
+  return NULL;
+}
+
+/* Open the log for a LogWriter or LogReader, deriving its key without the
+ * GVL. */
+static void
+scrypty_log_init(rb_self, argc, argv, writable)
+  VALUE rb_self;
+  int argc;
+  VALUE *argv;
+  int writable;
+{
+  VALUE rb_path, rb_password;
+  struct scrypty_log *log;
+  struct scrypty_log_args args;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_log, &scrypty_log_type, log);
+  if (log->open) {
+    rb_raise(rb_eRuntimeError, "log is already open");
+  }
+
+  rb_check_arity(argc, 3, 5);
+  rb_path = rb_get_path(argv[0]);
+  rb_password = argv[1];
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
+  }
+  scrypty_get_profile(argc - 2, argv + 2, 2, &args.profile);
+
+  rb_path = rb_str_new_frozen(rb_path);
+  rb_password = rb_str_new_frozen(rb_password);
+  args.log = &log->log;
+  args.path = StringValueCStr(rb_path);
+  args.password = (const uint8_t *) RSTRING_PTR(rb_password);
+  args.password_len = (size_t) RSTRING_LEN(rb_password);
+  args.writable = writable;
+
+  rb_thread_call_without_gvl(scrypty_log_nogvl, &args, NULL, NULL);
+  scrypty_gc_settle(0);
+  RB_GC_GUARD(rb_path);
+  RB_GC_GUARD(rb_password);
+  if (args.errorcode) {
+    raise_scrypty_error(args.errorcode);
+  }
+  log->open = 1;
+  log->writable = writable;
+}
+
+/* Scrypty::LogWriter.new(path, password, profile, checkpoint_bytes: 65536,
+ *                        checkpoint_records: nil)
+ * Scrypty::LogWriter.new(path, password, maxmem, maxmemfrac, maxtime, ...)
+ *
+ * Open the encrypted log in path for appending, creating it if need be.
+ * The key is derived once, here; an existing log is verified and cut back
+ * to its last checkpoint, after which new records go.  A checkpoint is
+ * written whenever checkpoint_bytes bytes or checkpoint_records records
+ * have been appended since the last one, and on checkpoint and close. */
+static VALUE
+scrypty_log_writer_initialize(argc, argv, rb_self)
+  int argc;
+  VALUE *argv;
+  VALUE rb_self;
+{
+  VALUE rb_opts, rb_values[2];
+  struct scrypty_log *log;
+  uint64_t ckbytes, ckrecords;
+
+  argc = rb_scan_args(argc, argv, "*:", NULL, &rb_opts);
+  ckbytes = LOG_CHECKPOINT;
+  ckrecords = 0;
+  if (!NIL_P(rb_opts)) {
+    rb_get_kwargs(rb_opts, scrypty_log_kwargs, 0, 2, rb_values);
+    if (rb_values[0] != Qundef && !NIL_P(rb_values[0])) {
+      ckbytes = NUM2ULL(rb_values[0]);
+    }
+    if (rb_values[1] != Qundef && !NIL_P(rb_values[1])) {
+      ckrecords = NUM2ULL(rb_values[1]);
+    }
+  }
+
+  scrypty_log_init(rb_self, argc, argv, 1);
+  log = scrypty_log_get(rb_self);
+  log->log.ckbytes = ckbytes;
+  log->log.ckrecords = ckrecords;
+
+  return rb_self;
+}
+
+/* Scrypty::LogWriter#write(record)
+ *
+ * Append record (a String) to the log.  Returns self, so that it can be
+ * chained like IO#<<. */
+static VALUE
+scrypty_log_writer_write(rb_self, rb_record)
+  VALUE rb_self;
+  VALUE rb_record;
+{
+  struct scrypty_log *log = scrypty_log_get(rb_self);
+  int errorcode;
+
+  StringValue(rb_record);
+  errorcode = scrypty_log_append(&log->log,
+      (const uint8_t *) RSTRING_PTR(rb_record), (size_t) RSTRING_LEN(rb_record));
+  RB_GC_GUARD(rb_record);
+  if (errorcode) {
+    raise_scrypty_error(errorcode);
   }
 
-  if (FIXNUM_P(rb_opslimit) || TYPE(rb_opslimit) == T_FLOAT) {
-    opslimit = NUM2DBL(rb_opslimit);
+  return rb_self;
+}
+
+/* Scrypty::LogWriter#checkpoint
+ *
+ * Write a checkpoint now, so that readers see every record so far. */
+static VALUE
+scrypty_log_writer_checkpoint(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_log *log = scrypty_log_get(rb_self);
+  int errorcode;
+
+  if ((errorcode = scrypty_log_checkpoint(&log->log)) != 0) {
+    raise_scrypty_error(errorcode);
   }
-  else {
-    rb_raise(rb_eTypeError, "second argument (opslimit) must be a Fixnum or Float");
+
+  return Qnil;
+}
+
+/* Scrypty::LogWriter#close, Scrypty::LogReader#close
+ *
+ * Checkpoint (when writing) and close the log, zeroing its key. */
+static VALUE
+scrypty_log_close_m(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_log *log;
+  int errorcode = 0;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_log, &scrypty_log_type, log);
+  if (!log->open) {
+    return Qnil;
+  }
+  if (log->writable) {
+    errorcode = scrypty_log_checkpoint(&log->log);
+  }
+  scrypty_log_close(&log->log);
+  log->open = 0;
+  if (errorcode) {
+    raise_scrypty_error(errorcode);
   }
 
-  /* Fix r = 8 for now. */
-  r = 8;
+  return Qnil;
+}
 
-  if (opslimit < memlimit/32) {
-    /* Set p = 1 and choose N based on the CPU limit. */
-    p = 1;
-    maxN = opslimit / (r * 4);
-    for (logN = 1; logN < 63; logN += 1) {
-      if ((uint64_t)(1) << logN > maxN / 2)
-        break;
-    }
-  } else {
-    /* Set N based on the memory limit. */
-    maxN = memlimit / (r * 128);
-    for (logN = 1; logN < 63; logN += 1) {
-      N = (uint64_t)(1) << logN;
-      if (N > maxN / 2)
-        break;
+/* Scrypty::LogWriter#closed?, Scrypty::LogReader#closed? */
+static VALUE
+scrypty_log_closed_p(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_log *log;
+
+  TypedData_Get_Struct(rb_self, struct scrypty_log, &scrypty_log_type, log);
+  return log->open ? Qfalse : Qtrue;
+}
+
+/* Scrypty::LogReader.new(path, password, profile)
+ * Scrypty::LogReader.new(path, password, maxmem, maxmemfrac, maxtime)
+ *
+ * Open the encrypted log in path for reading, deriving its key once. */
+static VALUE
+scrypty_log_reader_initialize(argc, argv, rb_self)
+  int argc;
+  VALUE *argv;
+  VALUE rb_self;
+{
+  scrypty_log_init(rb_self, argc, argv, 0);
+
+  return rb_self;
+}
+
+/* Scrypty::LogReader#read
+ *
+ * Return an Array of the records covered by the checkpoints written since
+ * the last call (or the start of the log), so that calling it again and
+ * again tails the log.  Once a checkpoint that doesn't verify is reached,
+ * the records before it are returned, and the next call raises
+ * Scrypty::InvalidBlockError. */
+static VALUE
+scrypty_log_reader_read(rb_self)
+  VALUE rb_self;
+{
+  struct scrypty_log *log = scrypty_log_get(rb_self);
+  VALUE rb_records;
+  uint8_t *out;
+  size_t outlen, pos, len;
+  int errorcode;
+
+  errorcode = scrypty_log_read(&log->log, &out, &outlen);
+  if (errorcode && (errorcode != 7 || out == NULL)) {
+    if (out != NULL) {
+      memset(out, 0, outlen);
+      free(out);
     }
+    raise_scrypty_error(errorcode);
+  }
 
-    /* Choose p based on the CPU limit. */
-    maxrp = (opslimit / 4) / ((uint64_t)(1) << logN);
-    if (maxrp > 0x3fffffff)
-      maxrp = 0x3fffffff;
-    p = (uint32_t)(maxrp) / r;
+  rb_records = rb_ary_new();
+  for (pos = 0; pos < outlen; pos += 4 + len) {
+    len = ((size_t) out[pos] << 24) | ((size_t) out[pos + 1] << 16) |
+        ((size_t) out[pos + 2] << 8) | (size_t) out[pos + 3];
+    rb_ary_push(rb_records, rb_str_new((const char *) &out[pos + 4], (long) len));
+  }
+  if (out != NULL) {
+    memset(out, 0, outlen);
+    free(out);
   }
 
-  rb_result = rb_ary_new3(3, UINT2NUM(N), UINT2NUM(r), UINT2NUM(p));
-  return rb_result;
+  return rb_records;
+}
+
+struct scrypty_mcf_args {
+  const char *hash;
+  size_t hash_len;
+  const uint8_t *password;
+  size_t password_len;
+  struct scryptenc_profile profile;
+  int format;
+  int create;
+  char out[MCF_MAXLEN];
+  int errorcode;
 };
 
-VALUE
-scrypty_dk(rb_obj, rb_password, rb_salt, rb_n, rb_r, rb_p, rb_keylen)
-  VALUE rb_obj;
-  VALUE rb_password;
-  VALUE rb_salt;
-  VALUE rb_n;
-  VALUE rb_r;
-  VALUE rb_p;
-  VALUE rb_keylen;
+static void *
+scrypty_mcf_nogvl(ptr)
+  void *ptr;
 {
-  VALUE rb_dk;
-  const uint8_t *password, *salt;
-  uint8_t *dk;
-  uint64_t N;
-  uint32_t r, p;
-  size_t password_len, salt_len, keylen;
+  struct scrypty_mcf_args *args = ptr;
 
-  if (TYPE(rb_password) == T_STRING) {
-    password = (const uint8_t *) RSTRING_PTR(rb_password);
-    password_len = (size_t) RSTRING_LEN(rb_password);
+  if (args->create) {
+    scrypty_stats_count(STATS_PASSWORD_CREATE, 1, args->password_len);
+    args->errorcode = scrypty_mcf_create(args->out, args->password,
+        args->password_len, &args->profile, args->format);
   }
   else {
-    rb_raise(rb_eTypeError, "first argument (password) must be a String");
+    scrypty_stats_count(STATS_PASSWORD_VERIFY, 1, args->password_len);
+    args->errorcode = scrypty_mcf_verify(args->hash, args->hash_len,
+        args->password, args->password_len);
   }
 
-  if (TYPE(rb_salt) == T_STRING) {
-    salt = (const uint8_t *) RSTRING_PTR(rb_salt);
-    salt_len = (size_t) RSTRING_LEN(rb_salt);
+  return NULL;
+}
+
+/* Scrypty::Password.create(password, profile, prefix = "$7$", priority: 0,
+ *                          deadline: nil, timeout: nil)
+ *
+ * Hash password with a new salt and the parameters from profile, and
+ * return the hash as a modular crypt format String: "$7$" (as libsodium
+ * and the scrypt reference code write) or "$s1$" (as the Java scrypt
+ * library writes, for r and p up to 255).  The key is derived without the
+ * GVL, through the scheduler, in a workspace the deriving thread keeps for
+ * the next password. */
+static VALUE
+scrypty_password_create(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_password, rb_prefix;
+  struct scrypty_mcf_args args;
+  struct scrypty_job job;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 2, 3);
+  rb_password = argv[0];
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (password) must be a String");
   }
-  else {
-    rb_raise(rb_eTypeError, "second argument (salt) must be a String");
+  scrypty_get_profile(1, argv + 1, 1, &args.profile);
+
+  args.format = MCF_7;
+  if (argc > 2) {
+    rb_prefix = argv[2];
+    if (TYPE(rb_prefix) == T_STRING && strcmp(StringValueCStr(rb_prefix), "$s1$") == 0) {
+      args.format = MCF_S1;
+    }
+    else if (TYPE(rb_prefix) != T_STRING || strcmp(StringValueCStr(rb_prefix), "$7$") != 0) {
+      rb_raise(rb_eArgError, "prefix must be \"$7$\" or \"$s1$\"");
+    }
   }
 
-  if (FIXNUM_P(rb_n)) {
-    N = (uint64_t) NUM2ULL(rb_n);
+  rb_password = rb_str_new_frozen(rb_password);
+  args.password = (const uint8_t *) RSTRING_PTR(rb_password);
+  args.password_len = (size_t) RSTRING_LEN(rb_password);
+  args.create = 1;
+  job.vbytes = scrypty_vbytes(args.profile.logN, args.profile.r);
+
+  scrypty_without_gvl(scrypty_mcf_nogvl, &args, &job);
+  RB_GC_GUARD(rb_password);
+  if (args.errorcode == 8) {
+    rb_raise(rb_eArgError, "profile parameters don't fit the %s format",
+        args.format == MCF_S1 ? "$s1$" : "$7$");
   }
-  else {
-    rb_raise(rb_eTypeError, "third argument (n) must be a Fixnum");
+  if (args.errorcode) {
+    raise_scrypty_error(args.errorcode);
   }
 
-  if (FIXNUM_P(rb_r)) {
-    r = (uint32_t) NUM2ULONG(rb_r);
+  return rb_usascii_str_new_cstr(args.out);
+}
+
+/* Scrypty::Password.verify(hash, password, priority: 0, deadline: nil,
+ *                          timeout: nil)
+ *
+ * Return true if password is the one hash (a String from create, or any
+ * "$7$" or "$s1$" hash) was made from, and false if not, comparing the
+ * derived keys in constant time.  Raises Scrypty::UnrecognizedFormatError
+ * if hash can't be parsed.  The parameters in hash are used as they are, so
+ * hashes must come from a trusted store. */
+static VALUE
+scrypty_password_verify(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_hash, rb_password;
+  struct scrypty_mcf_args args;
+  struct scrypty_job job;
+  struct scryptenc_mcf mcf;
+
+  scrypty_get_job(&argc, argv, &job);
+  rb_check_arity(argc, 2, 2);
+  rb_hash = argv[0];
+  rb_password = argv[1];
+  if (TYPE(rb_hash) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (hash) must be a String");
   }
-  else {
-    rb_raise(rb_eTypeError, "fourth argument (r) must be a Fixnum");
+  if (TYPE(rb_password) != T_STRING) {
+    rb_raise(rb_eTypeError, "second argument (password) must be a String");
   }
 
-  if (FIXNUM_P(rb_p)) {
-    p = (uint32_t) NUM2ULONG(rb_p);
+  rb_hash = rb_str_new_frozen(rb_hash);
+  rb_password = rb_str_new_frozen(rb_password);
+  args.hash = RSTRING_PTR(rb_hash);
+  args.hash_len = (size_t) RSTRING_LEN(rb_hash);
+  args.password = (const uint8_t *) RSTRING_PTR(rb_password);
+  args.password_len = (size_t) RSTRING_LEN(rb_password);
+  args.create = 0;
+  if (scrypty_mcf_parse(args.hash, args.hash_len, &mcf) == 0) {
+    job.vbytes = scrypty_vbytes(mcf.logN, mcf.r);
   }
-  else {
-    rb_raise(rb_eTypeError, "fifth argument (p) must be a Fixnum");
+
+  scrypty_without_gvl(scrypty_mcf_nogvl, &args, &job);
+  RB_GC_GUARD(rb_hash);
+  RB_GC_GUARD(rb_password);
+  switch (args.errorcode) {
+    case 0:
+      return Qtrue;
+    case 11:
+      return Qfalse;
+    default:
+      raise_scrypty_error(args.errorcode);
   }
 
-  if (FIXNUM_P(rb_keylen)) {
-    keylen = NUM2SIZET(rb_keylen);
+  return Qnil;
+}
+
+/* Scrypty::Password.needs_rehash?(hash, profile)
+ *
+ * Return true if hash was made with parameters other than profile's, so
+ * that the password should be hashed again with create the next time it
+ * is verified.  Raises Scrypty::UnrecognizedFormatError if hash can't be
+ * parsed. */
+static VALUE
+scrypty_password_needs_rehash_p(rb_obj, rb_hash, rb_profile)
+  VALUE rb_obj;
+  VALUE rb_hash;
+  VALUE rb_profile;
+{
+  struct scryptenc_profile profile;
+  struct scryptenc_mcf mcf;
+  int errorcode;
+
+  if (TYPE(rb_hash) != T_STRING) {
+    rb_raise(rb_eTypeError, "first argument (hash) must be a String");
   }
-  else {
-    rb_raise(rb_eTypeError, "sixth argument (keylen) must be a Fixnum");
+  scrypty_get_profile(1, &rb_profile, 1, &profile);
+
+  errorcode = scrypty_mcf_parse(RSTRING_PTR(rb_hash),
+      (size_t) RSTRING_LEN(rb_hash), &mcf);
+  if (errorcode) {
+    raise_scrypty_error(errorcode);
   }
 
-  rb_dk = rb_str_buf_new(keylen);
-  dk = (uint8_t *) RSTRING_PTR(rb_dk);
+  return (mcf.logN != profile.logN || mcf.r != profile.r ||
+      mcf.p != profile.p) ? Qtrue : Qfalse;
+}
 
-  if (scrypty_crypto_scrypt(password, password_len, salt,
-        salt_len, N, r, p, dk, keylen) != 0) {
+struct scrypty_tune_args {
+  double target;
+  size_t maxmem;
+  double tolerance;
+  struct scryptenc_profile profile;
+  int errorcode;
+};
 
-    switch (errno) {
-      case EFBIG:
-        rb_raise(rb_eRuntimeError, "parameters were too big");
-        break;
+static void *
+scrypty_tune_nogvl(ptr)
+  void *ptr;
+{
+  struct scrypty_tune_args *args = ptr;
 
-      case EINVAL:
-        rb_raise(rb_eRuntimeError, "parameters were invalid");
-        break;
+  args->errorcode = scrypty_scryptenc_tune(args->target, args->maxmem,
+      args->tolerance, &args->profile);
 
-      case ENOMEM:
-        rb_raise(rb_eNoMemError, "not enough memory to create derived key");
-        break;
+  return NULL;
+}
 
-      default:
-        rb_raise(rb_eRuntimeError, "%s", strerror(errno));
-    }
+/* Build a Profile from real timed derivations on this host:
+ *
+ *   Scrypty.tune(target_seconds: 1.0, max_memory: 2 ** 30, tolerance: 0.1)
+ *
+ * max_memory defaults to 0 (half of the available memory) and tolerance,
+ * the accepted relative error of the derivation time, to 0.1. */
+static VALUE
+scrypty_tune(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
+  VALUE rb_obj;
+{
+  VALUE rb_opts, rb_values[3], rb_profile;
+  struct scrypty_tune_args args;
+  struct scryptenc_profile *profile;
+
+  rb_scan_args(argc, argv, ":", &rb_opts);
+  rb_get_kwargs(rb_opts, scrypty_tune_kwargs, 1, 2, rb_values);
+
+  args.target = NUM2DBL(rb_values[0]);
+  args.maxmem = rb_values[1] == Qundef ? 0 : NUM2SIZET(rb_values[1]);
+  args.tolerance = rb_values[2] == Qundef ? 0.1 : NUM2DBL(rb_values[2]);
+  if (!(args.target > 0)) {
+    rb_raise(rb_eArgError, "target_seconds must be positive");
+  }
+  if (!(args.tolerance >= 0)) {
+    rb_raise(rb_eArgError, "tolerance must not be negative");
   }
 
-  rb_str_set_len(rb_dk, keylen);
-  return rb_dk;
+  rb_thread_call_without_gvl(scrypty_tune_nogvl, &args, NULL, NULL);
+  scrypty_gc_settle(0);
+  if (args.errorcode) {
+    raise_scrypty_error(args.errorcode);
+  }
+
+  rb_profile = scrypty_profile_alloc(cProfile);
+  TypedData_Get_Struct(rb_profile, struct scryptenc_profile,
+      &scrypty_profile_type, profile);
+  *profile = args.profile;
+
+  return rb_obj_freeze(rb_profile);
 }
 
-VALUE
-scrypty_encrypt_raw(rb_obj, rb_data, rb_dk)
+/* Scrypty.set_memory_budget(bytes, policy = :fifo)
+ *
+ * Limit the total size of the V arrays of all key derivations in the
+ * process to bytes (nil or 0 for no limit).  Derivations which don't fit
+ * wait, and are given memory in order of arrival (:fifo) or highest
+ * priority first (:priority). */
+static VALUE
+scrypty_set_memory_budget(argc, argv, rb_obj)
+  int argc;
+  VALUE *argv;
   VALUE rb_obj;
-  VALUE rb_data;
-  VALUE rb_dk;
 {
-  VALUE rb_out;
-  uint8_t *data, *dk, *out, *key_enc, *key_hmac;
-  uint8_t hbuf[32];
-  size_t data_len;
-  scrypty_HMAC_SHA256_CTX hctx;
-  AES_KEY key_enc_exp;
-  struct crypto_aesctr *AES;
+  VALUE rb_limit, rb_policy;
+  int policy;
 
-  if (TYPE(rb_data) == T_STRING) {
-    data = (uint8_t *) RSTRING_PTR(rb_data);
-    data_len = (size_t) RSTRING_LEN(rb_data);
-  }
-  else {
-    rb_raise(rb_eTypeError, "first argument (data) must be a String");
-  }
+  rb_scan_args(argc, argv, "11", &rb_limit, &rb_policy);
 
-  if (TYPE(rb_dk) == T_STRING) {
-    dk = (uint8_t *) RSTRING_PTR(rb_dk);
+  if (NIL_P(rb_policy) || SYM2ID(rb_policy) == rb_intern("fifo")) {
+    policy = BUDGET_FIFO;
+  }
+  else if (SYM2ID(rb_policy) == rb_intern("priority")) {
+    policy = BUDGET_PRIORITY;
   }
   else {
-    rb_raise(rb_eTypeError, "second argument (dk) must be a String");
+    rb_raise(rb_eArgError, "policy must be :fifo or :priority");
   }
-  key_enc = dk;
-  key_hmac = &dk[32];
 
-  rb_out = rb_str_buf_new(data_len + 32);
-  out = (uint8_t *) RSTRING_PTR(rb_out);
+  scrypty_budget_set(NIL_P(rb_limit) ? 0 : NUM2SIZET(rb_limit), policy);
+  return Qnil;
+}
+
+/* Scrypty.memory_budget
+ *
+ * Return the state of the memory budget: its :limit (0 for none) and
+ * :policy, the bytes :in_use, the number of derivations :waiting now and
+ * at most (:max_waiting), and counts of derivations which were granted
+ * memory (:acquired), had to wait (:waits) or gave up (:timeouts), with
+ * the total time spent waiting (:wait_ns).  :held is the size of all the V
+ * arrays allocated now, including those threads keep for reuse, which is
+ * what Ruby's GC is told about; unlike :in_use it doesn't wait on the
+ * budget. */
+static VALUE
+scrypty_memory_budget(rb_obj)
+  VALUE rb_obj;
+{
+  struct scryptenc_budget_stats stats;
+  VALUE rb_budget;
+
+  scrypty_budget_stats(&stats);
+
+  rb_budget = rb_hash_new();
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("limit")), SIZET2NUM(stats.limit));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("policy")), ID2SYM(rb_intern(
+      stats.policy == BUDGET_PRIORITY ? "priority" : "fifo")));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("in_use")), SIZET2NUM(stats.inuse));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("waiting")), ULL2NUM(stats.waiting));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("max_waiting")), ULL2NUM(stats.maxwaiting));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("acquired")), ULL2NUM(stats.acquired));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("waits")), ULL2NUM(stats.waits));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("timeouts")), ULL2NUM(stats.timeouts));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("wait_ns")), ULL2NUM(stats.wait_ns));
+  rb_hash_aset(rb_budget, ID2SYM(rb_intern("held")), SIZET2NUM(scrypty_mem_held()));
+
+  return rb_budget;
+}
 
-  /* Encrypt data. */
-  if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
-    rb_raise(eOpenSSLError, "OpenSSL error");
+/* Scrypty.set_scheduler(workers)
+ *
+ * Run the key derivations of encrypt, decrypt, dk and friends on a fixed
+ * set of workers native threads, most urgent priority: class first and
+ * earliest deadline: first within a class, rather than on the calling
+ * thread.  nil or 0 finishes the queued derivations and stops the
+ * workers. */
+static VALUE
+scrypty_set_scheduler(rb_obj, rb_workers)
+  VALUE rb_obj;
+  VALUE rb_workers;
+{
+  size_t workers;
 
-  if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL)
-    rb_raise(rb_eNoMemError, "couldn't allocate memory");
+  workers = NIL_P(rb_workers) ? 0 : NUM2SIZET(rb_workers);
+  if (scrypty_sched_set(workers)) {
+    rb_sys_fail("pthread_create");
+  }
+  return Qnil;
+}
 
-  scrypty_crypto_aesctr_stream(AES, data, out, data_len);
-  scrypty_crypto_aesctr_free(AES);
+/* Scrypty.set_cipher_threads(threads)
+ *
+ * Split the AES-CTR of buffers and regular files of 4 MiB or more, and of
+ * all pipes, in the existing format over threads native threads, with the HMAC computed on
+ * another thread as the ciphertext comes through; the output is the same
+ * byte for byte.  nil or 0 does everything on the calling thread. */
+static VALUE
+scrypty_set_cipher_threads(rb_obj, rb_threads)
+  VALUE rb_obj;
+  VALUE rb_threads;
+{
+  scrypty_pipe_set(NIL_P(rb_threads) ? 0 : NUM2SIZET(rb_threads));
+  return Qnil;
+}
 
-  /* Add signature. */
-  scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
-  scrypty_HMAC_SHA256_Update(&hctx, out, data_len);
-  scrypty_HMAC_SHA256_Final(hbuf, &hctx);
-  memcpy(&out[data_len], hbuf, 32);
+/* Scrypty.cipher_threads
+ *
+ * Return the number of threads set with set_cipher_threads. */
+static VALUE
+scrypty_cipher_threads(rb_obj)
+  VALUE rb_obj;
+{
+  return SIZET2NUM(scrypty_pipe_get());
+}
 
-  rb_str_set_len(rb_out, data_len + 32);
-  return rb_out;
+/* Scrypty.set_inflate_ratio(ratio)
+ *
+ * Make decrypting compressed data raise Scrypty::CompressionError once it
+ * has inflated to more than 16 MiB and more than ratio times its compressed
+ * size (1024 unless set), rather than allocating or writing whatever it
+ * expands to.  nil or 0 removes the limit. */
+static VALUE
+scrypty_set_inflate_ratio(rb_obj, rb_ratio)
+  VALUE rb_obj;
+  VALUE rb_ratio;
+{
+  scrypty_compress_set_ratio(NIL_P(rb_ratio) ? 0 : NUM2SIZET(rb_ratio));
+  return Qnil;
 }
 
-VALUE
-scrypty_decrypt_raw(rb_obj, rb_data, rb_dk)
+/* Scrypty.inflate_ratio
+ *
+ * Return the ratio set with set_inflate_ratio (0 for no limit). */
+static VALUE
+scrypty_inflate_ratio(rb_obj)
   VALUE rb_obj;
-  VALUE rb_data;
-  VALUE rb_dk;
 {
-  VALUE rb_out;
-  uint8_t *data, *dk, *out, *key_enc, *key_hmac;
-  uint8_t hbuf[32];
-  size_t data_len;
-  scrypty_HMAC_SHA256_CTX hctx;
-  AES_KEY key_enc_exp;
-  struct crypto_aesctr *AES;
+  return SIZET2NUM(scrypty_compress_get_ratio());
+}
 
-  if (TYPE(rb_data) == T_STRING) {
-    data = (uint8_t *) RSTRING_PTR(rb_data);
-    data_len = (size_t) RSTRING_LEN(rb_data);
+/* Scrypty.set_entropy_seed(seed)
+ *
+ * Derive every salt from the String seed instead of the operating system,
+ * so that encrypting the same data gives the same output from run to run.
+ * This is only for reproducible benchmarks and tests: anything encrypted
+ * meanwhile has predictable salts.  nil goes back to the operating
+ * system. */
+static VALUE
+scrypty_set_entropy_seed(rb_obj, rb_seed)
+  VALUE rb_obj;
+  VALUE rb_seed;
+{
+  if (NIL_P(rb_seed)) {
+    scrypty_entropy_seed(NULL, 0);
   }
   else {
-    rb_raise(rb_eTypeError, "first argument (data) must be a String");
+    StringValue(rb_seed);
+    scrypty_entropy_seed((const uint8_t *) RSTRING_PTR(rb_seed),
+        (size_t) RSTRING_LEN(rb_seed));
   }
+  return Qnil;
+}
+
+static const char *scrypty_sched_classes[SCRYPTY_SCHED_NCLASSES] = {
+  "interactive", "normal", "batch"
+};
 
-  if (TYPE(rb_dk) == T_STRING) {
-    dk = (uint8_t *) RSTRING_PTR(rb_dk);
+/* Scrypty.scheduler
+ *
+ * Return the number of :workers, the number of NUMA :nodes they are spread
+ * over, and for each class (:interactive,
+ * :normal and :batch) a Hash of the derivations :queued now, :submitted,
+ * :completed, and completed after their deadline (:missed), with the
+ * total and longest time they waited in the queue (:wait_ns and
+ * :max_wait_ns). */
+static VALUE
+scrypty_scheduler(rb_obj)
+  VALUE rb_obj;
+{
+  struct scryptenc_sched_stats stats;
+  VALUE rb_sched, rb_class;
+  int i;
+
+  scrypty_sched_stats(&stats);
+
+  rb_sched = rb_hash_new();
+  rb_hash_aset(rb_sched, ID2SYM(rb_intern("workers")), SIZET2NUM(stats.workers));
+  rb_hash_aset(rb_sched, ID2SYM(rb_intern("nodes")), SIZET2NUM(stats.nodes));
+  for (i = 0; i < SCRYPTY_SCHED_NCLASSES; i++) {
+    rb_class = rb_hash_new();
+    rb_hash_aset(rb_class, ID2SYM(rb_intern("queued")), ULL2NUM(stats.queued[i]));
+    rb_hash_aset(rb_class, ID2SYM(rb_intern("submitted")), ULL2NUM(stats.submitted[i]));
+    rb_hash_aset(rb_class, ID2SYM(rb_intern("completed")), ULL2NUM(stats.completed[i]));
+    rb_hash_aset(rb_class, ID2SYM(rb_intern("missed")), ULL2NUM(stats.missed[i]));
+    rb_hash_aset(rb_class, ID2SYM(rb_intern("wait_ns")), ULL2NUM(stats.wait_ns[i]));
+    rb_hash_aset(rb_class, ID2SYM(rb_intern("max_wait_ns")), ULL2NUM(stats.maxwait_ns[i]));
+    rb_hash_aset(rb_sched, ID2SYM(rb_intern(scrypty_sched_classes[i])), rb_class);
   }
-  else {
-    rb_raise(rb_eTypeError, "second argument (dk) must be a String");
+
+  return rb_sched;
+}
+
+static const char *scrypty_stats_ops[STATS_NOPS] = {
+  "encrypt", "decrypt", "encrypt_file", "decrypt_file", "dk",
+  "encrypt_raw", "decrypt_raw", "verify", "verify_file", "reencrypt",
+  "reencrypt_file", "log_append", "password_create", "password_verify"
+};
+
+static const char *scrypty_stats_phases[STATS_NPHASES] = {
+  "calibration", "memtouse", "kdf", "aes", "hmac", "io", "queue",
+  "compress"
+};
+
+static VALUE
+scrypty_stats_hash(names, values, n)
+  const char **names;
+  const uint64_t *values;
+  int n;
+{
+  VALUE rb_hash;
+  int i;
+
+  rb_hash = rb_hash_new();
+  for (i = 0; i < n; i++) {
+    rb_hash_aset(rb_hash, ID2SYM(rb_intern(names[i])), ULL2NUM(values[i]));
   }
-  key_enc = dk;
-  key_hmac = &dk[32];
+  return rb_hash;
+}
 
-  rb_out = rb_str_buf_new(data_len - 32);
-  out = (uint8_t *) RSTRING_PTR(rb_out);
+/*
+ * Return the counters kept since the extension was loaded, or since the last
+ * call to Scrypty.stats_reset, summed over all threads.  Phase histograms
+ * are arrays of counts where element i counts durations of 2^i up to
+ * 2^(i+1) nanoseconds.
+ */
+static VALUE
+scrypty_stats(rb_obj)
+  VALUE rb_obj;
+{
+  struct scryptenc_stats stats;
+  VALUE rb_stats, rb_phases, rb_phase, rb_hist, rb_errors, rb_calibration;
+  int i, j;
 
-  /* Decrypt data. */
-  if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
-    rb_raise(eOpenSSLError, "OpenSSL error");
-  if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL)
-    rb_raise(rb_eNoMemError, "couldn't allocate memory");
+  scrypty_stats_snapshot(&stats);
 
-  scrypty_crypto_aesctr_stream(AES, data, out, data_len - 32);
-  scrypty_crypto_aesctr_free(AES);
+  rb_phases = rb_hash_new();
+  for (i = 0; i < STATS_NPHASES; i++) {
+    rb_hist = rb_ary_new_capa(STATS_NBUCKETS);
+    for (j = 0; j < STATS_NBUCKETS; j++) {
+      rb_ary_push(rb_hist, ULL2NUM(stats.phase_hist[i][j]));
+    }
+    rb_phase = rb_hash_new();
+    rb_hash_aset(rb_phase, ID2SYM(rb_intern("count")), ULL2NUM(stats.phase_count[i]));
+    rb_hash_aset(rb_phase, ID2SYM(rb_intern("total_ns")), ULL2NUM(stats.phase_ns[i]));
+    rb_hash_aset(rb_phase, ID2SYM(rb_intern("histogram")), rb_hist);
+    rb_hash_aset(rb_phases, ID2SYM(rb_intern(scrypty_stats_phases[i])), rb_phase);
+  }
 
-  /* Verify signature. */
-  scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
-  scrypty_HMAC_SHA256_Update(&hctx, data, data_len - 32);
-  scrypty_HMAC_SHA256_Final(hbuf, &hctx);
-  if (memcmp(hbuf, &data[data_len - 32], 32))
-    rb_raise(eInvalidBlockError, "data is not a valid scrypt-encrypted block");
+  rb_errors = rb_hash_new();
+  for (i = 1; i < STATS_NERRORS; i++) {
+    if (stats.errors[i] != 0) {
+      rb_hash_aset(rb_errors, INT2FIX(i), ULL2NUM(stats.errors[i]));
+    }
+  }
 
-  rb_str_set_len(rb_out, data_len - 32);
-  return rb_out;
+  rb_calibration = rb_hash_new();
+  rb_hash_aset(rb_calibration, ID2SYM(rb_intern("count")), ULL2NUM(stats.calibrations));
+  rb_hash_aset(rb_calibration, ID2SYM(rb_intern("last_opps")),
+      stats.calibrations ? DBL2NUM(stats.opps) : Qnil);
+
+  rb_stats = rb_hash_new();
+  rb_hash_aset(rb_stats, ID2SYM(rb_intern("operations")),
+      scrypty_stats_hash(scrypty_stats_ops, stats.ops, STATS_NOPS));
+  rb_hash_aset(rb_stats, ID2SYM(rb_intern("bytes")),
+      scrypty_stats_hash(scrypty_stats_ops, stats.bytes, STATS_NOPS));
+  rb_hash_aset(rb_stats, ID2SYM(rb_intern("phases")), rb_phases);
+  rb_hash_aset(rb_stats, ID2SYM(rb_intern("v_bytes")), ULL2NUM(stats.vbytes));
+  rb_hash_aset(rb_stats, ID2SYM(rb_intern("errors")), rb_errors);
+  rb_hash_aset(rb_stats, ID2SYM(rb_intern("calibration")), rb_calibration);
+
+  return rb_stats;
+}
+
+static VALUE
+scrypty_stats_reset_m(rb_obj)
+  VALUE rb_obj;
+{
+  scrypty_stats_reset();
+  return Qnil;
 }
 
 void
 Init_scrypty_ext(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /* Nothing here keeps per-process Ruby state beyond the classes defined
+   * below, and the C library guards its own, so any Ractor may call in. */
+  rb_ext_ractor_safe(true);
+#endif
+
+  scrypty_job_kwargs[0] = rb_intern("priority");
+  scrypty_job_kwargs[1] = rb_intern("timeout");
+  scrypty_job_kwargs[2] = rb_intern("deadline");
+  scrypty_job_kwargs[3] = rb_intern("compress");
+  scrypty_job_kwargs[4] = rb_intern("out");
+  scrypty_log_kwargs[0] = rb_intern("checkpoint_bytes");
+  scrypty_log_kwargs[1] = rb_intern("checkpoint_records");
+  scrypty_tune_kwargs[0] = rb_intern("target_seconds");
+  scrypty_tune_kwargs[1] = rb_intern("max_memory");
+  scrypty_tune_kwargs[2] = rb_intern("tolerance");
+
   mScrypty = rb_define_module("Scrypty");
-  rb_define_singleton_method(mScrypty, "encrypt", scrypty_encrypt_buffer, 5);
-  rb_define_singleton_method(mScrypty, "decrypt", scrypty_decrypt_buffer, 5);
-  rb_define_singleton_method(mScrypty, "encrypt_file", scrypty_encrypt_file, 6);
-  rb_define_singleton_method(mScrypty, "decrypt_file", scrypty_decrypt_file, 6);
+  rb_define_singleton_method(mScrypty, "encrypt", scrypty_encrypt_buffer, -1);
+  rb_define_singleton_method(mScrypty, "decrypt", scrypty_decrypt_buffer, -1);
+  rb_define_singleton_method(mScrypty, "encrypt_file", scrypty_encrypt_file, -1);
+  rb_define_singleton_method(mScrypty, "decrypt_file", scrypty_decrypt_file, -1);
+  rb_define_singleton_method(mScrypty, "encrypt_batch", scrypty_encrypt_batch, -1);
+  rb_define_singleton_method(mScrypty, "decrypt_batch", scrypty_decrypt_batch, -1);
+  rb_define_singleton_method(mScrypty, "reencrypt", scrypty_reencrypt, -1);
+  rb_define_singleton_method(mScrypty, "reencrypt_file", scrypty_reencrypt_file, -1);
+  rb_define_singleton_method(mScrypty, "encrypt_tree", scrypty_encrypt_tree, -1);
+  rb_define_singleton_method(mScrypty, "decrypt_tree", scrypty_decrypt_tree, -1);
+  rb_define_singleton_method(mScrypty, "verify", scrypty_verify, -1);
+  rb_define_singleton_method(mScrypty, "verify_file", scrypty_verify_file, -1);
+  rb_define_singleton_method(mScrypty, "verify_files", scrypty_verify_files, -1);
+  rb_define_singleton_method(mScrypty, "header", scrypty_header, 1);
+  rb_define_singleton_method(mScrypty, "password_ok?", scrypty_password_ok, -1);
   rb_define_singleton_method(mScrypty, "memlimit", scrypty_memlimit, 2);
   rb_define_singleton_method(mScrypty, "opslimit", scrypty_opslimit, 1);
   rb_define_singleton_method(mScrypty, "params", scrypty_params, 2);
-  rb_define_singleton_method(mScrypty, "dk", scrypty_dk, 6);
+  rb_define_singleton_method(mScrypty, "dk", scrypty_dk, -1);
   rb_define_singleton_method(mScrypty, "encrypt_raw", scrypty_encrypt_raw, 2);
   rb_define_singleton_method(mScrypty, "decrypt_raw", scrypty_decrypt_raw, 2);
+  rb_define_singleton_method(mScrypty, "tune", scrypty_tune, -1);
+  rb_define_singleton_method(mScrypty, "set_memory_budget", scrypty_set_memory_budget, -1);
+  rb_define_singleton_method(mScrypty, "memory_budget", scrypty_memory_budget, 0);
+  rb_define_singleton_method(mScrypty, "set_scheduler", scrypty_set_scheduler, 1);
+  rb_define_singleton_method(mScrypty, "scheduler", scrypty_scheduler, 0);
+  rb_define_singleton_method(mScrypty, "set_cipher_threads", scrypty_set_cipher_threads, 1);
+  rb_define_singleton_method(mScrypty, "cipher_threads", scrypty_cipher_threads, 0);
+  rb_define_singleton_method(mScrypty, "set_inflate_ratio", scrypty_set_inflate_ratio, 1);
+  rb_define_singleton_method(mScrypty, "inflate_ratio", scrypty_inflate_ratio, 0);
+  rb_define_singleton_method(mScrypty, "set_entropy_seed", scrypty_set_entropy_seed, 1);
+  rb_define_singleton_method(mScrypty, "stats", scrypty_stats, 0);
+  rb_define_singleton_method(mScrypty, "stats_reset", scrypty_stats_reset_m, 0);
 
   eScryptyError = rb_define_class_under(mScrypty, "Exception", rb_eException);
   eMemoryLimitError = rb_define_class_under(mScrypty, "MemoryLimitError", eScryptyError);
@@ -666,4 +3315,48 @@ Init_scrypty_ext(void)
   eIncorrectPasswordError = rb_define_class_under(mScrypty, "IncorrectPasswordError", eScryptyError);
   eWriteError = rb_define_class_under(mScrypty, "WriteError", eScryptyError);
   eReadError = rb_define_class_under(mScrypty, "ReadError", eScryptyError);
+  eMemoryBudgetTimeoutError = rb_define_class_under(mScrypty, "MemoryBudgetTimeoutError", eScryptyError);
+  eCompressionError = rb_define_class_under(mScrypty, "CompressionError", eScryptyError);
+  eCancelledError = rb_define_class_under(mScrypty, "CancelledError", eScryptyError);
+  eLockedError = rb_define_class_under(mScrypty, "LockedError", eScryptyError);
+
+  cProfile = rb_define_class_under(mScrypty, "Profile", rb_cObject);
+  rb_define_alloc_func(cProfile, scrypty_profile_alloc);
+  rb_define_method(cProfile, "initialize", scrypty_profile_initialize, 3);
+  rb_define_singleton_method(cProfile, "from_params", scrypty_profile_from_params, -1);
+  rb_define_method(cProfile, "memlimit", scrypty_profile_memlimit, 0);
+  rb_define_method(cProfile, "opslimit", scrypty_profile_opslimit, 0);
+  rb_define_method(cProfile, "n", scrypty_profile_n, 0);
+  rb_define_method(cProfile, "r", scrypty_profile_r, 0);
+  rb_define_method(cProfile, "p", scrypty_profile_p, 0);
+  rb_define_method(cProfile, "params", scrypty_profile_params, 0);
+
+  cKey = rb_define_class_under(mScrypty, "Key", rb_cObject);
+  rb_define_alloc_func(cKey, scrypty_key_alloc);
+  rb_define_method(cKey, "initialize", scrypty_key_initialize, 1);
+  rb_define_method(cKey, "encrypt_raw", scrypty_key_encrypt_raw, 1);
+  rb_define_method(cKey, "decrypt_raw", scrypty_key_decrypt_raw, 1);
+  rb_define_method(cKey, "wipe", scrypty_key_wipe_m, 0);
+  rb_define_method(cKey, "wiped?", scrypty_key_wiped_p, 0);
+
+  cLogWriter = rb_define_class_under(mScrypty, "LogWriter", rb_cObject);
+  rb_define_alloc_func(cLogWriter, scrypty_log_alloc);
+  rb_define_method(cLogWriter, "initialize", scrypty_log_writer_initialize, -1);
+  rb_define_method(cLogWriter, "write", scrypty_log_writer_write, 1);
+  rb_define_method(cLogWriter, "<<", scrypty_log_writer_write, 1);
+  rb_define_method(cLogWriter, "checkpoint", scrypty_log_writer_checkpoint, 0);
+  rb_define_method(cLogWriter, "close", scrypty_log_close_m, 0);
+  rb_define_method(cLogWriter, "closed?", scrypty_log_closed_p, 0);
+
+  cLogReader = rb_define_class_under(mScrypty, "LogReader", rb_cObject);
+  rb_define_alloc_func(cLogReader, scrypty_log_alloc);
+  rb_define_method(cLogReader, "initialize", scrypty_log_reader_initialize, -1);
+  rb_define_method(cLogReader, "read", scrypty_log_reader_read, 0);
+  rb_define_method(cLogReader, "close", scrypty_log_close_m, 0);
+  rb_define_method(cLogReader, "closed?", scrypty_log_closed_p, 0);
+
+  mPassword = rb_define_module_under(mScrypty, "Password");
+  rb_define_singleton_method(mPassword, "create", scrypty_password_create, -1);
+  rb_define_singleton_method(mPassword, "verify", scrypty_password_verify, -1);
+  rb_define_singleton_method(mPassword, "needs_rehash?", scrypty_password_needs_rehash_p, 2);
 }
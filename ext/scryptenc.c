@@ -30,8 +30,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -40,7 +42,14 @@
 #include "crypto_aesctr.h"
 #include "crypto_scrypt.h"
 #include "memlimit.h"
+#include "scryptenc_budget.h"
+#include "scryptenc_compress.h"
 #include "scryptenc_cpuperf.h"
+#include "scryptenc_entropy.h"
+#include "scryptenc_pipe.h"
+#include "scryptenc_sched.h"
+#include "scryptenc_stats.h"
+#include "scrypty_probes.h"
 #include "sha256.h"
 #include "sysendian.h"
 
@@ -48,33 +57,28 @@
 
 #define ENCBLOCK 65536
 
-static int pickparams(size_t, double, double,
-    int *, uint32_t *, uint32_t *);
-static int checkparams(size_t, double, double, int, uint32_t, uint32_t);
+/* Verification only hashes, so it reads in larger blocks. */
+#define VERIFYBLOCK (1024 * 1024)
+
+static int checkparams(const struct scryptenc_profile *,
+    int, uint32_t, uint32_t);
 static int getsalt(uint8_t[32]);
+static int readheader(FILE *, uint8_t[96]);
 
-static int
-pickparams(size_t maxmem, double maxmemfrac, double maxtime,
+/* Returned by a sink when compressed data won't fit in the output buffer. */
+#define ZFULL (-1)
+
+/**
+ * scrypty_scryptenc_pickparams(memlimit, opslimit, logN, r, p):
+ * Choose scrypt parameters which make the derived key as strong as possible
+ * while using at most memlimit bytes of storage for the V array and at most
+ * opslimit salsa20/8 cores.
+ */
+int
+scrypty_scryptenc_pickparams(size_t memlimit, double opslimit,
     int * logN, uint32_t * r, uint32_t * p)
 {
-	size_t memlimit;
-	double opps;
-	double opslimit;
 	double maxN, maxrp;
-	int rc;
-
-	/* Figure out how much memory to use. */
-	if (scrypty_memtouse(maxmem, maxmemfrac, &memlimit))
-		return (1);
-
-	/* Figure out how fast the CPU is. */
-	if ((rc = scrypty_scryptenc_cpuperf(&opps)) != 0)
-		return (rc);
-	opslimit = opps * maxtime;
-
-	/* Allow a minimum of 2^15 salsa20/8 cores. */
-	if (opslimit < 32768)
-		opslimit = 32768;
 
 	/* Fix r = 8 for now. */
 	*r = 8;
@@ -115,93 +119,121 @@ pickparams(size_t maxmem, double maxmemfrac, double maxtime,
 	fprintf(stderr, "N = %zu r = %d p = %d\n",
 	    (size_t)(1) << *logN, (int)(*r), (int)(*p));
 #endif
+	SCRYPTY_PROBE5(pickparams, memlimit, (uint64_t)(opslimit), *logN,
+	    *r, *p);
 
 	/* Success! */
 	return (0);
 }
 
-static int
-checkparams(size_t maxmem, double maxmemfrac, double maxtime,
-    int logN, uint32_t r, uint32_t p)
+/**
+ * scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime, profile):
+ * Examine the system (available memory and CPU speed) once and fill in
+ * profile with the resulting limits and the parameters which would be
+ * picked for encryption.
+ */
+int
+scrypty_scryptenc_profile(size_t maxmem, double maxmemfrac, double maxtime,
+    struct scryptenc_profile * profile)
 {
-	size_t memlimit;
 	double opps;
-	double opslimit;
-	uint64_t N;
+	uint64_t st;
 	int rc;
 
-	/* Figure out the maximum amount of memory we can use. */
-	if (scrypty_memtouse(maxmem, maxmemfrac, &memlimit))
+	/* Figure out how much memory to use. */
+	st = scrypty_stats_now();
+	if (scrypty_memtouse(maxmem, maxmemfrac, &profile->memlimit))
 		return (1);
+	scrypty_stats_phase(STATS_MEMTOUSE, st);
 
 	/* Figure out how fast the CPU is. */
+	st = scrypty_stats_now();
 	if ((rc = scrypty_scryptenc_cpuperf(&opps)) != 0)
 		return (rc);
-	opslimit = opps * maxtime;
+	scrypty_stats_phase(STATS_CALIBRATE, st);
+	scrypty_stats_calibration(opps);
+	profile->opslimit = opps * maxtime;
+
+	/* Allow a minimum of 2^15 salsa20/8 cores. */
+	if (profile->opslimit < 32768)
+		profile->opslimit = 32768;
+
+	/* Pick values for N, r, p. */
+	return (scrypty_scryptenc_pickparams(profile->memlimit,
+	    profile->opslimit, &profile->logN, &profile->r, &profile->p));
+}
+
+/**
+ * scrypty_scryptenc_profile_params(logN, r, p, profile):
+ * Fill in profile with the explicit parameters N = 2^logN, r, and p, and
+ * with exactly the memory and CPU limits those parameters require.
+ */
+int
+scrypty_scryptenc_profile_params(int logN, uint32_t r, uint32_t p,
+    struct scryptenc_profile * profile)
+{
+	uint64_t N;
 
 	/* Sanity-check values. */
-	if ((logN < 1) || (logN > 63))
+	if ((logN < 1) || (logN > 63) || (r == 0) || (p == 0))
 		return (7);
 	if ((uint64_t)(r) * (uint64_t)(p) >= 0x40000000)
 		return (7);
-
-	/* Check limits. */
 	N = (uint64_t)(1) << logN;
-	if ((memlimit / N) / r < 128)
+	if (N > SIZE_MAX / 128 / r)
 		return (9);
-	if ((opslimit / N) / (r * p) < 4)
-		return (10);
+
+	profile->memlimit = (size_t)(128 * r * N);
+	profile->opslimit = 4.0 * N * r * p;
+	profile->logN = logN;
+	profile->r = r;
+	profile->p = p;
 
 	/* Success! */
 	return (0);
 }
 
 static int
-getsalt(uint8_t salt[32])
+checkparams(const struct scryptenc_profile * profile,
+    int logN, uint32_t r, uint32_t p)
 {
-	int fd;
-	ssize_t lenread;
-	uint8_t * buf = salt;
-	size_t buflen = 32;
-
-	/* Open /dev/urandom. */
-	if ((fd = open("/dev/urandom", O_RDONLY)) == -1)
-		goto err0;
+	uint64_t N;
+	int rc = 0;
 
-	/* Read bytes until we have filled the buffer. */
-	while (buflen > 0) {
-		if ((lenread = read(fd, buf, buflen)) == -1)
-			goto err1;
+	/* Sanity-check values. */
+	if ((logN < 1) || (logN > 63) ||
+	    ((uint64_t)(r) * (uint64_t)(p) >= 0x40000000)) {
+		rc = 7;
+		goto done;
+	}
 
-		/* The random device should never EOF. */
-		if (lenread == 0)
-			goto err1;
+	/* Check limits. */
+	N = (uint64_t)(1) << logN;
+	if ((profile->memlimit / N) / r < 128)
+		rc = 9;
+	else if ((profile->opslimit / N) / (r * p) < 4)
+		rc = 10;
+
+done:
+	SCRYPTY_PROBE4(checkparams, logN, r, p, rc);
+	return (rc);
+}
 
-		/* We're partly done. */
-		buf += lenread;
-		buflen -= lenread;
-	}
+static int
+getsalt(uint8_t salt[32])
+{
 
-	/* Close the device. */
-	while (close(fd) == -1) {
-		if (errno != EINTR)
-			goto err0;
-	}
+	if (scrypty_entropy_read(salt, 32))
+		return (4);
 
 	/* Success! */
 	return (0);
-
-err1:
-	close(fd);
-err0:
-	/* Failure! */
-	return (4);
 }
 
 static int
 scryptenc_setup(uint8_t header[96], uint8_t dk[64],
     const uint8_t * passwd, size_t passwdlen,
-    size_t maxmem, double maxmemfrac, double maxtime)
+    const struct scryptenc_profile * profile, int version)
 {
 	uint8_t salt[32];
 	uint8_t hbuf[32];
@@ -214,10 +246,10 @@ scryptenc_setup(uint8_t header[96], uint8_t dk[64],
 	scrypty_HMAC_SHA256_CTX hctx;
 	int rc;
 
-	/* Pick values for N, r, p. */
-	if ((rc = pickparams(maxmem, maxmemfrac, maxtime,
-	    &logN, &r, &p)) != 0)
-		return (rc);
+	/* Use the values for N, r, p picked by the profile. */
+	logN = profile->logN;
+	r = profile->r;
+	p = profile->p;
 	N = (uint64_t)(1) << logN;
 
 	/* Get some salt. */
@@ -225,12 +257,14 @@ scryptenc_setup(uint8_t header[96], uint8_t dk[64],
 		return (rc);
 
 	/* Generate the derived keys. */
-	if (scrypty_crypto_scrypt(passwd, passwdlen, salt, 32, N, r, p, dk, 64))
-		return (3);
+	scrypty_stats_vbytes(128 * r * N);
+	if (scrypty_sched_scrypt(passwd, passwdlen, salt, 32, N, r, p, dk, 64))
+		return ((errno == ETIMEDOUT) ? 14 :
+		    (errno == ECANCELED) ? 16 : 3);
 
 	/* Construct the file header. */
 	memcpy(header, "scrypt", 6);
-	header[6] = 0;
+	header[6] = version;
 	header[7] = logN;
 	be32enc(&header[8], r);
 	be32enc(&header[12], p);
@@ -255,44 +289,34 @@ scryptenc_setup(uint8_t header[96], uint8_t dk[64],
 static int
 scryptdec_setup(const uint8_t header[96], uint8_t dk[64],
     const uint8_t * passwd, size_t passwdlen,
-    size_t maxmem, double maxmemfrac, double maxtime)
+    const struct scryptenc_profile * profile)
 {
-	uint8_t salt[32];
+	struct scryptenc_header params;
 	uint8_t hbuf[32];
-	int logN;
-	uint32_t r;
-	uint32_t p;
 	uint64_t N;
-	scrypty_SHA256_CTX ctx;
 	uint8_t * key_hmac = &dk[32];
 	scrypty_HMAC_SHA256_CTX hctx;
 	int rc;
 
-	/* Parse N, r, p, salt. */
-	logN = header[7];
-	r = be32dec(&header[8]);
-	p = be32dec(&header[12]);
-	memcpy(salt, &header[16], 32);
-
-	/* Verify header checksum. */
-	scrypty_SHA256_Init(&ctx);
-	scrypty_SHA256_Update(&ctx, header, 48);
-	scrypty_SHA256_Final(hbuf, &ctx);
-	if (memcmp(&header[48], hbuf, 16))
-		return (7);
+	/* Parse N, r, p, salt and verify the header checksum. */
+	if ((rc = scrypty_scryptdec_header(header, 96, &params)) != 0)
+		return (rc);
 
 	/*
 	 * Check whether the provided parameters are valid and whether the
 	 * key derivation function can be computed within the allowed memory
 	 * and CPU time.
 	 */
-	if ((rc = checkparams(maxmem, maxmemfrac, maxtime, logN, r, p)) != 0)
+	if ((rc = checkparams(profile, params.logN, params.r, params.p)) != 0)
 		return (rc);
 
 	/* Compute the derived keys. */
-	N = (uint64_t)(1) << logN;
-	if (scrypty_crypto_scrypt(passwd, passwdlen, salt, 32, N, r, p, dk, 64))
-		return (3);
+	N = (uint64_t)(1) << params.logN;
+	scrypty_stats_vbytes(128 * params.r * N);
+	if (scrypty_sched_scrypt(passwd, passwdlen, params.salt, 32, N,
+	    params.r, params.p, dk, 64))
+		return ((errno == ETIMEDOUT) ? 14 :
+		    (errno == ECANCELED) ? 16 : 3);
 
 	/* Check header signature (i.e., verify password). */
 	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
@@ -306,50 +330,35 @@ scryptdec_setup(const uint8_t header[96], uint8_t dk[64],
 }
 
 /**
- * scrypty_scryptenc_buf(inbuf, inbuflen, outbuf, passwd, passwdlen,
- *     maxmem, maxmemfrac, maxtime):
- * Encrypt inbuflen bytes from inbuf, writing the resulting inbuflen + 128
- * bytes to outbuf.
+ * encbuf(header, dk, inbuf, inbuflen, outbuf):
+ * Write header, then inbuflen bytes from inbuf encrypted with dk, then the
+ * HMAC of both, to outbuf.  inbuf may be &outbuf[96].
  */
-int
-scrypty_scryptenc_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
-    const uint8_t * passwd, size_t passwdlen,
-    size_t maxmem, double maxmemfrac, double maxtime)
+static int
+encbuf(const uint8_t header[96], const uint8_t dk[64],
+    const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf)
 {
-	uint8_t dk[64];
 	uint8_t hbuf[32];
-	uint8_t header[96];
-	uint8_t * key_enc = dk;
-	uint8_t * key_hmac = &dk[32];
-	int rc;
+	const uint8_t * key_enc = dk;
+	const uint8_t * key_hmac = &dk[32];
 	scrypty_HMAC_SHA256_CTX hctx;
 	AES_KEY key_enc_exp;
-	struct crypto_aesctr * AES;
-
-	/* Generate the header and derived key. */
-	if ((rc = scryptenc_setup(header, dk, passwd, passwdlen,
-	    maxmem, maxmemfrac, maxtime)) != 0)
-		return (rc);
 
 	/* Copy header into output buffer. */
 	memcpy(outbuf, header, 96);
 
-	/* Encrypt data. */
+	/* Encrypt data, hashing the header and then the ciphertext. */
 	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
 		return (5);
-	if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL)
-		return (6);
-	scrypty_crypto_aesctr_stream(AES, inbuf, &outbuf[96], inbuflen);
-	scrypty_crypto_aesctr_free(AES);
+	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
+	scrypty_HMAC_SHA256_Update(&hctx, outbuf, 96);
+	scrypty_pipe_buf(&key_enc_exp, &hctx, inbuf, &outbuf[96], inbuflen, 0);
 
 	/* Add signature. */
-	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
-	scrypty_HMAC_SHA256_Update(&hctx, outbuf, 96 + inbuflen);
 	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
 	memcpy(&outbuf[96 + inbuflen], hbuf, 32);
 
 	/* Zero sensitive data. */
-	memset(dk, 0, 64);
 	memset(&key_enc_exp, 0, sizeof(AES_KEY));
 
 	/* Success! */
@@ -357,16 +366,258 @@ scrypty_scryptenc_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
 }
 
 /**
- * scrypty_scryptdec_buf(inbuf, inbuflen, outbuf, outlen, passwd, passwdlen,
- *     maxmem, maxmemfrac, maxtime):
+ * scrypty_scryptenc_buf_profile(inbuf, inbuflen, outbuf, passwd,
+ *     passwdlen, profile):
+ * Encrypt inbuflen bytes from inbuf, writing the resulting inbuflen + 128
+ * bytes to outbuf.
+ */
+int
+scrypty_scryptenc_buf_profile(const uint8_t * inbuf, size_t inbuflen,
+    uint8_t * outbuf, const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile)
+{
+	uint8_t dk[64];
+	uint8_t header[96];
+	int rc;
+
+	scrypty_stats_count(STATS_ENC_BUF, 1, inbuflen);
+
+	/* Generate the header and derived key. */
+	if ((rc = scryptenc_setup(header, dk, passwd, passwdlen, profile,
+	    0)) != 0)
+		return (rc);
+
+	/* Encrypt and sign the data. */
+	rc = encbuf(header, dk, inbuf, inbuflen, outbuf);
+
+	/* Zero sensitive data. */
+	memset(dk, 0, 64);
+
+	return (rc);
+}
+
+/* A buffer which compression output is appended to. */
+struct zbuf {
+	uint8_t * buf;
+	size_t len;
+	size_t cap;
+};
+
+/**
+ * zbuf_fixed(cookie, buf, buflen):
+ * Append buflen bytes from buf to the zbuf cookie, or return ZFULL if they
+ * don't fit.
+ */
+static int
+zbuf_fixed(void * cookie, const uint8_t * buf, size_t buflen)
+{
+	struct zbuf * zb = cookie;
+
+	if (buflen > zb->cap - zb->len)
+		return (ZFULL);
+	memcpy(&zb->buf[zb->len], buf, buflen);
+	zb->len += buflen;
+	return (0);
+}
+
+/**
+ * zbuf_grow(cookie, buf, buflen):
+ * Append buflen bytes from buf to the zbuf cookie, growing it as needed.
+ */
+static int
+zbuf_grow(void * cookie, const uint8_t * buf, size_t buflen)
+{
+	struct zbuf * zb = cookie;
+	uint8_t * nbuf;
+	size_t ncap;
+
+	if (buflen > zb->cap - zb->len) {
+		ncap = zb->cap;
+		do {
+			if (ncap > SIZE_MAX / 2)
+				return (6);
+			ncap *= 2;
+		} while (buflen > ncap - zb->len);
+		if ((nbuf = malloc(ncap)) == NULL)
+			return (6);
+		memcpy(nbuf, zb->buf, zb->len);
+		memset(zb->buf, 0, zb->len);
+		free(zb->buf);
+		zb->buf = nbuf;
+		zb->cap = ncap;
+	}
+	memcpy(&zb->buf[zb->len], buf, buflen);
+	zb->len += buflen;
+	return (0);
+}
+
+/**
+ * scrypty_scryptenc_buf_compress(inbuf, inbuflen, outbuf, outlen, passwd,
+ *     passwdlen, profile, compress):
+ * Compress and encrypt inbuflen bytes from inbuf, writing at most
+ * inbuflen + 128 bytes to outbuf and their number to outlen.
+ */
+int
+scrypty_scryptenc_buf_compress(const uint8_t * inbuf, size_t inbuflen,
+    uint8_t * outbuf, size_t * outlen, const uint8_t * passwd,
+    size_t passwdlen, const struct scryptenc_profile * profile, int compress)
+{
+	struct scryptenc_zstream * z;
+	struct zbuf zb;
+	uint8_t dk[64];
+	uint8_t header[96];
+	int rc = ZFULL;
+
+	if (compress == SCRYPTENC_COMPRESS_NONE) {
+		*outlen = inbuflen + 128;
+		return (scrypty_scryptenc_buf_profile(inbuf, inbuflen, outbuf,
+		    passwd, passwdlen, profile));
+	}
+	if (!scrypty_compress_supported(compress))
+		return (15);
+
+	scrypty_stats_count(STATS_ENC_BUF, 1, inbuflen);
+
+	/*
+	 * Compress into the output buffer after the header and the algorithm
+	 * byte, giving up if the result would be no smaller than the input.
+	 */
+	if (inbuflen > 1) {
+		zb.buf = &outbuf[97];
+		zb.len = 0;
+		zb.cap = inbuflen - 1;
+		if ((z = scrypty_zstream_init(compress, 1, zbuf_fixed,
+		    &zb)) == NULL)
+			return (6);
+		if ((rc = scrypty_zstream_write(z, inbuf, inbuflen)) == 0)
+			rc = scrypty_zstream_finish(z);
+		scrypty_zstream_free(z);
+		if ((rc != 0) && (rc != ZFULL))
+			return (rc);
+	}
+
+	/* Generate the header and derived key, and encrypt in place. */
+	if ((rc = scryptenc_setup(header, dk, passwd, passwdlen, profile,
+	    (rc == ZFULL) ? 0 : 1)) != 0)
+		return (rc);
+	if (header[6] == 0) {
+		rc = encbuf(header, dk, inbuf, inbuflen, outbuf);
+		*outlen = inbuflen + 128;
+	} else {
+		outbuf[96] = compress;
+		rc = encbuf(header, dk, &outbuf[96], zb.len + 1, outbuf);
+		*outlen = zb.len + 129;
+	}
+
+	/* Zero sensitive data. */
+	memset(dk, 0, 64);
+
+	return (rc);
+}
+
+/**
+ * scrypty_scryptdec_header(inbuf, inbuflen, header):
+ * Parse and checksum the header at the start of the inbuflen bytes of
+ * encrypted data in inbuf into header, without deriving any keys.
+ */
+int
+scrypty_scryptdec_header(const uint8_t * inbuf, size_t inbuflen,
+    struct scryptenc_header * header)
+{
+	uint8_t hbuf[32];
+	scrypty_SHA256_CTX ctx;
+
+	/* Check the magic, the format and the header length. */
+	if ((inbuflen < 7) || (memcmp(inbuf, "scrypt", 6) != 0))
+		return (7);
+	if (inbuf[6] > SCRYPTENC_VERSION_LOG)
+		return (8);
+	if (inbuflen < 96)
+		return (7);
+
+	/* Parse N, r, p, salt. */
+	header->version = inbuf[6];
+	header->logN = inbuf[7];
+	header->r = be32dec(&inbuf[8]);
+	header->p = be32dec(&inbuf[12]);
+	memcpy(header->salt, &inbuf[16], 32);
+
+	/* Verify header checksum. */
+	scrypty_SHA256_Init(&ctx);
+	scrypty_SHA256_Update(&ctx, inbuf, 48);
+	scrypty_SHA256_Final(hbuf, &ctx);
+	if (memcmp(&inbuf[48], hbuf, 16))
+		return (7);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * scrypty_scryptenc_keys(header, dk, passwd, passwdlen, profile, version):
+ * Derive dk from passwd and a new salt, and write the header for it.
+ */
+int
+scrypty_scryptenc_keys(uint8_t header[96], uint8_t dk[64],
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile, int version)
+{
+
+	return (scryptenc_setup(header, dk, passwd, passwdlen, profile,
+	    version));
+}
+
+/**
+ * scrypty_scryptdec_keys(header, dk, passwd, passwdlen, profile):
+ * Derive dk from passwd and the salt in header, and check it.
+ */
+int
+scrypty_scryptdec_keys(const uint8_t header[96], uint8_t dk[64],
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile)
+{
+
+	return (scryptdec_setup(header, dk, passwd, passwdlen, profile));
+}
+
+/**
+ * scrypty_scryptdec_password(inbuf, inbuflen, passwd, passwdlen, profile):
+ * Check that passwd is the password for the encrypted data whose header is
+ * at the start of inbuf, by deriving the keys and checking the header HMAC
+ * only; return 11 if it is not.
+ */
+int
+scrypty_scryptdec_password(const uint8_t * inbuf, size_t inbuflen,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile)
+{
+	struct scryptenc_header params;
+	uint8_t dk[64];
+	int rc;
+
+	/* Check the header before spending time on the keys. */
+	if ((rc = scrypty_scryptdec_header(inbuf, inbuflen, &params)) != 0)
+		return (rc);
+
+	rc = scryptdec_setup(inbuf, dk, passwd, passwdlen, profile);
+
+	/* Zero sensitive data. */
+	memset(dk, 0, 64);
+
+	return (rc);
+}
+
+/**
+ * scrypty_scryptdec_buf_profile(inbuf, inbuflen, outbuf, outlen, passwd,
+ *     passwdlen, profile):
  * Decrypt inbuflen bytes fro inbuf, writing the result into outbuf and the
  * decrypted data length to outlen.  The allocated length of outbuf must
  * be at least inbuflen.
  */
 int
-scrypty_scryptdec_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
-    size_t * outlen, const uint8_t * passwd, size_t passwdlen,
-    size_t maxmem, double maxmemfrac, double maxtime)
+scrypty_scryptdec_buf_profile(const uint8_t * inbuf, size_t inbuflen,
+    uint8_t * outbuf, size_t * outlen, const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile)
 {
 	uint8_t hbuf[32];
 	uint8_t dk[64];
@@ -375,7 +626,8 @@ scrypty_scryptdec_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
 	int rc;
 	scrypty_HMAC_SHA256_CTX hctx;
 	AES_KEY key_enc_exp;
-	struct crypto_aesctr * AES;
+
+	scrypty_stats_count(STATS_DEC_BUF, 1, inbuflen);
 
 	/*
 	 * All versions of the scrypt format will start with "scrypt" and
@@ -393,22 +645,19 @@ scrypty_scryptdec_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
 		return (7);
 
 	/* Parse the header and generate derived keys. */
-	if ((rc = scryptdec_setup(inbuf, dk, passwd, passwdlen,
-	    maxmem, maxmemfrac, maxtime)) != 0)
+	if ((rc = scryptdec_setup(inbuf, dk, passwd, passwdlen, profile)) != 0)
 		return (rc);
 
-	/* Decrypt data. */
+	/* Decrypt data, hashing the header and then the ciphertext. */
 	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
 		return (5);
-	if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL)
-		return (6);
-	scrypty_crypto_aesctr_stream(AES, &inbuf[96], outbuf, inbuflen - 128);
-	scrypty_crypto_aesctr_free(AES);
+	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
+	scrypty_HMAC_SHA256_Update(&hctx, inbuf, 96);
+	scrypty_pipe_buf(&key_enc_exp, &hctx, &inbuf[96], outbuf,
+	    inbuflen - 128, 1);
 	*outlen = inbuflen - 128;
 
 	/* Verify signature. */
-	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
-	scrypty_HMAC_SHA256_Update(&hctx, inbuf, inbuflen - 32);
 	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
 	if (memcmp(hbuf, &inbuf[inbuflen - 32], 32))
 		return (7);
@@ -422,60 +671,223 @@ scrypty_scryptdec_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
 }
 
 /**
- * scrypty_scryptenc_file(infile, outfile, passwd, passwdlen,
- *     maxmem, maxmemfrac, maxtime):
- * Read a stream from infile and encrypt it, writing the resulting stream to
- * outfile.
+ * scrypty_scryptdec_buf_alloc(inbuf, inbuflen, outbuf, outlen, passwd,
+ *     passwdlen, profile):
+ * Check and decrypt (and for version 1, decompress) inbuflen bytes from
+ * inbuf into a buffer allocated with malloc, storing it in outbuf and its
+ * length in outlen.
  */
 int
-scrypty_scryptenc_file(FILE * infile, FILE * outfile,
-    const uint8_t * passwd, size_t passwdlen,
-    size_t maxmem, double maxmemfrac, double maxtime)
+scrypty_scryptdec_buf_alloc(const uint8_t * inbuf, size_t inbuflen,
+    uint8_t ** outbuf, size_t * outlen, const uint8_t * passwd,
+    size_t passwdlen, const struct scryptenc_profile * profile)
 {
 	uint8_t buf[ENCBLOCK];
-	uint8_t dk[64];
 	uint8_t hbuf[32];
-	uint8_t header[96];
+	uint8_t dk[64];
 	uint8_t * key_enc = dk;
 	uint8_t * key_hmac = &dk[32];
-	size_t readlen;
 	scrypty_HMAC_SHA256_CTX hctx;
 	AES_KEY key_enc_exp;
-	struct crypto_aesctr * AES;
+	struct crypto_aesctr * AES = NULL;
+	struct scryptenc_zstream * z = NULL;
+	struct zbuf zb;
+	size_t pos, end, len;
+	uint64_t st;
 	int rc;
 
-	/* Generate the header and derived key. */
-	if ((rc = scryptenc_setup(header, dk, passwd, passwdlen,
-	    maxmem, maxmemfrac, maxtime)) != 0)
+	scrypty_stats_count(STATS_DEC_BUF, 1, inbuflen);
+	*outbuf = NULL;
+	*outlen = 0;
+
+	/* Check the magic, the format and the minimum length. */
+	if ((inbuflen < 7) || (memcmp(inbuf, "scrypt", 6) != 0))
+		return (7);
+	if (inbuf[6] > 1)
+		return (8);
+	if ((inbuflen < 128) || ((inbuf[6] == 1) && (inbuflen < 129)))
+		return (7);
+
+	/* Parse the header and generate derived keys. */
+	if ((rc = scryptdec_setup(inbuf, dk, passwd, passwdlen, profile)) != 0)
 		return (rc);
 
-	/* Hash and write the header. */
+	/* Verify signature before decrypting anything. */
+	st = scrypty_stats_now();
 	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
-	scrypty_HMAC_SHA256_Update(&hctx, header, 96);
-	if (fwrite(header, 96, 1, outfile) != 1)
-		return (12);
-
-	/*
-	 * Read blocks of data, encrypt them, and write them out; hash the
-	 * data as it is produced.
-	 */
-	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
-		return (5);
-	if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL)
+	scrypty_HMAC_SHA256_Update(&hctx, inbuf, inbuflen - 32);
+	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
+	scrypty_stats_phase(STATS_HMAC, st);
+	if (memcmp(hbuf, &inbuf[inbuflen - 32], 32)) {
+		rc = 7;
+		goto err0;
+	}
+
+	/* Version 1 data inflates to an unknown size; start at twice. */
+	zb.len = 0;
+	zb.cap = (inbuflen - 128) * (inbuf[6] + 1);
+	if (zb.cap == 0)
+		zb.cap = 1;
+	if ((zb.buf = malloc(zb.cap)) == NULL) {
+		rc = 6;
+		goto err0;
+	}
+
+	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp)) {
+		rc = 5;
+		goto err1;
+	}
+	if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL) {
+		rc = 6;
+		goto err1;
+	}
+
+	/* Decrypt in blocks, inflating them if the data was compressed. */
+	pos = 96;
+	end = inbuflen - 32;
+	if (inbuf[6] == 1) {
+		scrypty_crypto_aesctr_stream(AES, &inbuf[pos], buf, 1);
+		pos += 1;
+		if (!scrypty_compress_supported(buf[0])) {
+			rc = 8;
+			goto err1;
+		}
+		if ((z = scrypty_zstream_init(buf[0], 0, zbuf_grow,
+		    &zb)) == NULL) {
+			rc = 6;
+			goto err1;
+		}
+	}
+	for (; pos < end; pos += len) {
+		len = (end - pos > ENCBLOCK) ? ENCBLOCK : end - pos;
+		st = scrypty_stats_now();
+		scrypty_crypto_aesctr_stream(AES, &inbuf[pos], buf, len);
+		scrypty_stats_phase(STATS_AES, st);
+		if (z != NULL)
+			rc = scrypty_zstream_write(z, buf, len);
+		else
+			rc = zbuf_grow(&zb, buf, len);
+		if (rc != 0)
+			goto err1;
+	}
+	if ((z != NULL) && ((rc = scrypty_zstream_finish(z)) != 0))
+		goto err1;
+
+	/* Success! */
+	*outbuf = zb.buf;
+	*outlen = zb.len;
+	rc = 0;
+	goto done;
+
+err1:
+	memset(zb.buf, 0, zb.len);
+	free(zb.buf);
+done:
+	if (z != NULL)
+		scrypty_zstream_free(z);
+	if (AES != NULL)
+		scrypty_crypto_aesctr_free(AES);
+	memset(buf, 0, sizeof(buf));
+	memset(&key_enc_exp, 0, sizeof(AES_KEY));
+err0:
+	memset(dk, 0, 64);
+	return (rc);
+}
+
+/**
+ * encstream(key, hctx, infile, outfile):
+ * Read blocks of data from infile, encrypt them, and write them out to
+ * outfile; hash the data into hctx as it is produced.
+ */
+static int
+encstream(const AES_KEY * key, scrypty_HMAC_SHA256_CTX * hctx,
+    FILE * infile, FILE * outfile)
+{
+	uint8_t buf[ENCBLOCK];
+	struct crypto_aesctr * AES;
+	size_t readlen;
+	uint64_t st;
+	int rc = 0;
+
+	if ((AES = scrypty_crypto_aesctr_init(key, 0)) == NULL)
 		return (6);
 	do {
+		st = scrypty_stats_now();
 		if ((readlen = fread(buf, 1, ENCBLOCK, infile)) == 0)
 			break;
+		scrypty_stats_phase(STATS_IO, st);
+		scrypty_stats_count(STATS_ENC_FILE, 0, readlen);
+		SCRYPTY_PROBE1(enc__chunk, readlen);
+		st = scrypty_stats_now();
 		scrypty_crypto_aesctr_stream(AES, buf, buf, readlen);
-		scrypty_HMAC_SHA256_Update(&hctx, buf, readlen);
-		if (fwrite(buf, 1, readlen, outfile) < readlen)
-			return (12);
+		scrypty_stats_phase(STATS_AES, st);
+		st = scrypty_stats_now();
+		scrypty_HMAC_SHA256_Update(hctx, buf, readlen);
+		scrypty_stats_phase(STATS_HMAC, st);
+		st = scrypty_stats_now();
+		if (fwrite(buf, 1, readlen, outfile) < readlen) {
+			rc = 12;
+			break;
+		}
+		scrypty_stats_phase(STATS_IO, st);
 	} while (1);
 	scrypty_crypto_aesctr_free(AES);
 
 	/* Did we exit the loop due to a read error? */
-	if (ferror(infile))
-		return (13);
+	if ((rc == 0) && ferror(infile))
+		rc = 13;
+
+	return (rc);
+}
+
+/**
+ * scrypty_scryptenc_file_profile(infile, outfile, passwd, passwdlen,
+ *     profile):
+ * Read a stream from infile and encrypt it, writing the resulting stream to
+ * outfile.
+ */
+int
+scrypty_scryptenc_file_profile(FILE * infile, FILE * outfile,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile)
+{
+	uint8_t dk[64];
+	uint8_t hbuf[32];
+	uint8_t header[96];
+	uint8_t * key_enc = dk;
+	uint8_t * key_hmac = &dk[32];
+	scrypty_HMAC_SHA256_CTX hctx;
+	AES_KEY key_enc_exp;
+	uint64_t total;
+	int rc;
+
+	scrypty_stats_count(STATS_ENC_FILE, 1, 0);
+
+	/* Generate the header and derived key. */
+	if ((rc = scryptenc_setup(header, dk, passwd, passwdlen, profile,
+	    0)) != 0)
+		return (rc);
+
+	/* Hash and write the header. */
+	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
+	scrypty_HMAC_SHA256_Update(&hctx, header, 96);
+	if (fwrite(header, 96, 1, outfile) != 1)
+		return (12);
+
+	/*
+	 * Encrypt the data, on the cipher threads if there are any, or else
+	 * block by block here.
+	 */
+	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
+		return (5);
+	rc = scrypty_pipe_file(&key_enc_exp, &hctx, infile, outfile, 0, NULL,
+	    &total);
+	if (rc == -1)
+		rc = encstream(&key_enc_exp, &hctx, infile, outfile);
+	else
+		scrypty_stats_count(STATS_ENC_FILE, 0, total);
+	if (rc != 0)
+		return (rc);
 
 	/* Compute the final HMAC and output it. */
 	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
@@ -490,16 +902,199 @@ scrypty_scryptenc_file(FILE * infile, FILE * outfile,
 	return (0);
 }
 
+/* Where compressed data is encrypted, hashed and written to. */
+struct encsink {
+	struct crypto_aesctr * AES;
+	scrypty_HMAC_SHA256_CTX * hctx;
+	FILE * outfile;
+	uint8_t buf[ENCBLOCK];
+};
+
 /**
- * scrypty_scryptdec_file(infile, outfile, passwd, passwdlen,
- *     maxmem, maxmemfrac, maxtime):
+ * encsink(cookie, buf, buflen):
+ * Encrypt buflen bytes from buf, hash them and write them out, as the
+ * loop in scrypty_scryptenc_file_profile does.
+ */
+static int
+encsink(void * cookie, const uint8_t * buf, size_t buflen)
+{
+	struct encsink * es = cookie;
+	size_t len;
+	uint64_t st;
+
+	for (; buflen > 0; buf += len, buflen -= len) {
+		len = (buflen > ENCBLOCK) ? ENCBLOCK : buflen;
+		st = scrypty_stats_now();
+		scrypty_crypto_aesctr_stream(es->AES, buf, es->buf, len);
+		scrypty_stats_phase(STATS_AES, st);
+		st = scrypty_stats_now();
+		scrypty_HMAC_SHA256_Update(es->hctx, es->buf, len);
+		scrypty_stats_phase(STATS_HMAC, st);
+		st = scrypty_stats_now();
+		if (fwrite(es->buf, 1, len, es->outfile) < len)
+			return (12);
+		scrypty_stats_phase(STATS_IO, st);
+	}
+	return (0);
+}
+
+/**
+ * scrypty_scryptenc_file_compress(infile, outfile, passwd, passwdlen,
+ *     profile, compress):
+ * Read a stream from infile, compress it with compress and encrypt it,
+ * writing the resulting version 1 stream to outfile.
+ */
+int
+scrypty_scryptenc_file_compress(FILE * infile, FILE * outfile,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile, int compress)
+{
+	struct encsink es;
+	uint8_t buf[ENCBLOCK];
+	uint8_t dk[64];
+	uint8_t hbuf[32];
+	uint8_t header[96];
+	uint8_t algo = compress;
+	uint8_t * key_enc = dk;
+	uint8_t * key_hmac = &dk[32];
+	size_t readlen;
+	scrypty_HMAC_SHA256_CTX hctx;
+	AES_KEY key_enc_exp;
+	struct scryptenc_zstream * z = NULL;
+	uint64_t st;
+	int rc;
+
+	if (compress == SCRYPTENC_COMPRESS_NONE)
+		return (scrypty_scryptenc_file_profile(infile, outfile,
+		    passwd, passwdlen, profile));
+	if (!scrypty_compress_supported(compress))
+		return (15);
+
+	scrypty_stats_count(STATS_ENC_FILE, 1, 0);
+
+	/* Generate the header and derived key. */
+	if ((rc = scryptenc_setup(header, dk, passwd, passwdlen, profile,
+	    1)) != 0)
+		return (rc);
+
+	/* Hash and write the header. */
+	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
+	scrypty_HMAC_SHA256_Update(&hctx, header, 96);
+	if (fwrite(header, 96, 1, outfile) != 1) {
+		rc = 12;
+		goto err0;
+	}
+
+	/*
+	 * Compress blocks of data as they are read; the compressor hands its
+	 * output, after the algorithm byte, to encsink.
+	 */
+	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp)) {
+		rc = 5;
+		goto err0;
+	}
+	es.hctx = &hctx;
+	es.outfile = outfile;
+	if ((es.AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL) {
+		rc = 6;
+		goto err1;
+	}
+	if ((z = scrypty_zstream_init(compress, 1, encsink, &es)) == NULL) {
+		rc = 6;
+		goto err2;
+	}
+	if ((rc = encsink(&es, &algo, 1)) != 0)
+		goto err3;
+	do {
+		st = scrypty_stats_now();
+		if ((readlen = fread(buf, 1, ENCBLOCK, infile)) == 0)
+			break;
+		scrypty_stats_phase(STATS_IO, st);
+		scrypty_stats_count(STATS_ENC_FILE, 0, readlen);
+		SCRYPTY_PROBE1(enc__chunk, readlen);
+		if ((rc = scrypty_zstream_write(z, buf, readlen)) != 0)
+			goto err3;
+	} while (1);
+
+	/* Did we exit the loop due to a read error? */
+	if (ferror(infile)) {
+		rc = 13;
+		goto err3;
+	}
+
+	/* Flush the compressor, then compute the final HMAC and output it. */
+	if ((rc = scrypty_zstream_finish(z)) != 0)
+		goto err3;
+	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
+	if (fwrite(hbuf, 32, 1, outfile) != 1)
+		rc = 12;
+
+err3:
+	scrypty_zstream_free(z);
+err2:
+	scrypty_crypto_aesctr_free(es.AES);
+err1:
+	memset(&key_enc_exp, 0, sizeof(AES_KEY));
+	memset(&es.buf, 0, sizeof(es.buf));
+	memset(buf, 0, sizeof(buf));
+err0:
+	/* Zero sensitive data. */
+	memset(dk, 0, 64);
+
+	return (rc);
+}
+
+/**
+ * filesink(cookie, buf, buflen):
+ * Write buflen bytes from buf to the FILE cookie.
+ */
+static int
+filesink(void * cookie, const uint8_t * buf, size_t buflen)
+{
+	uint64_t st;
+
+	st = scrypty_stats_now();
+	if (fwrite(buf, 1, buflen, cookie) < buflen)
+		return (12);
+	scrypty_stats_phase(STATS_IO, st);
+	return (0);
+}
+
+/**
+ * decwrite(outfile, version, z, buf, buflen):
+ * Write buflen bytes of decrypted data from buf to outfile; for version 1,
+ * the first byte names the compression algorithm, and the stream z is
+ * created to inflate the rest.
+ */
+static int
+decwrite(FILE * outfile, int version, struct scryptenc_zstream ** z,
+    const uint8_t * buf, size_t buflen)
+{
+
+	if (version == 0)
+		return (filesink(outfile, buf, buflen));
+	if ((*z == NULL) && (buflen > 0)) {
+		if (!scrypty_compress_supported(buf[0]))
+			return (8);
+		if ((*z = scrypty_zstream_init(buf[0], 0, filesink,
+		    outfile)) == NULL)
+			return (6);
+		buf += 1;
+		buflen -= 1;
+	}
+	return (scrypty_zstream_write(*z, buf, buflen));
+}
+
+/**
+ * scrypty_scryptdec_file_profile(infile, outfile, passwd, passwdlen,
+ *     profile):
  * Read a stream from infile and decrypt it, writing the resulting stream to
  * outfile.
  */
 int
-scrypty_scryptdec_file(FILE * infile, FILE * outfile,
+scrypty_scryptdec_file_profile(FILE * infile, FILE * outfile,
     const uint8_t * passwd, size_t passwdlen,
-    size_t maxmem, double maxmemfrac, double maxtime)
+    const struct scryptenc_profile * profile)
 {
 	uint8_t buf[ENCBLOCK + 32];
 	uint8_t header[96];
@@ -511,40 +1106,20 @@ scrypty_scryptdec_file(FILE * infile, FILE * outfile,
 	size_t readlen;
 	scrypty_HMAC_SHA256_CTX hctx;
 	AES_KEY key_enc_exp;
-	struct crypto_aesctr * AES;
+	struct crypto_aesctr * AES = NULL;
+	struct scryptenc_zstream * z = NULL;
+	uint64_t st, total;
+	int zrc = 0;
 	int rc;
 
-	/*
-	 * Read the first 7 bytes of the file; all future version of scrypt
-	 * are guaranteed to have at least 7 bytes of header.
-	 */
-	if (fread(header, 7, 1, infile) < 1) {
-		if (ferror(infile))
-			return (13);
-		else
-			return (7);
-	}
+	scrypty_stats_count(STATS_DEC_FILE, 1, 0);
 
-	/* Do we have the right magic? */
-	if (memcmp(header, "scrypt", 6))
-		return (7);
-	if (header[6] != 0)
-		return (8);
-
-	/*
-	 * Read another 89 bytes of the file; version 0 of the srypt file
-	 * format has a 96-byte header.
-	 */
-	if (fread(&header[7], 89, 1, infile) < 1) {
-		if (ferror(infile))
-			return (13);
-		else
-			return (7);
-	}
+	/* Read the header. */
+	if ((rc = readheader(infile, header)) != 0)
+		return (rc);
 
 	/* Parse the header and generate derived keys. */
-	if ((rc = scryptdec_setup(header, dk, passwd, passwdlen,
-	    maxmem, maxmemfrac, maxtime)) != 0)
+	if ((rc = scryptdec_setup(header, dk, passwd, passwdlen, profile)) != 0)
 		return (rc);
 
 	/* Start hashing with the header. */
@@ -559,13 +1134,32 @@ scrypty_scryptdec_file(FILE * infile, FILE * outfile,
 	 */
 	if (AES_set_encrypt_key(key_enc, 256, &key_enc_exp))
 		return (5);
+
+	/*
+	 * With cipher threads, a large version 0 stream goes through the
+	 * pipeline, which hands back the last 32 bytes.
+	 */
+	if ((header[6] == 0) && ((rc = scrypty_pipe_file(&key_enc_exp, &hctx,
+	    infile, outfile, 1, buf, &total)) != -1)) {
+		scrypty_stats_count(STATS_DEC_FILE, 0, total);
+		if (rc != 0)
+			goto err;
+		buflen = (total < 32) ? total : 32;
+		goto verify;
+	}
+
 	if ((AES = scrypty_crypto_aesctr_init(&key_enc_exp, 0)) == NULL)
 		return (6);
+	rc = 0;
 	do {
 		/* Read data until we have more than 32 bytes of it. */
+		st = scrypty_stats_now();
 		if ((readlen = fread(&buf[buflen], 1,
 		    ENCBLOCK + 32 - buflen, infile)) == 0)
 			break;
+		scrypty_stats_phase(STATS_IO, st);
+		scrypty_stats_count(STATS_DEC_FILE, 0, readlen);
+		SCRYPTY_PROBE1(dec__chunk, readlen);
 		buflen += readlen;
 		if (buflen <= 32)
 			continue;
@@ -574,33 +1168,645 @@ scrypty_scryptdec_file(FILE * infile, FILE * outfile,
 		 * Decrypt, hash, and output everything except the last 32
 		 * bytes out of what we have in our buffer.
 		 */
+		st = scrypty_stats_now();
 		scrypty_HMAC_SHA256_Update(&hctx, buf, buflen - 32);
+		scrypty_stats_phase(STATS_HMAC, st);
+		st = scrypty_stats_now();
 		scrypty_crypto_aesctr_stream(AES, buf, buf, buflen - 32);
-		if (fwrite(buf, 1, buflen - 32, outfile) < buflen - 32)
-			return (12);
+		scrypty_stats_phase(STATS_AES, st);
+		/*
+		 * Data which doesn't inflate may just have been tampered
+		 * with, so that error waits until the HMAC has been checked;
+		 * nothing more is written, but everything is still hashed.
+		 */
+		if ((zrc == 0) && ((rc = decwrite(outfile, header[6], &z, buf,
+		    buflen - 32)) != 0)) {
+			if (rc == 12)
+				goto err;
+			zrc = rc;
+			rc = 0;
+		}
 
 		/* Move the last 32 bytes to the start of the buffer. */
 		memmove(buf, &buf[buflen - 32], 32);
 		buflen = 32;
 	} while (1);
-	scrypty_crypto_aesctr_free(AES);
 
 	/* Did we exit the loop due to a read error? */
-	if (ferror(infile))
-		return (13);
+	if (ferror(infile)) {
+		rc = 13;
+		goto err;
+	}
 
+verify:
 	/* Did we read enough data that we *might* have a valid signature? */
-	if (buflen < 32)
-		return (7);
+	if (buflen < 32) {
+		rc = 7;
+		goto err;
+	}
 
 	/* Verify signature. */
 	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
-	if (memcmp(hbuf, buf, 32))
-		return (7);
+	if (memcmp(hbuf, buf, 32)) {
+		rc = 7;
+		goto err;
+	}
+
+	/* A compressed stream must have been inflated to its end. */
+	if (zrc != 0)
+		rc = zrc;
+	else if (header[6] == 1)
+		rc = (z == NULL) ? 7 : scrypty_zstream_finish(z);
+
+err:
+	if (z != NULL)
+		scrypty_zstream_free(z);
+	if (AES != NULL)
+		scrypty_crypto_aesctr_free(AES);
 
 	/* Zero sensitive data. */
 	memset(dk, 0, 64);
 	memset(&key_enc_exp, 0, sizeof(AES_KEY));
 
+	return (rc);
+}
+
+/**
+ * readheader(infile, header):
+ * Read the 96-byte header of a version 0 or 1 scrypt stream from infile.
+ */
+static int
+readheader(FILE * infile, uint8_t header[96])
+{
+
+	/*
+	 * Read the first 7 bytes of the file; all future version of scrypt
+	 * are guaranteed to have at least 7 bytes of header.
+	 */
+	if (fread(header, 7, 1, infile) < 1) {
+		if (ferror(infile))
+			return (13);
+		else
+			return (7);
+	}
+
+	/* Do we have the right magic? */
+	if (memcmp(header, "scrypt", 6))
+		return (7);
+	if (header[6] > 1)
+		return (8);
+
+	/*
+	 * Read another 89 bytes of the file; versions 0 and 1 of the scrypt
+	 * file format have a 96-byte header.
+	 */
+	if (fread(&header[7], 89, 1, infile) < 1) {
+		if (ferror(infile))
+			return (13);
+		else
+			return (7);
+	}
+
+	/* Success! */
 	return (0);
 }
+
+/**
+ * scrypty_scryptdec_verify_buf(inbuf, inbuflen, passwd, passwdlen,
+ *     profile):
+ * Check that the inbuflen bytes in inbuf are intact data encrypted with
+ * passwd, without decrypting them: derive the keys, check the header, and
+ * compute only the HMAC over the header and ciphertext.
+ */
+int
+scrypty_scryptdec_verify_buf(const uint8_t * inbuf, size_t inbuflen,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile)
+{
+	uint8_t hbuf[32];
+	uint8_t dk[64];
+	uint8_t * key_hmac = &dk[32];
+	scrypty_HMAC_SHA256_CTX hctx;
+	uint64_t st;
+	int rc;
+
+	scrypty_stats_count(STATS_VERIFY_BUF, 1, inbuflen);
+
+	/* Check the magic, the format and the minimum length. */
+	if ((inbuflen < 7) || (memcmp(inbuf, "scrypt", 6) != 0))
+		return (7);
+	if (inbuf[6] > 1)
+		return (8);
+	if (inbuflen < 128)
+		return (7);
+
+	/* Parse the header and generate derived keys. */
+	if ((rc = scryptdec_setup(inbuf, dk, passwd, passwdlen, profile)) != 0)
+		return (rc);
+
+	/* Verify signature. */
+	st = scrypty_stats_now();
+	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
+	scrypty_HMAC_SHA256_Update(&hctx, inbuf, inbuflen - 32);
+	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
+	scrypty_stats_phase(STATS_HMAC, st);
+	memset(dk, 0, 64);
+	if (memcmp(hbuf, &inbuf[inbuflen - 32], 32))
+		return (7);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * scrypty_scryptdec_verify_file(infile, passwd, passwdlen, profile):
+ * As scrypty_scryptdec_verify_buf, but reading the stream from infile.
+ * The stream is read unbuffered in large blocks, so nothing may have been
+ * read from it yet.
+ */
+int
+scrypty_scryptdec_verify_file(FILE * infile, const uint8_t * passwd,
+    size_t passwdlen, const struct scryptenc_profile * profile)
+{
+	uint8_t * buf;
+	uint8_t header[96];
+	uint8_t hbuf[32];
+	uint8_t dk[64];
+	uint8_t * key_hmac = &dk[32];
+	size_t buflen = 0;
+	size_t readlen;
+	scrypty_HMAC_SHA256_CTX hctx;
+	uint64_t st;
+	int rc;
+
+	scrypty_stats_count(STATS_VERIFY_FILE, 1, 0);
+
+	/* Let each fread go straight to the file in VERIFYBLOCK chunks. */
+	setvbuf(infile, NULL, _IONBF, 0);
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(fileno(infile), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* Read and parse the header, and generate derived keys. */
+	if ((rc = readheader(infile, header)) != 0)
+		return (rc);
+	if ((rc = scryptdec_setup(header, dk, passwd, passwdlen, profile)) != 0)
+		return (rc);
+	if ((buf = malloc(VERIFYBLOCK + 32)) == NULL)
+		return (6);
+
+	/* Hash everything except the final 32 bytes, as scryptdec_file. */
+	scrypty_HMAC_SHA256_Init(&hctx, key_hmac, 32);
+	scrypty_HMAC_SHA256_Update(&hctx, header, 96);
+	memset(dk, 0, 64);
+	do {
+		st = scrypty_stats_now();
+		if ((readlen = fread(&buf[buflen], 1,
+		    VERIFYBLOCK + 32 - buflen, infile)) == 0)
+			break;
+		scrypty_stats_phase(STATS_IO, st);
+		scrypty_stats_count(STATS_VERIFY_FILE, 0, readlen);
+		buflen += readlen;
+		if (buflen <= 32)
+			continue;
+
+		st = scrypty_stats_now();
+		scrypty_HMAC_SHA256_Update(&hctx, buf, buflen - 32);
+		scrypty_stats_phase(STATS_HMAC, st);
+
+		memmove(buf, &buf[buflen - 32], 32);
+		buflen = 32;
+	} while (1);
+
+	/* Did we exit the loop due to a read error? */
+	if (ferror(infile)) {
+		rc = 13;
+		goto done;
+	}
+
+	/* Verify signature. */
+	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
+	if ((buflen < 32) || memcmp(hbuf, buf, 32))
+		rc = 7;
+
+done:
+	free(buf);
+	return (rc);
+}
+
+/*
+ * The old keys of a re-encryption, derived on a thread of their own with
+ * the caller's memory budget and scheduler settings and cancellation flag.
+ */
+struct oldkeys {
+	const uint8_t * header;
+	uint8_t * dk;
+	const uint8_t * passwd;
+	size_t passwdlen;
+	const struct scryptenc_profile * profile;
+	int priority;
+	double timeout;
+	int * cancel;
+	int class;
+	uint64_t deadline;
+	int rc;
+};
+
+static void *
+oldkeys(void * cookie)
+{
+	struct oldkeys * ok = cookie;
+
+	scrypty_budget_setattr(ok->priority, ok->timeout);
+	scrypty_budget_setcancel(ok->cancel);
+	scrypty_sched_setattr(ok->class, ok->deadline);
+	ok->rc = scryptdec_setup(ok->header, ok->dk, ok->passwd, ok->passwdlen,
+	    ok->profile);
+	return (NULL);
+}
+
+/**
+ * rekey_setup(inheader, olddk, outheader, newdk, oldpasswd, oldpasswdlen,
+ *     newpasswd, newpasswdlen, profile):
+ * Derive olddk for the data whose header is inheader from oldpasswd, and
+ * newdk and outheader (of the same version) from newpasswd.  If both V
+ * arrays fit in profile->memlimit together, the two derivations run at the
+ * same time; otherwise the old keys come first, so that a wrong password is
+ * caught before the new keys are derived.
+ */
+static int
+rekey_setup(const uint8_t inheader[96], uint8_t olddk[64],
+    uint8_t outheader[96], uint8_t newdk[64], const uint8_t * oldpasswd,
+    size_t oldpasswdlen, const uint8_t * newpasswd, size_t newpasswdlen,
+    const struct scryptenc_profile * profile)
+{
+	struct scryptenc_header params;
+	struct oldkeys ok;
+	pthread_t tid;
+	uint64_t oldv, newv;
+	int rc;
+
+	/* Check the old header and its parameters before deriving anything. */
+	if ((rc = scrypty_scryptdec_header(inheader, 96, &params)) != 0)
+		return (rc);
+	if ((rc = checkparams(profile, params.logN, params.r, params.p)) != 0)
+		return (rc);
+
+	ok.header = inheader;
+	ok.dk = olddk;
+	ok.passwd = oldpasswd;
+	ok.passwdlen = oldpasswdlen;
+	ok.profile = profile;
+	scrypty_budget_getattr(&ok.priority, &ok.timeout);
+	ok.cancel = scrypty_budget_getcancel();
+	scrypty_sched_getattr(&ok.class, &ok.deadline);
+
+	/* Both fit within the limits checked above, so these can't overflow. */
+	oldv = ((uint64_t)(128) * params.r) << params.logN;
+	newv = ((uint64_t)(128) * profile->r) << profile->logN;
+	if ((oldv + newv <= profile->memlimit) &&
+	    (pthread_create(&tid, NULL, oldkeys, &ok) == 0)) {
+		rc = scryptenc_setup(outheader, newdk, newpasswd, newpasswdlen,
+		    profile, inheader[6]);
+		pthread_join(tid, NULL);
+	} else {
+		oldkeys(&ok);
+		if (ok.rc == 0)
+			rc = scryptenc_setup(outheader, newdk, newpasswd,
+			    newpasswdlen, profile, inheader[6]);
+	}
+	if (ok.rc != 0)
+		rc = ok.rc;
+
+	if (rc != 0) {
+		memset(olddk, 0, 64);
+		memset(newdk, 0, 64);
+	}
+	return (rc);
+}
+
+/* The state of a re-encryption: both ciphers and both HMACs. */
+struct rekey {
+	AES_KEY oldkey;
+	AES_KEY newkey;
+	struct crypto_aesctr * oldAES;
+	struct crypto_aesctr * newAES;
+	scrypty_HMAC_SHA256_CTX oldhctx;
+	scrypty_HMAC_SHA256_CTX newhctx;
+};
+
+/**
+ * rekey_init(rk, inheader, olddk, outheader, newdk):
+ * Set up rk to turn the ciphertext after inheader under olddk into that
+ * after outheader under newdk, with both HMACs fed their header.
+ */
+static int
+rekey_init(struct rekey * rk, const uint8_t inheader[96],
+    const uint8_t olddk[64], const uint8_t outheader[96],
+    const uint8_t newdk[64])
+{
+	int rc = 6;
+
+	if (AES_set_encrypt_key(olddk, 256, &rk->oldkey) ||
+	    AES_set_encrypt_key(newdk, 256, &rk->newkey)) {
+		rc = 5;
+		goto err0;
+	}
+	if ((rk->oldAES = scrypty_crypto_aesctr_init(&rk->oldkey, 0)) == NULL)
+		goto err0;
+	if ((rk->newAES = scrypty_crypto_aesctr_init(&rk->newkey, 0)) == NULL)
+		goto err1;
+	scrypty_HMAC_SHA256_Init(&rk->oldhctx, &olddk[32], 32);
+	scrypty_HMAC_SHA256_Update(&rk->oldhctx, inheader, 96);
+	scrypty_HMAC_SHA256_Init(&rk->newhctx, &newdk[32], 32);
+	scrypty_HMAC_SHA256_Update(&rk->newhctx, outheader, 96);
+
+	/* Success! */
+	return (0);
+
+err1:
+	scrypty_crypto_aesctr_free(rk->oldAES);
+err0:
+	memset(rk, 0, sizeof(struct rekey));
+
+	/* Failure! */
+	return (rc);
+}
+
+/**
+ * rekey_block(rk, in, out, len):
+ * Hash len bytes of old ciphertext from in, turn them into new ciphertext
+ * in out (which may be in), and hash that.
+ */
+static void
+rekey_block(struct rekey * rk, const uint8_t * in, uint8_t * out,
+    size_t len)
+{
+	uint64_t st;
+
+	st = scrypty_stats_now();
+	scrypty_HMAC_SHA256_Update(&rk->oldhctx, in, len);
+	scrypty_stats_phase(STATS_HMAC, st);
+	st = scrypty_stats_now();
+	scrypty_crypto_aesctr_stream(rk->oldAES, in, out, len);
+	scrypty_crypto_aesctr_stream(rk->newAES, out, out, len);
+	scrypty_stats_phase(STATS_AES, st);
+	st = scrypty_stats_now();
+	scrypty_HMAC_SHA256_Update(&rk->newhctx, out, len);
+	scrypty_stats_phase(STATS_HMAC, st);
+}
+
+/**
+ * rekey_free(rk):
+ * Free the ciphers of rk and zero it.
+ */
+static void
+rekey_free(struct rekey * rk)
+{
+
+	scrypty_crypto_aesctr_free(rk->oldAES);
+	scrypty_crypto_aesctr_free(rk->newAES);
+	memset(rk, 0, sizeof(struct rekey));
+}
+
+/**
+ * scrypty_scryptenc_rekey_buf(inbuf, inbuflen, outbuf, oldpasswd,
+ *     oldpasswdlen, newpasswd, newpasswdlen, profile):
+ * Re-encrypt the inbuflen bytes in inbuf from oldpasswd to newpasswd,
+ * writing inbuflen bytes to outbuf in a single pass.
+ */
+int
+scrypty_scryptenc_rekey_buf(const uint8_t * inbuf, size_t inbuflen,
+    uint8_t * outbuf, const uint8_t * oldpasswd, size_t oldpasswdlen,
+    const uint8_t * newpasswd, size_t newpasswdlen,
+    const struct scryptenc_profile * profile)
+{
+	struct rekey rk;
+	uint8_t olddk[64];
+	uint8_t newdk[64];
+	uint8_t hbuf[32];
+	size_t pos, end, len;
+	int rc;
+
+	scrypty_stats_count(STATS_REKEY_BUF, 1, inbuflen);
+
+	/* Check the magic, the format and the minimum length. */
+	if ((inbuflen < 7) || (memcmp(inbuf, "scrypt", 6) != 0))
+		return (7);
+	if (inbuf[6] > 1)
+		return (8);
+	if (inbuflen < 128)
+		return (7);
+
+	/* Derive both sets of keys, writing the new header. */
+	if ((rc = rekey_setup(inbuf, olddk, outbuf, newdk, oldpasswd,
+	    oldpasswdlen, newpasswd, newpasswdlen, profile)) != 0)
+		return (rc);
+	if ((rc = rekey_init(&rk, inbuf, olddk, outbuf, newdk)) != 0)
+		goto err0;
+
+	for (pos = 96, end = inbuflen - 32; pos < end; pos += len) {
+		len = (end - pos > ENCBLOCK) ? ENCBLOCK : end - pos;
+		rekey_block(&rk, &inbuf[pos], &outbuf[pos], len);
+	}
+
+	/* Only sign the new data if the old data was intact. */
+	scrypty_HMAC_SHA256_Final(hbuf, &rk.oldhctx);
+	if (memcmp(hbuf, &inbuf[end], 32)) {
+		memset(outbuf, 0, inbuflen);
+		rc = 7;
+		goto err1;
+	}
+	scrypty_HMAC_SHA256_Final(&outbuf[end], &rk.newhctx);
+
+err1:
+	rekey_free(&rk);
+err0:
+	/* Zero sensitive data. */
+	memset(olddk, 0, 64);
+	memset(newdk, 0, 64);
+
+	return (rc);
+}
+
+/**
+ * scrypty_scryptenc_rekey_file(infile, outfile, oldpasswd, oldpasswdlen,
+ *     newpasswd, newpasswdlen, profile):
+ * As scrypty_scryptenc_rekey_buf, but reading a stream from infile and
+ * writing the new stream to outfile.
+ */
+int
+scrypty_scryptenc_rekey_file(FILE * infile, FILE * outfile,
+    const uint8_t * oldpasswd, size_t oldpasswdlen,
+    const uint8_t * newpasswd, size_t newpasswdlen,
+    const struct scryptenc_profile * profile)
+{
+	struct rekey rk;
+	uint8_t buf[ENCBLOCK + 32];
+	uint8_t inheader[96];
+	uint8_t outheader[96];
+	uint8_t olddk[64];
+	uint8_t newdk[64];
+	uint8_t hbuf[32];
+	size_t buflen = 0;
+	size_t readlen;
+	uint64_t st;
+	int rc;
+
+	scrypty_stats_count(STATS_REKEY_FILE, 1, 0);
+
+	/* Read the header, and derive both sets of keys. */
+	if ((rc = readheader(infile, inheader)) != 0)
+		return (rc);
+	if ((rc = rekey_setup(inheader, olddk, outheader, newdk, oldpasswd,
+	    oldpasswdlen, newpasswd, newpasswdlen, profile)) != 0)
+		return (rc);
+	if ((rc = rekey_init(&rk, inheader, olddk, outheader, newdk)) != 0)
+		goto err0;
+	if (fwrite(outheader, 96, 1, outfile) != 1) {
+		rc = 12;
+		goto err1;
+	}
+
+	/* As scryptdec_file, holding back the last 32 bytes read. */
+	do {
+		st = scrypty_stats_now();
+		if ((readlen = fread(&buf[buflen], 1,
+		    ENCBLOCK + 32 - buflen, infile)) == 0)
+			break;
+		scrypty_stats_phase(STATS_IO, st);
+		scrypty_stats_count(STATS_REKEY_FILE, 0, readlen);
+		buflen += readlen;
+		if (buflen <= 32)
+			continue;
+
+		rekey_block(&rk, buf, buf, buflen - 32);
+		st = scrypty_stats_now();
+		if (fwrite(buf, 1, buflen - 32, outfile) < buflen - 32) {
+			rc = 12;
+			goto err1;
+		}
+		scrypty_stats_phase(STATS_IO, st);
+
+		memmove(buf, &buf[buflen - 32], 32);
+		buflen = 32;
+	} while (1);
+
+	/* Did we exit the loop due to a read error? */
+	if (ferror(infile)) {
+		rc = 13;
+		goto err1;
+	}
+
+	/*
+	 * Only sign the new stream if the old one was intact; without its
+	 * HMAC the output is never accepted by a decryption.
+	 */
+	scrypty_HMAC_SHA256_Final(hbuf, &rk.oldhctx);
+	if ((buflen < 32) || memcmp(hbuf, buf, 32)) {
+		rc = 7;
+		goto err1;
+	}
+	scrypty_HMAC_SHA256_Final(hbuf, &rk.newhctx);
+	if (fwrite(hbuf, 32, 1, outfile) != 1)
+		rc = 12;
+
+err1:
+	rekey_free(&rk);
+	memset(buf, 0, sizeof(buf));
+err0:
+	/* Zero sensitive data. */
+	memset(olddk, 0, 64);
+	memset(newdk, 0, 64);
+
+	return (rc);
+}
+
+/**
+ * scrypty_scryptenc_buf(inbuf, inbuflen, outbuf, passwd, passwdlen,
+ *     maxmem, maxmemfrac, maxtime):
+ * Encrypt inbuflen bytes from inbuf, writing the resulting inbuflen + 128
+ * bytes to outbuf.
+ */
+int
+scrypty_scryptenc_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
+    const uint8_t * passwd, size_t passwdlen,
+    size_t maxmem, double maxmemfrac, double maxtime)
+{
+	struct scryptenc_profile profile;
+	int rc;
+
+	if ((rc = scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime,
+	    &profile)) != 0)
+		return (rc);
+
+	return (scrypty_scryptenc_buf_profile(inbuf, inbuflen, outbuf,
+	    passwd, passwdlen, &profile));
+}
+
+/**
+ * scrypty_scryptdec_buf(inbuf, inbuflen, outbuf, outlen, passwd, passwdlen,
+ *     maxmem, maxmemfrac, maxtime):
+ * Decrypt inbuflen bytes fro inbuf, writing the result into outbuf and the
+ * decrypted data length to outlen.  The allocated length of outbuf must
+ * be at least inbuflen.
+ */
+int
+scrypty_scryptdec_buf(const uint8_t * inbuf, size_t inbuflen, uint8_t * outbuf,
+    size_t * outlen, const uint8_t * passwd, size_t passwdlen,
+    size_t maxmem, double maxmemfrac, double maxtime)
+{
+	struct scryptenc_profile profile;
+	int rc;
+
+	if ((rc = scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime,
+	    &profile)) != 0)
+		return (rc);
+
+	return (scrypty_scryptdec_buf_profile(inbuf, inbuflen, outbuf, outlen,
+	    passwd, passwdlen, &profile));
+}
+
+/**
+ * scrypty_scryptenc_file(infile, outfile, passwd, passwdlen,
+ *     maxmem, maxmemfrac, maxtime):
+ * Read a stream from infile and encrypt it, writing the resulting stream to
+ * outfile.
+ */
+int
+scrypty_scryptenc_file(FILE * infile, FILE * outfile,
+    const uint8_t * passwd, size_t passwdlen,
+    size_t maxmem, double maxmemfrac, double maxtime)
+{
+	struct scryptenc_profile profile;
+	int rc;
+
+	if ((rc = scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime,
+	    &profile)) != 0)
+		return (rc);
+
+	return (scrypty_scryptenc_file_profile(infile, outfile,
+	    passwd, passwdlen, &profile));
+}
+
+/**
+ * scrypty_scryptdec_file(infile, outfile, passwd, passwdlen,
+ *     maxmem, maxmemfrac, maxtime):
+ * Read a stream from infile and decrypt it, writing the resulting stream to
+ * outfile.
+ */
+int
+scrypty_scryptdec_file(FILE * infile, FILE * outfile,
+    const uint8_t * passwd, size_t passwdlen,
+    size_t maxmem, double maxmemfrac, double maxtime)
+{
+	struct scryptenc_profile profile;
+	int rc;
+
+	if ((rc = scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime,
+	    &profile)) != 0)
+		return (rc);
+
+	return (scrypty_scryptdec_file_profile(infile, outfile,
+	    passwd, passwdlen, &profile));
+}
@@ -60,7 +60,7 @@
  * 1	getrlimit or sysctl(hw.usermem) failed
  * 2	clock_getres or clock_gettime failed
  * 3	error computing derived key
- * 4	could not read salt from /dev/urandom
+ * 4	could not get random bytes for the salt
  * 5	error in OpenSSL
  * 6	malloc failed
  * 7	data is not a valid scrypt-encrypted block
@@ -70,8 +70,84 @@
  * 11	password is incorrect
  * 12	error writing output file
  * 13	error reading input file
+ * 14	timed out waiting for the memory budget (see scryptenc_budget.h)
+ * 15	error compressing or decompressing data
+ * 16	cancelled (see scrypty_budget_setcancel in scryptenc_budget.h)
+ * 17	the log is open for writing elsewhere (see scryptenc_log.h)
  */
 
+/**
+ * Version 1 of the format is version 0 with the plaintext compressed: the
+ * first byte of the encrypted data names the algorithm (one of the
+ * SCRYPTENC_COMPRESS_* values) and the rest is the compressed stream.
+ */
+#define SCRYPTENC_COMPRESS_NONE	0
+#define SCRYPTENC_COMPRESS_ZLIB	1
+#define SCRYPTENC_COMPRESS_ZSTD	2
+#define SCRYPTENC_COMPRESS_LZ4	3
+
+/**
+ * Version 2 is the append-only log format described in scryptenc_log.h.
+ * It shares the header, but of the functions here only the header,
+ * password and key functions accept it.
+ */
+#define SCRYPTENC_VERSION_LOG	2
+
+/**
+ * A profile holds resolved limits and the scrypt parameters chosen under
+ * them, so that the system only needs to be examined once:
+ * memlimit - maximum number of bytes of storage to use for the V array.
+ * opslimit - maximum number of salsa20/8 cores to spend computing the
+ *     derived keys.
+ * logN, r, p - the scrypt parameters (N = 2^logN) used when encrypting.
+ * The *_profile functions below take a profile instead of maxmem,
+ * maxmemfrac, and maxtime and do no probing of memory or CPU speed.
+ */
+struct scryptenc_profile {
+	size_t memlimit;
+	double opslimit;
+	int logN;
+	uint32_t r;
+	uint32_t p;
+};
+
+/**
+ * The parameters of encrypted data, as read from its header.
+ */
+struct scryptenc_header {
+	int version;
+	int logN;
+	uint32_t r;
+	uint32_t p;
+	uint8_t salt[32];
+};
+
+/**
+ * scrypty_scryptenc_pickparams(memlimit, opslimit, logN, r, p):
+ * Choose scrypt parameters which make the derived key as strong as possible
+ * while using at most memlimit bytes of storage for the V array and at most
+ * opslimit salsa20/8 cores.
+ */
+int scrypty_scryptenc_pickparams(size_t, double, int *, uint32_t *,
+    uint32_t *);
+
+/**
+ * scrypty_scryptenc_profile(maxmem, maxmemfrac, maxtime, profile):
+ * Examine the system (available memory and CPU speed) once and fill in
+ * profile with the resulting limits and the parameters which would be
+ * picked for encryption.
+ */
+int scrypty_scryptenc_profile(size_t, double, double,
+    struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptenc_profile_params(logN, r, p, profile):
+ * Fill in profile with the explicit parameters N = 2^logN, r, and p, and
+ * with exactly the memory and CPU limits those parameters require.
+ */
+int scrypty_scryptenc_profile_params(int, uint32_t, uint32_t,
+    struct scryptenc_profile *);
+
 /**
  * scrypty_scryptenc_buf(inbuf, inbuflen, outbuf, passwd, passwdlen,
  *     maxmem, maxmemfrac, maxtime):
@@ -109,4 +185,152 @@ int scrypty_scryptenc_file(FILE *, FILE *, const uint8_t *, size_t,
 int scrypty_scryptdec_file(FILE *, FILE *, const uint8_t *, size_t,
     size_t, double, double);
 
+/**
+ * scrypty_scryptenc_buf_profile(inbuf, inbuflen, outbuf, passwd,
+ *     passwdlen, profile):
+ * As scrypty_scryptenc_buf, but using the parameters from profile.
+ */
+int scrypty_scryptenc_buf_profile(const uint8_t *, size_t, uint8_t *,
+    const uint8_t *, size_t, const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptdec_buf_profile(inbuf, inbuflen, outbuf, outlen, passwd,
+ *     passwdlen, profile):
+ * As scrypty_scryptdec_buf, but checking against the limits from profile.
+ * Only version 0 data fits in outbuf; version 1 data returns 8 (see
+ * scrypty_scryptdec_buf_alloc).
+ */
+int scrypty_scryptdec_buf_profile(const uint8_t *, size_t, uint8_t *,
+    size_t *, const uint8_t *, size_t, const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptenc_buf_compress(inbuf, inbuflen, outbuf, outlen, passwd,
+ *     passwdlen, profile, compress):
+ * As scrypty_scryptenc_buf_profile, but compressing inbuf with compress
+ * (one of the SCRYPTENC_COMPRESS_* values) into version 1 of the format
+ * first.  If that doesn't make the data smaller it is written as version
+ * 0 instead, so at most inbuflen + 128 bytes are written to outbuf; their
+ * number is stored in outlen.
+ */
+int scrypty_scryptenc_buf_compress(const uint8_t *, size_t, uint8_t *,
+    size_t *, const uint8_t *, size_t, const struct scryptenc_profile *, int);
+
+/**
+ * scrypty_scryptdec_buf_alloc(inbuf, inbuflen, outbuf, outlen, passwd,
+ *     passwdlen, profile):
+ * As scrypty_scryptdec_buf_profile, but for either version of the format:
+ * the decrypted (and if need be decompressed) data is written to a buffer
+ * allocated with malloc, which is stored in outbuf and must be freed by
+ * the caller.  The HMAC is checked before anything is decrypted.
+ */
+int scrypty_scryptdec_buf_alloc(const uint8_t *, size_t, uint8_t **,
+    size_t *, const uint8_t *, size_t, const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptenc_file_profile(infile, outfile, passwd, passwdlen,
+ *     profile):
+ * As scrypty_scryptenc_file, but using the parameters from profile.
+ */
+int scrypty_scryptenc_file_profile(FILE *, FILE *, const uint8_t *, size_t,
+    const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptenc_file_compress(infile, outfile, passwd, passwdlen,
+ *     profile, compress):
+ * As scrypty_scryptenc_file_profile, but compressing the stream with
+ * compress (one of the SCRYPTENC_COMPRESS_* values) into version 1 of the
+ * format, unless compress is SCRYPTENC_COMPRESS_NONE.
+ */
+int scrypty_scryptenc_file_compress(FILE *, FILE *, const uint8_t *, size_t,
+    const struct scryptenc_profile *, int);
+
+/**
+ * scrypty_scryptdec_file_profile(infile, outfile, passwd, passwdlen,
+ *     profile):
+ * As scrypty_scryptdec_file, but checking against the limits from profile.
+ * Version 1 streams are decompressed as they are decrypted.
+ */
+int scrypty_scryptdec_file_profile(FILE *, FILE *, const uint8_t *, size_t,
+    const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptdec_header(inbuf, inbuflen, header):
+ * Parse and checksum the header at the start of the inbuflen bytes of
+ * encrypted data in inbuf into header, without deriving any keys.  Only
+ * the first 96 bytes are needed.
+ */
+int scrypty_scryptdec_header(const uint8_t *, size_t,
+    struct scryptenc_header *);
+
+/**
+ * scrypty_scryptenc_keys(header, dk, passwd, passwdlen, profile, version):
+ * Pick a salt, derive the 64-byte key dk from passwd with the parameters
+ * from profile, and write the 96-byte header of data of the given version
+ * encrypted under it to header.
+ */
+int scrypty_scryptenc_keys(uint8_t[96], uint8_t[64], const uint8_t *,
+    size_t, const struct scryptenc_profile *, int);
+
+/**
+ * scrypty_scryptdec_keys(header, dk, passwd, passwdlen, profile):
+ * Check the 96-byte header and its parameters against the limits from
+ * profile, derive the 64-byte key dk from passwd, and check the header
+ * HMAC; return 11 if passwd is not the password.
+ */
+int scrypty_scryptdec_keys(const uint8_t[96], uint8_t[64], const uint8_t *,
+    size_t, const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptdec_password(inbuf, inbuflen, passwd, passwdlen, profile):
+ * Check that passwd is the password for the encrypted data whose header is
+ * at the start of inbuf, by deriving the keys and checking the header HMAC
+ * only; return 11 if it is not.  Only the first 96 bytes are needed.
+ */
+int scrypty_scryptdec_password(const uint8_t *, size_t, const uint8_t *,
+    size_t, const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptdec_verify_buf(inbuf, inbuflen, passwd, passwdlen,
+ *     profile):
+ * Check that the inbuflen bytes in inbuf are intact data encrypted with
+ * passwd, as scrypty_scryptdec_buf_profile would, but without decrypting
+ * them: only the HMAC over the header and ciphertext is computed.
+ */
+int scrypty_scryptdec_verify_buf(const uint8_t *, size_t, const uint8_t *,
+    size_t, const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptdec_verify_file(infile, passwd, passwdlen, profile):
+ * As scrypty_scryptdec_verify_buf, but reading the stream from infile in
+ * large unbuffered reads; nothing may have been read from infile yet.
+ */
+int scrypty_scryptdec_verify_file(FILE *, const uint8_t *, size_t,
+    const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptenc_rekey_buf(inbuf, inbuflen, outbuf, oldpasswd,
+ *     oldpasswdlen, newpasswd, newpasswdlen, profile):
+ * Re-encrypt the inbuflen bytes of encrypted data (of either version) in
+ * inbuf from oldpasswd to newpasswd with the parameters from profile,
+ * writing inbuflen bytes to outbuf, which must not overlap inbuf.  The old
+ * parameters are checked against the limits from profile; both keys are
+ * derived first (at the same time if both V arrays fit in the memory
+ * limit), and the data is then decrypted, re-encrypted and hashed under
+ * both keys in a single pass.  If the old HMAC does not match, outbuf is
+ * zeroed and 7 is returned.
+ */
+int scrypty_scryptenc_rekey_buf(const uint8_t *, size_t, uint8_t *,
+    const uint8_t *, size_t, const uint8_t *, size_t,
+    const struct scryptenc_profile *);
+
+/**
+ * scrypty_scryptenc_rekey_file(infile, outfile, oldpasswd, oldpasswdlen,
+ *     newpasswd, newpasswdlen, profile):
+ * As scrypty_scryptenc_rekey_buf, but streaming from infile to outfile.
+ * The new HMAC is written last and only if the old one matched, so output
+ * from a failed call never decrypts; the caller should still discard it.
+ */
+int scrypty_scryptenc_rekey_file(FILE *, FILE *, const uint8_t *, size_t,
+    const uint8_t *, size_t, const struct scryptenc_profile *);
+
 #endif /* !_SCRYPTENC_H_ */
@@ -0,0 +1,379 @@
+#include "scrypt_platform.h"
+
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memlimit.h"
+#include "scryptenc_budget.h"
+#include "scryptenc_numa.h"
+#include "sysendian.h"
+
+#include "scryptenc_batch.h"
+
+struct batch {
+	struct scryptenc_batch_item * items;
+	size_t nitems;
+	const uint8_t * passwd;
+	size_t passwdlen;
+	const struct scryptenc_profile * profile;
+	int mode;
+	int * cancel;
+
+	pthread_mutex_t mtx;
+	size_t next;
+};
+
+/* A worker and the NUMA node it runs on (-1 for wherever). */
+struct thread {
+	pthread_t tid;
+	struct batch * batch;
+	int node;
+};
+
+static size_t vsize(const struct batch *, size_t);
+static int smallfile(const struct batch *, struct scryptenc_batch_item *,
+    FILE *, FILE *, size_t);
+static int dofile(const struct batch *, struct scryptenc_batch_item *);
+static void * worker(void *);
+
+/**
+ * vsize(batch, i):
+ * Return the size of the V array needed to process item i, or 0 if that
+ * can't be determined (in which case the item will fail without deriving
+ * a key at all).
+ */
+static size_t
+vsize(const struct batch * batch, size_t i)
+{
+	const struct scryptenc_batch_item * item = &batch->items[i];
+	uint8_t header[12];
+	FILE * f;
+	int logN;
+	uint32_t r;
+
+	if ((batch->mode == SCRYPTENC_BATCH_ENCRYPT) ||
+	    (batch->mode == SCRYPTENC_BATCH_ENCRYPT_FILE)) {
+		logN = batch->profile->logN;
+		r = batch->profile->r;
+	} else if (item->path != NULL) {
+		/* Peek at the parameters in the file's header. */
+		if ((f = fopen(item->path, "rb")) == NULL)
+			return (0);
+		if ((fread(header, 12, 1, f) < 1) ||
+		    (memcmp(header, "scrypt", 6) != 0)) {
+			fclose(f);
+			return (0);
+		}
+		fclose(f);
+		logN = header[7];
+		r = be32dec(&header[8]);
+	} else {
+		if ((item->inbuflen < 128) ||
+		    (memcmp(item->inbuf, "scrypt", 6) != 0))
+			return (0);
+		logN = item->inbuf[7];
+		r = be32dec(&item->inbuf[8]);
+	}
+	if ((logN < 1) || (logN > 63) || (r == 0))
+		return (0);
+	if (((uint64_t)(1) << logN) > SIZE_MAX / 128 / r)
+		return (0);
+
+	return ((size_t)(128 * r) << logN);
+}
+
+/**
+ * smallfile(batch, item, infile, outfile, len):
+ * Process the len-byte file infile for item with one read, one buffer
+ * call and one write to outfile.  Return -1 (with infile rewound) if the
+ * file turns out to be longer than len bytes, so that it gets streamed
+ * instead.
+ */
+static int
+smallfile(const struct batch * batch, struct scryptenc_batch_item * item,
+    FILE * infile, FILE * outfile, size_t len)
+{
+	uint8_t * inbuf;
+	uint8_t * outbuf = NULL;
+	uint8_t * outalloc = NULL;
+	size_t inlen, outlen;
+	int rc;
+
+	/* Read the whole file, and one byte more to see that it ends there. */
+	if ((inbuf = malloc(len + 1)) == NULL)
+		return (6);
+	inlen = fread(inbuf, 1, len + 1, infile);
+	if (ferror(infile)) {
+		rc = 13;
+		goto done;
+	}
+	if (inlen > len) {
+		rewind(infile);
+		rc = -1;
+		goto done;
+	}
+
+	if (batch->mode == SCRYPTENC_BATCH_ENCRYPT_FILE) {
+		if ((outbuf = malloc(inlen + 128)) == NULL) {
+			rc = 6;
+			goto done;
+		}
+		rc = scrypty_scryptenc_buf_profile(inbuf, inlen, outbuf,
+		    batch->passwd, batch->passwdlen, batch->profile);
+		outlen = inlen + 128;
+	} else if ((inlen > 6) && (inbuf[6] == 1)) {
+		rc = scrypty_scryptdec_buf_alloc(inbuf, inlen, &outalloc,
+		    &outlen, batch->passwd, batch->passwdlen, batch->profile);
+		outbuf = outalloc;
+	} else {
+		if ((outbuf = malloc(inlen + 1)) == NULL) {
+			rc = 6;
+			goto done;
+		}
+		rc = scrypty_scryptdec_buf_profile(inbuf, inlen, outbuf,
+		    &outlen, batch->passwd, batch->passwdlen, batch->profile);
+	}
+	if (rc)
+		goto done;
+
+	if ((outlen > 0) && (fwrite(outbuf, outlen, 1, outfile) < 1)) {
+		rc = 12;
+		goto done;
+	}
+	item->inbuflen = inlen;
+	item->outlen = outlen;
+
+done:
+	free(outbuf);
+	free(inbuf);
+	return (rc);
+}
+
+/**
+ * dofile(batch, item):
+ * Encrypt or decrypt the file named by item->path into the file named by
+ * item->outpath, removing the latter again on failure.
+ */
+static int
+dofile(const struct batch * batch, struct scryptenc_batch_item * item)
+{
+	struct stat sb;
+	FILE * infile;
+	FILE * outfile;
+	off_t pos;
+	int rc;
+
+	item->inbuflen = 0;
+	item->outlen = 0;
+	if ((infile = fopen(item->path, "rb")) == NULL)
+		return (13);
+	if (fstat(fileno(infile), &sb)) {
+		rc = 13;
+		goto err0;
+	}
+	if ((outfile = fopen(item->outpath, "wb")) == NULL) {
+		rc = 12;
+		goto err0;
+	}
+
+	/* Small files in one go, everything else through the stream loop. */
+	rc = -1;
+	if (S_ISREG(sb.st_mode) && (sb.st_size <= SCRYPTENC_BATCH_SMALLFILE))
+		rc = smallfile(batch, item, infile, outfile,
+		    (size_t)sb.st_size);
+	if (rc == -1) {
+		if (batch->mode == SCRYPTENC_BATCH_ENCRYPT_FILE)
+			rc = scrypty_scryptenc_file_profile(infile, outfile,
+			    batch->passwd, batch->passwdlen, batch->profile);
+		else
+			rc = scrypty_scryptdec_file_profile(infile, outfile,
+			    batch->passwd, batch->passwdlen, batch->profile);
+		if ((pos = ftello(infile)) > 0)
+			item->inbuflen = (size_t)pos;
+		if ((pos = ftello(outfile)) > 0)
+			item->outlen = (size_t)pos;
+	}
+
+	if (fclose(outfile) && (rc == 0))
+		rc = 12;
+	if (rc) {
+		unlink(item->outpath);
+		item->outlen = 0;
+	}
+
+err0:
+	fclose(infile);
+	return (rc);
+}
+
+/**
+ * worker(cookie):
+ * Process items from the batch until there are none left, or the batch
+ * has been cancelled.
+ */
+static void *
+worker(void * cookie)
+{
+	struct thread * thread = cookie;
+	struct batch * batch = thread->batch;
+	struct scryptenc_batch_item * item;
+	FILE * f;
+	size_t i;
+
+	scrypty_numa_bind(thread->node);
+	scrypty_budget_setcancel(batch->cancel);
+
+	do {
+		/* Claim the next item, unless we've been told to stop. */
+		if (scrypty_budget_cancelled())
+			break;
+		pthread_mutex_lock(&batch->mtx);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->mtx);
+		if (i >= batch->nitems)
+			break;
+		item = &batch->items[i];
+
+		switch (batch->mode) {
+		case SCRYPTENC_BATCH_ENCRYPT:
+			item->rc = scrypty_scryptenc_buf_profile(item->inbuf,
+			    item->inbuflen, item->outbuf, batch->passwd,
+			    batch->passwdlen, batch->profile);
+			item->outlen = item->inbuflen + 128;
+			break;
+		case SCRYPTENC_BATCH_DECRYPT:
+			item->outalloc = NULL;
+			if ((item->inbuflen > 6) && (item->inbuf[6] == 1)) {
+				item->rc = scrypty_scryptdec_buf_alloc(
+				    item->inbuf, item->inbuflen,
+				    &item->outalloc, &item->outlen,
+				    batch->passwd, batch->passwdlen,
+				    batch->profile);
+				if (item->outalloc != NULL)
+					item->outbuf = item->outalloc;
+				break;
+			}
+			item->rc = scrypty_scryptdec_buf_profile(item->inbuf,
+			    item->inbuflen, item->outbuf, &item->outlen,
+			    batch->passwd, batch->passwdlen, batch->profile);
+			break;
+		case SCRYPTENC_BATCH_VERIFY:
+			item->outlen = 0;
+			if (item->path == NULL) {
+				item->rc = scrypty_scryptdec_verify_buf(
+				    item->inbuf, item->inbuflen, batch->passwd,
+				    batch->passwdlen, batch->profile);
+			} else if ((f = fopen(item->path, "rb")) == NULL) {
+				item->rc = 13;
+			} else {
+				item->rc = scrypty_scryptdec_verify_file(f,
+				    batch->passwd, batch->passwdlen,
+				    batch->profile);
+				fclose(f);
+			}
+			break;
+		case SCRYPTENC_BATCH_DECRYPT_FILE:
+		case SCRYPTENC_BATCH_ENCRYPT_FILE:
+			item->rc = dofile(batch, item);
+			break;
+		}
+	} while (1);
+
+	return (NULL);
+}
+
+/**
+ * scrypty_scryptenc_batch(items, nitems, passwd, passwdlen, profile,
+ *     mode, nthreads, maxmemtotal):
+ * Encrypt, decrypt or verify (according to mode, one of the
+ * SCRYPTENC_BATCH_* values) each of the nitems items using the limits and
+ * parameters from profile, spreading the items over at most nthreads native
+ * threads.  The number of threads is further limited so that the V arrays
+ * of all derivations in flight fit in maxmemtotal bytes; if maxmemtotal is
+ * 0, half of the available storage is used.  Each item's result is
+ * reported in its rc field, and items not started before the batch was
+ * cancelled fail with 16; the batch as a whole fails (returning 1) only
+ * if the available storage cannot be determined.
+ */
+int
+scrypty_scryptenc_batch(struct scryptenc_batch_item * items, size_t nitems,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile, int mode, size_t nthreads,
+    size_t maxmemtotal)
+{
+	struct batch batch;
+	struct thread * threads;
+	struct thread self;
+	int * nodes;
+	size_t maxv, v;
+	size_t nstarted;
+	size_t i;
+
+	batch.items = items;
+	batch.nitems = nitems;
+	batch.passwd = passwd;
+	batch.passwdlen = passwdlen;
+	batch.profile = profile;
+	batch.mode = mode;
+	batch.cancel = scrypty_budget_getcancel();
+	batch.next = 0;
+
+	/* Figure out how much memory all the workers may use together. */
+	if ((maxmemtotal == 0) && scrypty_memtouse(0, 0.5, &maxmemtotal))
+		return (1);
+
+	/* No more threads than items, nor than the V arrays fit in memory. */
+	for (maxv = 0, i = 0; i < nitems; i++) {
+		if ((v = vsize(&batch, i)) > maxv)
+			maxv = v;
+	}
+	if (nthreads > nitems)
+		nthreads = nitems;
+	if ((maxv > 0) && (nthreads > maxmemtotal / maxv))
+		nthreads = maxmemtotal / maxv;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	/*
+	 * Start the workers, spread over the NUMA nodes by free memory; if we
+	 * can't start any, do the work ourselves.
+	 */
+	pthread_mutex_init(&batch.mtx, NULL);
+	nstarted = 0;
+	if ((nthreads > 1) &&
+	    ((threads = malloc(nthreads * sizeof(struct thread))) != NULL)) {
+		if ((nodes = malloc(nthreads * sizeof(int))) != NULL) {
+			scrypty_numa_spread(nodes, nthreads);
+			for (; nstarted < nthreads; nstarted++) {
+				threads[nstarted].batch = &batch;
+				threads[nstarted].node = nodes[nstarted];
+				if (pthread_create(&threads[nstarted].tid,
+				    NULL, worker, &threads[nstarted]))
+					break;
+			}
+			free(nodes);
+		}
+		for (i = 0; i < nstarted; i++)
+			pthread_join(threads[i].tid, NULL);
+		free(threads);
+	}
+	if (nstarted == 0) {
+		self.batch = &batch;
+		self.node = -1;
+		worker(&self);
+	}
+	pthread_mutex_destroy(&batch.mtx);
+
+	/* Anything not claimed was cancelled. */
+	for (i = batch.next; i < nitems; i++)
+		items[i].rc = 16;
+
+	/* Success! */
+	return (0);
+}
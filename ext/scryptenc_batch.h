@@ -0,0 +1,66 @@
+#ifndef _SCRYPTENC_BATCH_H_
+#define _SCRYPTENC_BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scryptenc.h"
+
+/* What a batch does with each of its items. */
+#define SCRYPTENC_BATCH_DECRYPT	0
+#define SCRYPTENC_BATCH_ENCRYPT	1
+#define SCRYPTENC_BATCH_VERIFY	2
+#define SCRYPTENC_BATCH_DECRYPT_FILE	3
+#define SCRYPTENC_BATCH_ENCRYPT_FILE	4
+
+/*
+ * Files this small are read whole and processed with a single buffer call
+ * and a single write; larger ones are streamed.
+ */
+#define SCRYPTENC_BATCH_SMALLFILE	(1024 * 1024)
+
+/**
+ * One buffer in a batch.  For encryption outbuf must have room for
+ * inbuflen + 128 bytes, and for decryption inbuflen bytes; verification
+ * writes no output, and checks the file named by path instead of inbuf if
+ * path is not NULL.  On return rc holds the scrypt(enc|dec)_buf (or
+ * scryptdec_verify_(buf|file)) return code for this item and outlen the
+ * number of bytes written to outbuf.  Decrypting compressed (version 1)
+ * data may need more room than inbuflen bytes, so its output is put in a
+ * buffer allocated with malloc instead; outbuf and outalloc then both point
+ * at it, and the caller must free outalloc.  The *_FILE modes read the file
+ * named by path and write the file named by outpath instead, leaving
+ * inbuf and outbuf alone; inbuflen and outlen are set to the number of
+ * bytes read and written, and outpath is removed again if rc is non-zero.
+ */
+struct scryptenc_batch_item {
+	const uint8_t * inbuf;
+	size_t inbuflen;
+	const char * path;
+	const char * outpath;
+	uint8_t * outbuf;
+	size_t outlen;
+	uint8_t * outalloc;
+	int rc;
+};
+
+/**
+ * scrypty_scryptenc_batch(items, nitems, passwd, passwdlen, profile,
+ *     mode, nthreads, maxmemtotal):
+ * Encrypt, decrypt or verify (according to mode, one of the
+ * SCRYPTENC_BATCH_* values) each of the nitems items using the limits and
+ * parameters from profile, spreading the items over at most nthreads native
+ * threads (themselves spread over the NUMA nodes).  The number of threads
+ * is further limited so that the V arrays of all derivations in flight fit
+ * in maxmemtotal bytes; if maxmemtotal is 0, half of the available storage
+ * is used.  The workers share the calling thread's cancellation flag (see
+ * scrypty_budget_setcancel), and once it is set stop taking items.  Each
+ * item's result is reported in its rc field, and items never started fail
+ * with 16; the batch as a whole fails (returning 1) only if the available
+ * storage cannot be determined.
+ */
+int scrypty_scryptenc_batch(struct scryptenc_batch_item *, size_t,
+    const uint8_t *, size_t, const struct scryptenc_profile *, int, size_t,
+    size_t);
+
+#endif /* !_SCRYPTENC_BATCH_H_ */
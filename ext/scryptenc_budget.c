@@ -0,0 +1,344 @@
+#include "scrypt_platform.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "scryptenc_budget.h"
+
+/*
+ * Waiting derivations queue in a list kept in policy order; only the head
+ * of the queue may take memory, so a large request is not starved by a
+ * stream of small ones.  Every change wakes all waiters and each checks
+ * whether it is now the head and fits.
+ */
+struct waiter {
+	size_t nbytes;
+	int priority;
+	uint64_t ticket;
+	struct waiter * next;
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_cond_t cv;
+static struct waiter * queue = NULL;
+static struct scryptenc_budget_stats budget;
+static uint64_t nextticket = 0;
+
+/* Waiting attributes of the calling thread. */
+static __thread int mypriority = 0;
+static __thread double mytimeout = 0;
+static __thread int * mycancel = NULL;
+
+static void
+init(void)
+{
+	pthread_condattr_t attr;
+
+	/* Time out against the monotonic clock where we can. */
+	pthread_condattr_init(&attr);
+#ifdef CLOCK_MONOTONIC
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&cv, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/**
+ * now(ts):
+ * Read the clock used for timeouts into ts.
+ */
+static int
+now(struct timespec * ts)
+{
+
+#ifdef CLOCK_MONOTONIC
+	return (clock_gettime(CLOCK_MONOTONIC, ts));
+#else
+	return (clock_gettime(CLOCK_REALTIME, ts));
+#endif
+}
+
+/**
+ * fits(nbytes):
+ * Return non-zero if nbytes more bytes fit in the budget.  The mutex must
+ * be held.
+ */
+static int
+fits(size_t nbytes)
+{
+
+	return ((budget.limit == 0) || (budget.inuse == 0) ||
+	    ((budget.inuse <= budget.limit) &&
+	    (nbytes <= budget.limit - budget.inuse)));
+}
+
+/**
+ * before(a, b):
+ * Return non-zero if waiter a goes ahead of waiter b under the current
+ * policy.  The mutex must be held.
+ */
+static int
+before(const struct waiter * a, const struct waiter * b)
+{
+
+	if ((budget.policy == BUDGET_PRIORITY) && (a->priority != b->priority))
+		return (a->priority > b->priority);
+	return (a->ticket < b->ticket);
+}
+
+/**
+ * enqueue(w):
+ * Insert w into the queue in policy order.  The mutex must be held.
+ */
+static void
+enqueue(struct waiter * w)
+{
+	struct waiter ** p;
+
+	for (p = &queue; (*p != NULL) && before(*p, w); p = &(*p)->next)
+		continue;
+	w->next = *p;
+	*p = w;
+}
+
+/**
+ * dequeue(w):
+ * Remove w from the queue.  The mutex must be held.
+ */
+static void
+dequeue(struct waiter * w)
+{
+	struct waiter ** p;
+
+	for (p = &queue; *p != w; p = &(*p)->next)
+		continue;
+	*p = w->next;
+}
+
+/**
+ * scrypty_budget_set(limit, policy):
+ * Limit the total size of V arrays to limit bytes, granting memory in
+ * policy order.
+ */
+void
+scrypty_budget_set(size_t limit, int policy)
+{
+	struct waiter * w;
+	struct waiter * waiters;
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&mtx);
+	budget.limit = limit;
+
+	/* Re-sort the queue if the policy changed. */
+	if (budget.policy != policy) {
+		budget.policy = policy;
+		waiters = queue;
+		queue = NULL;
+		while ((w = waiters) != NULL) {
+			waiters = w->next;
+			enqueue(w);
+		}
+	}
+	pthread_cond_broadcast(&cv);
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * scrypty_budget_setattr(priority, timeout):
+ * Set the priority and timeout with which the calling thread waits.
+ */
+void
+scrypty_budget_setattr(int priority, double timeout)
+{
+
+	mypriority = priority;
+	mytimeout = timeout;
+}
+
+/**
+ * scrypty_budget_getattr(priority, timeout):
+ * Read back the calling thread's waiting attributes.
+ */
+void
+scrypty_budget_getattr(int * priority, double * timeout)
+{
+
+	*priority = mypriority;
+	*timeout = mytimeout;
+}
+
+/**
+ * scrypty_budget_setcancel(cancel):
+ * Give up the calling thread's waits once *cancel is non-zero.
+ */
+void
+scrypty_budget_setcancel(int * cancel)
+{
+
+	mycancel = cancel;
+}
+
+/**
+ * scrypty_budget_getcancel(void):
+ * Read back the calling thread's cancellation flag.
+ */
+int *
+scrypty_budget_getcancel(void)
+{
+
+	return (mycancel);
+}
+
+/**
+ * scrypty_budget_wake(void):
+ * Wake all waiters to check their cancellation flags.
+ */
+void
+scrypty_budget_wake(void)
+{
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&mtx);
+	pthread_cond_broadcast(&cv);
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * scrypty_budget_cancelled(void):
+ * Return non-zero, and note that it was acted on, if the calling thread
+ * has been cancelled.
+ */
+int
+scrypty_budget_cancelled(void)
+{
+
+	if ((mycancel == NULL) ||
+	    !(__atomic_load_n(mycancel, __ATOMIC_ACQUIRE) & BUDGET_CANCEL))
+		return (0);
+	__atomic_or_fetch(mycancel, BUDGET_CANCELLED, __ATOMIC_RELAXED);
+	return (1);
+}
+
+/**
+ * scrypty_budget_acquire(nbytes):
+ * Wait until nbytes bytes of the budget are free and take them.
+ */
+int
+scrypty_budget_acquire(size_t nbytes)
+{
+	struct waiter w;
+	struct timespec start, end, deadline;
+	int timedout = 0;
+	int gaveup = 0;
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&mtx);
+
+	/* Take the memory straight away if nobody is ahead of us. */
+	if ((queue == NULL) && fits(nbytes)) {
+		budget.inuse += nbytes;
+		budget.acquired += 1;
+		pthread_mutex_unlock(&mtx);
+		return (0);
+	}
+
+	/* Work out when to give up. */
+	if (now(&start)) {
+		pthread_mutex_unlock(&mtx);
+		return (-1);
+	}
+	if (mytimeout > 0) {
+		deadline.tv_sec = start.tv_sec + (time_t)mytimeout;
+		deadline.tv_nsec = start.tv_nsec +
+		    (long)((mytimeout - (time_t)mytimeout) * 1000000000);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	/* Queue up. */
+	w.nbytes = nbytes;
+	w.priority = mypriority;
+	w.ticket = nextticket++;
+	enqueue(&w);
+	budget.waits += 1;
+	budget.waiting += 1;
+	if (budget.waiting > budget.maxwaiting)
+		budget.maxwaiting = budget.waiting;
+
+	/* Wait until we are at the head of the queue and fit. */
+	while ((queue != &w) || !fits(nbytes)) {
+		if (scrypty_budget_cancelled()) {
+			gaveup = 1;
+			break;
+		}
+		if (mytimeout > 0) {
+			if (pthread_cond_timedwait(&cv, &mtx, &deadline) ==
+			    ETIMEDOUT) {
+				timedout = (queue != &w) || !fits(nbytes);
+				break;
+			}
+		} else
+			pthread_cond_wait(&cv, &mtx);
+	}
+	dequeue(&w);
+	budget.waiting -= 1;
+	if (now(&end) == 0)
+		budget.wait_ns += (uint64_t)(end.tv_sec - start.tv_sec) *
+		    1000000000 + end.tv_nsec - start.tv_nsec;
+
+	if (timedout) {
+		budget.timeouts += 1;
+	} else if (!gaveup) {
+		budget.inuse += nbytes;
+		budget.acquired += 1;
+	}
+
+	/* Whoever is now at the head may be able to go too. */
+	pthread_cond_broadcast(&cv);
+	pthread_mutex_unlock(&mtx);
+
+	if (timedout) {
+		errno = ETIMEDOUT;
+		return (-1);
+	}
+	if (gaveup) {
+		errno = ECANCELED;
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * scrypty_budget_release(nbytes):
+ * Return nbytes bytes to the budget.
+ */
+void
+scrypty_budget_release(size_t nbytes)
+{
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&mtx);
+	budget.inuse -= nbytes;
+	if (queue != NULL)
+		pthread_cond_broadcast(&cv);
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * scrypty_budget_stats(stats):
+ * Store the state and counters of the budget into stats.
+ */
+void
+scrypty_budget_stats(struct scryptenc_budget_stats * stats)
+{
+
+	pthread_mutex_lock(&mtx);
+	*stats = budget;
+	pthread_mutex_unlock(&mtx);
+}
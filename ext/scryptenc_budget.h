@@ -0,0 +1,106 @@
+#ifndef _SCRYPTENC_BUDGET_H_
+#define _SCRYPTENC_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Order in which waiting derivations are given memory. */
+#define BUDGET_FIFO	0
+#define BUDGET_PRIORITY	1
+
+/* Bits of a cancellation flag (see scrypty_budget_setcancel). */
+#define BUDGET_CANCEL	1
+#define BUDGET_CANCELLED	2
+
+struct scryptenc_budget_stats {
+	size_t limit;
+	size_t inuse;
+	int policy;
+	uint64_t waiting;
+	uint64_t maxwaiting;
+	uint64_t acquired;
+	uint64_t waits;
+	uint64_t timeouts;
+	uint64_t wait_ns;
+};
+
+/**
+ * scrypty_budget_set(limit, policy):
+ * Limit the total size of the V arrays of all key derivations in the
+ * process to limit bytes (0 for no limit), granting memory to waiting
+ * derivations in policy order: BUDGET_FIFO in order of arrival, or
+ * BUDGET_PRIORITY highest priority first (and in order of arrival within a
+ * priority).  Derivations already holding memory keep it.
+ */
+void scrypty_budget_set(size_t, int);
+
+/**
+ * scrypty_budget_setattr(priority, timeout):
+ * Set the priority with which the calling thread waits for memory, and the
+ * longest it waits, in seconds (0 to wait as long as it takes).  Threads
+ * start out with priority 0 and no timeout.
+ */
+void scrypty_budget_setattr(int, double);
+
+/**
+ * scrypty_budget_getattr(priority, timeout):
+ * Store the priority and timeout set with scrypty_budget_setattr for the
+ * calling thread into priority and timeout.
+ */
+void scrypty_budget_getattr(int *, double *);
+
+/**
+ * scrypty_budget_setcancel(cancel):
+ * Make the calling thread's waits for memory give up once BUDGET_CANCEL is
+ * set in *cancel, and set BUDGET_CANCELLED in it when they do; or never
+ * give up if cancel is NULL (as threads start out).  Whoever sets
+ * BUDGET_CANCEL must then call scrypty_budget_wake.
+ */
+void scrypty_budget_setcancel(int *);
+
+/**
+ * scrypty_budget_getcancel(void):
+ * Return the pointer set with scrypty_budget_setcancel for the calling
+ * thread.
+ */
+int * scrypty_budget_getcancel(void);
+
+/**
+ * scrypty_budget_cancelled(void):
+ * Return non-zero if BUDGET_CANCEL is set in the calling thread's
+ * cancellation flag, setting BUDGET_CANCELLED in it as well: work which
+ * asks is expected to stop short.
+ */
+int scrypty_budget_cancelled(void);
+
+/**
+ * scrypty_budget_wake(void):
+ * Wake every thread waiting for memory to check whether it was cancelled.
+ */
+void scrypty_budget_wake(void);
+
+/**
+ * scrypty_budget_acquire(nbytes):
+ * Wait until nbytes bytes of the budget are free and take them.  A request
+ * larger than the whole budget is granted once nothing else is in use.
+ * Return 0 on success, or -1 with errno set to ETIMEDOUT if the calling
+ * thread's timeout expired first, or to ECANCELED if its wait was
+ * cancelled (see scrypty_budget_setcancel).
+ */
+int scrypty_budget_acquire(size_t);
+
+/**
+ * scrypty_budget_release(nbytes):
+ * Return nbytes bytes taken with scrypty_budget_acquire to the budget.
+ */
+void scrypty_budget_release(size_t);
+
+/**
+ * scrypty_budget_stats(stats):
+ * Store the limit, the memory in use, the current and highest number of
+ * waiting derivations, and counts of grants, waits, timeouts and the total
+ * time spent waiting into stats.
+ */
+void scrypty_budget_stats(struct scryptenc_budget_stats *);
+
+#endif /* !_SCRYPTENC_BUDGET_H_ */
@@ -0,0 +1,482 @@
+#include "scrypt_platform.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4FRAME_H
+#include <lz4frame.h>
+#endif
+
+#include "scryptenc_stats.h"
+
+#include "scryptenc_compress.h"
+
+/* Size of the output buffer filled by the library between calls to the sink. */
+#define ZBUFSIZE	65536
+
+/* Largest input handed to LZ4F_compressUpdate at once. */
+#define LZ4CHUNK	65536
+
+static size_t inflateratio = INFLATE_RATIO;
+
+struct scryptenc_zstream {
+	int algo;
+	int compress;
+	int started;
+	int ended;
+	scryptenc_zsink * sink;
+	void * cookie;
+	uint64_t sinkns;
+	uint64_t inbytes;	/* Fed to zstream_write so far... */
+	uint64_t outbytes;	/* ... and handed to the sink. */
+#ifdef HAVE_ZLIB_H
+	z_stream z;
+#endif
+#ifdef HAVE_ZSTD_H
+	ZSTD_CCtx * zcctx;
+	ZSTD_DCtx * zdctx;
+#endif
+#ifdef HAVE_LZ4FRAME_H
+	LZ4F_cctx * lcctx;
+	LZ4F_dctx * ldctx;
+	size_t lbufsize;
+#endif
+	uint8_t * buf;
+};
+
+/**
+ * emit(z, buf, buflen):
+ * Pass buflen bytes of output to the sink, keeping track of the time spent
+ * there so that it isn't counted as compression.
+ */
+static int
+emit(struct scryptenc_zstream * z, const uint8_t * buf, size_t buflen)
+{
+	uint64_t st;
+	size_t ratio;
+	int rc;
+
+	if (buflen == 0)
+		return (0);
+
+	/* Stop a decompression bomb before it reaches the sink. */
+	z->outbytes += buflen;
+	if (!z->compress && (ratio = scrypty_compress_get_ratio()) != 0 &&
+	    (z->outbytes > INFLATE_FLOOR) &&
+	    (z->outbytes / ratio > z->inbytes))
+		return (15);
+
+	st = scrypty_stats_now();
+	rc = z->sink(z->cookie, buf, buflen);
+	z->sinkns += scrypty_stats_now() - st;
+	return (rc);
+}
+
+/**
+ * scrypty_compress_set_ratio(ratio):
+ * Limit decompression to ratio times its input.
+ */
+void
+scrypty_compress_set_ratio(size_t ratio)
+{
+
+	__atomic_store_n(&inflateratio, ratio, __ATOMIC_RELAXED);
+}
+
+/**
+ * scrypty_compress_get_ratio(void):
+ * Return the decompression ratio limit.
+ */
+size_t
+scrypty_compress_get_ratio(void)
+{
+
+	return (__atomic_load_n(&inflateratio, __ATOMIC_RELAXED));
+}
+
+/**
+ * scrypty_compress_supported(algo):
+ * Return non-zero if algo is compiled in.
+ */
+int
+scrypty_compress_supported(int algo)
+{
+
+	switch (algo) {
+#ifdef HAVE_ZLIB_H
+	case SCRYPTENC_COMPRESS_ZLIB:
+		return (1);
+#endif
+#ifdef HAVE_ZSTD_H
+	case SCRYPTENC_COMPRESS_ZSTD:
+		return (1);
+#endif
+#ifdef HAVE_LZ4FRAME_H
+	case SCRYPTENC_COMPRESS_LZ4:
+		return (1);
+#endif
+	default:
+		return (0);
+	}
+}
+
+/**
+ * scrypty_zstream_init(algo, compress, sink, cookie):
+ * Prepare a compression or decompression stream.
+ */
+struct scryptenc_zstream *
+scrypty_zstream_init(int algo, int compress, scryptenc_zsink * sink,
+    void * cookie)
+{
+	struct scryptenc_zstream * z;
+	size_t bufsize = ZBUFSIZE;
+
+	if (!scrypty_compress_supported(algo))
+		goto err0;
+	if ((z = calloc(1, sizeof(struct scryptenc_zstream))) == NULL)
+		goto err0;
+	z->algo = algo;
+	z->compress = compress;
+	z->sink = sink;
+	z->cookie = cookie;
+
+	switch (algo) {
+#ifdef HAVE_ZLIB_H
+	case SCRYPTENC_COMPRESS_ZLIB:
+		if (compress) {
+			if (deflateInit(&z->z, Z_DEFAULT_COMPRESSION) != Z_OK)
+				goto err1;
+		} else {
+			if (inflateInit(&z->z) != Z_OK)
+				goto err1;
+		}
+		break;
+#endif
+#ifdef HAVE_ZSTD_H
+	case SCRYPTENC_COMPRESS_ZSTD:
+		if (compress) {
+			if ((z->zcctx = ZSTD_createCCtx()) == NULL)
+				goto err1;
+		} else {
+			if ((z->zdctx = ZSTD_createDCtx()) == NULL)
+				goto err1;
+		}
+		break;
+#endif
+#ifdef HAVE_LZ4FRAME_H
+	case SCRYPTENC_COMPRESS_LZ4:
+		if (compress) {
+			if (LZ4F_isError(LZ4F_createCompressionContext(
+			    &z->lcctx, LZ4F_VERSION)))
+				goto err1;
+			bufsize = LZ4F_compressBound(LZ4CHUNK, NULL);
+			if (bufsize < LZ4F_HEADER_SIZE_MAX)
+				bufsize = LZ4F_HEADER_SIZE_MAX;
+		} else {
+			if (LZ4F_isError(LZ4F_createDecompressionContext(
+			    &z->ldctx, LZ4F_VERSION)))
+				goto err1;
+		}
+		z->lbufsize = bufsize;
+		break;
+#endif
+	}
+
+	if ((z->buf = malloc(bufsize)) == NULL)
+		goto err2;
+
+	/* Success! */
+	return (z);
+
+err2:
+	z->buf = NULL;
+	scrypty_zstream_free(z);
+	goto err0;
+err1:
+	free(z);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+#ifdef HAVE_ZLIB_H
+/**
+ * zlib_chunk(z, buf, buflen, flush):
+ * Feed buf, of at most UINT_MAX bytes, to zlib with the given flush mode,
+ * emitting its output.
+ */
+static int
+zlib_chunk(struct scryptenc_zstream * z, const uint8_t * buf, size_t buflen,
+    int flush)
+{
+	size_t outlen;
+	int zrc;
+	int rc;
+
+	z->z.next_in = (Bytef *)(uintptr_t)buf;
+	z->z.avail_in = (uInt)buflen;
+	do {
+		z->z.next_out = z->buf;
+		z->z.avail_out = ZBUFSIZE;
+		if (z->compress)
+			zrc = deflate(&z->z, flush);
+		else
+			zrc = inflate(&z->z, Z_NO_FLUSH);
+		if ((zrc != Z_OK) && (zrc != Z_STREAM_END) &&
+		    (zrc != Z_BUF_ERROR))
+			return (15);
+		outlen = ZBUFSIZE - z->z.avail_out;
+		if ((rc = emit(z, z->buf, outlen)) != 0)
+			return (rc);
+		if (zrc == Z_STREAM_END) {
+			z->ended = 1;
+			break;
+		}
+	} while ((z->z.avail_in > 0) || (z->z.avail_out == 0));
+
+	/* Nothing may follow the end of a compressed stream. */
+	if (!z->compress && (z->z.avail_in > 0))
+		return (15);
+	return (0);
+}
+
+/**
+ * zlib_run(z, buf, buflen, flush):
+ * Feed buf to zlib in pieces that fit its 32-bit counts, with the flush
+ * mode applying to the last.
+ */
+static int
+zlib_run(struct scryptenc_zstream * z, const uint8_t * buf, size_t buflen,
+    int flush)
+{
+	size_t len;
+	int rc;
+
+	do {
+		len = (buflen > UINT_MAX) ? UINT_MAX : buflen;
+		if ((rc = zlib_chunk(z, buf, len,
+		    (len == buflen) ? flush : Z_NO_FLUSH)) != 0)
+			return (rc);
+		buf += len;
+		buflen -= len;
+	} while (buflen > 0);
+	return (0);
+}
+#endif
+
+#ifdef HAVE_ZSTD_H
+/**
+ * zstd_run(z, buf, buflen, end):
+ * Feed buf to zstd, ending the frame if end is non-zero, emitting its
+ * output.
+ */
+static int
+zstd_run(struct scryptenc_zstream * z, const uint8_t * buf, size_t buflen,
+    int end)
+{
+	ZSTD_inBuffer in = { buf, buflen, 0 };
+	ZSTD_outBuffer out;
+	size_t zrc;
+	int rc;
+
+	do {
+		out.dst = z->buf;
+		out.size = ZBUFSIZE;
+		out.pos = 0;
+		if (z->compress)
+			zrc = ZSTD_compressStream2(z->zcctx, &out, &in,
+			    end ? ZSTD_e_end : ZSTD_e_continue);
+		else
+			zrc = ZSTD_decompressStream(z->zdctx, &out, &in);
+		if (ZSTD_isError(zrc))
+			return (15);
+		if ((rc = emit(z, z->buf, out.pos)) != 0)
+			return (rc);
+		if (!z->compress && (zrc == 0)) {
+			z->ended = 1;
+			break;
+		}
+	} while ((in.pos < in.size) || (out.pos == out.size) ||
+	    (z->compress && end && (zrc != 0)));
+
+	if (!z->compress && (in.pos < in.size))
+		return (15);
+	return (0);
+}
+#endif
+
+#ifdef HAVE_LZ4FRAME_H
+/**
+ * lz4_run(z, buf, buflen):
+ * Feed buf to LZ4, emitting its output.
+ */
+static int
+lz4_run(struct scryptenc_zstream * z, const uint8_t * buf, size_t buflen)
+{
+	size_t inlen, outlen, zrc;
+	int rc;
+
+	/* Start the frame before the first data. */
+	if (z->compress && !z->started) {
+		zrc = LZ4F_compressBegin(z->lcctx, z->buf, z->lbufsize, NULL);
+		if (LZ4F_isError(zrc))
+			return (15);
+		if ((rc = emit(z, z->buf, zrc)) != 0)
+			return (rc);
+		z->started = 1;
+	}
+
+	if (z->compress) {
+		while (buflen > 0) {
+			inlen = (buflen > LZ4CHUNK) ? LZ4CHUNK : buflen;
+			zrc = LZ4F_compressUpdate(z->lcctx, z->buf,
+			    z->lbufsize, buf, inlen, NULL);
+			if (LZ4F_isError(zrc))
+				return (15);
+			if ((rc = emit(z, z->buf, zrc)) != 0)
+				return (rc);
+			buf += inlen;
+			buflen -= inlen;
+		}
+		return (0);
+	}
+
+	/* Decompress until the input is used up and the output drained. */
+	do {
+		if (z->ended)
+			return ((buflen > 0) ? 15 : 0);
+		inlen = buflen;
+		outlen = z->lbufsize;
+		zrc = LZ4F_decompress(z->ldctx, z->buf, &outlen, buf, &inlen,
+		    NULL);
+		if (LZ4F_isError(zrc))
+			return (15);
+		if (zrc == 0)
+			z->ended = 1;
+		if ((rc = emit(z, z->buf, outlen)) != 0)
+			return (rc);
+		buf += inlen;
+		buflen -= inlen;
+	} while ((buflen > 0) || (outlen == z->lbufsize));
+	return (0);
+}
+#endif
+
+/**
+ * run(z, buf, buflen, finish):
+ * Feed buf to the library for z, finishing the stream if finish is set.
+ */
+static int
+run(struct scryptenc_zstream * z, const uint8_t * buf, size_t buflen,
+    int finish)
+{
+	uint64_t st;
+	int rc = 15;
+#ifdef HAVE_LZ4FRAME_H
+	size_t zrc;
+#endif
+
+	st = scrypty_stats_now();
+	z->sinkns = 0;
+	switch (z->algo) {
+#ifdef HAVE_ZLIB_H
+	case SCRYPTENC_COMPRESS_ZLIB:
+		rc = zlib_run(z, buf, buflen, finish ? Z_FINISH : Z_NO_FLUSH);
+		break;
+#endif
+#ifdef HAVE_ZSTD_H
+	case SCRYPTENC_COMPRESS_ZSTD:
+		rc = zstd_run(z, buf, buflen, finish);
+		break;
+#endif
+#ifdef HAVE_LZ4FRAME_H
+	case SCRYPTENC_COMPRESS_LZ4:
+		if ((rc = lz4_run(z, buf, buflen)) != 0)
+			break;
+		if (finish && z->compress) {
+			zrc = LZ4F_compressEnd(z->lcctx, z->buf, z->lbufsize,
+			    NULL);
+			if (LZ4F_isError(zrc)) {
+				rc = 15;
+				break;
+			}
+			rc = emit(z, z->buf, zrc);
+		}
+		break;
+#endif
+	}
+	scrypty_stats_phase(STATS_COMPRESS, st + z->sinkns);
+	return (rc);
+}
+
+/**
+ * scrypty_zstream_write(z, buf, buflen):
+ * Compress or decompress buflen bytes from buf.
+ */
+int
+scrypty_zstream_write(struct scryptenc_zstream * z, const uint8_t * buf,
+    size_t buflen)
+{
+
+	if (buflen == 0)
+		return (0);
+	z->inbytes += buflen;
+	return (run(z, buf, buflen, 0));
+}
+
+/**
+ * scrypty_zstream_finish(z):
+ * Finish compressing, or check that decompression reached the end.
+ */
+int
+scrypty_zstream_finish(struct scryptenc_zstream * z)
+{
+
+	if (z->compress)
+		return (run(z, NULL, 0, 1));
+	return (z->ended ? 0 : 15);
+}
+
+/**
+ * scrypty_zstream_free(z):
+ * Free the stream z.
+ */
+void
+scrypty_zstream_free(struct scryptenc_zstream * z)
+{
+
+	switch (z->algo) {
+#ifdef HAVE_ZLIB_H
+	case SCRYPTENC_COMPRESS_ZLIB:
+		if (z->compress)
+			deflateEnd(&z->z);
+		else
+			inflateEnd(&z->z);
+		break;
+#endif
+#ifdef HAVE_ZSTD_H
+	case SCRYPTENC_COMPRESS_ZSTD:
+		ZSTD_freeCCtx(z->zcctx);
+		ZSTD_freeDCtx(z->zdctx);
+		break;
+#endif
+#ifdef HAVE_LZ4FRAME_H
+	case SCRYPTENC_COMPRESS_LZ4:
+		if (z->lcctx != NULL)
+			LZ4F_freeCompressionContext(z->lcctx);
+		if (z->ldctx != NULL)
+			LZ4F_freeDecompressionContext(z->ldctx);
+		break;
+#endif
+	}
+	free(z->buf);
+	free(z);
+}
@@ -0,0 +1,78 @@
+#ifndef _SCRYPTENC_COMPRESS_H_
+#define _SCRYPTENC_COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scryptenc.h"
+
+/**
+ * Output of a compression stream is handed to a sink as it is produced.
+ * A sink returns 0 to continue, or a scryptenc return code, which the
+ * stream function then returns.
+ */
+typedef int scryptenc_zsink(void *, const uint8_t *, size_t);
+
+struct scryptenc_zstream;
+
+/*
+ * Decompression gives up (with 15) once its output exceeds the larger of
+ * INFLATE_FLOOR bytes and the ratio set with scrypty_compress_set_ratio
+ * (INFLATE_RATIO unless changed) times the compressed bytes seen so far,
+ * so that a small input can't expand into an arbitrarily large one.
+ */
+#define INFLATE_RATIO	1024
+#define INFLATE_FLOOR	(16 * 1024 * 1024)
+
+/**
+ * scrypty_compress_set_ratio(ratio):
+ * Limit decompression to ratio times its input (0 for no limit).
+ */
+void scrypty_compress_set_ratio(size_t);
+
+/**
+ * scrypty_compress_get_ratio(void):
+ * Return the ratio set with scrypty_compress_set_ratio.
+ */
+size_t scrypty_compress_get_ratio(void);
+
+/**
+ * scrypty_compress_supported(algo):
+ * Return non-zero if this build can compress and decompress with algo (one
+ * of the SCRYPTENC_COMPRESS_* values other than _NONE).
+ */
+int scrypty_compress_supported(int);
+
+/**
+ * scrypty_zstream_init(algo, compress, sink, cookie):
+ * Prepare to compress (if compress is non-zero) or decompress a stream with
+ * algo, passing the output to sink(cookie, buf, buflen).  Return NULL if
+ * algo is not supported or on allocation failure.
+ */
+struct scryptenc_zstream * scrypty_zstream_init(int, int, scryptenc_zsink *,
+    void *);
+
+/**
+ * scrypty_zstream_write(z, buf, buflen):
+ * Compress or decompress the next buflen bytes of the stream from buf.
+ * Return 0 on success, 15 if the library failed, the compressed data is
+ * corrupt or it inflates past the limit, or the return code of the sink.
+ */
+int scrypty_zstream_write(struct scryptenc_zstream *, const uint8_t *,
+    size_t);
+
+/**
+ * scrypty_zstream_finish(z):
+ * When compressing, flush the end of the stream to the sink; when
+ * decompressing, check that the whole compressed stream has been seen.
+ * Return codes are as for scrypty_zstream_write.
+ */
+int scrypty_zstream_finish(struct scryptenc_zstream *);
+
+/**
+ * scrypty_zstream_free(z):
+ * Free the stream z.
+ */
+void scrypty_zstream_free(struct scryptenc_zstream *);
+
+#endif /* !_SCRYPTENC_COMPRESS_H_ */
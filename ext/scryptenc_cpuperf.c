@@ -30,22 +30,31 @@
 
 #include <sys/time.h>
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
 #include "crypto_scrypt.h"
+#include "scryptenc_stats.h"
+#include "scrypty_probes.h"
 
 #include "scryptenc_cpuperf.h"
 
 #ifdef HAVE_CLOCK_GETTIME
 
-static clock_t clocktouse;
+/*
+ * The clock is picked once per process, so that threads calibrating at the
+ * same time (from different Ractors, say) never see it half-chosen.
+ */
+static pthread_once_t clockonce = PTHREAD_ONCE_INIT;
+static clockid_t clocktouse;
+static int clockok = 0;
+static struct timespec clockres;
 
-static int
-getclockres(double * resd)
+static void
+pickclock(void)
 {
-	struct timespec res;
 
 	/*
 	 * Try clocks in order of preference until we find one which works.
@@ -54,22 +63,33 @@ getclockres(double * resd)
 	 * is ugly but legal, and allows us to #ifdef things appropriately.
 	 */
 #ifdef CLOCK_VIRTUAL
-	if (clock_getres(CLOCK_VIRTUAL, &res) == 0)
+	if (clock_getres(CLOCK_VIRTUAL, &clockres) == 0)
 		clocktouse = CLOCK_VIRTUAL;
 	else
 #endif
 #ifdef CLOCK_MONOTONIC
-	if (clock_getres(CLOCK_MONOTONIC, &res) == 0)
+	if (clock_getres(CLOCK_MONOTONIC, &clockres) == 0)
 		clocktouse = CLOCK_MONOTONIC;
 	else
 #endif
-	if (clock_getres(CLOCK_REALTIME, &res) == 0)
+	if (clock_getres(CLOCK_REALTIME, &clockres) == 0)
 		clocktouse = CLOCK_REALTIME;
 	else
+		return;
+
+	clockok = 1;
+}
+
+static int
+getclockres(double * resd)
+{
+
+	pthread_once(&clockonce, pickclock);
+	if (!clockok)
 		return (-1);
 
 	/* Convert clock resolution to a double. */
-	*resd = res.tv_sec + res.tv_nsec * 0.000000001;
+	*resd = clockres.tv_sec + clockres.tv_nsec * 0.000000001;
 
 	return (0);
 }
@@ -181,5 +201,28 @@ scrypty_scryptenc_cpuperf(double * opps)
 
 	/* We can do approximately i salsa20/8 cores per diffd seconds. */
 	*opps = i / diffd;
+	SCRYPTY_PROBE3(cpuperf, (uint64_t)(*opps), i,
+	    (uint64_t)(diffd * 1000000000));
 	return (0);
 }
+
+/**
+ * scrypty_scryptenc_cpuperf_cached(opps):
+ * As scrypty_scryptenc_cpuperf, but measure only until it first succeeds.
+ */
+int
+scrypty_scryptenc_cpuperf_cached(double * opps)
+{
+	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+	static double cached = 0;
+	int rc = 0;
+
+	pthread_mutex_lock(&mtx);
+	if ((cached == 0) &&
+	    ((rc = scrypty_scryptenc_cpuperf(&cached)) == 0))
+		scrypty_stats_calibration(cached);
+	*opps = cached;
+	pthread_mutex_unlock(&mtx);
+
+	return (rc);
+}
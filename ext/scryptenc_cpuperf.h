@@ -36,4 +36,12 @@
  */
 int scrypty_scryptenc_cpuperf(double *);
 
+/**
+ * scrypty_scryptenc_cpuperf_cached(opps):
+ * As scrypty_scryptenc_cpuperf, but only measure the first time this is
+ * called (or until a measurement succeeds), returning the same value from
+ * then on.  Safe to call from several threads at once.
+ */
+int scrypty_scryptenc_cpuperf_cached(double *);
+
 #endif /* !_SCRYPTENC_CPUPERF_H_ */
@@ -0,0 +1,283 @@
+#include "scrypt_platform.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+
+#include <openssl/aes.h>
+
+#include "sha256.h"
+#include "sysendian.h"
+
+#include "scryptenc_entropy.h"
+
+/* Bytes of output generated per refill, after the 32 which become the key. */
+#define RNGBUF	512
+
+/* Bytes of output between reseeds from the operating system. */
+#define RESEED	(1024 * 1024)
+
+struct rng {
+	AES_KEY key;
+	uint8_t buf[RNGBUF];
+	size_t pos;
+	uint64_t outsince;
+	unsigned int generation;
+};
+
+/* Generator of the calling thread; generation 0 means never seeded. */
+static __thread struct rng rng;
+
+/* The one generator all threads share (under mtx) while the seed is fixed. */
+static struct rng shared;
+
+/*
+ * Bumped in the child after a fork and whenever the seed changes; a thread
+ * whose generator is from an older generation reseeds before using it.
+ */
+static volatile unsigned int generation = 1;
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static volatile int fixed = 0;
+static uint8_t fixedseed[32];
+
+static void
+atfork_child(void)
+{
+
+	generation += 1;
+}
+
+static void
+init(void)
+{
+
+	pthread_atfork(NULL, NULL, atfork_child);
+}
+
+/**
+ * osentropy(buf, buflen):
+ * Fill buf with buflen bytes of entropy from the operating system.
+ */
+static int
+osentropy(uint8_t * buf, size_t buflen)
+{
+	ssize_t lenread;
+	int fd;
+
+#ifdef HAVE_GETRANDOM
+	/* Use getrandom, unless the kernel doesn't have it. */
+	while (buflen > 0) {
+		if ((lenread = getrandom(buf, buflen, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS)
+				break;
+			goto err0;
+		}
+		buf += lenread;
+		buflen -= lenread;
+	}
+	if (buflen == 0)
+		return (0);
+#endif
+
+	/* Open /dev/urandom. */
+	if ((fd = open("/dev/urandom", O_RDONLY)) == -1)
+		goto err0;
+
+	/* Read bytes until we have filled the buffer. */
+	while (buflen > 0) {
+		if ((lenread = read(fd, buf, buflen)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto err1;
+		}
+
+		/* The random device should never EOF. */
+		if (lenread == 0)
+			goto err1;
+
+		/* We're partly done. */
+		buf += lenread;
+		buflen -= lenread;
+	}
+
+	/* Close the device. */
+	while (close(fd) == -1) {
+		if (errno != EINTR)
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	close(fd);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * setkey(r, seed, gen):
+ * Start the generator r over from seed, as of generation gen.
+ */
+static int
+setkey(struct rng * r, const uint8_t seed[32], unsigned int gen)
+{
+
+	if (AES_set_encrypt_key(seed, 256, &r->key))
+		return (-1);
+	r->pos = RNGBUF;
+	r->outsince = 0;
+	r->generation = gen;
+	return (0);
+}
+
+/**
+ * reseed(void):
+ * Key the calling thread's generator from the operating system.
+ */
+static int
+reseed(void)
+{
+	uint8_t seed[32];
+	int rc;
+
+	if (osentropy(seed, 32))
+		return (-1);
+	rc = setkey(&rng, seed, generation);
+	memset(seed, 0, 32);
+	return (rc);
+}
+
+/**
+ * refill(r):
+ * Generate a new key and RNGBUF bytes of output for the generator r.
+ */
+static int
+refill(struct rng * r)
+{
+	uint8_t out[32 + RNGBUF];
+	uint8_t ctr[16];
+	size_t i;
+
+	/* Run AES-CTR from zero under the current key... */
+	memset(ctr, 0, 16);
+	for (i = 0; i < sizeof(out) / 16; i++) {
+		be64enc(&ctr[8], i);
+		AES_encrypt(ctr, &out[16 * i], &r->key);
+	}
+
+	/* ... and replace the key with the first 32 bytes of output. */
+	if (AES_set_encrypt_key(out, 256, &r->key)) {
+		memset(out, 0, sizeof(out));
+		return (-1);
+	}
+	memcpy(r->buf, &out[32], RNGBUF);
+	memset(out, 0, sizeof(out));
+	r->pos = 0;
+	return (0);
+}
+
+/**
+ * generate(r, buf, buflen):
+ * Fill buf with buflen bytes from the generator r.
+ */
+static int
+generate(struct rng * r, uint8_t * buf, size_t buflen)
+{
+	size_t len;
+
+	while (buflen > 0) {
+		if ((r->pos == RNGBUF) && refill(r))
+			return (-1);
+		len = RNGBUF - r->pos;
+		if (len > buflen)
+			len = buflen;
+
+		/* Hand out bytes once only. */
+		memcpy(buf, &r->buf[r->pos], len);
+		memset(&r->buf[r->pos], 0, len);
+		r->pos += len;
+		r->outsince += len;
+		buf += len;
+		buflen -= len;
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * scrypty_entropy_read(buf, buflen):
+ * Fill buf with buflen random bytes from the calling thread's generator,
+ * or from the shared one while the seed is fixed.
+ */
+int
+scrypty_entropy_read(uint8_t * buf, size_t buflen)
+{
+	int rc;
+
+	pthread_once(&once, init);
+
+	/*
+	 * A fixed seed gives one reproducible stream, without reseeds; were
+	 * each thread to start over from it, they would all hand out the
+	 * same bytes.
+	 */
+	if (fixed) {
+		pthread_mutex_lock(&mtx);
+		if (fixed) {
+			rc = 0;
+			if (shared.generation != generation)
+				rc = setkey(&shared, fixedseed, generation);
+			if (rc == 0)
+				rc = generate(&shared, buf, buflen);
+			pthread_mutex_unlock(&mtx);
+			return (rc);
+		}
+		pthread_mutex_unlock(&mtx);
+	}
+
+	/* Reseed after a fork, a change of seed, or enough output. */
+	if ((rng.generation != generation) || (rng.outsince >= RESEED)) {
+		if (reseed())
+			return (-1);
+	}
+
+	return (generate(&rng, buf, buflen));
+}
+
+/**
+ * scrypty_entropy_seed(seed, seedlen):
+ * Use seed for every generator, or the operating system if seed is NULL.
+ */
+void
+scrypty_entropy_seed(const uint8_t * seed, size_t seedlen)
+{
+	scrypty_SHA256_CTX ctx;
+
+	pthread_mutex_lock(&mtx);
+	if (seed != NULL) {
+		scrypty_SHA256_Init(&ctx);
+		scrypty_SHA256_Update(&ctx, seed, seedlen);
+		scrypty_SHA256_Final(fixedseed, &ctx);
+		fixed = 1;
+	} else {
+		memset(fixedseed, 0, 32);
+		memset(&shared, 0, sizeof(struct rng));
+		fixed = 0;
+	}
+	generation += 1;
+	pthread_mutex_unlock(&mtx);
+}
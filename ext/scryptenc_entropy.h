@@ -0,0 +1,30 @@
+#ifndef _SCRYPTENC_ENTROPY_H_
+#define _SCRYPTENC_ENTROPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * scrypty_entropy_read(buf, buflen):
+ * Fill buf with buflen random bytes for salts and nonces.  Each thread
+ * draws them from its own AES-256-CTR generator, which replaces its key
+ * with its own output after every refill (so earlier output can't be
+ * recovered from the state) and is reseeded from getrandom(2), or
+ * /dev/urandom where that is missing, after every 1 MiB of output and in
+ * the child after a fork.  Return 0 on success, or -1 if the operating
+ * system provided no entropy.
+ */
+int scrypty_entropy_read(uint8_t *, size_t);
+
+/**
+ * scrypty_entropy_seed(seed, seedlen):
+ * Draw every thread's bytes from one generator seeded from the seedlen
+ * bytes in seed instead of the operating system, so that salts repeat from
+ * run to run; this is for reproducible benchmarks and tests only.  The
+ * stream is shared (under a lock), so no two threads get the same bytes,
+ * and starts over from the seed after a fork.  A NULL seed goes back to
+ * each thread's own generator and the operating system.
+ */
+void scrypty_entropy_seed(const uint8_t *, size_t);
+
+#endif /* !_SCRYPTENC_ENTROPY_H_ */
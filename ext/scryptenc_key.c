@@ -0,0 +1,101 @@
+#include "scrypt_platform.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/aes.h>
+
+#include "crypto_aesctr.h"
+#include "scryptenc_stats.h"
+#include "sha256.h"
+
+#include "scryptenc_key.h"
+
+/**
+ * scrypty_key_init(key, dk):
+ * Expand the derived key dk into key.
+ */
+int
+scrypty_key_init(struct scryptenc_key * key, const uint8_t * dk)
+{
+
+	if (AES_set_encrypt_key(dk, 256, &key->aes))
+		return (5);
+	scrypty_HMAC_SHA256_Init(&key->hmac, &dk[32], 32);
+	return (0);
+}
+
+/**
+ * mac(key, buf, buflen, hbuf):
+ * Compute the HMAC of buf under key into hbuf, starting from the stored
+ * pad states so only the message and the two finalizations are hashed.
+ */
+static void
+mac(const struct scryptenc_key * key, const uint8_t * buf, size_t buflen,
+    uint8_t hbuf[32])
+{
+	scrypty_HMAC_SHA256_CTX hctx;
+	uint64_t st;
+
+	st = scrypty_stats_now();
+	memcpy(&hctx, &key->hmac, sizeof(hctx));
+	scrypty_HMAC_SHA256_Update(&hctx, buf, buflen);
+	scrypty_HMAC_SHA256_Final(hbuf, &hctx);
+	scrypty_stats_phase(STATS_HMAC, st);
+}
+
+/**
+ * scrypty_key_encrypt(key, inbuf, inbuflen, outbuf):
+ * Encrypt and sign inbuf into outbuf.
+ */
+void
+scrypty_key_encrypt(const struct scryptenc_key * key, const uint8_t * inbuf,
+    size_t inbuflen, uint8_t * outbuf)
+{
+	uint64_t st;
+
+	st = scrypty_stats_now();
+	scrypty_crypto_aesctr_buf(&key->aes, 0, inbuf, outbuf, inbuflen);
+	scrypty_stats_phase(STATS_AES, st);
+	mac(key, outbuf, inbuflen, &outbuf[inbuflen]);
+}
+
+/**
+ * scrypty_key_decrypt(key, inbuf, inbuflen, outbuf):
+ * Verify and decrypt inbuf into outbuf.
+ */
+int
+scrypty_key_decrypt(const struct scryptenc_key * key, const uint8_t * inbuf,
+    size_t inbuflen, uint8_t * outbuf)
+{
+	uint8_t hbuf[32];
+	uint64_t st;
+
+	if (inbuflen < 32)
+		return (7);
+	inbuflen -= 32;
+
+	/* Check the signature before decrypting anything. */
+	mac(key, inbuf, inbuflen, hbuf);
+	if (memcmp(hbuf, &inbuf[inbuflen], 32))
+		return (7);
+
+	st = scrypty_stats_now();
+	scrypty_crypto_aesctr_buf(&key->aes, 0, inbuf, outbuf, inbuflen);
+	scrypty_stats_phase(STATS_AES, st);
+	return (0);
+}
+
+/**
+ * scrypty_key_wipe(key):
+ * Zero key.
+ */
+void
+scrypty_key_wipe(struct scryptenc_key * key)
+{
+	volatile uint8_t * p = (volatile uint8_t *)key;
+	size_t i;
+
+	for (i = 0; i < sizeof(struct scryptenc_key); i++)
+		p[i] = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef _SCRYPTENC_KEY_H_
+#define _SCRYPTENC_KEY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/aes.h>
+
+#include "sha256.h"
+
+/*
+ * The expanded form of a 64-byte derived key for the raw format: the AES-256
+ * key schedule for its first half, and the HMAC-SHA256 state after hashing
+ * the inner and outer pads of its second half.
+ */
+struct scryptenc_key {
+	AES_KEY aes;
+	scrypty_HMAC_SHA256_CTX hmac;
+};
+
+/**
+ * scrypty_key_init(key, dk):
+ * Expand the 64-byte derived key dk into key.  Return 0 on success, or 5
+ * if OpenSSL failed.
+ */
+int scrypty_key_init(struct scryptenc_key *, const uint8_t *);
+
+/**
+ * scrypty_key_encrypt(key, inbuf, inbuflen, outbuf):
+ * Encrypt inbuflen bytes from inbuf with AES-CTR under key and write them,
+ * followed by their 32-byte HMAC, to outbuf.
+ */
+void scrypty_key_encrypt(const struct scryptenc_key *, const uint8_t *,
+    size_t, uint8_t *);
+
+/**
+ * scrypty_key_decrypt(key, inbuf, inbuflen, outbuf):
+ * Check the HMAC at the end of the inbuflen bytes in inbuf and decrypt the
+ * inbuflen - 32 bytes before it into outbuf.  Return 0 on success, or 7 if
+ * inbuf is not a valid block under key.
+ */
+int scrypty_key_decrypt(const struct scryptenc_key *, const uint8_t *,
+    size_t, uint8_t *);
+
+/**
+ * scrypty_key_wipe(key):
+ * Zero key, in a way the compiler will not optimize away.
+ */
+void scrypty_key_wipe(struct scryptenc_key *);
+
+#endif /* !_SCRYPTENC_KEY_H_ */
@@ -0,0 +1,592 @@
+#include "scrypt_platform.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crypto_aesctr.h"
+#include "scryptenc.h"
+#include "scryptenc_entropy.h"
+#include "scryptenc_key.h"
+#include "scryptenc_stats.h"
+#include "sha256.h"
+#include "sysendian.h"
+
+#include "scryptenc_log.h"
+
+/*
+ * The scrypt derivation happens once, when the log is opened; after that
+ * an append is an AES-CTR pass over the record at its offset in the
+ * keystream, an HMAC update and one write, and a checkpoint is one HMAC
+ * finalization and a 33-byte write.  Reopening a log to append to it only
+ * hashes the frames to find the last checkpoint; nothing is decrypted.
+ */
+
+/* Frames read but not yet verified, or records decrypted. */
+struct growbuf {
+	uint8_t * buf;
+	size_t len;
+	size_t cap;
+};
+
+/* Buffered reading from a file descriptor at a position. */
+struct reader {
+	int fd;
+	uint64_t pos;		/* File offset of buf[off]. */
+	uint8_t buf[65536];
+	size_t len;
+	size_t off;
+};
+
+static uint8_t * grow(struct growbuf *, size_t);
+static void renonce(struct scryptenc_log *);
+static int rfill(struct reader *);
+static int rget(struct reader *, uint8_t *, size_t);
+static int rhash(struct reader *, scrypty_HMAC_SHA256_CTX *, size_t);
+static void restart(struct scryptenc_log *);
+static int unpack(struct scryptenc_log *, const struct growbuf *,
+    struct growbuf *);
+static int scan(struct scryptenc_log *, struct growbuf *);
+
+/**
+ * grow(gb, len):
+ * Make room for len more bytes at the end of gb, and return a pointer to
+ * them (counted in gb->len already), or NULL on failure.
+ */
+static uint8_t *
+grow(struct growbuf * gb, size_t len)
+{
+	uint8_t * nbuf;
+	size_t ncap;
+
+	if (len > SIZE_MAX - gb->len)
+		return (NULL);
+	if (gb->len + len > gb->cap) {
+		ncap = (gb->cap > 0) ? gb->cap : 4096;
+		while (ncap < gb->len + len) {
+			if (ncap > SIZE_MAX / 2) {
+				ncap = gb->len + len;
+				break;
+			}
+			ncap *= 2;
+		}
+		if ((nbuf = realloc(gb->buf, ncap)) == NULL)
+			return (NULL);
+		gb->buf = nbuf;
+		gb->cap = ncap;
+	}
+	gb->len += len;
+	return (&gb->buf[gb->len - len]);
+}
+
+/**
+ * renonce(log):
+ * Draw a new nonce for the records written from now on, to be written
+ * before the next one.
+ */
+static void
+renonce(struct scryptenc_log * log)
+{
+	uint8_t buf[8];
+
+	if (scrypty_entropy_read(buf, 8)) {
+		log->nonced = LOG_NONCE_NONE;
+		return;
+	}
+	log->nonce = be64dec(buf);
+	log->ctroff = 0;
+	log->nonced = LOG_NONCE_NEW;
+}
+
+/**
+ * rfill(r):
+ * Read more of the file into r once everything buffered has been used.
+ * Return 0 on success, 1 at the end of the file, or -1 on a read error.
+ */
+static int
+rfill(struct reader * r)
+{
+	ssize_t n;
+
+	if (r->off < r->len)
+		return (0);
+	r->pos += r->len;
+	r->off = r->len = 0;
+	do {
+		n = pread(r->fd, r->buf, sizeof(r->buf), (off_t)r->pos);
+	} while ((n == -1) && (errno == EINTR));
+	if (n == -1)
+		return (-1);
+	if (n == 0)
+		return (1);
+	r->len = (size_t)n;
+	return (0);
+}
+
+/**
+ * rget(r, out, len):
+ * Read the next len bytes into out.  Return 0 on success, 1 if the file
+ * ends first, or -1 on a read error.
+ */
+static int
+rget(struct reader * r, uint8_t * out, size_t len)
+{
+	size_t m;
+	int rc;
+
+	while (len > 0) {
+		if ((rc = rfill(r)) != 0)
+			return (rc);
+		m = (len < r->len - r->off) ? len : r->len - r->off;
+		memcpy(out, &r->buf[r->off], m);
+		r->off += m;
+		out += m;
+		len -= m;
+	}
+	return (0);
+}
+
+/**
+ * rhash(r, hctx, len):
+ * As rget, but feed the next len bytes straight to hctx instead.
+ */
+static int
+rhash(struct reader * r, scrypty_HMAC_SHA256_CTX * hctx, size_t len)
+{
+	size_t m;
+	int rc;
+
+	while (len > 0) {
+		if ((rc = rfill(r)) != 0)
+			return (rc);
+		m = (len < r->len - r->off) ? len : r->len - r->off;
+		scrypty_HMAC_SHA256_Update(hctx, &r->buf[r->off], m);
+		r->off += m;
+		len -= m;
+	}
+	return (0);
+}
+
+/**
+ * restart(log):
+ * Start hashing the frames after the last checkpoint.
+ */
+static void
+restart(struct scryptenc_log * log)
+{
+
+	memcpy(&log->hctx, &log->key.hmac, sizeof(log->hctx));
+	scrypty_HMAC_SHA256_Update(&log->hctx, log->mac, 32);
+	log->pending = 0;
+	log->records = 0;
+}
+
+/**
+ * unpack(log, frames, out):
+ * Decrypt the records among the verified frames onto the end of out.
+ */
+static int
+unpack(struct scryptenc_log * log, const struct growbuf * frames,
+    struct growbuf * out)
+{
+	const uint8_t * p = frames->buf;
+	const uint8_t * end = &frames->buf[frames->len];
+	uint8_t * q;
+	uint32_t len;
+
+	while (p < end) {
+		/* Only nonces and records are left in frames. */
+		if (p[0] == 'N') {
+			log->nonce = be64dec(&p[1]);
+			log->ctroff = 0;
+			p += 9;
+			continue;
+		}
+		len = be32dec(&p[1]);
+		if ((q = grow(out, 4 + (size_t)len)) == NULL)
+			return (6);
+		memcpy(q, &p[1], 4);
+		scrypty_crypto_aesctr_buf_at(&log->key.aes, log->nonce,
+		    log->ctroff, &p[5], &q[4], len);
+		log->ctroff += len;
+		p += 5 + (size_t)len;
+	}
+	return (0);
+}
+
+/**
+ * scrypty_log_open(log, path, passwd, passwdlen, profile, writable):
+ * Open (and if writable, create or prepare to append to) the log in path.
+ */
+int
+scrypty_log_open(struct scryptenc_log * log, const char * path,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile, int writable)
+{
+	struct stat sb;
+	uint8_t header[96];
+	uint8_t dk[64];
+	ssize_t n;
+	int rc;
+
+	memset(log, 0, sizeof(struct scryptenc_log));
+	log->ckbytes = LOG_CHECKPOINT;
+	if ((log->fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY,
+	    0666)) == -1)
+		return (writable ? 12 : 13);
+
+	/* One writer at a time; readers don't care. */
+	if (writable && flock(log->fd, LOCK_EX | LOCK_NB) &&
+	    (errno == EWOULDBLOCK)) {
+		rc = 17;
+		goto err0;
+	}
+	if (fstat(log->fd, &sb)) {
+		rc = 13;
+		goto err0;
+	}
+
+	if (writable && (sb.st_size == 0)) {
+		/* A new log: derive a key and write the header. */
+		if ((rc = scrypty_scryptenc_keys(header, dk, passwd,
+		    passwdlen, profile, SCRYPTENC_VERSION_LOG)) != 0)
+			goto err0;
+		if (write(log->fd, header, 96) != 96) {
+			rc = 12;
+			goto err1;
+		}
+	} else {
+		/* An existing one: check its header and password. */
+		if ((n = pread(log->fd, header, 96, 0)) == -1) {
+			rc = 13;
+			goto err0;
+		}
+		if ((n < 7) || (memcmp(header, "scrypt", 6) != 0)) {
+			rc = 7;
+			goto err0;
+		}
+		if (header[6] != SCRYPTENC_VERSION_LOG) {
+			rc = 8;
+			goto err0;
+		}
+		if (n < 96) {
+			rc = 7;
+			goto err0;
+		}
+		if ((rc = scrypty_scryptdec_keys(header, dk, passwd,
+		    passwdlen, profile)) != 0)
+			goto err0;
+	}
+	if ((rc = scrypty_key_init(&log->key, dk)) != 0)
+		goto err1;
+	memset(dk, 0, 64);
+
+	memcpy(log->mac, &header[64], 32);
+	log->end = log->size = 96;
+	restart(log);
+
+	/*
+	 * Appending starts after the last checkpoint; whatever follows it
+	 * was never vouched for, and goes.  Finding it only takes the HMAC.
+	 */
+	if (writable && (sb.st_size > 96)) {
+		if ((rc = scan(log, NULL)) != 0)
+			goto err2;
+		if (ftruncate(log->fd, (off_t)log->end)) {
+			rc = 12;
+			goto err2;
+		}
+		log->size = log->end;
+	}
+	if (writable && (lseek(log->fd, 0, SEEK_END) == -1)) {
+		rc = 12;
+		goto err2;
+	}
+
+	/*
+	 * The records cut off above may have used keystream past the end of
+	 * the verified ones, so this writer's records get a keystream of
+	 * their own.
+	 */
+	if (writable) {
+		renonce(log);
+		if (log->nonced == LOG_NONCE_NONE) {
+			rc = 4;
+			goto err2;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err2:
+	scrypty_key_wipe(&log->key);
+err1:
+	memset(dk, 0, 64);
+err0:
+	close(log->fd);
+	log->fd = -1;
+
+	/* Failure! */
+	return (rc);
+}
+
+/**
+ * scrypty_log_append(log, buf, buflen):
+ * Encrypt buf as the next record and write it.
+ */
+int
+scrypty_log_append(struct scryptenc_log * log, const uint8_t * buf,
+    size_t buflen)
+{
+	scrypty_HMAC_SHA256_CTX hctx;
+	uint8_t stackframe[9 + 5 + 256];
+	uint8_t * frame = stackframe;
+	uint8_t * rec;
+	size_t framelen;
+	ssize_t n;
+	uint64_t st;
+	int rc = 0;
+
+	if (log->nonced == LOG_NONCE_NONE) {
+		renonce(log);
+		if (log->nonced == LOG_NONCE_NONE)
+			return (4);
+	}
+	if ((uint64_t)buflen > UINT32_MAX)
+		return (6);
+	framelen = ((log->nonced == LOG_NONCE_NEW) ? 9 : 0) + 5 + buflen;
+	if ((framelen > sizeof(stackframe)) &&
+	    ((frame = malloc(framelen)) == NULL))
+		return (6);
+
+	/* Build the frame and hash it, but keep the old state until written. */
+	rec = frame;
+	if (log->nonced == LOG_NONCE_NEW) {
+		frame[0] = 'N';
+		be64enc(&frame[1], log->nonce);
+		rec = &frame[9];
+	}
+	rec[0] = 'R';
+	be32enc(&rec[1], (uint32_t)buflen);
+	st = scrypty_stats_now();
+	scrypty_crypto_aesctr_buf_at(&log->key.aes, log->nonce, log->ctroff,
+	    buf, &rec[5], buflen);
+	scrypty_stats_phase(STATS_AES, st);
+	memcpy(&hctx, &log->hctx, sizeof(hctx));
+	scrypty_HMAC_SHA256_Update(&hctx, frame, framelen);
+
+	st = scrypty_stats_now();
+	do {
+		n = write(log->fd, frame, framelen);
+	} while ((n == -1) && (errno == EINTR));
+	if (n != (ssize_t)framelen) {
+		/*
+		 * Don't leave half a frame for the next one to follow, and
+		 * don't use the keystream that may have reached the disk again.
+		 */
+		if ((n > 0) && ftruncate(log->fd, (off_t)log->size) == 0)
+			lseek(log->fd, (off_t)log->size, SEEK_SET);
+		renonce(log);
+		rc = 12;
+		goto done;
+	}
+	scrypty_stats_phase(STATS_IO, st);
+	scrypty_stats_count(STATS_LOG_APPEND, 1, buflen);
+
+	memcpy(&log->hctx, &hctx, sizeof(hctx));
+	log->nonced = LOG_NONCE_WRITTEN;
+	log->ctroff += buflen;
+	log->size += framelen;
+	log->pending += framelen;
+	log->records += 1;
+
+	/* Checkpoint if enough has piled up. */
+	if ((log->pending >= log->ckbytes) ||
+	    ((log->ckrecords > 0) && (log->records >= log->ckrecords)))
+		rc = scrypty_log_checkpoint(log);
+
+done:
+	memset(&hctx, 0, sizeof(hctx));
+	if (frame != stackframe)
+		free(frame);
+	return (rc);
+}
+
+/**
+ * scrypty_log_checkpoint(log):
+ * Write a checkpoint if any records were appended since the last one.
+ */
+int
+scrypty_log_checkpoint(struct scryptenc_log * log)
+{
+	scrypty_HMAC_SHA256_CTX hctx;
+	uint8_t frame[33];
+	ssize_t n;
+
+	if (log->pending == 0)
+		return (0);
+
+	frame[0] = 'C';
+	memcpy(&hctx, &log->hctx, sizeof(hctx));
+	scrypty_HMAC_SHA256_Update(&hctx, frame, 1);
+	scrypty_HMAC_SHA256_Final(&frame[1], &hctx);
+
+	do {
+		n = write(log->fd, frame, 33);
+	} while ((n == -1) && (errno == EINTR));
+	if (n != 33) {
+		if ((n > 0) && ftruncate(log->fd, (off_t)log->size) == 0)
+			lseek(log->fd, (off_t)log->size, SEEK_SET);
+		return (12);
+	}
+
+	memcpy(log->mac, &frame[1], 32);
+	log->size += 33;
+	log->end = log->size;
+	restart(log);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * scan(log, records):
+ * Verify the frames after the last checkpoint read up to the last complete
+ * checkpoint in the file, and decrypt the records they hold onto the end
+ * of records; or if records is NULL, only hash the frames, without keeping
+ * or decrypting them.
+ */
+static int
+scan(struct scryptenc_log * log, struct growbuf * records)
+{
+	struct stat sb;
+	struct reader * r;
+	struct growbuf frames = {NULL, 0, 0};
+	uint8_t hbuf[32];
+	uint8_t mac[32];
+	uint8_t head[9];
+	uint8_t * p;
+	uint32_t len;
+	int rc = 0;
+	int got;
+
+	if (fstat(log->fd, &sb))
+		return (13);
+	if ((r = malloc(sizeof(struct reader))) == NULL)
+		return (6);
+	r->fd = log->fd;
+	r->pos = log->end;
+	r->len = r->off = 0;
+	restart(log);
+
+	do {
+		if ((got = rget(r, head, 1)) != 0)
+			break;
+		if (head[0] == 'R') {
+			if ((got = rget(r, &head[1], 4)) != 0)
+				break;
+			len = be32dec(&head[1]);
+
+			/* A record running past the end isn't complete yet. */
+			if ((uint64_t)len >
+			    (uint64_t)sb.st_size - (r->pos + r->off))
+				break;
+			if (records == NULL) {
+				scrypty_HMAC_SHA256_Update(&log->hctx, head, 5);
+				if ((got = rhash(r, &log->hctx, len)) != 0)
+					break;
+				continue;
+			}
+			if ((p = grow(&frames, 5 + (size_t)len)) == NULL) {
+				rc = 6;
+				break;
+			}
+			memcpy(p, head, 5);
+			if ((got = rget(r, &p[5], len)) != 0)
+				break;
+			scrypty_HMAC_SHA256_Update(&log->hctx, p, 5 + len);
+		} else if (head[0] == 'N') {
+			if ((got = rget(r, &head[1], 8)) != 0)
+				break;
+			scrypty_HMAC_SHA256_Update(&log->hctx, head, 9);
+			if (records == NULL)
+				continue;
+			if ((p = grow(&frames, 9)) == NULL) {
+				rc = 6;
+				break;
+			}
+			memcpy(p, head, 9);
+		} else if (head[0] == 'C') {
+			if ((got = rget(r, mac, 32)) != 0)
+				break;
+			scrypty_HMAC_SHA256_Update(&log->hctx, head, 1);
+			scrypty_HMAC_SHA256_Final(hbuf, &log->hctx);
+			if (memcmp(hbuf, mac, 32)) {
+				rc = 7;
+				break;
+			}
+
+			/* Everything up to here is good. */
+			if ((records != NULL) &&
+			    ((rc = unpack(log, &frames, records)) != 0))
+				break;
+			memcpy(log->mac, mac, 32);
+			log->end = r->pos + r->off;
+			frames.len = 0;
+			restart(log);
+		} else {
+			rc = 7;
+			break;
+		}
+	} while (1);
+	if ((rc == 0) && (got == -1))
+		rc = 13;
+	restart(log);
+
+	if (frames.buf != NULL) {
+		memset(frames.buf, 0, frames.cap);
+		free(frames.buf);
+	}
+	free(r);
+	return (rc);
+}
+
+/**
+ * scrypty_log_read(log, out, outlen):
+ * Verify and decrypt the records up to the last complete checkpoint.
+ */
+int
+scrypty_log_read(struct scryptenc_log * log, uint8_t ** out,
+    size_t * outlen)
+{
+	struct growbuf records = {NULL, 0, 0};
+	int rc;
+
+	rc = scan(log, &records);
+	*out = records.buf;
+	*outlen = records.len;
+	return (rc);
+}
+
+/**
+ * scrypty_log_close(log):
+ * Close the log and zero its keys.
+ */
+void
+scrypty_log_close(struct scryptenc_log * log)
+{
+
+	if (log->fd != -1)
+		close(log->fd);
+	scrypty_key_wipe(&log->key);
+	memset(log, 0, sizeof(struct scryptenc_log));
+	log->fd = -1;
+}
@@ -0,0 +1,113 @@
+#ifndef _SCRYPTENC_LOG_H_
+#define _SCRYPTENC_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scryptenc.h"
+#include "scryptenc_key.h"
+#include "sha256.h"
+
+/**
+ * An encrypted log is a 96-byte header of version SCRYPTENC_VERSION_LOG
+ * followed by frames, each starting with a type byte:
+ * 'N' nonce - the 8-byte big-endian AES-CTR nonce for the records after
+ *     it, whose keystream starts over at offset 0.  Each writer draws a
+ *     random nonce and writes it before its first record, and draws a new
+ *     one after a failed write, so that records cut off by a crash or a
+ *     short write never have their keystream used again.
+ * 'R' len data - a record: the 4-byte big-endian length len and len bytes
+ *     of data, encrypted with AES-CTR under the first half of the derived
+ *     key (with the last nonce, or 0 before any), continuing the keystream
+ *     from the end of the previous record.
+ * 'C' mac - a checkpoint: the HMAC-SHA256, under the second half of the
+ *     derived key, of the previous checkpoint's mac (or for the first, of
+ *     the header HMAC in bytes 64 ... 95) followed by every byte of the
+ *     frames since it and the 'C' itself.
+ * Records are only trusted, and only returned by readers, once a
+ * checkpoint after them has been verified; a writer that stops half-way
+ * through a frame leaves a log which reads up to its last checkpoint.
+ */
+
+/* Whether a writer's nonce is in the file yet, or couldn't be drawn. */
+#define LOG_NONCE_NEW		0
+#define LOG_NONCE_WRITTEN	1
+#define LOG_NONCE_NONE		(-1)
+
+/* Checkpoint after this many bytes of frames unless told otherwise. */
+#define LOG_CHECKPOINT	65536
+
+/* An open log, for writing or reading. */
+struct scryptenc_log {
+	struct scryptenc_key key;
+	scrypty_HMAC_SHA256_CTX hctx;	/* Frames since the last checkpoint. */
+	uint8_t mac[32];		/* Of the last checkpoint. */
+	int fd;
+	uint64_t end;		/* File offset after the last checkpoint. */
+	uint64_t size;		/* File offset after the last frame. */
+	uint64_t nonce;		/* AES-CTR nonce of the next record... */
+	uint64_t ctroff;	/* ... and its keystream offset. */
+	int nonced;		/* Writing: LOG_NONCE_*. */
+	uint64_t pending;	/* Bytes of frames since the last checkpoint. */
+	uint64_t records;	/* Records since the last checkpoint. */
+	uint64_t ckbytes;	/* Checkpoint after this many bytes... */
+	uint64_t ckrecords;	/* ... or this many records (0: never). */
+};
+
+/**
+ * scrypty_log_open(log, path, passwd, passwdlen, profile, writable):
+ * Open the log in the file path.  If writable is non-zero, the file is
+ * created with a new header (and a key derived with the parameters from
+ * profile) if it is empty or doesn't exist, and otherwise verified up to
+ * its last checkpoint (without decrypting anything) and truncated there,
+ * so that records are appended after it; the file stays locked with
+ * flock(2) against other writers until it is closed, and opening it for
+ * writing while it is locked fails with 17.  If writable is zero, the file
+ * is only opened and its key derived; see scrypty_log_read.  The
+ * parameters in an existing header are checked against the limits from
+ * profile.  Return 0 on success or a scryptenc error code, in which case
+ * nothing needs to be closed.
+ */
+int scrypty_log_open(struct scryptenc_log *, const char *, const uint8_t *,
+    size_t, const struct scryptenc_profile *, int);
+
+/**
+ * scrypty_log_append(log, buf, buflen):
+ * Append buflen bytes from buf to the log as one record with a single
+ * write, then a checkpoint if log->ckbytes bytes or log->ckrecords records
+ * have been written since the last one.  Return 0, 4 if no nonce could be
+ * drawn after an earlier failure, 6 if buflen is too large for a record or
+ * memory couldn't be allocated, or 12 if writing failed, in which case the
+ * file is cut back to where it was and the next record gets a new nonce.
+ */
+int scrypty_log_append(struct scryptenc_log *, const uint8_t *, size_t);
+
+/**
+ * scrypty_log_checkpoint(log):
+ * Write a checkpoint covering the records appended since the last one, if
+ * there are any.  Return 0 on success or 12 on a write error.
+ */
+int scrypty_log_checkpoint(struct scryptenc_log *);
+
+/**
+ * scrypty_log_read(log, out, outlen):
+ * Read the frames after the last checkpoint read (or the header) up to
+ * the last complete checkpoint in the file, and verify them.  The records
+ * they hold are decrypted into a buffer allocated with malloc, as a 4-byte
+ * big-endian length followed by the data for each, which is stored in out
+ * (NULL if there are none) with its length in outlen; the caller must free
+ * it.  A frame that stops at the end of the file is left for the next call.
+ * Return 0 on success, 6 if memory couldn't be allocated, 7 if a frame is
+ * malformed or a checkpoint doesn't verify (the records before it are still
+ * returned), or 13 on a read error.
+ */
+int scrypty_log_read(struct scryptenc_log *, uint8_t **, size_t *);
+
+/**
+ * scrypty_log_close(log):
+ * Close the log and zero its keys.  A log open for writing must have been
+ * checkpointed first if its last records are to be kept.
+ */
+void scrypty_log_close(struct scryptenc_log *);
+
+#endif /* !_SCRYPTENC_LOG_H_ */
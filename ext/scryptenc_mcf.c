@@ -0,0 +1,419 @@
+#include "scrypt_platform.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scryptenc_entropy.h"
+#include "scryptenc_sched.h"
+#include "scryptenc_stats.h"
+
+#include "scryptenc_mcf.h"
+
+static const char itoa64[] =
+    "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * decone(alphabet, c):
+ * Return the value of the character c in alphabet, or -1 if it isn't one.
+ */
+static int
+decone(const char * alphabet, char c)
+{
+	const char * s;
+
+	if ((c == '\0') || ((s = strchr(alphabet, c)) == NULL))
+		return (-1);
+	return ((int)(s - alphabet));
+}
+
+/**
+ * enc7(dst, value, bits):
+ * Write the low bits bits of value to dst in the $7$ encoding, six at a
+ * time and least significant first, and return the number of characters.
+ */
+static size_t
+enc7(char * dst, uint32_t value, int bits)
+{
+	size_t n = 0;
+	int bit;
+
+	for (bit = 0; bit < bits; bit += 6)
+		dst[n++] = itoa64[(value >> bit) & 0x3f];
+	return (n);
+}
+
+/**
+ * dec7(value, bits, src):
+ * Read a bits-bit value written by enc7 from src into value.
+ */
+static int
+dec7(uint32_t * value, int bits, const char * src)
+{
+	int bit, c;
+
+	*value = 0;
+	for (bit = 0; bit < bits; bit += 6) {
+		if ((c = decone(itoa64, *src++)) < 0)
+			return (-1);
+		*value |= (uint32_t)c << bit;
+	}
+	if ((bits < 32) && ((*value >> bits) != 0))
+		return (-1);
+	return (0);
+}
+
+/**
+ * enc7buf(dst, src, srclen):
+ * Write srclen bytes from src to dst in the $7$ encoding, three bytes at a
+ * time, and return the number of characters.
+ */
+static size_t
+enc7buf(char * dst, const uint8_t * src, size_t srclen)
+{
+	size_t i, n = 0;
+	uint32_t value;
+	int bits;
+
+	for (i = 0; i < srclen; i += 3) {
+		value = 0;
+		for (bits = 0; (bits < 24) && (i + bits / 8 < srclen); bits += 8)
+			value |= (uint32_t)src[i + bits / 8] << bits;
+		n += enc7(&dst[n], value, bits);
+	}
+	return (n);
+}
+
+/**
+ * dec7buf(dst, dstlen, src, srclen):
+ * Read exactly dstlen bytes written by enc7buf from the srclen characters
+ * in src into dst.
+ */
+static int
+dec7buf(uint8_t * dst, size_t dstlen, const char * src, size_t srclen)
+{
+	size_t i, n = 0;
+	uint32_t value;
+	int bits, chars;
+
+	for (i = 0; i < dstlen; i += 3) {
+		bits = (dstlen - i >= 3) ? 24 : (int)(dstlen - i) * 8;
+		chars = (bits + 5) / 6;
+		if ((srclen - n < (size_t)chars) || dec7(&value, bits, &src[n]))
+			return (-1);
+		n += chars;
+		for (; bits > 0; bits -= 8, value >>= 8)
+			*dst++ = value & 0xff;
+	}
+	return ((n == srclen) ? 0 : -1);
+}
+
+/**
+ * encb64(dst, src, srclen):
+ * Write srclen bytes from src to dst in padded base64, and return the
+ * number of characters.
+ */
+static size_t
+encb64(char * dst, const uint8_t * src, size_t srclen)
+{
+	size_t i, n = 0;
+	uint32_t value;
+
+	for (i = 0; i < srclen; i += 3) {
+		value = (uint32_t)src[i] << 16;
+		if (i + 1 < srclen)
+			value |= (uint32_t)src[i + 1] << 8;
+		if (i + 2 < srclen)
+			value |= src[i + 2];
+		dst[n++] = b64[(value >> 18) & 0x3f];
+		dst[n++] = b64[(value >> 12) & 0x3f];
+		dst[n++] = (i + 1 < srclen) ? b64[(value >> 6) & 0x3f] : '=';
+		dst[n++] = (i + 2 < srclen) ? b64[value & 0x3f] : '=';
+	}
+	return (n);
+}
+
+/**
+ * decb64(dst, dstmax, dstlen, src, srclen):
+ * Read the padded base64 in the srclen characters in src into dst, which
+ * has room for dstmax bytes, and store the number of bytes in dstlen.
+ */
+static int
+decb64(uint8_t * dst, size_t dstmax, size_t * dstlen, const char * src,
+    size_t srclen)
+{
+	size_t i, n = 0;
+	uint32_t value;
+	int c, j, pad;
+
+	if ((srclen == 0) || (srclen % 4 != 0))
+		return (-1);
+	for (i = 0; i < srclen; i += 4) {
+		value = 0;
+		pad = 0;
+		for (j = 0; j < 4; j++) {
+			/* Padding only at the end, in the last two places. */
+			if ((src[i + j] == '=') && (i + 4 == srclen) && (j >= 2) &&
+			    ((j == 3) || (src[i + 3] == '='))) {
+				pad++;
+				value <<= 6;
+				continue;
+			}
+			if ((pad > 0) || ((c = decone(b64, src[i + j])) < 0))
+				return (-1);
+			value = (value << 6) | (uint32_t)c;
+		}
+		if ((pad > 0) && ((value & ((1 << (8 * pad)) - 1)) != 0))
+			return (-1);
+		if (n + 3 - pad > dstmax)
+			return (-1);
+		dst[n++] = (value >> 16) & 0xff;
+		if (pad < 2)
+			dst[n++] = (value >> 8) & 0xff;
+		if (pad < 1)
+			dst[n++] = value & 0xff;
+	}
+	*dstlen = n;
+	return (0);
+}
+
+/**
+ * parse7(hash, hashlen, mcf):
+ * Parse a $7$ hash string.
+ */
+static int
+parse7(const char * hash, size_t hashlen, struct scryptenc_mcf * mcf)
+{
+	const char * salt;
+	const char * end;
+
+	/* Prefix, N, r and p. */
+	if ((hashlen < 14) || (memcmp(hash, "$7$", 3) != 0))
+		return (8);
+	if ((mcf->logN = decone(itoa64, hash[3])) < 1)
+		return (8);
+	if (dec7(&mcf->r, 30, &hash[4]) || dec7(&mcf->p, 30, &hash[9]))
+		return (8);
+
+	/* The salt runs up to the one remaining '$'. */
+	salt = &hash[14];
+	if ((end = memchr(salt, '$', hashlen - 14)) == NULL)
+		return (8);
+	mcf->saltlen = end - salt;
+	if (mcf->saltlen > MCF_SALTMAX)
+		return (8);
+	memcpy(mcf->salt, salt, mcf->saltlen);
+
+	/* The hash is the rest. */
+	end++;
+	mcf->dklen = 32;
+	if (dec7buf(mcf->dk, mcf->dklen, end, hashlen - (end - hash)))
+		return (8);
+
+	mcf->format = MCF_7;
+	return (0);
+}
+
+/**
+ * parses1(hash, hashlen, mcf):
+ * Parse a $s1$ hash string.
+ */
+static int
+parses1(const char * hash, size_t hashlen, struct scryptenc_mcf * mcf)
+{
+	const char * end = &hash[hashlen];
+	const char * dollar;
+	const char * s;
+	uint32_t params = 0;
+	int c;
+
+	if ((hashlen < 4) || (memcmp(hash, "$s1$", 4) != 0))
+		return (8);
+	s = &hash[4];
+
+	/* Parameters, as at most eight hex digits. */
+	if (((dollar = memchr(s, '$', end - s)) == NULL) || (dollar == s) ||
+	    (dollar - s > 8))
+		return (8);
+	for (; s < dollar; s++) {
+		if ((*s >= '0') && (*s <= '9'))
+			c = *s - '0';
+		else if ((*s >= 'a') && (*s <= 'f'))
+			c = *s - 'a' + 10;
+		else
+			return (8);
+		params = (params << 4) | (uint32_t)c;
+	}
+	mcf->logN = params >> 16;
+	mcf->r = (params >> 8) & 0xff;
+	mcf->p = params & 0xff;
+
+	/* Salt and hash. */
+	s = dollar + 1;
+	if ((dollar = memchr(s, '$', end - s)) == NULL)
+		return (8);
+	if (decb64(mcf->salt, MCF_SALTMAX, &mcf->saltlen, s, dollar - s))
+		return (8);
+	s = dollar + 1;
+	if (decb64(mcf->dk, MCF_DKMAX, &mcf->dklen, s, end - s) ||
+	    (mcf->dklen < 16))
+		return (8);
+
+	mcf->format = MCF_S1;
+	return (0);
+}
+
+/**
+ * scrypty_mcf_parse(hash, hashlen, mcf):
+ * Parse the hash string hash into mcf.
+ */
+int
+scrypty_mcf_parse(const char * hash, size_t hashlen,
+    struct scryptenc_mcf * mcf)
+{
+	int rc;
+
+	if ((hashlen >= 3) && (memcmp(hash, "$7$", 3) == 0))
+		rc = parse7(hash, hashlen, mcf);
+	else
+		rc = parses1(hash, hashlen, mcf);
+	if (rc)
+		return (rc);
+
+	/* Parameters scrypt can't be asked to use. */
+	if ((mcf->logN < 1) || (mcf->logN > 63) || (mcf->r == 0) ||
+	    (mcf->p == 0) || ((uint64_t)mcf->r * mcf->p >= (1 << 30)))
+		return (8);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * kdf(mcf, passwd, passwdlen, dk):
+ * Derive mcf->dklen bytes from passwd with the salt and parameters in mcf
+ * into dk.
+ */
+static int
+kdf(const struct scryptenc_mcf * mcf, const uint8_t * passwd,
+    size_t passwdlen, uint8_t * dk)
+{
+	uint64_t N = (uint64_t)(1) << mcf->logN;
+
+	scrypty_stats_vbytes(128 * mcf->r * N);
+	if (scrypty_sched_scrypt_keep(passwd, passwdlen, mcf->salt,
+	    mcf->saltlen, N, mcf->r, mcf->p, dk, mcf->dklen))
+		return ((errno == ETIMEDOUT) ? 14 :
+		    (errno == ECANCELED) ? 16 : 3);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * scrypty_mcf_create(hash, passwd, passwdlen, profile, format):
+ * Hash passwd with the parameters from profile into the string hash.
+ */
+int
+scrypty_mcf_create(char * hash, const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile, int format)
+{
+	struct scryptenc_mcf mcf;
+	uint8_t salt[32];
+	size_t n;
+	int rc;
+
+	mcf.format = format;
+	mcf.logN = profile->logN;
+	mcf.r = profile->r;
+	mcf.p = profile->p;
+	mcf.dklen = 32;
+
+	/* Draw a salt, in the form it is passed to scrypt. */
+	switch (format) {
+	case MCF_7:
+		if ((mcf.logN < 1) || (mcf.logN > 63) ||
+		    (mcf.r >= (1 << 30)) || (mcf.p >= (1 << 30)))
+			return (8);
+		if (scrypty_entropy_read(salt, 32))
+			return (4);
+		mcf.saltlen = enc7buf((char *)mcf.salt, salt, 32);
+		break;
+	case MCF_S1:
+		if ((mcf.logN < 1) || (mcf.logN > 0xffff) || (mcf.r > 0xff) ||
+		    (mcf.p > 0xff))
+			return (8);
+		if (scrypty_entropy_read(mcf.salt, 16))
+			return (4);
+		mcf.saltlen = 16;
+		break;
+	default:
+		return (8);
+	}
+
+	if ((rc = kdf(&mcf, passwd, passwdlen, mcf.dk)) != 0)
+		goto err0;
+
+	/* Write the string. */
+	if (format == MCF_7) {
+		memcpy(hash, "$7$", 3);
+		n = 3;
+		hash[n++] = itoa64[mcf.logN];
+		n += enc7(&hash[n], mcf.r, 30);
+		n += enc7(&hash[n], mcf.p, 30);
+		memcpy(&hash[n], mcf.salt, mcf.saltlen);
+		n += mcf.saltlen;
+		hash[n++] = '$';
+		n += enc7buf(&hash[n], mcf.dk, mcf.dklen);
+	} else {
+		n = (size_t)snprintf(hash, MCF_MAXLEN, "$s1$%x$",
+		    (unsigned int)((uint32_t)mcf.logN << 16 | mcf.r << 8 |
+		    mcf.p));
+		n += encb64(&hash[n], mcf.salt, mcf.saltlen);
+		hash[n++] = '$';
+		n += encb64(&hash[n], mcf.dk, mcf.dklen);
+	}
+	hash[n] = '\0';
+	memset(mcf.dk, 0, sizeof(mcf.dk));
+
+	/* Success! */
+	return (0);
+
+err0:
+	memset(mcf.dk, 0, sizeof(mcf.dk));
+
+	/* Failure! */
+	return (rc);
+}
+
+/**
+ * scrypty_mcf_verify(hash, hashlen, passwd, passwdlen):
+ * Check passwd against the hash string hash.
+ */
+int
+scrypty_mcf_verify(const char * hash, size_t hashlen, const uint8_t * passwd,
+    size_t passwdlen)
+{
+	struct scryptenc_mcf mcf;
+	uint8_t dk[MCF_DKMAX];
+	uint8_t diff = 0;
+	size_t i;
+	int rc;
+
+	if ((rc = scrypty_mcf_parse(hash, hashlen, &mcf)) != 0)
+		return (rc);
+	if ((rc = kdf(&mcf, passwd, passwdlen, dk)) != 0)
+		goto done;
+
+	/* Look at every byte, whatever the first difference. */
+	for (i = 0; i < mcf.dklen; i++)
+		diff |= dk[i] ^ mcf.dk[i];
+	rc = (diff == 0) ? 0 : 11;
+
+done:
+	memset(dk, 0, sizeof(dk));
+	return (rc);
+}
@@ -0,0 +1,75 @@
+#ifndef _SCRYPTENC_MCF_H_
+#define _SCRYPTENC_MCF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scryptenc.h"
+
+/**
+ * Password hashes are stored as modular crypt format strings in one of two
+ * encodings:
+ * MCF_7:  "$7$" N r p salt "$" hash, as in libsodium and Colin Percival's
+ *     reference code: N is one character holding log2(N), r and p are five
+ *     characters of 30 bits each, and hash is 32 bytes, all in the crypt(3)
+ *     base64 alphabet ./0-9A-Za-z least significant bits first; the salt is
+ *     passed to scrypt as the characters themselves (43 of them, from 32
+ *     random bytes, for new hashes).
+ * MCF_S1: "$s1$" params "$" salt "$" hash, as in the Java scrypt library:
+ *     params is log2(N) << 16 | r << 8 | p in lower-case hexadecimal, and
+ *     salt (16 bytes for new hashes) and hash (32 bytes) are in standard
+ *     padded base64.
+ */
+#define MCF_7	0
+#define MCF_S1	1
+
+/* Longest hash string written, including the terminating NUL. */
+#define MCF_MAXLEN	128
+
+/* Longest salt accepted, in bytes as passed to scrypt. */
+#define MCF_SALTMAX	64
+
+/* Longest hash accepted, in bytes. */
+#define MCF_DKMAX	64
+
+/* A parsed hash string. */
+struct scryptenc_mcf {
+	int format;
+	int logN;
+	uint32_t r;
+	uint32_t p;
+	uint8_t salt[MCF_SALTMAX];
+	size_t saltlen;
+	uint8_t dk[MCF_DKMAX];
+	size_t dklen;
+};
+
+/**
+ * scrypty_mcf_parse(hash, hashlen, mcf):
+ * Parse the hashlen-character string hash, in either format, into mcf.
+ * Return 0 on success, or 8 if it is not a hash this code would write.
+ */
+int scrypty_mcf_parse(const char *, size_t, struct scryptenc_mcf *);
+
+/**
+ * scrypty_mcf_create(hash, passwd, passwdlen, profile, format):
+ * Hash passwd with a new salt and the parameters from profile, and write
+ * the NUL-terminated string in format (one of MCF_*), at most MCF_MAXLEN
+ * bytes, to hash.  The key is derived with scrypty_sched_scrypt_keep.
+ * Return 0 on success, 3 if the key couldn't be derived, 4 if no salt
+ * could be drawn, 8 if profile's parameters can't be written in format, or
+ * 14 if the memory budget timed out.
+ */
+int scrypty_mcf_create(char *, const uint8_t *, size_t,
+    const struct scryptenc_profile *, int);
+
+/**
+ * scrypty_mcf_verify(hash, hashlen, passwd, passwdlen):
+ * Check passwd against the hashlen-character string hash, comparing the
+ * derived key in constant time.  The parameters in hash are trusted: they
+ * are not checked against any limits.  Return 0 if passwd matches, 11 if
+ * it does not, or as scrypty_mcf_parse and scrypty_mcf_create.
+ */
+int scrypty_mcf_verify(const char *, size_t, const uint8_t *, size_t);
+
+#endif /* !_SCRYPTENC_MCF_H_ */
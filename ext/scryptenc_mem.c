@@ -0,0 +1,70 @@
+#include "scrypt_platform.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scryptenc_numa.h"
+
+#include "scryptenc_mem.h"
+
+/*
+ * Both counters are updated atomically, so that allocating and freeing
+ * never take a lock; reported is what held was at the last call to
+ * scrypty_mem_unreported.
+ */
+static size_t held = 0;
+static size_t reported = 0;
+
+/**
+ * scrypty_mem_alloc(len):
+ * Allocate and count len bytes.
+ */
+void *
+scrypty_mem_alloc(size_t len)
+{
+	void * ptr;
+
+	if ((ptr = scrypty_numa_alloc(len)) != NULL)
+		__atomic_add_fetch(&held, len, __ATOMIC_RELAXED);
+	return (ptr);
+}
+
+/**
+ * scrypty_mem_free(ptr, len):
+ * Free and stop counting len bytes at ptr.
+ */
+void
+scrypty_mem_free(void * ptr, size_t len)
+{
+
+	if (ptr == NULL)
+		return;
+	scrypty_numa_free(ptr, len);
+	__atomic_sub_fetch(&held, len, __ATOMIC_RELAXED);
+}
+
+/**
+ * scrypty_mem_held(void):
+ * Return the bytes held now.
+ */
+size_t
+scrypty_mem_held(void)
+{
+
+	return (__atomic_load_n(&held, __ATOMIC_RELAXED));
+}
+
+/**
+ * scrypty_mem_unreported(void):
+ * Return, and mark as reported, the change in bytes held since last time.
+ */
+int64_t
+scrypty_mem_unreported(void)
+{
+	size_t now, last;
+
+	/* Swap in the current count; unsigned wraparound gives the delta. */
+	now = __atomic_load_n(&held, __ATOMIC_RELAXED);
+	last = __atomic_exchange_n(&reported, now, __ATOMIC_RELAXED);
+	return ((int64_t)(now - last));
+}
@@ -0,0 +1,41 @@
+#ifndef _SCRYPTENC_MEM_H_
+#define _SCRYPTENC_MEM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The V arrays of key derivations, which are by far the largest allocations
+ * made here, are allocated through these functions, which keep count of the
+ * bytes held.  The Ruby extension reports changes in the count to Ruby's GC
+ * (see scrypty_mem_unreported), since it can't see malloc'd memory.
+ */
+
+/**
+ * scrypty_mem_alloc(len):
+ * Allocate len bytes with scrypty_numa_alloc and count them as held.  The
+ * memory must be freed with scrypty_mem_free with the same len.
+ */
+void * scrypty_mem_alloc(size_t);
+
+/**
+ * scrypty_mem_free(ptr, len):
+ * Free len bytes at ptr allocated with scrypty_mem_alloc.
+ */
+void scrypty_mem_free(void *, size_t);
+
+/**
+ * scrypty_mem_held(void):
+ * Return the number of bytes allocated with scrypty_mem_alloc and not yet
+ * freed, in all threads.
+ */
+size_t scrypty_mem_held(void);
+
+/**
+ * scrypty_mem_unreported(void):
+ * Return the change in scrypty_mem_held since the last call, which may be
+ * negative.  Each change is returned to one caller only.
+ */
+int64_t scrypty_mem_unreported(void);
+
+#endif /* !_SCRYPTENC_MEM_H_ */
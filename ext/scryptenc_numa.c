@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include "scrypt_platform.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef HAVE_NUMA_H
+#include <numa.h>
+#include <sched.h>
+#endif
+
+#include "scryptenc_numa.h"
+
+/*
+ * Linux already puts each page on the node of the CPU that first touches
+ * it, so what goes wrong on a multi-node system is that the thread filling
+ * V migrates to the other node halfway through, or that malloc hands back
+ * pages first touched by some other thread.  Large allocations therefore
+ * get their own mapping bound to the local node, and the thread is kept on
+ * that node until the derivation is done.
+ */
+
+#ifdef HAVE_NUMA_H
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int nnodes = 1;
+
+/* Non-zero if the calling thread was bound with scrypty_numa_bind. */
+static __thread int bound = 0;
+
+static void
+init(void)
+{
+
+	if (numa_available() < 0)
+		return;
+	if ((nnodes = numa_bitmask_weight(numa_all_nodes_ptr)) < 1)
+		nnodes = 1;
+}
+
+/**
+ * multinode(void):
+ * Return non-zero if there is more than one node to place memory on.
+ */
+static int
+multinode(void)
+{
+
+	pthread_once(&once, init);
+	return (nnodes > 1);
+}
+
+/**
+ * nodecpus(node, allowed):
+ * Return a new cpumask of the CPUs of node which are also in allowed, or
+ * NULL if there are none.
+ */
+static struct bitmask *
+nodecpus(int node, const struct bitmask * allowed)
+{
+	struct bitmask * mask;
+	unsigned int cpu;
+
+	if ((mask = numa_allocate_cpumask()) == NULL)
+		return (NULL);
+	if (numa_node_to_cpus(node, mask))
+		goto err;
+	for (cpu = 0; cpu < mask->size; cpu++) {
+		if (numa_bitmask_isbitset(mask, cpu) &&
+		    !numa_bitmask_isbitset(allowed, cpu))
+			numa_bitmask_clearbit(mask, cpu);
+	}
+	if (numa_bitmask_weight(mask) == 0)
+		goto err;
+	return (mask);
+
+err:
+	numa_free_cpumask(mask);
+	return (NULL);
+}
+#endif
+
+/**
+ * scrypty_numa_nodes(void):
+ * Return the number of NUMA nodes with memory.
+ */
+int
+scrypty_numa_nodes(void)
+{
+
+#ifdef HAVE_NUMA_H
+	pthread_once(&once, init);
+	return (nnodes);
+#else
+	return (1);
+#endif
+}
+
+/**
+ * scrypty_numa_spread(nodes, n):
+ * Choose a node for each of n threads in proportion to free memory.
+ */
+void
+scrypty_numa_spread(int * nodes, size_t n)
+{
+#ifdef HAVE_NUMA_H
+	struct bitmask * mask;
+	long long * freemem;
+	size_t * count;
+	int maxnode, node, best;
+#endif
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		nodes[i] = -1;
+
+#ifdef HAVE_NUMA_H
+	if (!multinode())
+		return;
+	maxnode = numa_max_node();
+	if ((freemem = calloc(maxnode + 1, sizeof(long long))) == NULL)
+		return;
+	if ((count = calloc(maxnode + 1, sizeof(size_t))) == NULL)
+		goto done;
+
+	/* Only nodes we may allocate from and run on are candidates. */
+	for (node = 0; node <= maxnode; node++) {
+		if (!numa_bitmask_isbitset(numa_all_nodes_ptr, node))
+			continue;
+		if ((mask = nodecpus(node, numa_all_cpus_ptr)) == NULL)
+			continue;
+		numa_free_cpumask(mask);
+		if (numa_node_size64(node, &freemem[node]) < 0)
+			freemem[node] = 0;
+	}
+
+	/* Give each thread to the node with the most free memory per thread. */
+	for (i = 0; i < n; i++) {
+		best = -1;
+		for (node = 0; node <= maxnode; node++) {
+			if (freemem[node] <= 0)
+				continue;
+			if ((best == -1) ||
+			    ((double)freemem[node] / (count[node] + 1) >
+			    (double)freemem[best] / (count[best] + 1)))
+				best = node;
+		}
+		if (best == -1)
+			break;
+		nodes[i] = best;
+		count[best] += 1;
+	}
+
+	free(count);
+done:
+	free(freemem);
+#endif
+}
+
+/**
+ * scrypty_numa_bind(node):
+ * Keep the calling thread and its memory on node.
+ */
+void
+scrypty_numa_bind(int node)
+{
+#ifdef HAVE_NUMA_H
+	struct bitmask * mask;
+
+	if ((node < 0) || !multinode())
+		return;
+	if ((mask = nodecpus(node, numa_all_cpus_ptr)) == NULL)
+		return;
+	if (numa_sched_setaffinity(0, mask) == 0) {
+		numa_set_preferred(node);
+		bound = 1;
+	}
+	numa_free_cpumask(mask);
+#else
+	(void)node;
+#endif
+}
+
+/**
+ * scrypty_numa_pin(len):
+ * Keep the calling thread on its current node until scrypty_numa_unpin.
+ */
+void *
+scrypty_numa_pin(size_t len)
+{
+#ifdef HAVE_NUMA_H
+	struct bitmask * saved;
+	struct bitmask * mask;
+	int cpu, node;
+
+	if ((len < NUMA_MINALLOC) || bound || !multinode())
+		return (NULL);
+	if (((cpu = sched_getcpu()) < 0) ||
+	    ((node = numa_node_of_cpu(cpu)) < 0))
+		return (NULL);
+
+	/* Remember the affinity we had, and narrow it down to this node. */
+	if ((saved = numa_allocate_cpumask()) == NULL)
+		return (NULL);
+	if (numa_sched_getaffinity(0, saved) < 0)
+		goto err0;
+	if ((mask = nodecpus(node, saved)) == NULL)
+		goto err0;
+	if (numa_sched_setaffinity(0, mask))
+		goto err1;
+	numa_free_cpumask(mask);
+
+	return (saved);
+
+err1:
+	numa_free_cpumask(mask);
+err0:
+	numa_free_cpumask(saved);
+	return (NULL);
+#else
+	(void)len;
+	return (NULL);
+#endif
+}
+
+/**
+ * scrypty_numa_unpin(cookie):
+ * Restore the affinity saved by scrypty_numa_pin.
+ */
+void
+scrypty_numa_unpin(void * cookie)
+{
+#ifdef HAVE_NUMA_H
+	struct bitmask * saved = cookie;
+
+	if (saved == NULL)
+		return;
+	numa_sched_setaffinity(0, saved);
+	numa_free_cpumask(saved);
+#else
+	(void)cookie;
+#endif
+}
+
+/**
+ * scrypty_numa_alloc(len):
+ * Allocate len bytes on the calling thread's node.
+ */
+void *
+scrypty_numa_alloc(size_t len)
+{
+
+#ifdef HAVE_NUMA_H
+	if ((len >= NUMA_MINALLOC) && multinode())
+		return (numa_alloc_local(len));
+#endif
+	return (malloc(len));
+}
+
+/**
+ * scrypty_numa_free(ptr, len):
+ * Free memory from scrypty_numa_alloc.
+ */
+void
+scrypty_numa_free(void * ptr, size_t len)
+{
+
+#ifdef HAVE_NUMA_H
+	if ((len >= NUMA_MINALLOC) && multinode()) {
+		if (ptr != NULL)
+			numa_free(ptr, len);
+		return;
+	}
+#endif
+	free(ptr);
+}
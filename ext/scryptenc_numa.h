@@ -0,0 +1,64 @@
+#ifndef _SCRYPTENC_NUMA_H_
+#define _SCRYPTENC_NUMA_H_
+
+#include <stddef.h>
+
+/*
+ * Allocations smaller than this are left to malloc and don't pin the
+ * calling thread; the cost of an extra mapping and two affinity changes
+ * only pays off for V arrays that take a while to fill.
+ */
+#define NUMA_MINALLOC	(1024 * 1024)
+
+/**
+ * scrypty_numa_nodes(void):
+ * Return the number of NUMA nodes with memory, or 1 if the system has only
+ * one or scrypty was built without libnuma.
+ */
+int scrypty_numa_nodes(void);
+
+/**
+ * scrypty_numa_spread(nodes, n):
+ * Choose a node for each of n threads, handing out nodes in proportion to
+ * their free memory, and store them into nodes[0] ... nodes[n - 1].  On a
+ * single-node system every entry is set to -1.
+ */
+void scrypty_numa_spread(int *, size_t);
+
+/**
+ * scrypty_numa_bind(node):
+ * Run the calling thread only on the CPUs of node, and prefer memory from
+ * it, for the rest of its life.  Does nothing if node is -1.
+ */
+void scrypty_numa_bind(int);
+
+/**
+ * scrypty_numa_pin(len):
+ * If the calling thread isn't bound to a node and is about to allocate len
+ * bytes (at least NUMA_MINALLOC) on a multi-node system, keep it on the
+ * node it is running on until scrypty_numa_unpin is called with the
+ * returned cookie.  Otherwise return NULL, which scrypty_numa_unpin
+ * ignores.
+ */
+void * scrypty_numa_pin(size_t);
+
+/**
+ * scrypty_numa_unpin(cookie):
+ * Restore the CPU affinity saved by scrypty_numa_pin.
+ */
+void scrypty_numa_unpin(void *);
+
+/**
+ * scrypty_numa_alloc(len):
+ * Allocate len bytes on the node of the CPU the calling thread runs on.
+ * The memory must be freed with scrypty_numa_free with the same len.
+ */
+void * scrypty_numa_alloc(size_t);
+
+/**
+ * scrypty_numa_free(ptr, len):
+ * Free len bytes at ptr allocated with scrypty_numa_alloc.
+ */
+void scrypty_numa_free(void *, size_t);
+
+#endif /* !_SCRYPTENC_NUMA_H_ */
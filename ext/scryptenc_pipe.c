@@ -0,0 +1,471 @@
+#include "scrypt_platform.h"
+
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/aes.h>
+
+#include "crypto_aesctr.h"
+#include "sha256.h"
+#include "scryptenc_stats.h"
+
+#include "scryptenc_pipe.h"
+
+/*
+ * CTR mode lets any range of the stream be computed on its own, so the
+ * data is cut into chunks which worker threads encrypt or decrypt in
+ * whatever order they get to them.  The HMAC has to see the ciphertext in
+ * order, so a single thread feeds it chunk by chunk as they become ready;
+ * with enough workers the whole thing runs at the speed of SHA256 alone.
+ * Each pipeline has one mutex and one condition variable, broadcast on
+ * every change of state.
+ */
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static size_t pipethreads = 0;
+
+/* A buffer being processed. */
+struct bufpipe {
+	const AES_KEY * key;
+	const uint8_t * inbuf;
+	uint8_t * outbuf;
+	size_t buflen;
+	size_t nchunks;
+	size_t next;		/* Next chunk for a worker. */
+	size_t released;	/* Chunks the workers may touch. */
+	uint8_t * done;		/* Chunks the workers have finished. */
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+};
+
+/* A chunk of a file in flight. */
+struct slot {
+	uint8_t * in;
+	uint8_t * out;
+	size_t len;
+	uint64_t offset;
+	int state;
+#define SLOT_FREE	0
+#define SLOT_READ	1
+#define SLOT_CRYPTED	2
+};
+
+/* A file being processed. */
+struct filepipe {
+	const AES_KEY * key;
+	scrypty_HMAC_SHA256_CTX * hctx;
+	FILE * outfile;
+	int decrypt;
+	struct slot * slots;
+	size_t nslots;
+	uint64_t nread;		/* Chunks read so far. */
+	uint64_t nctr;		/* Next chunk for a worker. */
+	int eof;		/* Nothing more will be read. */
+	int werr;		/* The hashing thread failed to write. */
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+};
+
+/**
+ * scrypty_pipe_set(nthreads):
+ * Set the number of threads running AES-CTR.
+ */
+void
+scrypty_pipe_set(size_t n)
+{
+
+	pthread_mutex_lock(&mtx);
+	pipethreads = n;
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * scrypty_pipe_get(void):
+ * Return the number of threads running AES-CTR.
+ */
+size_t
+scrypty_pipe_get(void)
+{
+	size_t n;
+
+	pthread_mutex_lock(&mtx);
+	n = pipethreads;
+	pthread_mutex_unlock(&mtx);
+
+	return (n);
+}
+
+/**
+ * ctr(key, offset, inbuf, outbuf, len):
+ * Run len bytes at offset in the stream through AES-CTR, timing it.
+ */
+static void
+ctr(const AES_KEY * key, uint64_t offset, const uint8_t * inbuf,
+    uint8_t * outbuf, size_t len)
+{
+	uint64_t st;
+
+	st = scrypty_stats_now();
+	scrypty_crypto_aesctr_buf_at(key, 0, offset, inbuf, outbuf, len);
+	scrypty_stats_phase(STATS_AES, st);
+}
+
+/**
+ * hmac(hctx, buf, len):
+ * Feed len bytes from buf to hctx, timing it.
+ */
+static void
+hmac(scrypty_HMAC_SHA256_CTX * hctx, const uint8_t * buf, size_t len)
+{
+	uint64_t st;
+
+	st = scrypty_stats_now();
+	scrypty_HMAC_SHA256_Update(hctx, buf, len);
+	scrypty_stats_phase(STATS_HMAC, st);
+}
+
+/**
+ * bufworker(cookie):
+ * Run chunks of a buffer through AES-CTR until there are none left.
+ */
+static void *
+bufworker(void * cookie)
+{
+	struct bufpipe * p = cookie;
+	size_t i, off, len;
+
+	pthread_mutex_lock(&p->mtx);
+	while ((i = p->next) < p->nchunks) {
+		p->next += 1;
+
+		/* Wait until the hashing thread lets go of it. */
+		while (i >= p->released)
+			pthread_cond_wait(&p->cv, &p->mtx);
+		pthread_mutex_unlock(&p->mtx);
+
+		off = i * PIPE_CHUNK;
+		len = (p->buflen - off > PIPE_CHUNK) ? PIPE_CHUNK :
+		    p->buflen - off;
+		ctr(p->key, off, &p->inbuf[off], &p->outbuf[off], len);
+
+		pthread_mutex_lock(&p->mtx);
+		p->done[i] = 1;
+		pthread_cond_broadcast(&p->cv);
+	}
+	pthread_mutex_unlock(&p->mtx);
+
+	return (NULL);
+}
+
+/**
+ * scrypty_pipe_buf(key, hctx, inbuf, outbuf, buflen, decrypt):
+ * Encrypt or decrypt a buffer and hash the ciphertext, in parallel if it
+ * is large enough.
+ */
+void
+scrypty_pipe_buf(const AES_KEY * key, scrypty_HMAC_SHA256_CTX * hctx,
+    const uint8_t * inbuf, uint8_t * outbuf, size_t buflen, int decrypt)
+{
+	struct bufpipe p;
+	pthread_t * threads = NULL;
+	size_t nthreads, nstarted = 0;
+	size_t i, off, len;
+
+	/* Start the workers, if it's worth it. */
+	nthreads = scrypty_pipe_get();
+	p.nchunks = (buflen + PIPE_CHUNK - 1) / PIPE_CHUNK;
+	if (nthreads > p.nchunks)
+		nthreads = p.nchunks;
+	if ((nthreads > 0) && (buflen >= PIPE_MINBUF) &&
+	    ((threads = malloc(nthreads * sizeof(pthread_t))) != NULL) &&
+	    ((p.done = calloc(p.nchunks, 1)) != NULL)) {
+		p.key = key;
+		p.inbuf = inbuf;
+		p.outbuf = outbuf;
+		p.buflen = buflen;
+		p.next = 0;
+
+		/*
+		 * Decrypting in place, a chunk must be hashed before it is
+		 * overwritten; otherwise the workers may go straight ahead.
+		 */
+		p.released = (decrypt && (inbuf == outbuf)) ? 0 : p.nchunks;
+		pthread_mutex_init(&p.mtx, NULL);
+		pthread_cond_init(&p.cv, NULL);
+		for (; nstarted < nthreads; nstarted++) {
+			if (pthread_create(&threads[nstarted], NULL,
+			    bufworker, &p))
+				break;
+		}
+		if (nstarted == 0)
+			free(p.done);
+	}
+
+	/* Do it all ourselves if we couldn't start any worker. */
+	if (nstarted == 0) {
+		free(threads);
+		if (decrypt)
+			hmac(hctx, inbuf, buflen);
+		ctr(key, 0, inbuf, outbuf, buflen);
+		if (!decrypt)
+			hmac(hctx, outbuf, buflen);
+		return;
+	}
+
+	/* Hash the ciphertext in order while the workers run. */
+	for (i = 0; i < p.nchunks; i++) {
+		off = i * PIPE_CHUNK;
+		len = (buflen - off > PIPE_CHUNK) ? PIPE_CHUNK : buflen - off;
+		if (decrypt) {
+			hmac(hctx, &inbuf[off], len);
+			pthread_mutex_lock(&p.mtx);
+			if (p.released <= i) {
+				p.released = i + 1;
+				pthread_cond_broadcast(&p.cv);
+			}
+			pthread_mutex_unlock(&p.mtx);
+		} else {
+			pthread_mutex_lock(&p.mtx);
+			while (!p.done[i])
+				pthread_cond_wait(&p.cv, &p.mtx);
+			pthread_mutex_unlock(&p.mtx);
+			hmac(hctx, &outbuf[off], len);
+		}
+	}
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&p.cv);
+	pthread_mutex_destroy(&p.mtx);
+	free(p.done);
+	free(threads);
+}
+
+/**
+ * fileworker(cookie):
+ * Run chunks of a file through AES-CTR as they are read, until the reader
+ * is done and there are none left.
+ */
+static void *
+fileworker(void * cookie)
+{
+	struct filepipe * p = cookie;
+	struct slot * s;
+
+	pthread_mutex_lock(&p->mtx);
+	do {
+		while ((p->nctr == p->nread) && !p->eof && !p->werr)
+			pthread_cond_wait(&p->cv, &p->mtx);
+		if ((p->nctr == p->nread) || p->werr)
+			break;
+		s = &p->slots[p->nctr % p->nslots];
+		p->nctr += 1;
+		pthread_mutex_unlock(&p->mtx);
+
+		ctr(p->key, s->offset, s->in, s->out, s->len);
+
+		pthread_mutex_lock(&p->mtx);
+		s->state = SLOT_CRYPTED;
+		pthread_cond_broadcast(&p->cv);
+	} while (1);
+	pthread_mutex_unlock(&p->mtx);
+
+	return (NULL);
+}
+
+/**
+ * hasher(cookie):
+ * Hash and write out the chunks of a file in order.
+ */
+static void *
+hasher(void * cookie)
+{
+	struct filepipe * p = cookie;
+	struct slot * s;
+	uint64_t seq, st;
+	int ready;
+
+	for (seq = 0; ; seq++) {
+		s = &p->slots[seq % p->nslots];
+		pthread_mutex_lock(&p->mtx);
+		while ((s->state != SLOT_CRYPTED) &&
+		    !(p->eof && (seq == p->nread)))
+			pthread_cond_wait(&p->cv, &p->mtx);
+		ready = (s->state == SLOT_CRYPTED);
+		pthread_mutex_unlock(&p->mtx);
+		if (!ready)
+			break;
+
+		hmac(p->hctx, p->decrypt ? s->in : s->out, s->len);
+		st = scrypty_stats_now();
+		if (fwrite(s->out, 1, s->len, p->outfile) < s->len) {
+			pthread_mutex_lock(&p->mtx);
+			p->werr = 1;
+			pthread_cond_broadcast(&p->cv);
+			pthread_mutex_unlock(&p->mtx);
+			break;
+		}
+		scrypty_stats_phase(STATS_IO, st);
+
+		pthread_mutex_lock(&p->mtx);
+		s->state = SLOT_FREE;
+		pthread_cond_broadcast(&p->cv);
+		pthread_mutex_unlock(&p->mtx);
+	}
+
+	return (NULL);
+}
+
+/**
+ * scrypty_pipe_file(key, hctx, infile, outfile, decrypt, tail, total):
+ * Encrypt or decrypt a file and hash the ciphertext, in parallel.
+ */
+int
+scrypty_pipe_file(const AES_KEY * key, scrypty_HMAC_SHA256_CTX * hctx,
+    FILE * infile, FILE * outfile, int decrypt, uint8_t tail[32],
+    uint64_t * total)
+{
+	struct filepipe p;
+	struct slot * s;
+	pthread_t * threads;
+	pthread_t hashthread;
+	uint8_t carry[32];
+	size_t carrylen = 0;
+	size_t nthreads, nstarted = 0;
+	size_t i, n, want, readlen;
+	uint64_t seq, offset = 0, st;
+	struct stat sb;
+	off_t pos;
+	int werr;
+	int rc = -1;
+
+	*total = 0;
+	if ((nthreads = scrypty_pipe_get()) == 0)
+		return (-1);
+
+	/* A small file isn't worth the threads and 2 (n + 1) chunk pairs. */
+	if ((fstat(fileno(infile), &sb) == 0) && S_ISREG(sb.st_mode) &&
+	    ((pos = ftello(infile)) != -1) && (sb.st_size - pos < PIPE_MINBUF))
+		return (-1);
+
+	/* Enough slots that every stage always has something to work on. */
+	p.key = key;
+	p.hctx = hctx;
+	p.outfile = outfile;
+	p.decrypt = decrypt;
+	p.nslots = 2 * (nthreads + 1);
+	p.nread = p.nctr = 0;
+	p.eof = p.werr = 0;
+	if ((threads = malloc(nthreads * sizeof(pthread_t))) == NULL)
+		goto err0;
+	if ((p.slots = calloc(p.nslots, sizeof(struct slot))) == NULL)
+		goto err1;
+	for (i = 0; i < p.nslots; i++) {
+		if (((p.slots[i].in = malloc(PIPE_CHUNK)) == NULL) ||
+		    ((p.slots[i].out = malloc(PIPE_CHUNK)) == NULL))
+			goto err2;
+	}
+	pthread_mutex_init(&p.mtx, NULL);
+	pthread_cond_init(&p.cv, NULL);
+
+	/* Start the hashing thread and the workers. */
+	if (pthread_create(&hashthread, NULL, hasher, &p))
+		goto err3;
+	for (; nstarted < nthreads; nstarted++) {
+		if (pthread_create(&threads[nstarted], NULL, fileworker, &p))
+			break;
+	}
+	if (nstarted == 0) {
+		pthread_mutex_lock(&p.mtx);
+		p.eof = 1;
+		pthread_cond_broadcast(&p.cv);
+		pthread_mutex_unlock(&p.mtx);
+		pthread_join(hashthread, NULL);
+		goto err3;
+	}
+
+	/* Read chunks into free slots until the end of the file. */
+	for (seq = 0; ; ) {
+		s = &p.slots[seq % p.nslots];
+		pthread_mutex_lock(&p.mtx);
+		while ((s->state != SLOT_FREE) && !p.werr)
+			pthread_cond_wait(&p.cv, &p.mtx);
+		werr = p.werr;
+		pthread_mutex_unlock(&p.mtx);
+		if (werr)
+			break;
+
+		/* When decrypting, always hold back the last 32 bytes. */
+		memcpy(s->in, carry, carrylen);
+		n = carrylen;
+		want = PIPE_CHUNK - n;
+		st = scrypty_stats_now();
+		readlen = fread(&s->in[n], 1, want, infile);
+		scrypty_stats_phase(STATS_IO, st);
+		*total += readlen;
+		n += readlen;
+		if (decrypt) {
+			carrylen = (n > 32) ? 32 : n;
+			memcpy(carry, &s->in[n - carrylen], carrylen);
+			n -= carrylen;
+		}
+
+		/* Hand the chunk on. */
+		if (n > 0) {
+			s->len = n;
+			s->offset = offset;
+			offset += n;
+			pthread_mutex_lock(&p.mtx);
+			s->state = SLOT_READ;
+			p.nread = ++seq;
+			pthread_cond_broadcast(&p.cv);
+			pthread_mutex_unlock(&p.mtx);
+		}
+		if (readlen < want)
+			break;
+	}
+
+	/* Let the other stages finish. */
+	pthread_mutex_lock(&p.mtx);
+	p.eof = 1;
+	pthread_cond_broadcast(&p.cv);
+	pthread_mutex_unlock(&p.mtx);
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+	pthread_join(hashthread, NULL);
+
+	if (p.werr)
+		rc = 12;
+	else if (ferror(infile))
+		rc = 13;
+	else
+		rc = 0;
+	if (decrypt)
+		memcpy(tail, carry, carrylen);
+
+err3:
+	pthread_cond_destroy(&p.cv);
+	pthread_mutex_destroy(&p.mtx);
+err2:
+	/* Zero plaintext and cipherstream before giving the memory back. */
+	for (i = 0; i < p.nslots; i++) {
+		if (p.slots[i].in != NULL)
+			memset(p.slots[i].in, 0, PIPE_CHUNK);
+		if (p.slots[i].out != NULL)
+			memset(p.slots[i].out, 0, PIPE_CHUNK);
+		free(p.slots[i].in);
+		free(p.slots[i].out);
+	}
+	free(p.slots);
+err1:
+	free(threads);
+err0:
+	memset(carry, 0, sizeof(carry));
+
+	return (rc);
+}
@@ -0,0 +1,58 @@
+#ifndef _SCRYPTENC_PIPE_H_
+#define _SCRYPTENC_PIPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <openssl/aes.h>
+
+#include "sha256.h"
+
+/* Data is handed between the pipeline's stages in chunks of this size. */
+#define PIPE_CHUNK	(1024 * 1024)
+
+/* Buffers smaller than this aren't worth starting threads for. */
+#define PIPE_MINBUF	(4 * PIPE_CHUNK)
+
+/**
+ * scrypty_pipe_set(nthreads):
+ * Run the AES-CTR of large encryptions and decryptions on nthreads native
+ * threads, with the HMAC computed by another thread as the ciphertext
+ * becomes available, or (if nthreads is 0) do both on the calling thread.
+ */
+void scrypty_pipe_set(size_t);
+
+/**
+ * scrypty_pipe_get(void):
+ * Return the number of threads set with scrypty_pipe_set.
+ */
+size_t scrypty_pipe_get(void);
+
+/**
+ * scrypty_pipe_buf(key, hctx, inbuf, outbuf, buflen, decrypt):
+ * XOR buflen bytes from inbuf with the AES-CTR stream (nonce 0) of key,
+ * writing the result to outbuf, and feed the ciphertext (outbuf when
+ * encrypting; inbuf if decrypt is non-zero) to hctx.  The buffers may be
+ * identical but must not otherwise overlap.  The work is spread over the
+ * threads set with scrypty_pipe_set if buflen is at least PIPE_MINBUF, and
+ * done on the calling thread otherwise or if no thread can be started.
+ */
+void scrypty_pipe_buf(const AES_KEY *, scrypty_HMAC_SHA256_CTX *,
+    const uint8_t *, uint8_t *, size_t, int);
+
+/**
+ * scrypty_pipe_file(key, hctx, infile, outfile, decrypt, tail, total):
+ * As scrypty_pipe_buf, reading from infile until EOF and writing to
+ * outfile, on the threads set with scrypty_pipe_set.  When decrypting, the
+ * last 32 bytes read are not decrypted or hashed but stored in tail, with
+ * fewer than 32 bytes read in all being an error for the caller to detect.
+ * The number of bytes read is stored in total.  Return 0 on success, 12 on
+ * a write error, 13 on a read error, or -1 without reading anything if the
+ * pipeline wasn't used: no threads are set, infile is a regular file with
+ * less than PIPE_MINBUF bytes left, or the threads couldn't be started.
+ */
+int scrypty_pipe_file(const AES_KEY *, scrypty_HMAC_SHA256_CTX *, FILE *,
+    FILE *, int, uint8_t[32], uint64_t *);
+
+#endif /* !_SCRYPTENC_PIPE_H_ */
@@ -0,0 +1,396 @@
+#include "scrypt_platform.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "crypto_scrypt.h"
+#include "scryptenc_budget.h"
+#include "scryptenc_numa.h"
+#include "scryptenc_stats.h"
+
+#include "scryptenc_sched.h"
+
+/*
+ * Submitters queue a job on the list for its class, kept in deadline
+ * order, and sleep until a worker marks it done.  One condition variable
+ * wakes idle workers and another wakes submitters; the latter is broadcast
+ * and each submitter checks its own job.
+ */
+struct job {
+	const uint8_t * passwd;
+	size_t passwdlen;
+	const uint8_t * salt;
+	size_t saltlen;
+	uint64_t N;
+	uint32_t r;
+	uint32_t p;
+	uint8_t * buf;
+	size_t buflen;
+	int keep;
+	int rc;
+	int err;
+
+	int class;
+	uint64_t deadline;
+	uint64_t ticket;
+	uint64_t submitted;
+	uint64_t wait;
+	int budgetpriority;
+	double budgettimeout;
+	int * cancel;
+	int started;
+	int done;
+	struct job * next;
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static struct job * queues[SCRYPTY_SCHED_NCLASSES];
+static pthread_t * workers = NULL;
+static int * workernodes = NULL;
+static size_t nworkers = 0;
+static int stopping = 0;
+static uint64_t nextticket = 0;
+static struct scryptenc_sched_stats sched;
+
+/* Scheduling attributes of the calling thread. */
+static __thread int myclass = SCRYPTY_SCHED_NORMAL;
+static __thread uint64_t mydeadline = 0;
+static __thread int isworker = 0;
+
+static void * worker(void *);
+static int submit(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint32_t, uint32_t, uint8_t *, size_t, int);
+
+/**
+ * run(job):
+ * Derive the key for job on the calling thread.
+ */
+static void
+run(struct job * job)
+{
+
+	if (job->keep)
+		job->rc = scrypty_crypto_scrypt_keep(job->passwd,
+		    job->passwdlen, job->salt, job->saltlen, job->N, job->r,
+		    job->p, job->buf, job->buflen);
+	else
+		job->rc = scrypty_crypto_scrypt(job->passwd, job->passwdlen,
+		    job->salt, job->saltlen, job->N, job->r, job->p, job->buf,
+		    job->buflen);
+	job->err = errno;
+}
+
+/**
+ * before(a, b):
+ * Return non-zero if job a runs before job b of the same class.
+ */
+static int
+before(const struct job * a, const struct job * b)
+{
+
+	if (a->deadline != b->deadline) {
+		if (a->deadline == 0)
+			return (0);
+		if (b->deadline == 0)
+			return (1);
+		return (a->deadline < b->deadline);
+	}
+	return (a->ticket < b->ticket);
+}
+
+/**
+ * worker(cookie):
+ * Run queued jobs, most urgent first, until told to stop and the queues
+ * are empty.
+ */
+static void *
+worker(void * cookie)
+{
+	struct job * job;
+	uint64_t now, wait;
+	int class;
+
+	isworker = 1;
+	scrypty_numa_bind(*(int *)cookie);
+
+	pthread_mutex_lock(&mtx);
+	do {
+		/* Find the most urgent job. */
+		for (class = 0; class < SCRYPTY_SCHED_NCLASSES; class++) {
+			if (queues[class] != NULL)
+				break;
+		}
+		if (class == SCRYPTY_SCHED_NCLASSES) {
+			if (stopping)
+				break;
+			pthread_cond_wait(&work, &mtx);
+			continue;
+		}
+		job = queues[class];
+		queues[class] = job->next;
+
+		/* Account for the time it spent queued. */
+		now = scrypty_stats_now();
+		wait = (now > job->submitted) ? now - job->submitted : 0;
+		job->wait = wait;
+		job->started = 1;
+		sched.queued[class] -= 1;
+		sched.wait_ns[class] += wait;
+		if (wait > sched.maxwait_ns[class])
+			sched.maxwait_ns[class] = wait;
+		pthread_mutex_unlock(&mtx);
+
+		scrypty_budget_setattr(job->budgetpriority, job->budgettimeout);
+		scrypty_budget_setcancel(job->cancel);
+		run(job);
+		scrypty_budget_setcancel(NULL);
+
+		pthread_mutex_lock(&mtx);
+		sched.completed[class] += 1;
+		if ((job->deadline != 0) &&
+		    (scrypty_stats_now() > job->deadline))
+			sched.missed[class] += 1;
+		job->done = 1;
+		pthread_cond_broadcast(&done);
+	} while (1);
+	pthread_mutex_unlock(&mtx);
+
+	return (NULL);
+}
+
+/**
+ * scrypty_sched_set(nworkers):
+ * Run key derivations on nworkers native threads, or directly if 0.
+ */
+int
+scrypty_sched_set(size_t n)
+{
+	pthread_t * old;
+	int * oldnodes;
+	size_t nold, i, j;
+	int rc = 0;
+
+	/* Let the current workers drain the queues and exit. */
+	pthread_mutex_lock(&mtx);
+	old = workers;
+	oldnodes = workernodes;
+	nold = nworkers;
+	workers = NULL;
+	workernodes = NULL;
+	nworkers = 0;
+	stopping = 1;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&mtx);
+	for (i = 0; i < nold; i++)
+		pthread_join(old[i], NULL);
+	free(old);
+	free(oldnodes);
+
+	/* Spread the new workers over the NUMA nodes by free memory. */
+	pthread_mutex_lock(&mtx);
+	stopping = 0;
+	if ((n > 0) && ((workers = malloc(n * sizeof(pthread_t))) != NULL) &&
+	    ((workernodes = malloc(n * sizeof(int))) != NULL)) {
+		scrypty_numa_spread(workernodes, n);
+		for (; nworkers < n; nworkers++) {
+			if (pthread_create(&workers[nworkers], NULL, worker,
+			    &workernodes[nworkers]))
+				break;
+		}
+	}
+	if ((n > 0) && (nworkers == 0)) {
+		free(workers);
+		free(workernodes);
+		workers = NULL;
+		workernodes = NULL;
+		rc = -1;
+	}
+	sched.workers = nworkers;
+
+	/* Count the distinct nodes the workers ended up on. */
+	sched.nodes = 0;
+	for (i = 0; i < nworkers; i++) {
+		for (j = 0; j < i; j++) {
+			if (workernodes[j] == workernodes[i])
+				break;
+		}
+		if (j == i)
+			sched.nodes += 1;
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return (rc);
+}
+
+/**
+ * scrypty_sched_setattr(class, deadline):
+ * Set the priority class and deadline of the calling thread's jobs.
+ */
+void
+scrypty_sched_setattr(int class, uint64_t deadline)
+{
+
+	if ((class < 0) || (class >= SCRYPTY_SCHED_NCLASSES))
+		class = SCRYPTY_SCHED_NORMAL;
+	myclass = class;
+	mydeadline = deadline;
+}
+
+/**
+ * scrypty_sched_getattr(class, deadline):
+ * Read back the priority class and deadline of the calling thread's jobs.
+ */
+void
+scrypty_sched_getattr(int * class, uint64_t * deadline)
+{
+
+	*class = myclass;
+	*deadline = mydeadline;
+}
+
+/**
+ * submit(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen, keep):
+ * Compute scrypt on a worker if any are running, otherwise directly, with
+ * scrypty_crypto_scrypt_keep if keep is non-zero.  Time spent in the queue
+ * is recorded apart from the derivation itself.
+ */
+static int
+submit(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
+    size_t saltlen, uint64_t N, uint32_t r, uint32_t p, uint8_t * buf,
+    size_t buflen, int keep)
+{
+	struct job job;
+	struct job ** q;
+	uint64_t st, now;
+
+	job.passwd = passwd;
+	job.passwdlen = passwdlen;
+	job.salt = salt;
+	job.saltlen = saltlen;
+	job.N = N;
+	job.r = r;
+	job.p = p;
+	job.buf = buf;
+	job.buflen = buflen;
+	job.keep = keep;
+	job.class = myclass;
+	job.deadline = mydeadline;
+	job.started = 0;
+	job.done = 0;
+	scrypty_budget_getattr(&job.budgetpriority, &job.budgettimeout);
+	job.cancel = scrypty_budget_getcancel();
+
+	/* Workers (and everyone, if there are none) run jobs directly. */
+	st = scrypty_stats_now();
+	pthread_mutex_lock(&mtx);
+	if (isworker || (nworkers == 0) || stopping) {
+		pthread_mutex_unlock(&mtx);
+		run(&job);
+		scrypty_stats_phase(STATS_KDF, st);
+		errno = job.err;
+		return (job.rc);
+	}
+
+	/* Queue the job in deadline order. */
+	job.submitted = st;
+	job.ticket = nextticket++;
+	for (q = &queues[job.class]; (*q != NULL) && before(*q, &job);
+	    q = &(*q)->next)
+		continue;
+	job.next = *q;
+	*q = &job;
+	sched.queued[job.class] += 1;
+	sched.submitted[job.class] += 1;
+	pthread_cond_signal(&work);
+
+	/*
+	 * Wait for a worker to finish it.  A job cancelled before a worker
+	 * takes it is taken off the queue; once it runs, the cancellation
+	 * reaches its wait for memory instead.
+	 */
+	while (!job.done) {
+		if (!job.started && (job.cancel != NULL) &&
+		    (__atomic_load_n(job.cancel, __ATOMIC_ACQUIRE) &
+		    BUDGET_CANCEL)) {
+			for (q = &queues[job.class]; *q != &job;
+			    q = &(*q)->next)
+				continue;
+			*q = job.next;
+			sched.queued[job.class] -= 1;
+			pthread_mutex_unlock(&mtx);
+			__atomic_or_fetch(job.cancel, BUDGET_CANCELLED,
+			    __ATOMIC_RELAXED);
+			errno = ECANCELED;
+			return (-1);
+		}
+		pthread_cond_wait(&done, &mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+	now = scrypty_stats_now();
+	scrypty_stats_phase_ns(STATS_QUEUE, job.wait);
+	scrypty_stats_phase_ns(STATS_KDF,
+	    (now > st + job.wait) ? now - st - job.wait : 0);
+
+	errno = job.err;
+	return (job.rc);
+}
+
+/**
+ * scrypty_sched_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen):
+ * Compute scrypt on a worker if any are running, otherwise directly.
+ */
+int
+scrypty_sched_scrypt(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
+    uint8_t * buf, size_t buflen)
+{
+
+	return (submit(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+	    0));
+}
+
+/**
+ * scrypty_sched_scrypt_keep(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen):
+ * As scrypty_sched_scrypt, reusing the workspace of the thread it runs on.
+ */
+int
+scrypty_sched_scrypt_keep(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
+    uint8_t * buf, size_t buflen)
+{
+
+	return (submit(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen,
+	    1));
+}
+
+/**
+ * scrypty_sched_wake(void):
+ * Wake all submitters to check their cancellation flags.
+ */
+void
+scrypty_sched_wake(void)
+{
+
+	pthread_mutex_lock(&mtx);
+	pthread_cond_broadcast(&done);
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * scrypty_sched_stats(stats):
+ * Store the state and counters of the scheduler into stats.
+ */
+void
+scrypty_sched_stats(struct scryptenc_sched_stats * stats)
+{
+
+	pthread_mutex_lock(&mtx);
+	*stats = sched;
+	pthread_mutex_unlock(&mtx);
+}
@@ -0,0 +1,94 @@
+#ifndef _SCRYPTENC_SCHED_H_
+#define _SCRYPTENC_SCHED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Priority classes, most urgent first. */
+#define SCRYPTY_SCHED_INTERACTIVE	0
+#define SCRYPTY_SCHED_NORMAL	1
+#define SCRYPTY_SCHED_BATCH	2
+#define SCRYPTY_SCHED_NCLASSES	3
+
+struct scryptenc_sched_stats {
+	size_t workers;
+	size_t nodes;
+	uint64_t queued[SCRYPTY_SCHED_NCLASSES];
+	uint64_t submitted[SCRYPTY_SCHED_NCLASSES];
+	uint64_t completed[SCRYPTY_SCHED_NCLASSES];
+	uint64_t missed[SCRYPTY_SCHED_NCLASSES];
+	uint64_t wait_ns[SCRYPTY_SCHED_NCLASSES];
+	uint64_t maxwait_ns[SCRYPTY_SCHED_NCLASSES];
+};
+
+/**
+ * scrypty_sched_set(nworkers):
+ * Run key derivations made through scrypty_sched_scrypt on a fixed set of
+ * nworkers native threads, or (if nworkers is 0) directly on the calling
+ * thread.  Jobs already queued are finished by the old workers first.
+ * On a multi-node system the workers are spread over the NUMA nodes in
+ * proportion to their free memory and bound to them, so each job's V
+ * array is local to the CPU computing it.
+ * Return 0 on success, or -1 if no worker could be started.
+ */
+int scrypty_sched_set(size_t);
+
+/**
+ * scrypty_sched_setattr(class, deadline):
+ * Set the priority class (one of SCRYPTY_SCHED_*) and the deadline (a
+ * scrypty_stats_now timestamp, or 0 for none) of the key derivations the
+ * calling thread submits.  Workers take jobs from the most urgent class
+ * first, and earliest deadline first within a class (jobs without a
+ * deadline last, in order of arrival).  Threads start out as
+ * SCRYPTY_SCHED_NORMAL with no deadline.
+ */
+void scrypty_sched_setattr(int, uint64_t);
+
+/**
+ * scrypty_sched_getattr(class, deadline):
+ * Store the priority class and deadline set with scrypty_sched_setattr for
+ * the calling thread into class and deadline.
+ */
+void scrypty_sched_getattr(int *, uint64_t *);
+
+/**
+ * scrypty_sched_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen):
+ * As scrypty_crypto_scrypt, but queued for the scheduler's workers if any
+ * are running (the calling thread waits for the result).  The memory
+ * budget priority, timeout and cancellation flag (see
+ * scrypty_budget_setcancel) of the calling thread go with the job, and a
+ * job cancelled while still queued fails with errno set to ECANCELED.  The
+ * time the job spent queued is recorded as STATS_QUEUE, and the rest of
+ * the call as STATS_KDF.
+ */
+int scrypty_sched_scrypt(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint32_t, uint32_t, uint8_t *, size_t);
+
+/**
+ * scrypty_sched_scrypt_keep(passwd, passwdlen, salt, saltlen, N, r, p, buf,
+ *     buflen):
+ * As scrypty_sched_scrypt, but computed with scrypty_crypto_scrypt_keep by
+ * whichever thread runs the job, so that each worker (or the calling
+ * thread, if there are none) reuses its own workspace.
+ */
+int scrypty_sched_scrypt_keep(const uint8_t *, size_t, const uint8_t *,
+    size_t, uint64_t, uint32_t, uint32_t, uint8_t *, size_t);
+
+/**
+ * scrypty_sched_wake(void):
+ * Wake every thread waiting for a queued job, to check whether it was
+ * cancelled.
+ */
+void scrypty_sched_wake(void);
+
+/**
+ * scrypty_sched_stats(stats):
+ * Store the number of workers, the number of NUMA nodes they run on, and,
+ * for each class, the number of jobs queued now, submitted, completed, and
+ * completed after their deadline, with the total and longest time jobs
+ * waited in the queue, into stats.
+ */
+void scrypty_sched_stats(struct scryptenc_sched_stats *);
+
+#endif /* !_SCRYPTENC_SCHED_H_ */
@@ -0,0 +1,293 @@
+#include "scrypt_platform.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scryptenc_stats.h"
+
+/*
+ * Every thread which records anything gets a slot of its own, so updates
+ * never contend: each slot is only ever written by the one thread that
+ * owns it, and is read with relaxed atomic loads by snapshots.  The mutex
+ * only protects the list of slots, which changes when a thread first
+ * records something or exits; the slot of an exited thread keeps its
+ * counts and is handed to the next new thread.  Resetting the counters
+ * saves a snapshot as a baseline instead of touching the slots.
+ */
+struct slot {
+	struct scryptenc_stats stats;
+	struct slot * next;
+	int inuse;
+};
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static struct slot * slots = NULL;
+static struct scryptenc_stats baseline;
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define ADD(x, v)	__atomic_store_n(&(x), LOAD(x) + (v), __ATOMIC_RELAXED)
+
+static void
+release(void * cookie)
+{
+	struct slot * slot = cookie;
+
+	pthread_mutex_lock(&mtx);
+	slot->inuse = 0;
+	pthread_mutex_unlock(&mtx);
+}
+
+static void
+init(void)
+{
+
+	pthread_key_create(&key, release);
+}
+
+/**
+ * getslot():
+ * Return the calling thread's slot, or NULL if one can't be allocated (in
+ * which case nothing is recorded).
+ */
+static struct slot *
+getslot(void)
+{
+	struct slot * slot;
+
+	pthread_once(&once, init);
+	if ((slot = pthread_getspecific(key)) != NULL)
+		return (slot);
+
+	/* Reuse the slot of an exited thread, or make a new one. */
+	pthread_mutex_lock(&mtx);
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		if (!slot->inuse)
+			break;
+	}
+	if ((slot == NULL) && ((slot = calloc(1, sizeof(*slot))) != NULL)) {
+		slot->next = slots;
+		slots = slot;
+	}
+	if (slot != NULL)
+		slot->inuse = 1;
+	pthread_mutex_unlock(&mtx);
+
+	if ((slot != NULL) && pthread_setspecific(key, slot)) {
+		release(slot);
+		slot = NULL;
+	}
+	return (slot);
+}
+
+/**
+ * scrypty_stats_now():
+ * Return a monotonic timestamp in nanoseconds, for passing to
+ * scrypty_stats_phase.
+ */
+uint64_t
+scrypty_stats_now(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+#endif
+		if (clock_gettime(CLOCK_REALTIME, &ts))
+			return (0);
+
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/**
+ * scrypty_stats_phase(phase, start):
+ * Record that the calling thread spent the time since start (as returned by
+ * scrypty_stats_now) in the given phase.
+ */
+void
+scrypty_stats_phase(int phase, uint64_t start)
+{
+	uint64_t end;
+
+	end = scrypty_stats_now();
+	scrypty_stats_phase_ns(phase, (end > start) ? end - start : 0);
+}
+
+/**
+ * scrypty_stats_phase_ns(phase, ns):
+ * Record that the calling thread spent ns nanoseconds in the given phase.
+ */
+void
+scrypty_stats_phase_ns(int phase, uint64_t ns)
+{
+	struct slot * slot;
+	int bucket;
+
+	if ((slot = getslot()) == NULL)
+		return;
+
+	/* Find the log2 bucket. */
+	for (bucket = 0; (bucket < STATS_NBUCKETS - 1) &&
+	    ((ns >> (bucket + 1)) != 0); bucket++)
+		continue;
+
+	ADD(slot->stats.phase_count[phase], 1);
+	ADD(slot->stats.phase_ns[phase], ns);
+	ADD(slot->stats.phase_hist[phase][bucket], 1);
+}
+
+/**
+ * scrypty_stats_count(op, nops, nbytes):
+ * Count nops operations of type op and nbytes bytes processed by them.
+ */
+void
+scrypty_stats_count(int op, uint64_t nops, uint64_t nbytes)
+{
+	struct slot * slot;
+
+	if ((slot = getslot()) == NULL)
+		return;
+	ADD(slot->stats.ops[op], nops);
+	ADD(slot->stats.bytes[op], nbytes);
+}
+
+/**
+ * scrypty_stats_vbytes(nbytes):
+ * Count nbytes bytes allocated for a V array.
+ */
+void
+scrypty_stats_vbytes(uint64_t nbytes)
+{
+	struct slot * slot;
+
+	if ((slot = getslot()) == NULL)
+		return;
+	ADD(slot->stats.vbytes, nbytes);
+}
+
+/**
+ * scrypty_stats_error(rc):
+ * Count an operation which failed with return code rc.
+ */
+void
+scrypty_stats_error(int rc)
+{
+	struct slot * slot;
+
+	if ((rc <= 0) || (rc >= STATS_NERRORS))
+		return;
+	if ((slot = getslot()) == NULL)
+		return;
+	ADD(slot->stats.errors[rc], 1);
+}
+
+/**
+ * scrypty_stats_calibration(opps):
+ * Count a CPU calibration which measured opps salsa20/8 cores per second.
+ */
+void
+scrypty_stats_calibration(double opps)
+{
+	struct slot * slot;
+
+	if ((slot = getslot()) == NULL)
+		return;
+	ADD(slot->stats.calibrations, 1);
+	__atomic_store(&slot->stats.opps, &opps, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->stats.opps_when, scrypty_stats_now(),
+	    __ATOMIC_RELAXED);
+}
+
+/**
+ * sum(stats):
+ * Sum the counters of all slots into stats.  Must be called with the mutex
+ * held.
+ */
+static void
+sum(struct scryptenc_stats * stats)
+{
+	struct slot * slot;
+	double opps;
+	uint64_t when;
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		for (i = 0; i < STATS_NOPS; i++) {
+			stats->ops[i] += LOAD(slot->stats.ops[i]);
+			stats->bytes[i] += LOAD(slot->stats.bytes[i]);
+		}
+		for (i = 0; i < STATS_NPHASES; i++) {
+			stats->phase_count[i] += LOAD(slot->stats.phase_count[i]);
+			stats->phase_ns[i] += LOAD(slot->stats.phase_ns[i]);
+			for (j = 0; j < STATS_NBUCKETS; j++) {
+				stats->phase_hist[i][j] +=
+				    LOAD(slot->stats.phase_hist[i][j]);
+			}
+		}
+		stats->vbytes += LOAD(slot->stats.vbytes);
+		for (i = 0; i < STATS_NERRORS; i++)
+			stats->errors[i] += LOAD(slot->stats.errors[i]);
+		stats->calibrations += LOAD(slot->stats.calibrations);
+
+		/* Keep the most recent calibration result. */
+		when = LOAD(slot->stats.opps_when);
+		if (when > stats->opps_when) {
+			__atomic_load(&slot->stats.opps, &opps,
+			    __ATOMIC_RELAXED);
+			stats->opps = opps;
+			stats->opps_when = when;
+		}
+	}
+}
+
+/**
+ * scrypty_stats_snapshot(stats):
+ * Sum the counters of all threads since the last reset into stats.  The
+ * counters are read without stopping the threads updating them, so a
+ * snapshot taken during an operation may include part of it.
+ */
+void
+scrypty_stats_snapshot(struct scryptenc_stats * stats)
+{
+	int i, j;
+
+	pthread_mutex_lock(&mtx);
+	sum(stats);
+	for (i = 0; i < STATS_NOPS; i++) {
+		stats->ops[i] -= baseline.ops[i];
+		stats->bytes[i] -= baseline.bytes[i];
+	}
+	for (i = 0; i < STATS_NPHASES; i++) {
+		stats->phase_count[i] -= baseline.phase_count[i];
+		stats->phase_ns[i] -= baseline.phase_ns[i];
+		for (j = 0; j < STATS_NBUCKETS; j++)
+			stats->phase_hist[i][j] -= baseline.phase_hist[i][j];
+	}
+	stats->vbytes -= baseline.vbytes;
+	for (i = 0; i < STATS_NERRORS; i++)
+		stats->errors[i] -= baseline.errors[i];
+	stats->calibrations -= baseline.calibrations;
+	if (stats->opps_when <= baseline.opps_when) {
+		stats->opps = 0;
+		stats->opps_when = 0;
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * scrypty_stats_reset():
+ * Start counting from zero again.
+ */
+void
+scrypty_stats_reset(void)
+{
+
+	pthread_mutex_lock(&mtx);
+	sum(&baseline);
+	pthread_mutex_unlock(&mtx);
+}
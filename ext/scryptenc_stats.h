@@ -0,0 +1,115 @@
+#ifndef _SCRYPTENC_STATS_H_
+#define _SCRYPTENC_STATS_H_
+
+#include <stdint.h>
+
+/* Operations which are counted. */
+#define STATS_ENC_BUF	0
+#define STATS_DEC_BUF	1
+#define STATS_ENC_FILE	2
+#define STATS_DEC_FILE	3
+#define STATS_DK	4
+#define STATS_ENC_RAW	5
+#define STATS_DEC_RAW	6
+#define STATS_VERIFY_BUF	7
+#define STATS_VERIFY_FILE	8
+#define STATS_REKEY_BUF	9
+#define STATS_REKEY_FILE	10
+#define STATS_LOG_APPEND	11
+#define STATS_PASSWORD_CREATE	12
+#define STATS_PASSWORD_VERIFY	13
+#define STATS_NOPS	14
+
+/* Phases of an operation which are timed. */
+#define STATS_CALIBRATE	0
+#define STATS_MEMTOUSE	1
+#define STATS_KDF	2
+#define STATS_AES	3
+#define STATS_HMAC	4
+#define STATS_IO	5
+#define STATS_QUEUE	6
+#define STATS_COMPRESS	7
+#define STATS_NPHASES	8
+
+/*
+ * Phase durations are also kept in log-bucketed histograms: bucket i counts
+ * durations of at least 2^i and less than 2^(i+1) nanoseconds (bucket 0 also
+ * counts durations under 1 ns, and the last bucket everything longer).
+ */
+#define STATS_NBUCKETS	40
+
+/* Error codes 1 .. STATS_NERRORS - 1 are counted. */
+#define STATS_NERRORS	18
+
+struct scryptenc_stats {
+	uint64_t ops[STATS_NOPS];
+	uint64_t bytes[STATS_NOPS];
+	uint64_t phase_count[STATS_NPHASES];
+	uint64_t phase_ns[STATS_NPHASES];
+	uint64_t phase_hist[STATS_NPHASES][STATS_NBUCKETS];
+	uint64_t vbytes;
+	uint64_t errors[STATS_NERRORS];
+	uint64_t calibrations;
+	double opps;
+	uint64_t opps_when;
+};
+
+/**
+ * scrypty_stats_now():
+ * Return a monotonic timestamp in nanoseconds, for passing to
+ * scrypty_stats_phase.
+ */
+uint64_t scrypty_stats_now(void);
+
+/**
+ * scrypty_stats_phase(phase, start):
+ * Record that the calling thread spent the time since start (as returned by
+ * scrypty_stats_now) in the given phase.
+ */
+void scrypty_stats_phase(int, uint64_t);
+
+/**
+ * scrypty_stats_phase_ns(phase, ns):
+ * Record that the calling thread spent ns nanoseconds in the given phase.
+ */
+void scrypty_stats_phase_ns(int, uint64_t);
+
+/**
+ * scrypty_stats_count(op, nops, nbytes):
+ * Count nops operations of type op and nbytes bytes processed by them.
+ */
+void scrypty_stats_count(int, uint64_t, uint64_t);
+
+/**
+ * scrypty_stats_vbytes(nbytes):
+ * Count nbytes bytes allocated for a V array.
+ */
+void scrypty_stats_vbytes(uint64_t);
+
+/**
+ * scrypty_stats_error(rc):
+ * Count an operation which failed with return code rc.
+ */
+void scrypty_stats_error(int);
+
+/**
+ * scrypty_stats_calibration(opps):
+ * Count a CPU calibration which measured opps salsa20/8 cores per second.
+ */
+void scrypty_stats_calibration(double);
+
+/**
+ * scrypty_stats_snapshot(stats):
+ * Sum the counters of all threads since the last reset into stats.  The
+ * counters are read without stopping the threads updating them, so a
+ * snapshot taken during an operation may include part of it.
+ */
+void scrypty_stats_snapshot(struct scryptenc_stats *);
+
+/**
+ * scrypty_stats_reset():
+ * Start counting from zero again.
+ */
+void scrypty_stats_reset(void);
+
+#endif /* !_SCRYPTENC_STATS_H_ */
@@ -0,0 +1,304 @@
+#include "scrypt_platform.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scryptenc_batch.h"
+#include "scryptenc_budget.h"
+
+#include "scryptenc_tree.h"
+
+/*
+ * The tree is walked once, before any key is derived: the file type comes
+ * from readdir where the filesystem reports it (so a tree of regular files
+ * costs no stat calls at all), the destination directories are created on
+ * the way down, and the files found become the items of a single batch.
+ * The profile, and with it the CPU calibration, is the caller's and shared
+ * by every file.  A directory or entry below srcdir which can't be read
+ * doesn't stop the walk: it becomes an item which has already failed, and
+ * is left out of the batch.
+ */
+
+struct walk {
+	struct scryptenc_batch_item * items;
+	size_t nitems;
+	size_t nalloc;
+	struct stat dst;	/* Not to be descended into. */
+};
+
+static char * join(const char *, const char *);
+static int additem(struct walk *, const char *, const char *);
+static int failitem(struct walk *, const char *, const char *, int);
+static int walkdir(struct walk *, const char *, const char *);
+static void swapitems(struct scryptenc_batch_item *,
+    struct scryptenc_batch_item *);
+static int bypath(const void *, const void *);
+
+/**
+ * join(dir, name):
+ * Return a new string holding dir, a '/' and name, or NULL on failure.
+ */
+static char *
+join(const char * dir, const char * name)
+{
+	size_t dirlen = strlen(dir);
+	size_t namelen = strlen(name);
+	char * s;
+
+	if ((s = malloc(dirlen + namelen + 2)) == NULL)
+		return (NULL);
+	memcpy(s, dir, dirlen);
+	s[dirlen] = '/';
+	memcpy(&s[dirlen + 1], name, namelen + 1);
+	return (s);
+}
+
+/**
+ * additem(walk, src, dst):
+ * Add an item for the file src to be written to dst.  Both names are kept
+ * in the one allocation pointed to by the item's path.
+ */
+static int
+additem(struct walk * walk, const char * src, const char * dst)
+{
+	struct scryptenc_batch_item * item;
+	struct scryptenc_batch_item * items;
+	size_t srclen = strlen(src) + 1;
+	size_t dstlen = strlen(dst) + 1;
+	size_t nalloc;
+	char * s;
+
+	if (walk->nitems == walk->nalloc) {
+		nalloc = (walk->nalloc > 0) ? walk->nalloc * 2 : 64;
+		if (nalloc > SIZE_MAX / sizeof(struct scryptenc_batch_item))
+			return (6);
+		if ((items = realloc(walk->items,
+		    nalloc * sizeof(struct scryptenc_batch_item))) == NULL)
+			return (6);
+		walk->items = items;
+		walk->nalloc = nalloc;
+	}
+	if ((s = malloc(srclen + dstlen)) == NULL)
+		return (6);
+	memcpy(s, src, srclen);
+	memcpy(&s[srclen], dst, dstlen);
+
+	item = &walk->items[walk->nitems++];
+	item->inbuf = NULL;
+	item->inbuflen = 0;
+	item->path = s;
+	item->outpath = &s[srclen];
+	item->outbuf = NULL;
+	item->outlen = 0;
+	item->outalloc = NULL;
+	item->rc = 0;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * failitem(walk, src, dst, rc):
+ * Add an item for src which has already failed with rc.
+ */
+static int
+failitem(struct walk * walk, const char * src, const char * dst, int rc)
+{
+
+	if (additem(walk, src, dst))
+		return (6);
+	walk->items[walk->nitems - 1].rc = rc;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * walkdir(walk, src, dst):
+ * Create the directory dst if it doesn't exist, and add the files below
+ * src to walk.  Return 12 or 13 if dst couldn't be created or src couldn't
+ * be read, 16 if the walk was cancelled, or 6 if memory ran out; failures
+ * below src are recorded as items instead.
+ */
+static int
+walkdir(struct walk * walk, const char * src, const char * dst)
+{
+	struct dirent * de;
+	struct stat sb;
+	DIR * dir;
+	char * s = NULL;
+	char * d = NULL;
+	int isdir, isreg;
+	int rc;
+
+	if ((dir = opendir(src)) == NULL)
+		return (13);
+
+	/* Don't encrypt our own output. */
+	if (fstat(dirfd(dir), &sb)) {
+		rc = 13;
+		goto done;
+	}
+	if ((sb.st_dev == walk->dst.st_dev) && (sb.st_ino == walk->dst.st_ino)) {
+		rc = 0;
+		goto done;
+	}
+
+	if (mkdir(dst, 0777) && (errno != EEXIST)) {
+		rc = 12;
+		goto done;
+	}
+
+	do {
+		if (scrypty_budget_cancelled()) {
+			rc = 16;
+			break;
+		}
+		errno = 0;
+		if ((de = readdir(dir)) == NULL) {
+			rc = (errno != 0) ? 13 : 0;
+			break;
+		}
+		if ((strcmp(de->d_name, ".") == 0) ||
+		    (strcmp(de->d_name, "..") == 0))
+			continue;
+
+		if (((s = join(src, de->d_name)) == NULL) ||
+		    ((d = join(dst, de->d_name)) == NULL)) {
+			rc = 6;
+			break;
+		}
+
+		/* Only ask the filesystem if readdir didn't tell us. */
+		rc = 0;
+#ifdef _DIRENT_HAVE_D_TYPE
+		isdir = (de->d_type == DT_DIR);
+		isreg = (de->d_type == DT_REG);
+		if (de->d_type == DT_UNKNOWN)
+#endif
+		{
+			isdir = isreg = 0;
+			if (lstat(s, &sb))
+				rc = 13;
+			else {
+				isdir = S_ISDIR(sb.st_mode);
+				isreg = S_ISREG(sb.st_mode);
+			}
+		}
+
+		if (isdir)
+			rc = walkdir(walk, s, d);
+		else if (isreg)
+			rc = additem(walk, s, d);
+
+		/* Record what we can't get at, and carry on with the rest. */
+		if ((rc == 12) || (rc == 13))
+			rc = failitem(walk, s, d, rc);
+		if (rc)
+			break;
+
+		free(d);
+		free(s);
+		d = s = NULL;
+	} while (1);
+
+	free(d);
+	free(s);
+done:
+	closedir(dir);
+	return (rc);
+}
+
+static void
+swapitems(struct scryptenc_batch_item * a, struct scryptenc_batch_item * b)
+{
+	struct scryptenc_batch_item t = *a;
+
+	*a = *b;
+	*b = t;
+}
+
+static int
+bypath(const void * a, const void * b)
+{
+	const struct scryptenc_batch_item * x = a;
+	const struct scryptenc_batch_item * y = b;
+
+	return (strcmp(x->path, y->path));
+}
+
+/**
+ * scrypty_scryptenc_tree(srcdir, dstdir, passwd, passwdlen, profile,
+ *     decrypt, nthreads, maxmemtotal, items, nitems):
+ * Encrypt or decrypt every regular file below srcdir into dstdir.
+ */
+int
+scrypty_scryptenc_tree(const char * srcdir, const char * dstdir,
+    const uint8_t * passwd, size_t passwdlen,
+    const struct scryptenc_profile * profile, int decrypt, size_t nthreads,
+    size_t maxmemtotal, struct scryptenc_batch_item ** items, size_t * nitems)
+{
+	struct walk walk;
+	size_t nok, i;
+	int rc;
+
+	walk.items = NULL;
+	walk.nitems = 0;
+	walk.nalloc = 0;
+
+	/* Create the top of the output first so we know what to skip. */
+	if (mkdir(dstdir, 0777) && (errno != EEXIST))
+		return (12);
+	if (stat(dstdir, &walk.dst))
+		return (12);
+
+	if ((rc = walkdir(&walk, srcdir, dstdir)) != 0)
+		goto err0;
+
+	/* Move the items which already failed out of the batch's way. */
+	for (nok = 0, i = 0; i < walk.nitems; i++) {
+		if (walk.items[i].rc == 0)
+			swapitems(&walk.items[nok++], &walk.items[i]);
+	}
+	qsort(walk.items, nok, sizeof(struct scryptenc_batch_item), bypath);
+
+	if ((rc = scrypty_scryptenc_batch(walk.items, nok, passwd,
+	    passwdlen, profile, decrypt ? SCRYPTENC_BATCH_DECRYPT_FILE :
+	    SCRYPTENC_BATCH_ENCRYPT_FILE, nthreads, maxmemtotal)) != 0)
+		goto err0;
+	qsort(walk.items, walk.nitems, sizeof(struct scryptenc_batch_item),
+	    bypath);
+
+	*items = walk.items;
+	*nitems = walk.nitems;
+
+	/* Success! */
+	return (0);
+
+err0:
+	scrypty_scryptenc_tree_free(walk.items, walk.nitems);
+
+	/* Failure! */
+	return (rc);
+}
+
+/**
+ * scrypty_scryptenc_tree_free(items, nitems):
+ * Free the items returned by scrypty_scryptenc_tree.
+ */
+void
+scrypty_scryptenc_tree_free(struct scryptenc_batch_item * items,
+    size_t nitems)
+{
+	size_t i;
+
+	for (i = 0; i < nitems; i++)
+		free((char *)(uintptr_t)items[i].path);
+	free(items);
+}
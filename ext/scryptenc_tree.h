@@ -0,0 +1,40 @@
+#ifndef _SCRYPTENC_TREE_H_
+#define _SCRYPTENC_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scryptenc.h"
+#include "scryptenc_batch.h"
+
+/**
+ * scrypty_scryptenc_tree(srcdir, dstdir, passwd, passwdlen, profile,
+ *     decrypt, nthreads, maxmemtotal, items, nitems):
+ * Encrypt (or if decrypt is non-zero, decrypt) every regular file below
+ * srcdir into the file with the same name relative to dstdir, creating
+ * dstdir and the directories below it as needed.  Symbolic links and other
+ * special files are skipped, as is dstdir itself if it lies below srcdir.
+ * The files are processed as one batch of SCRYPTENC_BATCH_*_FILE items
+ * (see scrypty_scryptenc_batch), which are sorted by name and stored in
+ * items and nitems; each item's path is srcdir, a '/' and the file's
+ * relative name.  A directory below srcdir which can't be read or created
+ * below dstdir, or an entry which can't be examined, is reported as an item
+ * of its own which failed with 13 or 12, and the walk carries on.  The walk
+ * and the batch stop early if the calling thread's cancellation flag is set
+ * (see scrypty_budget_setcancel).  The items must be freed with
+ * scrypty_scryptenc_tree_free.  Return 0 on success, 1 if the available
+ * storage cannot be determined, 6 if memory couldn't be allocated, 12 if
+ * dstdir couldn't be created, 13 if srcdir couldn't be read, or 16 if the
+ * walk was cancelled; only on success are items stored.
+ */
+int scrypty_scryptenc_tree(const char *, const char *, const uint8_t *,
+    size_t, const struct scryptenc_profile *, int, size_t, size_t,
+    struct scryptenc_batch_item **, size_t *);
+
+/**
+ * scrypty_scryptenc_tree_free(items, nitems):
+ * Free the nitems items returned by scrypty_scryptenc_tree.
+ */
+void scrypty_scryptenc_tree_free(struct scryptenc_batch_item *, size_t);
+
+#endif /* !_SCRYPTENC_TREE_H_ */
@@ -0,0 +1,165 @@
+#include "scrypt_platform.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crypto_scrypt.h"
+#include "memlimit.h"
+
+#include "scryptenc_tune.h"
+
+/* Values of r tried; larger blocks amortize DRAM latency on some hosts. */
+static const uint32_t tune_r[] = { 8, 16, 32 };
+
+/* Measurements shorter than this fraction of the target are too noisy to
+ * extrapolate from, unless nothing larger fits in memory. */
+#define MINFRAC	64
+
+static int timerun(uint64_t, uint32_t, uint32_t, double *);
+
+/**
+ * timerun(N, r, p, t):
+ * Time one derivation of a 64-byte key with parameters N, r, p, storing
+ * the wall-clock time in seconds in t.  Return 0, or a scryptenc return
+ * code.
+ */
+static int
+timerun(uint64_t N, uint32_t r, uint32_t p, double * t)
+{
+	struct timespec st, en;
+	uint8_t dk[64];
+
+	if (clock_gettime(CLOCK_MONOTONIC, &st))
+		return (2);
+	if (scrypty_crypto_scrypt((const uint8_t *)"scrypty", 7,
+	    (const uint8_t *)"tune", 4, N, r, p, dk, 64))
+		return (3);
+	if (clock_gettime(CLOCK_MONOTONIC, &en))
+		return (2);
+
+	*t = (en.tv_sec - st.tv_sec) + (en.tv_nsec - st.tv_nsec) * 0.000000001;
+	return (0);
+}
+
+/**
+ * scrypty_scryptenc_tune(target, maxmem, tolerance, profile):
+ * Pick scrypt parameters for profile from timed derivations.
+ */
+int
+scrypty_scryptenc_tune(double target, size_t maxmem, double tolerance,
+    struct scryptenc_profile * profile)
+{
+	double t[64];
+	double pred, err, mem, work, T;
+	double besterr = HUGE_VAL, bestmem = 0, bestwork = 0;
+	size_t memlimit, i;
+	uint64_t N;
+	uint32_t r, p, bestr = 0, bestp = 0;
+	int logN, last, bestlogN = 0, inrange = 0, fixedp;
+	int rc;
+
+	/* Figure out how much memory we may use. */
+	if (scrypty_memtouse(maxmem, 0.5, &memlimit))
+		return (1);
+
+	for (i = 0; i < sizeof(tune_r) / sizeof(tune_r[0]); i++) {
+		r = tune_r[i];
+
+		/* Double N until half the target or the memory is used up. */
+		for (last = 0, logN = 1; logN < 63; logN++) {
+			N = (uint64_t)(1) << logN;
+			if (N > memlimit / 128 / r)
+				break;
+			if ((rc = timerun(N, r, 1, &t[logN])) != 0)
+				return (rc);
+			last = logN;
+			if (t[logN] >= target / 2)
+				break;
+		}
+		if (last == 0)
+			continue;
+
+		/* One more doubling would overshoot; assume it scales. */
+		if ((logN == last) && (last < 62) &&
+		    (((uint64_t)(1) << (last + 1)) <= memlimit / 128 / r)) {
+			t[last + 1] = t[last] * 2;
+			last += 1;
+		}
+
+		/*
+		 * Pick p for each N.  Keep the candidate using the most memory,
+		 * and of those the one doing the most work in the time.
+		 */
+		for (logN = last; logN >= 1; logN--) {
+			if ((logN < last) && (t[logN] < target / MINFRAC))
+				break;
+			pred = floor(target / t[logN] + 0.5);
+			if (pred < 1)
+				pred = 1;
+			if (pred * r >= 0x40000000)
+				continue;
+			p = (uint32_t)pred;
+			pred = p * t[logN];
+			err = fabs(pred / target - 1);
+			mem = ldexp((double)r, logN);
+			work = mem * p;
+			if (err <= tolerance) {
+				if (inrange && ((mem < bestmem) ||
+				    ((mem == bestmem) && (work <= bestwork))))
+					continue;
+				inrange = 1;
+			} else if (inrange || (err >= besterr))
+				continue;
+			besterr = err;
+			bestmem = mem;
+			bestwork = work;
+			bestlogN = logN;
+			bestr = r;
+			bestp = p;
+		}
+	}
+
+	/* Not even N = 2 fits in memory. */
+	if (bestlogN == 0)
+		return (9);
+
+	/*
+	 * Check the prediction, and correct p once for each N if it was off.
+	 * While the run is still too slow after that (or with p = 1, which
+	 * can't go lower), halve N and time it again.
+	 */
+	N = (uint64_t)(1) << bestlogN;
+	for (fixedp = 0; ; ) {
+		if ((rc = timerun(N, bestr, bestp, &T)) != 0)
+			return (rc);
+		if (fabs(T / target - 1) <= tolerance)
+			break;
+		p = (uint32_t)floor(bestp * target / T + 0.5);
+		if (p < 1)
+			p = 1;
+		if (!fixedp && (p != bestp) &&
+		    ((uint64_t)(p) * bestr < 0x40000000)) {
+			bestp = p;
+			fixedp = 1;
+		} else if ((T > target) && (bestlogN > 1)) {
+			bestlogN -= 1;
+			N >>= 1;
+			fixedp = 0;
+		} else
+			break;
+	}
+
+	profile->logN = bestlogN;
+	profile->r = bestr;
+	profile->p = bestp;
+	profile->memlimit = memlimit;
+
+	/* Scale the work done to the target, but accept these parameters. */
+	profile->opslimit = 4.0 * N * bestr * bestp;
+	if (T < target)
+		profile->opslimit *= target / T;
+
+	/* Success! */
+	return (0);
+}
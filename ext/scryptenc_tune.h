@@ -0,0 +1,28 @@
+#ifndef _SCRYPTENC_TUNE_H_
+#define _SCRYPTENC_TUNE_H_
+
+#include <stddef.h>
+
+#include "scryptenc.h"
+
+/**
+ * scrypty_scryptenc_tune(target, maxmem, tolerance, profile):
+ * Pick scrypt parameters for profile by timing real derivations on this
+ * host, rather than from the salsa20/8 rate measured by cpuperf.  For each
+ * r in 8, 16 and 32, N is doubled until a derivation takes half of target
+ * seconds or its V array would exceed maxmem bytes (or the memtouse limit
+ * for maxmem and a fraction of 0.5, if lower); p is then picked so that
+ * the predicted time is within tolerance (a fraction) of target.  Of the
+ * candidates meeting the tolerance, the one using the most memory wins,
+ * and among those the one doing the most salsa20/8 work (which is where a
+ * larger r pays off); its time is checked, and p corrected, with one more
+ * run, and while it is still too slow once p is 1 or has been corrected,
+ * N is halved and timed again, until it is within tolerance or N is 2.
+ * The memlimit of profile is set to the memory allowed, and its opslimit
+ * to the work this host can do in target seconds.  Tuning takes a few
+ * times target seconds.  Return 0 on success, or a scryptenc return code.
+ */
+int scrypty_scryptenc_tune(double, size_t, double,
+    struct scryptenc_profile *);
+
+#endif /* !_SCRYPTENC_TUNE_H_ */
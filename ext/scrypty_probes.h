@@ -0,0 +1,34 @@
+#ifndef _SCRYPTY_PROBES_H_
+#define _SCRYPTY_PROBES_H_
+
+/*
+ * Static tracepoints in the "scrypty" provider, for bpftrace, perf probe and
+ * SystemTap.  They are only compiled in when the extension is configured
+ * with --enable-probes (which requires <sys/sdt.h>); otherwise they expand
+ * to nothing and their arguments are not evaluated.
+ *
+ * Doubles are passed as integers, since not every tracer reads floating
+ * point probe arguments.
+ */
+#ifdef ENABLE_PROBES
+#include <sys/sdt.h>
+
+#define SCRYPTY_PROBE1(name, a)						\
+	DTRACE_PROBE1(scrypty, name, a)
+#define SCRYPTY_PROBE2(name, a, b)					\
+	DTRACE_PROBE2(scrypty, name, a, b)
+#define SCRYPTY_PROBE3(name, a, b, c)					\
+	DTRACE_PROBE3(scrypty, name, a, b, c)
+#define SCRYPTY_PROBE4(name, a, b, c, d)				\
+	DTRACE_PROBE4(scrypty, name, a, b, c, d)
+#define SCRYPTY_PROBE5(name, a, b, c, d, e)				\
+	DTRACE_PROBE5(scrypty, name, a, b, c, d, e)
+#else
+#define SCRYPTY_PROBE1(name, a)			do { } while (0)
+#define SCRYPTY_PROBE2(name, a, b)		do { } while (0)
+#define SCRYPTY_PROBE3(name, a, b, c)		do { } while (0)
+#define SCRYPTY_PROBE4(name, a, b, c, d)	do { } while (0)
+#define SCRYPTY_PROBE5(name, a, b, c, d, e)	do { } while (0)
+#endif
+
+#endif /* !_SCRYPTY_PROBES_H_ */
@@ -0,0 +1,833 @@
+/*
+ * Known-answer and differential tests for the kernels underneath scrypty.
+ * Like bench/kernels.c, this file includes crypto_scrypt-ref.c directly so
+ * that it can reach the static SMix variants; the rest of the extension's
+ * C sources are linked in as usual.
+ *
+ * The known answers are the scrypt and PBKDF2-HMAC-SHA256 vectors of RFC
+ * 7914, the AES-256 block of FIPS-197 appendix C.3 and the CTR-AES256
+ * vector of SP 800-38A F.5.5.  Our CTR counter block is a 64-bit nonce and
+ * a 64-bit block number, which can't express the SP 800-38A counter, so
+ * that vector checks OpenSSL's EVP AES-256-CTR; every CTR backend is then
+ * compared against EVP.
+ *
+ * The differential tests run every backend compiled into this build on
+ * random inputs (parameters, lengths, and buffers at odd addresses) and
+ * compare its output with a reference: for scrypt and SMix a word-oriented
+ * transcription of RFC 7914 below, using OpenSSL's PBKDF2; for PBKDF2 and
+ * SHA256, OpenSSL; for AES-CTR, OpenSSL's EVP.  Each backend and its
+ * reference are timed on the same inputs, so every run reports speedups
+ * alongside correctness.
+ *
+ * Usage: kat [--quick] [--full] [--cases n] [--seed n] [--label text]
+ *
+ * --full adds the RFC 7914 vector with N = 2^20, which needs 1 GiB.
+ * Results are written to stdout as one JSON document; the exit status is 1
+ * if any test failed.
+ */
+#include "crypto_scrypt-ref.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#include "crypto_aesctr.h"
+#include "scryptenc_pipe.h"
+#include "scryptenc_sched.h"
+
+/* Command-line options. */
+static int quick = 0;
+static int full = 0;
+static size_t ncases = 0;
+static uint64_t seed = 1;
+static const char * label = "";
+
+/* Whether a result has already been printed (for JSON commas). */
+static int printed = 0;
+
+/* Number of failed tests. */
+static int failures = 0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/**
+ * rnd():
+ * Return the next output of a xorshift64* generator seeded from --seed, so
+ * that a failing case can be reproduced.
+ */
+static uint64_t
+rnd(void)
+{
+
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (seed * 0x2545F4914F6CDD1DULL);
+}
+
+static size_t
+rndrange(size_t lo, size_t hi)
+{
+
+	return (lo + (size_t)(rnd() % (hi - lo + 1)));
+}
+
+static void
+rndfill(uint8_t * buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rnd() & 0xff;
+}
+
+/**
+ * odd(buf):
+ * Return buf, which must have 16 bytes to spare, moved on by 0 to 15 bytes.
+ */
+static uint8_t *
+odd(uint8_t * buf)
+{
+
+	return (buf + rndrange(0, 15));
+}
+
+static uint8_t *
+xmalloc(size_t len)
+{
+	uint8_t * p;
+
+	if ((p = malloc(len + 16)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return (p);
+}
+
+static void
+hex(const char * s, uint8_t * buf, size_t len)
+{
+	unsigned int x;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(&s[2 * i], "%2x", &x) != 1)
+			abort();
+		buf[i] = (uint8_t)x;
+	}
+}
+
+/*
+ * The RFC 7914 reference, on 32-bit words as the RFC describes it, with
+ * nothing shared with crypto_scrypt-ref.c.
+ */
+static void
+ref_salsa20_8(uint32_t B[16])
+{
+	uint32_t x[16];
+	int i;
+
+	memcpy(x, B, sizeof(x));
+	for (i = 8; i > 0; i -= 2) {
+#define R(a,b) (((a) << (b)) | ((a) >> (32 - (b))))
+		x[ 4] ^= R(x[ 0]+x[12], 7);  x[ 8] ^= R(x[ 4]+x[ 0], 9);
+		x[12] ^= R(x[ 8]+x[ 4],13);  x[ 0] ^= R(x[12]+x[ 8],18);
+		x[ 9] ^= R(x[ 5]+x[ 1], 7);  x[13] ^= R(x[ 9]+x[ 5], 9);
+		x[ 1] ^= R(x[13]+x[ 9],13);  x[ 5] ^= R(x[ 1]+x[13],18);
+		x[14] ^= R(x[10]+x[ 6], 7);  x[ 2] ^= R(x[14]+x[10], 9);
+		x[ 6] ^= R(x[ 2]+x[14],13);  x[10] ^= R(x[ 6]+x[ 2],18);
+		x[ 3] ^= R(x[15]+x[11], 7);  x[ 7] ^= R(x[ 3]+x[15], 9);
+		x[11] ^= R(x[ 7]+x[ 3],13);  x[15] ^= R(x[11]+x[ 7],18);
+		x[ 1] ^= R(x[ 0]+x[ 3], 7);  x[ 2] ^= R(x[ 1]+x[ 0], 9);
+		x[ 3] ^= R(x[ 2]+x[ 1],13);  x[ 0] ^= R(x[ 3]+x[ 2],18);
+		x[ 6] ^= R(x[ 5]+x[ 4], 7);  x[ 7] ^= R(x[ 6]+x[ 5], 9);
+		x[ 4] ^= R(x[ 7]+x[ 6],13);  x[ 5] ^= R(x[ 4]+x[ 7],18);
+		x[11] ^= R(x[10]+x[ 9], 7);  x[ 8] ^= R(x[11]+x[10], 9);
+		x[ 9] ^= R(x[ 8]+x[11],13);  x[10] ^= R(x[ 9]+x[ 8],18);
+		x[12] ^= R(x[15]+x[14], 7);  x[13] ^= R(x[12]+x[15], 9);
+		x[14] ^= R(x[13]+x[12],13);  x[15] ^= R(x[14]+x[13],18);
+#undef R
+	}
+	for (i = 0; i < 16; i++)
+		B[i] += x[i];
+}
+
+/* B = BlockMix(B), with Y as scratch space of the same 32r words. */
+static void
+ref_blockmix(uint32_t * B, uint32_t * Y, size_t r)
+{
+	uint32_t X[16];
+	size_t i, j;
+
+	memcpy(X, &B[(2 * r - 1) * 16], 64);
+	for (i = 0; i < 2 * r; i++) {
+		for (j = 0; j < 16; j++)
+			X[j] ^= B[i * 16 + j];
+		ref_salsa20_8(X);
+		memcpy(&Y[i * 16], X, 64);
+	}
+	for (i = 0; i < r; i++) {
+		memcpy(&B[i * 16], &Y[(2 * i) * 16], 64);
+		memcpy(&B[(r + i) * 16], &Y[(2 * i + 1) * 16], 64);
+	}
+}
+
+static void
+ref_smix(uint8_t * B, size_t r, uint64_t N)
+{
+	uint32_t * X;
+	uint32_t * Y;
+	uint32_t * V;
+	uint64_t i, j;
+	size_t k;
+
+	X = (uint32_t *)xmalloc(128 * r);
+	Y = (uint32_t *)xmalloc(128 * r);
+	V = (uint32_t *)xmalloc(128 * r * N);
+
+	for (k = 0; k < 32 * r; k++)
+		X[k] = le32dec(&B[4 * k]);
+	for (i = 0; i < N; i++) {
+		memcpy(&V[i * 32 * r], X, 128 * r);
+		ref_blockmix(X, Y, r);
+	}
+	for (i = 0; i < N; i++) {
+		j = (X[(2 * r - 1) * 16] |
+		    ((uint64_t)X[(2 * r - 1) * 16 + 1] << 32)) & (N - 1);
+		for (k = 0; k < 32 * r; k++)
+			X[k] ^= V[j * 32 * r + k];
+		ref_blockmix(X, Y, r);
+	}
+	for (k = 0; k < 32 * r; k++)
+		le32enc(&B[4 * k], X[k]);
+
+	free(V);
+	free(Y);
+	free(X);
+}
+
+static void
+ref_pbkdf2(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
+    size_t saltlen, uint64_t c, uint8_t * buf, size_t dkLen)
+{
+	static const uint8_t empty[1] = {0};
+
+	if (!PKCS5_PBKDF2_HMAC((const char *)(passwdlen ? passwd : empty),
+	    (int)passwdlen, saltlen ? salt : empty, (int)saltlen, (int)c,
+	    EVP_sha256(), (int)dkLen, buf)) {
+		fprintf(stderr, "PKCS5_PBKDF2_HMAC failed\n");
+		exit(1);
+	}
+}
+
+static int
+ref_scrypt(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
+    size_t saltlen, uint64_t N, uint32_t r, uint32_t p, uint8_t * buf,
+    size_t buflen)
+{
+	uint8_t * B;
+	uint32_t i;
+
+	B = xmalloc(128 * r * p);
+	ref_pbkdf2(passwd, passwdlen, salt, saltlen, 1, B, 128 * r * p);
+	for (i = 0; i < p; i++)
+		ref_smix(&B[128 * r * i], r, N);
+	ref_pbkdf2(passwd, passwdlen, B, 128 * r * p, 1, buf, buflen);
+	free(B);
+
+	return (0);
+}
+
+static void
+ref_aesctr(const uint8_t key[32], uint64_t nonce, uint64_t offset,
+    const uint8_t * in, uint8_t * out, size_t len)
+{
+	EVP_CIPHER_CTX * ctx;
+	uint8_t iv[16];
+	uint8_t skip[16];
+	int outl;
+
+	be64enc(iv, nonce);
+	be64enc(&iv[8], offset / 16);
+	memset(skip, 0, sizeof(skip));
+	if (((ctx = EVP_CIPHER_CTX_new()) == NULL) ||
+	    !EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, iv) ||
+	    !EVP_EncryptUpdate(ctx, skip, &outl, skip, (int)(offset % 16)) ||
+	    !EVP_EncryptUpdate(ctx, out, &outl, in, (int)len)) {
+		fprintf(stderr, "EVP AES-256-CTR failed\n");
+		exit(1);
+	}
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+/* Results. */
+static void
+print_kat(const char * name, const char * backend, int pass)
+{
+
+	printf("%s\n    {\"test\": \"%s\", \"backend\": \"%s\", \"pass\": %s}",
+	    printed ? "," : "", name, backend, pass ? "true" : "false");
+	fflush(stdout);
+	printed = 1;
+	if (!pass)
+		failures++;
+}
+
+struct diff {
+	const char * backend;
+	const char * reference;
+	uint64_t cases;
+	uint64_t failed;
+	double ns;
+	double refns;
+};
+
+static void
+print_diff(const struct diff * d)
+{
+
+	printf("%s\n    {\"test\": \"differential\", \"backend\": \"%s\", "
+	    "\"reference\": \"%s\", \"cases\": %ju, \"failures\": %ju, ",
+	    printed ? "," : "", d->backend, d->reference, (uintmax_t)d->cases,
+	    (uintmax_t)d->failed);
+	if (d->cases > 0)
+		printf("\"ns_per_op\": %.1f, \"reference_ns_per_op\": %.1f, "
+		    "\"speedup\": %.2f}", d->ns / d->cases,
+		    d->refns / d->cases, d->refns / d->ns);
+	else
+		printf("\"ns_per_op\": null, \"reference_ns_per_op\": null, "
+		    "\"speedup\": null}");
+	fflush(stdout);
+	printed = 1;
+	failures += (d->failed > 0);
+}
+
+/**
+ * check(d, same, st, mid, en):
+ * Record a case of d in which the reference ran from st to mid and the
+ * backend from mid to en, and their outputs were the same if same is
+ * non-zero.
+ */
+static void
+check(struct diff * d, int same, double st, double mid, double en)
+{
+
+	d->cases++;
+	d->refns += mid - st;
+	d->ns += en - mid;
+	if (!same && (d->failed++ == 0))
+		fprintf(stderr, "%s differs from %s (case %ju)\n", d->backend,
+		    d->reference, (uintmax_t)d->cases);
+}
+
+/* Known answers. */
+typedef int scrypt_func(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint32_t, uint32_t, uint8_t *, size_t);
+
+static const struct {
+	const char * name;
+	const char * backend;
+	scrypt_func * fn;
+	int workers;
+} scrypts[] = {
+	{ "crypto_scrypt", "crypto_scrypt", scrypty_crypto_scrypt, 0 },
+	{ "crypto_scrypt_keep", "crypto_scrypt_keep",
+	    scrypty_crypto_scrypt_keep, 0 },
+	{ "sched_scrypt", "sched_scrypt (2 workers)", scrypty_sched_scrypt, 2 },
+	{ "ref_scrypt", "rfc7914", ref_scrypt, 0 }
+};
+#define NSCRYPTS (sizeof(scrypts) / sizeof(scrypts[0]))
+
+static void
+kat_scrypt(void)
+{
+	static const struct {
+		const char * passwd;
+		const char * salt;
+		uint64_t N;
+		uint32_t r;
+		uint32_t p;
+		const char * dk;
+	} vectors[] = {
+		{ "", "", 16, 1, 1,
+		    "77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442"
+		    "fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906" },
+		{ "password", "NaCl", 1024, 8, 16,
+		    "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b373162"
+		    "2eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640" },
+		{ "pleaseletmein", "SodiumChloride", 16384, 8, 1,
+		    "7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2"
+		    "d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887" },
+		{ "pleaseletmein", "SodiumChloride", 1048576, 8, 1,
+		    "2101cb9b6a511aaeaddbbe09cf70f881ec568d574a2ffd4dabe5ee9820adaa47"
+		    "8e56fd8f4ba5d09ffa1c6d927c40f4c337304049e8a952fbcbf45c6fa77a41a4" }
+	};
+	char name[64];
+	uint8_t expected[64];
+	uint8_t dk[64];
+	size_t i, j;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		if ((vectors[i].N > 16384) && !full)
+			continue;
+		hex(vectors[i].dk, expected, 64);
+		snprintf(name, sizeof(name), "rfc7914_scrypt_%zu", i + 1);
+		for (j = 0; j < NSCRYPTS; j++) {
+			/* The reference is slow; one large vector is enough. */
+			if ((scrypts[j].fn == ref_scrypt) && quick &&
+			    (vectors[i].N > 1024))
+				continue;
+			scrypty_sched_set(scrypts[j].workers);
+			memset(dk, 0, 64);
+			print_kat(name, scrypts[j].backend,
+			    (scrypts[j].fn((const uint8_t *)vectors[i].passwd,
+			    strlen(vectors[i].passwd),
+			    (const uint8_t *)vectors[i].salt,
+			    strlen(vectors[i].salt), vectors[i].N, vectors[i].r,
+			    vectors[i].p, dk, 64) == 0) &&
+			    (memcmp(dk, expected, 64) == 0));
+			scrypty_sched_set(0);
+		}
+	}
+}
+
+static void
+kat_pbkdf2(void)
+{
+	static const struct {
+		const char * passwd;
+		const char * salt;
+		uint64_t c;
+		const char * dk;
+	} vectors[] = {
+		{ "passwd", "salt", 1,
+		    "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+		    "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783" },
+		{ "Password", "NaCl", 80000,
+		    "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+		    "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d" }
+	};
+	char name[64];
+	uint8_t expected[64];
+	uint8_t dk[64];
+	size_t i;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		hex(vectors[i].dk, expected, 64);
+		snprintf(name, sizeof(name), "rfc7914_pbkdf2_%zu", i + 1);
+
+		scrypty_PBKDF2_SHA256((const uint8_t *)vectors[i].passwd,
+		    strlen(vectors[i].passwd), (const uint8_t *)vectors[i].salt,
+		    strlen(vectors[i].salt), vectors[i].c, dk, 64);
+		print_kat(name, "pbkdf2_sha256", memcmp(dk, expected, 64) == 0);
+
+		ref_pbkdf2((const uint8_t *)vectors[i].passwd,
+		    strlen(vectors[i].passwd), (const uint8_t *)vectors[i].salt,
+		    strlen(vectors[i].salt), vectors[i].c, dk, 64);
+		print_kat(name, "openssl", memcmp(dk, expected, 64) == 0);
+	}
+}
+
+static void
+kat_aes(void)
+{
+	uint8_t key[32], in[64], out[64], expected[64], iv[16];
+	EVP_CIPHER_CTX * ctx;
+	AES_KEY aes;
+	int outl;
+
+	/* FIPS-197 C.3: the block cipher every CTR backend is built on. */
+	hex("000102030405060708090a0b0c0d0e0f"
+	    "101112131415161718191a1b1c1d1e1f", key, 32);
+	hex("00112233445566778899aabbccddeeff", in, 16);
+	hex("8ea2b7ca516745bfeafc49904b496089", expected, 16);
+	if (AES_set_encrypt_key(key, 256, &aes)) {
+		fprintf(stderr, "AES_set_encrypt_key failed\n");
+		exit(1);
+	}
+	AES_encrypt(in, out, &aes);
+	print_kat("fips197_aes256", "AES_encrypt", memcmp(out, expected, 16) == 0);
+
+	/* SP 800-38A F.5.5: the CTR reference. */
+	hex("603deb1015ca71be2b73aef0857d7781"
+	    "1f352c073b6108d72d9810a30914dff4", key, 32);
+	hex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", iv, 16);
+	hex("6bc1bee22e409f96e93d7e117393172a"
+	    "ae2d8a571e03ac9c9eb76fac45af8e51"
+	    "30c81c46a35ce411e5fbc1191a0a52ef"
+	    "f69f2445df4f9b17ad2b417be66c3710", in, 64);
+	hex("601ec313775789a5b7a7f504bbf3d228"
+	    "f443e3ca4d62b59aca84e990cacaf5c5"
+	    "2b0930daa23de94ce87017ba2d84988d"
+	    "dfc9c58db67aada613c2dd08457941a6", expected, 64);
+	if (((ctx = EVP_CIPHER_CTX_new()) == NULL) ||
+	    !EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, iv) ||
+	    !EVP_EncryptUpdate(ctx, out, &outl, in, 64)) {
+		fprintf(stderr, "EVP AES-256-CTR failed\n");
+		exit(1);
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	print_kat("sp800_38a_ctr_aes256", "openssl",
+	    memcmp(out, expected, 64) == 0);
+}
+
+/* Differential tests. */
+static void
+diff_smix(void)
+{
+	static const size_t rs[] = {1, 2, 3, 5, 8, 16, 32};
+	static const size_t special[] = {1, 8, 16, 32};
+	struct diff generic = { "smix", "rfc7914", 0, 0, 0, 0 };
+	struct diff picked[4];
+	uint8_t * B, * B0, * Bref, * V, * XY;
+	uint8_t * b, * v, * xy;
+	double st, mid, en;
+	uint64_t N;
+	size_t i, k, r;
+	char names[4][16];
+
+	for (k = 0; k < 4; k++) {
+		snprintf(names[k], sizeof(names[k]), "smix_%zu", special[k]);
+		picked[k].backend = names[k];
+		picked[k].reference = "rfc7914";
+		picked[k].cases = picked[k].failed = 0;
+		picked[k].ns = picked[k].refns = 0;
+	}
+
+	for (i = 0; i < ncases; i++) {
+		r = rs[rndrange(0, sizeof(rs) / sizeof(rs[0]) - 1)];
+		N = (uint64_t)(1) << rndrange(1, quick ? 8 : 11);
+
+		B0 = xmalloc(128 * r);
+		Bref = xmalloc(128 * r);
+		B = xmalloc(128 * r);
+		V = xmalloc(128 * r * N);
+		XY = xmalloc(256 * r + 64);
+		rndfill(B0, 128 * r);
+		b = odd(B);
+		v = odd(V);
+		xy = odd(XY);
+
+		memcpy(Bref, B0, 128 * r);
+		memcpy(b, B0, 128 * r);
+		st = now();
+		ref_smix(Bref, r, N);
+		mid = now();
+		smix(b, r, N, v, xy);
+		en = now();
+		check(&generic, memcmp(b, Bref, 128 * r) == 0, st, mid, en);
+
+		for (k = 0; k < 4; k++) {
+			if (special[k] != r)
+				continue;
+			memcpy(Bref, B0, 128 * r);
+			memcpy(b, B0, 128 * r);
+			st = now();
+			ref_smix(Bref, r, N);
+			mid = now();
+			smix_pick(r)(b, r, N, v, xy);
+			en = now();
+			check(&picked[k], memcmp(b, Bref, 128 * r) == 0, st, mid, en);
+		}
+
+		free(XY);
+		free(V);
+		free(B);
+		free(Bref);
+		free(B0);
+	}
+
+	print_diff(&generic);
+	for (k = 0; k < 4; k++)
+		print_diff(&picked[k]);
+}
+
+static void
+diff_scrypt(void)
+{
+	struct diff d[NSCRYPTS - 1];
+	uint8_t * passwd, * salt, * dk, * dkref;
+	uint8_t * pw, * s, * out;
+	size_t passwdlen, saltlen, dklen, i, j;
+	double st, mid, en;
+	uint64_t N;
+	uint32_t r, p;
+
+	for (j = 0; j < NSCRYPTS - 1; j++) {
+		d[j].backend = scrypts[j].backend;
+		d[j].reference = "rfc7914";
+		d[j].cases = d[j].failed = 0;
+		d[j].ns = d[j].refns = 0;
+	}
+
+	passwd = xmalloc(128);
+	salt = xmalloc(128);
+	dk = xmalloc(300);
+	dkref = xmalloc(300);
+	for (i = 0; i < ncases; i++) {
+		passwdlen = rndrange(0, 128);
+		saltlen = rndrange(0, 128);
+		dklen = rndrange(1, 300);
+		N = (uint64_t)(1) << rndrange(1, quick ? 8 : 10);
+		r = (uint32_t)((rnd() % 4 == 0) ? rndrange(1, 17) : 8);
+		p = (uint32_t)rndrange(1, 4);
+		pw = odd(passwd);
+		s = odd(salt);
+		rndfill(pw, passwdlen);
+		rndfill(s, saltlen);
+
+		for (j = 0; j < NSCRYPTS - 1; j++) {
+			scrypty_sched_set(scrypts[j].workers);
+			out = odd(dk);
+			st = now();
+			ref_scrypt(pw, passwdlen, s, saltlen, N, r, p, dkref,
+			    dklen);
+			mid = now();
+			if (scrypts[j].fn(pw, passwdlen, s, saltlen, N, r, p, out,
+			    dklen))
+				memset(out, ~dkref[0], dklen);
+			en = now();
+			check(&d[j], memcmp(out, dkref, dklen) == 0, st, mid, en);
+			scrypty_sched_set(0);
+		}
+	}
+	free(dkref);
+	free(dk);
+	free(salt);
+	free(passwd);
+
+	for (j = 0; j < NSCRYPTS - 1; j++)
+		print_diff(&d[j]);
+}
+
+static void
+diff_pbkdf2(void)
+{
+	struct diff d = { "pbkdf2_sha256", "openssl", 0, 0, 0, 0 };
+	uint8_t * passwd, * salt, * dk, * dkref;
+	uint8_t * pw, * s, * out;
+	size_t passwdlen, saltlen, dklen, i;
+	double st, mid, en;
+	uint64_t c;
+
+	passwd = xmalloc(200);
+	salt = xmalloc(200);
+	dk = xmalloc(300);
+	dkref = xmalloc(300);
+	for (i = 0; i < ncases; i++) {
+		passwdlen = rndrange(0, 200);
+		saltlen = rndrange(0, 200);
+		dklen = rndrange(1, 300);
+		c = rndrange(1, 4);
+		pw = odd(passwd);
+		s = odd(salt);
+		out = odd(dk);
+		rndfill(pw, passwdlen);
+		rndfill(s, saltlen);
+
+		st = now();
+		ref_pbkdf2(pw, passwdlen, s, saltlen, c, dkref, dklen);
+		mid = now();
+		scrypty_PBKDF2_SHA256(pw, passwdlen, s, saltlen, c, out, dklen);
+		en = now();
+		check(&d, memcmp(out, dkref, dklen) == 0, st, mid, en);
+	}
+	free(dkref);
+	free(dk);
+	free(salt);
+	free(passwd);
+
+	print_diff(&d);
+}
+
+static void
+diff_sha256(void)
+{
+	struct diff d = { "sha256", "openssl", 0, 0, 0, 0 };
+	uint8_t * buf, * in;
+	uint8_t out[32], ref[32];
+	scrypty_SHA256_CTX ctx;
+	unsigned int outl;
+	size_t len, i, pos, n;
+	double st, mid, en;
+
+	buf = xmalloc(20000);
+	for (i = 0; i < ncases; i++) {
+		len = rndrange(0, 20000);
+		in = odd(buf);
+		rndfill(in, len);
+
+		st = now();
+		if (!EVP_Digest(in, len, ref, &outl, EVP_sha256(), NULL)) {
+			fprintf(stderr, "EVP_Digest failed\n");
+			exit(1);
+		}
+		mid = now();
+
+		/* Feed it in random pieces to cover the partial-block paths. */
+		scrypty_SHA256_Init(&ctx);
+		for (pos = 0; pos < len; pos += n) {
+			n = rndrange(1, len - pos);
+			scrypty_SHA256_Update(&ctx, &in[pos], n);
+		}
+		scrypty_SHA256_Final(out, &ctx);
+		en = now();
+		check(&d, memcmp(out, ref, 32) == 0, st, mid, en);
+	}
+	free(buf);
+
+	print_diff(&d);
+}
+
+static void
+diff_aesctr(void)
+{
+	struct diff stream = { "aesctr_stream", "openssl", 0, 0, 0, 0 };
+	struct diff bufat = { "aesctr_buf_at", "openssl", 0, 0, 0, 0 };
+	struct diff pipe0 = { "pipe_buf", "openssl", 0, 0, 0, 0 };
+	struct diff pipe3 = { "pipe_buf (3 threads)", "openssl", 0, 0, 0, 0 };
+	struct crypto_aesctr * s;
+	scrypty_HMAC_SHA256_CTX hctx;
+	uint8_t key[32], mac[32], macref[32];
+	uint8_t * inbuf, * outbuf, * refbuf;
+	uint8_t * in, * out;
+	size_t len, maxlen, pos, n, i;
+	uint64_t nonce, offset;
+	double st, mid, en;
+	AES_KEY aes;
+
+	maxlen = quick ? PIPE_MINBUF + 100000 : 2 * PIPE_MINBUF;
+	inbuf = xmalloc(maxlen);
+	outbuf = xmalloc(maxlen);
+	refbuf = xmalloc(maxlen);
+	for (i = 0; i < ncases; i++) {
+		rndfill(key, 32);
+		if (AES_set_encrypt_key(key, 256, &aes)) {
+			fprintf(stderr, "AES_set_encrypt_key failed\n");
+			exit(1);
+		}
+		len = rndrange(0, 5000);
+		nonce = rnd();
+		offset = rnd() >> 8;
+		in = odd(inbuf);
+		out = odd(outbuf);
+		rndfill(in, len);
+
+		/* A stream fed in random pieces. */
+		st = now();
+		ref_aesctr(key, nonce, 0, in, refbuf, len);
+		mid = now();
+		if ((s = scrypty_crypto_aesctr_init(&aes, nonce)) == NULL) {
+			perror("scrypty_crypto_aesctr_init");
+			exit(1);
+		}
+		for (pos = 0; pos < len; pos += n) {
+			n = rndrange(1, len - pos);
+			scrypty_crypto_aesctr_stream(s, &in[pos], &out[pos], n);
+		}
+		scrypty_crypto_aesctr_free(s);
+		en = now();
+		check(&stream, memcmp(out, refbuf, len) == 0, st, mid, en);
+
+		/* A buffer starting anywhere in the stream. */
+		st = now();
+		ref_aesctr(key, nonce, offset, in, refbuf, len);
+		mid = now();
+		scrypty_crypto_aesctr_buf_at(&aes, nonce, offset, in, out, len);
+		en = now();
+		check(&bufat, memcmp(out, refbuf, len) == 0, st, mid, en);
+
+		/* The pipeline, with its HMAC, serially and on threads. */
+		if (i % 8 == 0)
+			len = rndrange(PIPE_MINBUF, maxlen);
+		rndfill(in, len);
+		for (n = 0; n <= 3; n += 3) {
+			scrypty_pipe_set(n);
+			st = now();
+			ref_aesctr(key, 0, 0, in, refbuf, len);
+			scrypty_HMAC_SHA256_Init(&hctx, key, 32);
+			scrypty_HMAC_SHA256_Update(&hctx, refbuf, len);
+			scrypty_HMAC_SHA256_Final(macref, &hctx);
+			mid = now();
+			scrypty_HMAC_SHA256_Init(&hctx, key, 32);
+			scrypty_pipe_buf(&aes, &hctx, in, out, len, 0);
+			scrypty_HMAC_SHA256_Final(mac, &hctx);
+			en = now();
+			check((n == 0) ? &pipe0 : &pipe3,
+			    (memcmp(out, refbuf, len) == 0) &&
+			    (memcmp(mac, macref, 32) == 0), st, mid, en);
+		}
+		scrypty_pipe_set(0);
+	}
+	free(refbuf);
+	free(outbuf);
+	free(inbuf);
+
+	print_diff(&stream);
+	print_diff(&bufat);
+	print_diff(&pipe0);
+	print_diff(&pipe3);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: kat [--quick] [--full] [--cases n] "
+	    "[--seed n] [--label text]\n");
+	exit(1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0)
+			quick = 1;
+		else if (strcmp(argv[i], "--full") == 0)
+			full = 1;
+		else if ((strcmp(argv[i], "--cases") == 0) && (i + 1 < argc))
+			ncases = (size_t)strtoull(argv[++i], NULL, 0);
+		else if ((strcmp(argv[i], "--seed") == 0) && (i + 1 < argc))
+			seed = strtoull(argv[++i], NULL, 0);
+		else if ((strcmp(argv[i], "--label") == 0) && (i + 1 < argc))
+			label = argv[++i];
+		else
+			usage();
+	}
+	if (ncases == 0)
+		ncases = quick ? 40 : 200;
+	if (seed == 0)
+		seed = 1;
+
+	printf("{\n  \"label\": \"%s\",\n", label);
+	printf("  \"seed\": %ju,\n  \"cases\": %zu,\n", (uintmax_t)seed,
+	    ncases);
+	printf("  \"results\": [");
+
+	kat_scrypt();
+	kat_pbkdf2();
+	kat_aes();
+	diff_smix();
+	diff_scrypt();
+	diff_pbkdf2();
+	diff_sha256();
+	diff_aesctr();
+
+	printf("\n  ],\n  \"failures\": %d\n}\n", failures);
+
+	return (failures ? 1 : 0);
+}
@@ -1,5 +1,7 @@
 require 'test/unit'
 require 'securerandom'
+require 'fileutils'
+require 'tmpdir'
 require 'scrypty'
 
 class TestScrypty < Test::Unit::TestCase
@@ -41,4 +43,726 @@ class TestScrypty < Test::Unit::TestCase
     plaintext = Scrypty.decrypt_raw(ciphertext, dk);
     assert_equal "foobar", plaintext
   end
+
+  test 'key' do
+    dk = Scrypty.dk("secret", "salt", 1024, 8, 1, 64)
+    key = Scrypty::Key.new(dk)
+
+    ciphertext = key.encrypt_raw("foobar")
+    assert_equal Scrypty.encrypt_raw("foobar", dk), ciphertext
+    assert_equal "foobar", key.decrypt_raw(ciphertext)
+    assert_equal "", key.decrypt_raw(key.encrypt_raw(""))
+    ciphertext.setbyte(0, ciphertext.getbyte(0) ^ 1)
+    assert_raise(Scrypty::InvalidBlockError) { key.decrypt_raw(ciphertext) }
+    assert_raise(Scrypty::InvalidBlockError) { key.decrypt_raw("short") }
+    assert_raise(ArgumentError) { Scrypty::Key.new("too short") }
+
+    key.wipe
+    assert key.wiped?
+    assert_raise(RuntimeError) { key.encrypt_raw("foobar") }
+  end
+
+  test 'profile' do
+    profile = Scrypty::Profile.new(2 ** 27, 0.5, 2)
+    assert profile.memlimit >= (2 ** 27)
+    assert profile.opslimit >= 32768
+    assert_equal 8, profile.r
+    assert_equal [profile.n, profile.r, profile.p],
+      Scrypty.params(profile.memlimit, profile.opslimit)
+    assert profile.frozen?
+  end
+
+  test 'profile from params' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    assert_equal [1024, 8, 1], profile.params
+    assert_equal 128 * 1024 * 8, profile.memlimit
+    assert_raise(ArgumentError) { Scrypty::Profile.from_params(1000, 8, 1) }
+  end
+
+  test 'profile roundtrip' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    encrypted = Scrypty.encrypt("foobar", "secret", profile)
+    assert_equal "foobar", Scrypty.decrypt(encrypted, "secret", profile)
+
+    cheaper = Scrypty::Profile.from_params(512, 8, 1)
+    assert_raise(Scrypty::NotEnoughMemoryError) do
+      Scrypty.decrypt(encrypted, "secret", cheaper)
+    end
+  end
+
+  test 'profile file roundtrip' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    Dir.mktmpdir do |dir|
+      orig_fn = File.join(dir, "foo.txt")
+      enc_fn = File.join(dir, "foo.dat")
+      dec_fn = File.join(dir, "foo-dec.txt")
+      File.open(orig_fn, "wb") { |f| f.print("my data" * 10000) }
+      Scrypty.encrypt_file(orig_fn, enc_fn, "secret", profile)
+      Scrypty.decrypt_file(enc_fn, dec_fn, "secret", profile)
+      assert_equal File.read(orig_fn), File.read(dec_fn)
+    end
+  end
+
+  test 'compression' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    data = '{"id": 1, "name": "scrypty"}' * 1000
+    encrypted = Scrypty.encrypt(data, "secret", profile, compress: :zlib)
+    assert_operator encrypted.bytesize, :<, data.bytesize / 10
+    assert_equal 1, Scrypty.header(encrypted)[:version]
+    assert_equal data, Scrypty.decrypt(encrypted, "secret", profile)
+    assert Scrypty.verify(encrypted, "secret", profile)
+    assert_equal [data], Scrypty.decrypt_batch([encrypted], "secret", profile)
+
+    # Data which doesn't compress is stored as before.
+    noise = SecureRandom.random_bytes(1000)
+    encrypted = Scrypty.encrypt(noise, "secret", profile, compress: true)
+    assert_equal 0, Scrypty.header(encrypted)[:version]
+    assert_equal noise.bytesize + 128, encrypted.bytesize
+    assert_raise(ArgumentError) { Scrypty.encrypt(data, "secret", profile, compress: :brotli) }
+
+    Dir.mktmpdir do |dir|
+      orig_fn = File.join(dir, "foo.json")
+      enc_fn = File.join(dir, "foo.dat")
+      dec_fn = File.join(dir, "foo-dec.json")
+      File.binwrite(orig_fn, data * 10)
+      Scrypty.encrypt_file(orig_fn, enc_fn, "secret", profile, compress: :zlib)
+      assert_operator File.size(enc_fn), :<, data.bytesize
+      Scrypty.decrypt_file(enc_fn, dec_fn, "secret", profile)
+      assert_equal data * 10, File.binread(dec_fn)
+      assert Scrypty.verify_file(enc_fn, "secret", profile)
+
+      # A damaged compressed file fails its HMAC check before it fails to
+      # inflate.
+      enc = File.binread(enc_fn)
+      enc.setbyte(200, enc.getbyte(200) ^ 1)
+      File.binwrite(enc_fn, enc)
+      assert_raise(Scrypty::InvalidBlockError) { Scrypty.decrypt_file(enc_fn, dec_fn, "secret", profile) }
+    end
+
+    # Inflating past the ratio limit fails rather than exhausting memory.
+    zeros = Scrypty.encrypt("\0" * (20 * 1024 * 1024), "secret", profile, compress: :zlib)
+    assert_equal 1024, Scrypty.inflate_ratio
+    begin
+      Scrypty.set_inflate_ratio(64)
+      assert_raise(Scrypty::CompressionError) { Scrypty.decrypt(zeros, "secret", profile) }
+      Scrypty.set_inflate_ratio(nil)
+      assert_equal 20 * 1024 * 1024, Scrypty.decrypt(zeros, "secret", profile).bytesize
+    ensure
+      Scrypty.set_inflate_ratio(1024)
+    end
+  end
+
+  test 'reencrypt' do
+    old_profile = Scrypty::Profile.from_params(1024, 8, 1)
+    # Room for both V arrays, so the two derivations run side by side.
+    profile = Scrypty::Profile.new(2 ** 24, 0.5, 0.001)
+    data = "my data" * 20000
+    encrypted = Scrypty.encrypt(data, "old", old_profile)
+    rotated = Scrypty.reencrypt(encrypted, "old", "new", profile)
+    assert_equal encrypted.bytesize, rotated.bytesize
+    assert_equal data, Scrypty.decrypt(rotated, "new", profile)
+    assert_raise(Scrypty::IncorrectPasswordError) do
+      Scrypty.decrypt(rotated, "old", profile)
+    end
+    assert_raise(Scrypty::IncorrectPasswordError) do
+      Scrypty.reencrypt(encrypted, "wrong", "new", profile)
+    end
+    tampered = encrypted.dup
+    tampered[-40] = (tampered[-40].ord ^ 1).chr
+    assert_raise(Scrypty::InvalidBlockError) do
+      Scrypty.reencrypt(tampered, "old", "new", old_profile)
+    end
+
+    compressed = Scrypty.encrypt(data, "old", old_profile, compress: true)
+    rotated = Scrypty.reencrypt(compressed, "old", "new", old_profile)
+    assert_equal data, Scrypty.decrypt(rotated, "new", old_profile)
+
+    Dir.mktmpdir do |dir|
+      enc_fn = File.join(dir, "foo.dat")
+      File.binwrite(enc_fn, encrypted)
+      File.chmod(0640, enc_fn)
+      Scrypty.reencrypt_file(enc_fn, enc_fn, "old", "new", profile)
+      assert_equal data, Scrypty.decrypt(File.binread(enc_fn), "new", profile)
+      assert_equal 0640, File.stat(enc_fn).mode & 07777
+
+      # Concurrent rotations of the same file each write a file of their own.
+      src_fn = File.join(dir, "src.dat")
+      File.binwrite(src_fn, encrypted)
+      4.times.map do
+        Thread.new { Scrypty.reencrypt_file(src_fn, enc_fn, "old", "new", old_profile) }
+      end.each(&:join)
+      File.unlink(src_fn)
+      assert_equal data, Scrypty.decrypt(File.binread(enc_fn), "new", old_profile)
+      assert_raise(Errno::ENOENT) do
+        Scrypty.reencrypt_file(enc_fn, File.join(dir, "none", "foo.dat"), "new", "newer", old_profile)
+      end
+
+      # A failed rotation leaves the file alone and nothing behind it.
+      before = File.binread(enc_fn)
+      assert_raise(Scrypty::IncorrectPasswordError) do
+        Scrypty.reencrypt_file(enc_fn, enc_fn, "old", "newer", profile)
+      end
+      File.binwrite(File.join(dir, "bad.dat"), tampered)
+      assert_raise(Scrypty::InvalidBlockError) do
+        Scrypty.reencrypt_file(File.join(dir, "bad.dat"), enc_fn, "old", "newer", old_profile)
+      end
+      assert_equal before, File.binread(enc_fn)
+      assert_equal ["bad.dat", "foo.dat"], Dir.children(dir).sort
+    end
+  end
+
+  test 'log' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    Dir.mktmpdir do |dir|
+      fn = File.join(dir, "audit.log")
+      log = Scrypty::LogWriter.new(fn, "secret", profile, checkpoint_records: 2)
+      log << "one" << "two" << "three"
+      reader = Scrypty::LogReader.new(fn, "secret", profile)
+      assert_equal ["one", "two"], reader.read
+      assert_equal [], reader.read
+      log.checkpoint
+      assert_equal ["three"], reader.read
+
+      # One writer at a time.
+      assert_raise(Scrypty::LockedError) do
+        Scrypty::LogWriter.new(fn, "secret", profile)
+      end
+
+      # Records after the last checkpoint are dropped on reopening.
+      size = File.size(fn)
+      pid = fork do
+        log.write("lost")
+        File.open(fn, "ab") { |f| f.write("R\0\0") }
+        exit!
+      end
+      Process.wait(pid)
+      log.close
+      assert_equal [], reader.read
+      assert_operator File.size(fn), :>, size
+      assert_equal 128 * 1024 * 8, Scrypty.header(fn)[:memory]
+      assert_raise(Scrypty::UnrecognizedFormatError) do
+        Scrypty.decrypt(File.binread(fn), "secret", profile)
+      end
+
+      log2 = Scrypty::LogWriter.new(fn, "secret", profile)
+      log2.write("four")
+      log2.close
+      assert log2.closed?
+      assert_raise(IOError) { log2.write("five") }
+      assert_equal ["four"], reader.read
+      assert_equal ["one", "two", "three", "four"],
+        Scrypty::LogReader.new(fn, "secret", profile).read
+
+      assert_raise(Scrypty::IncorrectPasswordError) do
+        Scrypty::LogReader.new(fn, "wrong", profile)
+      end
+
+      # A bad checkpoint stops the reader after the records before it.
+      data = File.binread(fn)
+      data[-1] = (data[-1].ord ^ 1).chr
+      File.binwrite(fn, data)
+      reader = Scrypty::LogReader.new(fn, "secret", profile)
+      assert_equal ["one", "two", "three"], reader.read
+      assert_raise(Scrypty::InvalidBlockError) { reader.read }
+      reader.close
+    end
+  end
+
+  test 'log reopened after a crash' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    secret = "SECRET-PLAINTEXT-AAAA"
+    known = "K" * secret.bytesize
+    Dir.mktmpdir do |dir|
+      fn = File.join(dir, "audit.log")
+      log = Scrypty::LogWriter.new(fn, "secret", profile)
+      log.write("one")
+      log.checkpoint
+      size = File.size(fn)
+      pid = fork do
+        log.write(secret)
+        exit!
+      end
+      Process.wait(pid)
+      lost = File.binread(fn)[-secret.bytesize..]
+      log.close
+
+      # The next writer's record must not share keystream with the lost one.
+      log = Scrypty::LogWriter.new(fn, "secret", profile)
+      log.write(known)
+      log.close
+      data = File.binread(fn)
+      assert_equal "N", data[size]
+      written = data[size + 14, known.bytesize]
+      xored = lost.bytes.zip(written.bytes, known.bytes).map { |a, b, c| a ^ b ^ c }
+      assert_not_equal secret.bytes, xored
+      assert_equal ["one", known], Scrypty::LogReader.new(fn, "secret", profile).read
+    end
+  end
+
+  test 'batch roundtrip' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    items = ["foo", "", "bar" * 1000]
+    encrypted = Scrypty.encrypt_batch(items, "secret", profile, 2)
+    assert_equal 3, encrypted.length
+    assert_equal "foo", Scrypty.decrypt(encrypted[0], "secret", profile)
+
+    decrypted = Scrypty.decrypt_batch(encrypted + ["garbage"], "secret", profile)
+    assert_equal items, decrypted[0, 3]
+    assert_kind_of Scrypty::InvalidBlockError, decrypted[3]
+
+    # Thread#raise stops a long batch after the items already running.
+    slow = Scrypty::Profile.from_params(2 ** 14, 8, 1)
+    batch = Thread.new { Scrypty.encrypt_batch(["x"] * 200, "secret", slow, 1) }
+    sleep 0.2
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    batch.raise(IOError, "stop")
+    assert_raise(IOError) { batch.join(10) }
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 2
+  end
+
+  test 'stats' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    Scrypty.stats_reset
+    encrypted = Scrypty.encrypt("foobar", "secret", profile)
+    Scrypty.decrypt(encrypted, "secret", profile)
+    assert_raise(Scrypty::IncorrectPasswordError) do
+      Scrypty.decrypt(encrypted, "wrong", profile)
+    end
+
+    stats = Scrypty.stats
+    assert_equal 1, stats[:operations][:encrypt]
+    assert_equal 2, stats[:operations][:decrypt]
+    assert_equal 6, stats[:bytes][:encrypt]
+    assert_equal 3, stats[:phases][:kdf][:count]
+    assert_equal 3, stats[:phases][:kdf][:histogram].sum
+    assert_equal 3 * 128 * 8 * 1024, stats[:v_bytes]
+    assert_equal({11 => 1}, stats[:errors])
+
+    Scrypty.stats_reset
+    assert_equal 0, Scrypty.stats[:operations][:encrypt]
+  end
+
+  test 'tune' do
+    profile = Scrypty.tune(target_seconds: 0.05, max_memory: 8 * 1024 ** 2)
+    assert_true profile.frozen?
+    assert_operator 128 * profile.n * profile.r, :<=, 8 * 1024 ** 2
+    assert_include [8, 16, 32], profile.r
+
+    encrypted = Scrypty.encrypt("foobar", "secret", profile)
+    assert_equal "foobar", Scrypty.decrypt(encrypted, "secret", profile)
+    assert_raise(ArgumentError) { Scrypty.tune(max_memory: 0) }
+  end
+
+  test 'verify' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    encrypted = Scrypty.encrypt("foobar", "secret", profile)
+    assert_true Scrypty.verify(encrypted, "secret", profile)
+    assert_raise(Scrypty::IncorrectPasswordError) do
+      Scrypty.verify(encrypted, "wrong", profile)
+    end
+    tampered = encrypted.dup
+    tampered[100] = (tampered[100].ord ^ 1).chr
+    assert_raise(Scrypty::InvalidBlockError) do
+      Scrypty.verify(tampered, "secret", profile)
+    end
+  end
+
+  test 'verify files' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    Dir.mktmpdir do |dir|
+      orig_fn = File.join(dir, "foo.txt")
+      File.open(orig_fn, "wb") { |f| f.print("my data" * 300000) }
+      good_fn = File.join(dir, "good.dat")
+      bad_fn = File.join(dir, "bad.dat")
+      Scrypty.encrypt_file(orig_fn, good_fn, "secret", profile)
+      data = File.binread(good_fn)
+      data[-100] = (data[-100].ord ^ 1).chr
+      File.binwrite(bad_fn, data)
+
+      assert_true Scrypty.verify_file(good_fn, "secret", profile)
+      assert_raise(Scrypty::InvalidBlockError) do
+        Scrypty.verify_file(bad_fn, "secret", profile)
+      end
+
+      results = Scrypty.verify_files(dir, "secret", profile, 2)
+      assert_equal [bad_fn, orig_fn, good_fn].sort, results.keys.sort
+      assert_true results[good_fn]
+      assert_kind_of Scrypty::InvalidBlockError, results[bad_fn]
+      assert_kind_of Scrypty::InvalidBlockError, results[orig_fn]
+    end
+  end
+
+  test 'tree' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    big = Random.new(7).bytes(2 * 1024 * 1024 + 5)
+    Dir.mktmpdir do |dir|
+      src = File.join(dir, "src")
+      FileUtils.mkdir_p(File.join(src, "a", "b"))
+      File.binwrite(File.join(src, "top.txt"), "top")
+      File.binwrite(File.join(src, "a", "empty"), "")
+      File.binwrite(File.join(src, "a", "b", "big.bin"), big)
+      File.symlink("top.txt", File.join(src, "link"))
+
+      # The output may live inside the input without being walked.
+      enc = File.join(src, "enc")
+      results = Scrypty.encrypt_tree(src, enc, "secret", profile, 2)
+      assert_equal ["a/b/big.bin", "a/empty", "top.txt"], results.keys
+      assert_equal [big.bytesize + 128, 128, 131], results.values
+      assert_false File.exist?(File.join(enc, "link"))
+      assert_equal "top", Scrypty.decrypt(File.binread(File.join(enc, "top.txt")), "secret", profile)
+
+      dec = File.join(dir, "dec")
+      results = Scrypty.decrypt_tree(enc, dec, "secret", profile)
+      assert_equal [big.bytesize, 0, 3], results.values
+      assert_equal big, File.binread(File.join(dec, "a", "b", "big.bin"))
+      assert_equal "", File.binread(File.join(dec, "a", "empty"))
+
+      # A file that fails leaves no output behind.
+      File.binwrite(File.join(enc, "a", "empty"), "junk")
+      bad = File.join(dir, "bad")
+      results = Scrypty.decrypt_tree(enc, bad, "secret", profile)
+      assert_kind_of Scrypty::Exception, results["a/empty"]
+      assert_false File.exist?(File.join(bad, "a", "empty"))
+      assert_equal "top", File.binread(File.join(bad, "top.txt"))
+
+      assert_raise(Scrypty::ReadError) do
+        Scrypty.encrypt_tree(File.join(dir, "missing"), bad, "secret", profile)
+      end
+
+      # A directory that can't be created or read doesn't stop the rest.
+      blocked = File.join(dir, "blocked")
+      FileUtils.mkdir_p(blocked)
+      File.binwrite(File.join(blocked, "a"), "")
+      results = Scrypty.encrypt_tree(src, blocked, "secret", profile)
+      assert_kind_of Scrypty::WriteError, results["a/b"]
+      assert_kind_of Scrypty::WriteError, results["a/empty"]
+      assert_equal 131, results["top.txt"]
+      unless Process.uid == 0
+        File.chmod(0, File.join(src, "a"))
+        begin
+          results = Scrypty.encrypt_tree(src, File.join(dir, "locked"), "secret", profile)
+          assert_kind_of Scrypty::ReadError, results["a"]
+          assert_equal 131, results["top.txt"]
+        ensure
+          File.chmod(0755, File.join(src, "a"))
+        end
+      end
+    end
+  end
+
+  test 'header' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    encrypted = Scrypty.encrypt("foobar", "secret", profile)
+    header = Scrypty.header(encrypted)
+    assert_equal [1024, 8, 1], header.values_at(:n, :r, :p)
+    assert_equal encrypted[16, 32], header[:salt]
+    assert_equal 128 * 8 * 1024, header[:memory]
+    assert_operator header[:time], :>, 0
+
+    Dir.mktmpdir do |dir|
+      enc_fn = File.join(dir, "foo.dat")
+      File.binwrite(enc_fn, encrypted)
+      assert_equal header, Scrypty.header(enc_fn)
+      assert_true Scrypty.password_ok?(enc_fn, "secret", profile)
+
+      # A file name that starts like the magic is still a file name.
+      Dir.chdir(dir) do
+        File.binwrite("scrypt-backup.enc", encrypted)
+        assert_equal header, Scrypty.header("scrypt-backup.enc")
+        assert_true Scrypty.password_ok?("scrypt-backup.enc", "secret", profile)
+      end
+    end
+
+    assert_true Scrypty.password_ok?(encrypted, "secret", profile)
+    assert_false Scrypty.password_ok?(encrypted[0, 96], "wrong", profile)
+    encrypted[20] = (encrypted[20].ord ^ 1).chr
+    assert_raise(Scrypty::InvalidBlockError) { Scrypty.header(encrypted) }
+  end
+
+  test 'memory budget' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    Scrypty.set_memory_budget(128 * 8 * 1024, :priority)
+    assert_equal :priority, Scrypty.memory_budget[:policy]
+
+    threads = Array.new(4) do |i|
+      Thread.new { Scrypty.encrypt("data #{i}", "secret", profile, priority: i) }
+    end
+    threads.each_with_index do |thread, i|
+      assert_equal "data #{i}", Scrypty.decrypt(thread.value, "secret", profile)
+    end
+
+    # A derivation bigger than the budget runs alone; others time out.
+    big = Thread.new { Scrypty.dk("secret", "salt", 2 ** 14, 8, 4, 64) }
+    Thread.pass until Scrypty.memory_budget[:in_use] > 0 || !big.alive?
+    assert_raise(Scrypty::MemoryBudgetTimeoutError) do
+      Scrypty.encrypt("data", "secret", profile, timeout: 0.001)
+    end
+    assert_equal 64, big.value.bytesize
+
+    budget = Scrypty.memory_budget
+    assert_equal 0, budget[:in_use]
+    assert_equal 0, budget[:waiting]
+    assert_operator budget[:timeouts], :>=, 1
+
+    # Thread#raise reaches a derivation waiting for memory straight away.
+    big = Thread.new { Scrypty.dk("secret", "salt", 2 ** 16, 8, 8, 64) }
+    Thread.pass until Scrypty.memory_budget[:in_use] > 0 || !big.alive?
+    waiter = Thread.new { Scrypty.encrypt("data", "secret", profile) }
+    Thread.pass until Scrypty.memory_budget[:waiting] > 0
+    waiter.raise(IOError, "stop")
+    assert_raise(IOError) { waiter.join(5) }
+    assert_true big.alive?
+    assert_equal 64, big.value.bytesize
+    assert_equal 0, Scrypty.memory_budget[:waiting]
+
+    # So does a re-encryption deriving its old keys on a thread of its own.
+    encrypted = Scrypty.encrypt("data", "old", profile)
+    big = Thread.new { Scrypty.dk("secret", "salt", 2 ** 16, 8, 8, 64) }
+    Thread.pass until Scrypty.memory_budget[:in_use] > 0 || !big.alive?
+    both = Scrypty::Profile.from_params(1024, 8, 1, 2 * 128 * 8 * 1024)
+    waiter = Thread.new { Scrypty.reencrypt(encrypted, "old", "new", both) }
+    Thread.pass until Scrypty.memory_budget[:waiting] > 1
+    waiter.raise(IOError, "stop")
+    assert_raise(IOError) { waiter.join(5) }
+    assert_true big.alive?
+    assert_equal 64, big.value.bytesize
+    assert_equal 0, Scrypty.memory_budget[:waiting]
+  ensure
+    Scrypty.set_memory_budget(nil)
+  end
+
+  test 'output buffers' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    data = "my data" * 1000
+    out = String.new(capacity: 16384)
+    encrypted = Scrypty.encrypt(data, "secret", profile, out: out)
+    assert_same out, encrypted
+    assert_equal Encoding::BINARY, out.encoding
+    assert_equal data.bytesize + 128, out.bytesize
+
+    encrypted = out.dup
+    buf = "left over".encode(Encoding::UTF_8)
+    assert_same buf, Scrypty.decrypt(encrypted, "secret", profile, out: buf)
+    assert_equal data.b, buf
+    compressed = Scrypty.encrypt(data, "secret", profile, compress: true)
+    assert_equal data.b, Scrypty.decrypt(compressed, "secret", profile, out: buf)
+    assert_same out, Scrypty.reencrypt(encrypted, "secret", "new", profile, out: out)
+    assert_equal data, Scrypty.decrypt(out, "new", profile)
+
+    assert_raise(ArgumentError) do
+      Scrypty.decrypt(encrypted, "secret", profile, out: encrypted)
+    end
+    assert_raise(FrozenError) do
+      Scrypty.decrypt(encrypted, "secret", profile, out: "".freeze)
+    end
+    # Checked before the key is derived, compressed or not.
+    before = Scrypty.stats[:operations]
+    assert_raise(FrozenError) do
+      Scrypty.decrypt(compressed, "secret", profile, out: "".freeze)
+    end
+    assert_equal before, Scrypty.stats[:operations]
+    assert_raise(TypeError) do
+      Scrypty.decrypt(encrypted, "secret", profile, out: 1)
+    end
+  end
+
+  test 'memory accounting' do
+    require 'objspace'
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    dk = Scrypty.dk("secret", "salt", 1024, 8, 1, 64)
+    assert_operator ObjectSpace.memsize_of(Scrypty::Key.new(dk)), :>, 200
+    assert_operator ObjectSpace.memsize_of(profile), :>=, 32
+
+    # The workspace Password.create keeps is held after the call returns.
+    Scrypty::Password.create("secret", profile)
+    assert_operator Scrypty.memory_budget[:held], :>=, 128 * 8 * 1024
+  end
+
+  test 'scheduler' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    Scrypty.set_scheduler(2)
+    assert_equal 2, Scrypty.scheduler[:workers]
+    assert_includes 1..2, Scrypty.scheduler[:nodes]
+
+    classes = [:interactive, :normal, :batch]
+    threads = Array.new(6) do |i|
+      Thread.new do
+        Scrypty.encrypt("data #{i}", "secret", profile,
+                        priority: classes[i % 3], deadline: Time.now + 10)
+      end
+    end
+    threads.each_with_index do |thread, i|
+      assert_equal "data #{i}", Scrypty.decrypt(thread.value, "secret", profile, deadline: 10)
+    end
+    # An Integer is a budget priority only; the class stays :normal.
+    kdf = Scrypty.stats[:phases][:kdf][:count]
+    assert_equal 64, Scrypty.dk("secret", "salt", 1024, 8, 1, 64, priority: -1).bytesize
+    assert_equal kdf + 1, Scrypty.stats[:phases][:kdf][:count]
+
+    sched = Scrypty.scheduler
+    assert_equal 2, sched[:interactive][:completed]
+    assert_equal 9, sched[:normal][:completed]
+    assert_equal 2, sched[:batch][:completed]
+    classes.each { |c| assert_equal 0, sched[c][:queued] }
+    assert_operator Scrypty.stats[:phases][:queue][:count], :>=, 13
+    assert_raise(ArgumentError) { Scrypty.encrypt("data", "secret", profile, priority: :urgent) }
+
+    # A job still queued is taken off the queue by Thread#raise.
+    Scrypty.set_scheduler(1)
+    big = Thread.new { Scrypty.dk("secret", "salt", 2 ** 16, 8, 8, 64) }
+    sleep 0.05
+    waiter = Thread.new { Scrypty.encrypt("data", "secret", profile, priority: :batch) }
+    Thread.pass until Scrypty.scheduler[:batch][:queued] > 0
+    waiter.raise(IOError, "stop")
+    assert_raise(IOError) { waiter.join(5) }
+    assert_true big.alive?
+    assert_equal 0, Scrypty.scheduler[:batch][:queued]
+    assert_equal 64, big.value.bytesize
+  ensure
+    Scrypty.set_scheduler(0)
+  end
+
+  test 'entropy' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    salt = -> { Scrypty.header(Scrypty.encrypt("data", "secret", profile))[:salt] }
+
+    Scrypty.set_entropy_seed("benchmark")
+    first = [salt.call, salt.call]
+    assert_not_equal first[0], first[1]
+    Scrypty.set_entropy_seed("benchmark")
+    assert_equal first, [salt.call, salt.call]
+
+    # Threads share the seeded stream rather than each repeating it.
+    salts = Array.new(4) { Thread.new { salt.call } }.map(&:value)
+    assert_equal 6, (first + salts).uniq.length
+    Scrypty.set_entropy_seed(nil)
+    assert_not_equal first[0], salt.call
+
+    # A forked child doesn't repeat its parent's salts.
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      writer.write(salt.call)
+      exit!(0)
+    end
+    writer.close
+    child = reader.read
+    Process.wait(pid)
+    assert_equal 32, child.bytesize
+    assert_not_equal child, salt.call
+  ensure
+    Scrypty.set_entropy_seed(nil)
+  end
+
+  test 'ractors' do
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    assert Ractor.shareable?(profile)
+
+    ractors = 4.times.map do |i|
+      Ractor.new(profile, i) do |profile, i|
+        data = "ractor #{i}" * 100
+        encrypted = Scrypty.encrypt(data, "secret", profile)
+        wrong = begin
+          Scrypty.decrypt(encrypted, "wrong", profile)
+        rescue Scrypty::IncorrectPasswordError => e
+          e.class
+        end
+        [Scrypty.decrypt(encrypted, "secret", profile) == data, wrong,
+         Scrypty.dk("secret", "salt", 1024, 8, 1, 64)]
+      end
+    end
+
+    dk = Scrypty.dk("secret", "salt", 1024, 8, 1, 64)
+    ractors.each do |ractor|
+      assert_equal [true, Scrypty::IncorrectPasswordError, dk], ractor.take
+    end
+  ensure
+    Warning[:experimental] = experimental
+  end
+
+  test 'cipher threads' do
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    data = SecureRandom.random_bytes(9 * 1024 * 1024 + 17)
+
+    Dir.mktmpdir do |dir|
+      plain = File.join(dir, "plain")
+      File.binwrite(plain, data)
+      run = lambda do |threads|
+        Scrypty.set_cipher_threads(threads)
+        Scrypty.set_entropy_seed("cipher threads")
+        Scrypty.encrypt_file(plain, File.join(dir, "#{threads}.enc"), "secret", profile)
+        Scrypty.set_entropy_seed("cipher threads")
+        [Scrypty.encrypt(data, "secret", profile), File.binread(File.join(dir, "#{threads}.enc"))]
+      end
+
+      serial = run.call(0)
+      assert_equal serial, run.call(3)
+      assert_equal 3, Scrypty.cipher_threads
+
+      assert_equal data, Scrypty.decrypt(serial[0], "secret", profile)
+      Scrypty.decrypt_file(File.join(dir, "3.enc"), File.join(dir, "out"), "secret", profile)
+      assert_equal data, File.binread(File.join(dir, "out"))
+
+      # Empty and small files take the serial path with threads set or not.
+      File.binwrite(File.join(dir, "empty"), "")
+      [0, 3].each do |threads|
+        Scrypty.set_cipher_threads(threads)
+        Scrypty.encrypt_file(File.join(dir, "empty"), File.join(dir, "empty.enc"), "secret", profile)
+        Scrypty.decrypt_file(File.join(dir, "empty.enc"), File.join(dir, "out"), "secret", profile)
+        assert_equal "", File.binread(File.join(dir, "out"))
+      end
+
+      serial[0].setbyte(1000, serial[0].getbyte(1000) ^ 1)
+      assert_raise(Scrypty::InvalidBlockError) { Scrypty.decrypt(serial[0], "secret", profile) }
+      File.binwrite(File.join(dir, "short.enc"), File.binread(File.join(dir, "3.enc"), 100))
+      assert_raise(Scrypty::InvalidBlockError) do
+        Scrypty.decrypt_file(File.join(dir, "short.enc"), File.join(dir, "out"), "secret", profile)
+      end
+    end
+  ensure
+    Scrypty.set_cipher_threads(0)
+    Scrypty.set_entropy_seed(nil)
+  end
+
+  test 'password' do
+    # From libsodium's scryptsalsa208sha256 tests.
+    hash = "$7$C6..../....SodiumChloride$kBGj9fHznVYFQMEn/qDCfrDevf9YDtcDdKvEqHJLV8D"
+    assert Scrypty::Password.verify(hash, "pleaseletmein")
+    assert !Scrypty::Password.verify(hash, "pleaseletmeout")
+    assert !Scrypty::Password.verify(hash.sub("V8D", "V8C"), "pleaseletmein")
+
+    profile = Scrypty::Profile.from_params(1024, 8, 1)
+    created = Scrypty::Password.create("secret", profile)
+    assert_match(/\A\$7\$86\.\.\.\.\/\.\.\.\.[.\/0-9A-Za-z]{43}\$[.\/0-9A-Za-z]{43}\z/, created)
+    assert_not_equal created, Scrypty::Password.create("secret", profile)
+    assert Scrypty::Password.verify(created, "secret", priority: :interactive)
+    assert !Scrypty::Password.verify(created, "Secret")
+
+    s1 = Scrypty::Password.create("secret", profile, "$s1$")
+    _, _, params, salt, dk = s1.split("$")
+    assert_equal "a0801", params
+    assert_equal Scrypty.dk("secret", salt.unpack1("m"), 1024, 8, 1, 32), dk.unpack1("m")
+    assert Scrypty::Password.verify(s1, "secret")
+    assert !Scrypty::Password.verify(s1, "Secret")
+    assert_raise(ArgumentError) do
+      Scrypty::Password.create("secret", Scrypty::Profile.from_params(1024, 256, 1), "$s1$")
+    end
+    assert_raise(ArgumentError) { Scrypty::Password.create("secret", profile, "$2a$") }
+
+    assert !Scrypty::Password.needs_rehash?(created, profile)
+    assert !Scrypty::Password.needs_rehash?(s1, profile)
+    assert Scrypty::Password.needs_rehash?(hash, profile)
+    assert Scrypty::Password.needs_rehash?(created, Scrypty::Profile.from_params(2048, 8, 1))
+
+    ["", "$7$", "$2a$10$abcdefghijklmnopqrstuu", created.chop, s1.sub("$", "")].each do |bad|
+      assert_raise(Scrypty::UnrecognizedFormatError) { Scrypty::Password.verify(bad, "secret") }
+    end
+    assert_raise(Scrypty::UnrecognizedFormatError) { Scrypty::Password.needs_rehash?("x", profile) }
+
+    threads = 4.times.map do
+      Thread.new { 5.times.map { Scrypty::Password.verify(created, "secret") } }
+    end
+    threads.each { |thread| assert_equal [true] * 5, thread.value }
+  end
 end